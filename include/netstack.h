@@ -5,8 +5,12 @@
 #include <string.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <sys/types.h>
 #include <linux/if.h>
 #include <linux/rtnetlink.h>
+#include <linux/fib_rules.h>
+#include <linux/nexthop.h>
+#include <linux/pkt_sched.h>
 
 #ifdef __cplusplus
 // see http://www.open-std.org/jtc1/sc22/wg21/docs/papers/2019/p0943r3.html
@@ -36,12 +40,20 @@ struct netstack_iface;
 struct netstack_addr;
 struct netstack_neigh;
 struct netstack_route;
+struct netstack_rule;
+struct netstack_nexthop;
+struct netstack_tc;
+struct netstack_topology;
+struct netstack_request;
+struct netstack_batch;
 
 typedef struct netstack_stats {
-  // Current counts of each object class
-  unsigned ifaces, addrs, routes, neighs;
+  // Current counts of each object class in the cache. A class which is not
+  // being cached always reports 0.
+  unsigned ifaces, addrs, routes, neighs, rules, nexthops, fdbs, tcs;
   // Events for each object class (dumps + creations + changes + deletions)
-  uintmax_t iface_events, addr_events, route_events, neigh_events;
+  uintmax_t iface_events, addr_events, route_events, neigh_events, rule_events;
+  uintmax_t nexthop_events, tc_events;
   // The number of times a lookup + share or lookup + copy succeeded
   uintmax_t lookup_shares, lookup_copies;
   // Number of shares which have been invalidated but not destroyed
@@ -50,12 +62,33 @@ typedef struct netstack_stats {
   uintmax_t lookup_failures;
   uintmax_t netlink_errors; // number of nlmsgerrs received from netlink
   uintmax_t user_callbacks_total; // number of times we've called back
+  // Bytes occupied by each object class in the cache (see ifaces etc. above)
+  uint64_t iface_bytes, addr_bytes, route_bytes, neigh_bytes;
+  // References currently held by clients on cached (non-zombie) objects
+  uintmax_t live_shares;
+  uintmax_t parse_failures; // netlink messages we could not make sense of
+  uintmax_t overruns; // times the kernel dropped messages on us (ENOBUFS)
+  uintmax_t resyncs; // full redumps to recover from an overrun or truncation
+  uintmax_t filtered; // messages discarded by iface_include/iface_exclude
+  // Completed dumps, and the total and maximum time spent on a single dump
+  uintmax_t dumps;
+  uintmax_t dump_nsec_total, dump_nsec_max;
+  // Lookups answered by a thread-local cache, and those which weren't (only
+  // with the lookup_cache option). Hits are also counted in lookup_shares.
+  uintmax_t tlcache_hits, tlcache_misses;
 } netstack_stats;
 
 // Acquire the current statistics (might not be atomic)
 netstack_stats* netstack_sample_stats(const struct netstack* ns,
                                       netstack_stats* stats);
 
+// Write the statistics, dump latency histogram, and per-interface IFLA_STATS64
+// counters as OpenMetrics text into buf, which is len bytes long. No memory is
+// allocated. Like snprintf(), returns the number of bytes which would have
+// been written given sufficient space (not including the NUL terminator), so
+// a return >= len indicates truncation. Returns -1 on error.
+int netstack_write_metrics(const struct netstack* ns, char* buf, size_t len);
+
 // Objects arrive from netlink as a class-specific structure followed by a flat
 // set of struct rtattr* TLVs. These functions deal with struct rtattrs and
 // blocks thereof, and are primarily used by libnetstack itself.
@@ -114,6 +147,32 @@ char* netstack_l2addrstr(unsigned l2type, size_t len, const void* addr);
 // Functions for inspecting netstack_ifaces
 const struct rtattr* netstack_iface_attr(const struct netstack_iface* ni, int attridx);
 
+// The most frequently-consulted attributes of a netstack_iface, decoded once
+// when the object is created. This is the leading member of every
+// netstack_iface, allowing the accessors below to be simple loads. Fields
+// which were not reported hold the documented defaults of their accessors.
+#define NETSTACK_IFACE_HOT_L2ADDR  0x1u // l2addr/l2addrlen are valid
+#define NETSTACK_IFACE_HOT_STATS   0x2u // stats64 is valid
+#define NETSTACK_IFACE_HOT_CARRIER 0x4u // carrier is valid
+typedef struct netstack_iface_hotfields {
+  unsigned present;  // NETSTACK_IFACE_HOT_* bits
+  uint32_t mtu;      // IFLA_MTU, 0 if not reported
+  uint32_t txqlen;   // IFLA_TXQLEN, 0 if not reported
+  uint32_t group;    // IFLA_GROUP, 0 (the default group) if not reported
+  int master;        // IFLA_MASTER, -1 if not reported
+  int link;          // IFLA_LINK, 0 if not reported
+  uint8_t operstate; // IFLA_OPERSTATE, IF_OPER_UNKNOWN if not reported
+  uint8_t carrier;   // IFLA_CARRIER
+  uint8_t l2addrlen; // bytes of IFLA_ADDRESS in l2addr
+  unsigned char l2addr[32]; // MAX_ADDR_LEN
+  struct rtnl_link_stats64 stats64; // IFLA_STATS64, or widened IFLA_STATS
+} netstack_iface_hotfields;
+
+static inline const netstack_iface_hotfields*
+netstack_iface_hot(const struct netstack_iface* ni){
+  return (const netstack_iface_hotfields*)ni;
+}
+
 // name must be at least IFNAMSIZ bytes. returns NULL if no name was reported,
 // or the name was greater than IFNAMSIZ-1 bytes (should never happen).
 char* netstack_iface_name(const struct netstack_iface* ni, char* name);
@@ -121,6 +180,12 @@ unsigned netstack_iface_type(const struct netstack_iface* ni);
 char* netstack_iface_typestr(const struct netstack_iface* ni, char* buf, size_t blen);
 unsigned netstack_iface_family(const struct netstack_iface* ni);
 int netstack_iface_index(const struct netstack_iface* ni);
+
+// The namespace id of the object's network namespace, as seen from the
+// netstack's own namespace. Objects of the local namespace report
+// NETSTACK_NSID_LOCAL. Other values are only seen with the all_nsids option.
+#define NETSTACK_NSID_LOCAL -1
+int netstack_iface_nsid(const struct netstack_iface* ni);
 unsigned netstack_iface_flags(const struct netstack_iface* ni);
 
 static inline bool netstack_iface_up(const struct netstack_iface* ni){
@@ -157,21 +222,146 @@ static inline bool netstack_iface_promisc(const struct netstack_iface* ni){
 // netstack_iface_stats() can be used to get the new stats.
 int netstack_iface_stats_refresh(struct netstack*);
 
+// Refresh the 64-bit link statistics of the link having index ifindex (or of
+// all links, if ifindex is 0) using RTM_GETSTATS, which fetches only those
+// counters. Waits up to timeout_ms milliseconds (forever if negative) for the
+// kernel's reply. The results go to a separate per-link slot, read using
+// netstack_iface_stats_latest(); the netstack_ifaces (and the stats they
+// carry) are not replaced. Returns 0 on success, or -1 on error or timeout.
+// In threadless mode, this processes the socket itself, and must be called
+// from the thread which would otherwise call netstack_process(). Fails with
+// EDEADLK if called from a callback (see netstack_request_wait()).
+int netstack_iface_stats_refresh_sync(struct netstack* ns, int ifindex, int timeout_ms);
+
+// Copy out the most recent statistics fetched for ifindex using
+// netstack_iface_stats_refresh_sync(). Takes no locks. Returns false if none
+// have been fetched, or the link has since been deleted.
+bool netstack_iface_stats_latest(struct netstack* ns, int ifindex,
+                                 struct rtnl_link_stats64* stats);
+
+#define NETSTACK_SAMPLE_DEPTH_DEFAULT 64
+#define NETSTACK_SAMPLE_DEPTH_MAX 128
+
+// Rates derived from a link's retained stats samples. Counter resets (a
+// counter going backwards) are treated as a restart from zero.
+typedef struct netstack_rates {
+  double rx_pps, tx_pps;             // packets per second
+  double rx_bps, tx_bps;             // bits per second
+  double rx_errors_ps, tx_errors_ps; // errors per second
+  double rx_drops_ps, tx_drops_ps;   // drops per second
+  uint64_t nsec;                     // span covered by the samples used
+  unsigned samples;                  // number of samples used
+} netstack_rates;
+
+// Derive rates for ifindex from the newest sample, and all those taken within
+// window_ms of it (all retained samples if window_ms is 0). Takes no locks,
+// and allocates no memory.
+// Returns -1 if fewer than two samples are available in the window.
+int netstack_iface_rates(struct netstack* ns, int ifindex, unsigned window_ms,
+                         netstack_rates* rates);
+
 // Get the nth IRQ of the device, or -1 on failure. Currently only works for
 // directly-attached PCIe NICs (i.e. we don't look up xhci_hcd IRQs for a USB
-// device) using MSI.
+// device) using MSI. The IRQ range is discovered from sysfs on first use, and
+// cached with the netstack_iface (a new object, and thus a fresh lookup,
+// results from each RTM_NEWLINK, including renames). Always -1 for links of
+// peer namespaces, since sysfs only describes our own.
 int netstack_iface_irq(const struct netstack_iface* ni, unsigned qidx);
 
 // Get the number of MSI interrupts for the device.
 unsigned netstack_iface_irqcount(const struct netstack_iface* ni);
 
+// Sets of CPUs, as used by the topology API. CPU n is bit (n % 64) of
+// bits[n / 64].
+#define NETSTACK_MAX_CPUS 4096
+typedef struct netstack_cpumask {
+  uint64_t bits[NETSTACK_MAX_CPUS / 64];
+} netstack_cpumask;
+
+static inline bool
+netstack_cpumask_isset(const netstack_cpumask* mask, unsigned cpu){
+  if(cpu >= NETSTACK_MAX_CPUS){
+    return false;
+  }
+  return mask->bits[cpu / 64] & (1ull << (cpu % 64));
+}
+
+static inline unsigned
+netstack_cpumask_count(const netstack_cpumask* mask){
+  unsigned count = 0;
+  size_t z;
+  for(z = 0 ; z < sizeof(mask->bits) / sizeof(*mask->bits) ; ++z){
+    count += __builtin_popcountll(mask->bits[z]);
+  }
+  return count;
+}
+
+// The queue, IRQ, and CPU topology of a device, as read from sysfs and procfs:
+// its MSI vectors and their names in /proc/interrupts, each vector's
+// smp_affinity_list, the device's NUMA node, and the rps_cpus/xps_cpus of each
+// rx-N/tx-N queue. A topology is built on first request and cached by the
+// netstack under the link's index, surviving changes to the link (including
+// renames) until the link is deleted. None of this generates netlink events,
+// so it is refreshed only on demand, using netstack_iface_topology_refresh().
+// Topologies are immutable and refcounted; each one returned must be released
+// with netstack_topology_abandon(), and may outlive the netstack. Returns NULL
+// if the device can't be found in sysfs, and always for links of peer
+// namespaces, since sysfs only describes our own. ni may be any netstack_iface
+// of ns, including copies from netstack_iface_enumerate().
+const struct netstack_topology* netstack_iface_topology(struct netstack* ns,
+                                                        const struct netstack_iface* ni);
+
+// Rebuild the cached topology, returning the new one (which must likewise be
+// abandoned). Previously returned topologies remain valid until abandoned.
+const struct netstack_topology* netstack_iface_topology_refresh(struct netstack* ns,
+                                                                const struct netstack_iface* ni);
+
+void netstack_topology_abandon(const struct netstack_topology* nt);
+
+// The NUMA node to which the device is attached, or -1 if unknown.
+int netstack_topology_numa_node(const struct netstack_topology* nt);
+
+// MSI vectors of the device, in increasing order of IRQ number. The IRQ is -1
+// if n is out of range. The name is the action name from /proc/interrupts
+// (e.g. "eth0-TxRx-3"), or NULL if it wasn't listed.
+unsigned netstack_topology_irqcount(const struct netstack_topology* nt);
+int netstack_topology_irq(const struct netstack_topology* nt, unsigned n);
+const char* netstack_topology_irq_name(const struct netstack_topology* nt, unsigned n);
+
+// The nth vector's smp_affinity_list. Returns false if it couldn't be read.
+bool netstack_topology_irq_affinity(const struct netstack_topology* nt, unsigned n,
+                                    netstack_cpumask* mask);
+
+// Number of rx-N and tx-N queues in sysfs.
+unsigned netstack_topology_rxqueues(const struct netstack_topology* nt);
+unsigned netstack_topology_txqueues(const struct netstack_topology* nt);
+
+// The IRQ serving the given queue, or -1 if unknown. This is matched using
+// the vector names in /proc/interrupts, and is necessarily a heuristic (one
+// covering the common "<dev>-TxRx-N", "<dev>-rx-N", "<drv>-input.N", and
+// "<drv>_compN" conventions). Combined channels serve both rx-N and tx-N.
+int netstack_topology_rxqueue_irq(const struct netstack_topology* nt, unsigned q);
+int netstack_topology_txqueue_irq(const struct netstack_topology* nt, unsigned q);
+
+// The queue's rps_cpus (for rx-N) or xps_cpus (for tx-N). Returns false if
+// the queue is out of range, or the mask couldn't be read.
+bool netstack_topology_rps_cpus(const struct netstack_topology* nt, unsigned q,
+                                netstack_cpumask* mask);
+bool netstack_topology_xps_cpus(const struct netstack_topology* nt, unsigned q,
+                                netstack_cpumask* mask);
+
 // pass in the maximum number of bytes available for copying the link-layer
 // address. if this is sufficient, the actual number of bytes copied will be
 // stored to this variable. otherwise, NULL will be returned.
 static inline void*
 netstack_iface_l2addr(const struct netstack_iface* ni, void* buf, size_t* len){
-  const struct rtattr* rta = netstack_iface_attr(ni, IFLA_ADDRESS);
-  return netstack_rtattrcpy(rta, buf, len) ? buf : NULL;
+  const netstack_iface_hotfields* hot = netstack_iface_hot(ni);
+  if(!(hot->present & NETSTACK_IFACE_HOT_L2ADDR) || *len < hot->l2addrlen){
+    return NULL;
+  }
+  memcpy(buf, hot->l2addr, hot->l2addrlen);
+  *len = hot->l2addrlen;
+  return buf;
 }
 
 // Returns true iff there is an IFLA_ADDRESS layer 2 address associated with
@@ -208,26 +398,45 @@ netstack_iface_broadcaststr(const struct netstack_iface* ni, unsigned* type){
 // Returns the MTU as reported by netlink, or 0 if none was reported.
 static inline uint32_t
 netstack_iface_mtu(const struct netstack_iface* ni){
-  const struct rtattr* rta = netstack_iface_attr(ni, IFLA_MTU);
-  uint32_t ret;
-  return netstack_rtattrcpy_exact(rta, &ret, sizeof(ret)) ? ret : 0;
+  return netstack_iface_hot(ni)->mtu;
 }
 
 // Returns the link type (as opposed to the device type, as returned by
 // netstack_iface_type).
 static inline int
 netstack_iface_link(const struct netstack_iface* ni){
-  const struct rtattr* rta = netstack_iface_attr(ni, IFLA_LINK);
-  int ret;
-  return netstack_rtattrcpy_exact(rta, &ret, sizeof(ret)) ? ret : 0;
+  return netstack_iface_hot(ni)->link;
 }
 
 // Returns the interface index of a bound device's master.
 static inline int
 netstack_iface_master(const struct netstack_iface* ni){
-  const struct rtattr* rta = netstack_iface_attr(ni, IFLA_MASTER);
-  int ret;
-  return netstack_rtattrcpy_exact(rta, &ret, sizeof(ret)) ? ret : -1;
+  return netstack_iface_hot(ni)->master;
+}
+
+// Returns the RFC 2863 operational state (IF_OPER_*).
+static inline unsigned
+netstack_iface_operstate(const struct netstack_iface* ni){
+  return netstack_iface_hot(ni)->operstate;
+}
+
+// Returns 1 if the carrier is up, 0 if it is down, or -1 if not reported.
+static inline int
+netstack_iface_carrier(const struct netstack_iface* ni){
+  const netstack_iface_hotfields* hot = netstack_iface_hot(ni);
+  return (hot->present & NETSTACK_IFACE_HOT_CARRIER) ? hot->carrier : -1;
+}
+
+// Returns the transmit queue length, or 0 if none was reported.
+static inline uint32_t
+netstack_iface_txqlen(const struct netstack_iface* ni){
+  return netstack_iface_hot(ni)->txqlen;
+}
+
+// Returns the interface group.
+static inline uint32_t
+netstack_iface_group(const struct netstack_iface* ni){
+  return netstack_iface_hot(ni)->group;
 }
 
 // Returns the queuing discipline, or NULL if none was reported. The return is
@@ -238,13 +447,12 @@ char* netstack_iface_qdisc(const struct netstack_iface* ni);
 // and returning 0. Returns -1 if there were no stats.
 static inline bool
 netstack_iface_stats(const struct netstack_iface* ni, struct rtnl_link_stats64* stats){
-  const struct rtattr* rta = netstack_iface_attr(ni, IFLA_STATS64);
-  if(netstack_rtattrcpy_exact(rta, stats, sizeof(*stats))){
-    return true;
+  const netstack_iface_hotfields* hot = netstack_iface_hot(ni);
+  if(!(hot->present & NETSTACK_IFACE_HOT_STATS)){
+    return false;
   }
-  // fall back to lame 32-bit stats
-  rta = netstack_iface_attr(ni, IFLA_STATS);
-  return netstack_rtattrcpy_exact(rta, stats, sizeof(*stats));
+  memcpy(stats, &hot->stats64, sizeof(*stats));
+  return true;
 }
 
 // information about hardware queues. a value of -1 indicates that the driver
@@ -260,12 +468,64 @@ typedef struct netstack_iface_qcounts {
   int xdp;
 } netstack_iface_qcounts;
 
+// rx and tx come from the link's IFLA_NUM_RX_QUEUES and IFLA_NUM_TX_QUEUES.
+// combined is known only to ethtool, and is filled in (from the cached
+// channels; see netstack_iface_ethtool()) only by
+// netstack_iface_queuecounts_ethtool(). Neither rtnetlink nor ethtool reports
+// XDP queues, so xdp is always -1.
 void netstack_iface_queuecounts(const struct netstack_iface* ni,
                                 struct netstack_iface_qcounts* nqc);
+void netstack_iface_queuecounts_ethtool(struct netstack* ns,
+                                        const struct netstack_iface* ni,
+                                        struct netstack_iface_qcounts* nqc);
+
+// ethtool state of a link, as learned via ethtool-netlink (the ethtool
+// option). Only those groups indicated in present are valid; drivers needn't
+// support all (or any) of them. Values the driver doesn't report are 0.
+#define NETSTACK_ETHTOOL_CHANNELS  0x1u
+#define NETSTACK_ETHTOOL_RINGS     0x2u
+#define NETSTACK_ETHTOOL_COALESCE  0x4u
+#define NETSTACK_ETHTOOL_FEATURES  0x8u
+#define NETSTACK_ETHTOOL_FEATURE_MAX 128
+typedef struct netstack_ethtool {
+  unsigned present; // bitmask of NETSTACK_ETHTOOL_*
+  struct {
+    uint32_t rx, tx, other, combined;
+    uint32_t rx_max, tx_max, other_max, combined_max;
+  } channels;
+  struct {
+    uint32_t rx, rx_mini, rx_jumbo, tx;
+    uint32_t rx_max, rx_mini_max, rx_jumbo_max, tx_max;
+  } rings;
+  struct {
+    uint32_t rx_usecs, rx_max_frames, tx_usecs, tx_max_frames;
+    bool adaptive_rx, adaptive_tx;
+  } coalesce;
+  // active offload features, by the kernel's feature index. see
+  // netstack_ethtool_feature_index() and netstack_ethtool_feature().
+  uint64_t features[NETSTACK_ETHTOOL_FEATURE_MAX / 64];
+} netstack_ethtool;
+
+// Copy out the cached ethtool state of the local link having this index.
+// Returns false if there is none (including without the ethtool option).
+bool netstack_iface_ethtool(struct netstack* ns, int ifindex, netstack_ethtool* ne);
+
+// The kernel's index for the named offload feature (e.g. "rx-checksum", as
+// listed by ethtool -k), or -1 if it isn't known.
+int netstack_ethtool_feature_index(struct netstack* ns, const char* name);
+
+static inline bool
+netstack_ethtool_feature(const netstack_ethtool* ne, int fidx){
+  if(fidx < 0 || fidx >= NETSTACK_ETHTOOL_FEATURE_MAX){
+    return false;
+  }
+  return ne->features[fidx / 64] & (1ull << (fidx % 64));
+}
 
 // Functions for inspecting netstack_neighs
 const struct rtattr* netstack_neigh_attr(const struct netstack_neigh* nn, int attridx);
 unsigned netstack_neigh_family(const struct netstack_neigh* nn); // always AF_UNSPEC
+int netstack_neigh_nsid(const struct netstack_neigh* nn);
 int netstack_neigh_index(const struct netstack_neigh* nn);
 // A bitmask of NUD_{INCOMPLETE, REACHABLE, STALE, DELAY, PROBE, FAILED,
 //                   NOARP, PERMANENT}
@@ -431,6 +691,7 @@ static inline bool netstack_neigh_cachestats(const struct netstack_neigh* nn,
 // Functions for inspecting netstack_addrs
 const struct rtattr* netstack_addr_attr(const struct netstack_addr* na, int attridx);
 unsigned netstack_addr_family(const struct netstack_addr* na);
+int netstack_addr_nsid(const struct netstack_addr* na);
 unsigned netstack_addr_prefixlen(const struct netstack_addr* na);
 unsigned netstack_addr_flags(const struct netstack_addr* na);
 unsigned netstack_addr_scope(const struct netstack_addr* na);
@@ -533,6 +794,7 @@ netstack_addr_cacheinfo(const struct netstack_addr* na, struct ifa_cacheinfo* ci
 // because routes can have both incoming (RTA_IIF) and outgoing (RTA_OIF) ifaces.
 const struct rtattr* netstack_route_attr(const struct netstack_route* nr, int attridx);
 unsigned netstack_route_family(const struct netstack_route* nr);
+int netstack_route_nsid(const struct netstack_route* nr);
 unsigned netstack_route_dst_len(const struct netstack_route* nr);
 unsigned netstack_route_src_len(const struct netstack_route* nr);
 unsigned netstack_route_tos(const struct netstack_route* nr);
@@ -683,6 +945,32 @@ netstack_route_metric(const struct netstack_route* nr){
   return netstack_route_intattr(nr, RTA_METRICS);
 }
 
+// The id of the nexthop object (see netstack_nexthop_share_byid()) used by
+// the route, or 0 if it carries its own nexthops.
+static inline uint32_t
+netstack_route_nhid(const struct netstack_route* nr){
+  uint32_t id = 0;
+  netstack_rtattrcpy_exact(netstack_route_attr(nr, RTA_NH_ID), &id, sizeof(id));
+  return id;
+}
+
+// One of a route's own nexthops (routes using nexthop objects carry these
+// only with the nexthop_compat_mode sysctl set, as it is by default).
+typedef struct netstack_route_nexthop {
+  int oif;                   // outgoing ifindex, or 0
+  unsigned weight;           // relative weight among the route's nexthops
+  unsigned flags;            // RTNH_F_*
+  unsigned gw_family;        // AF_UNSPEC if there's no gateway
+  unsigned char gateway[16]; // may be of a family other than the route's
+} netstack_route_nexthop;
+
+// Walk the route's nexthops, whether the paths of a multipath (ECMP) route
+// or the single path of any other. *iter must be 0 to start, and is advanced
+// by each call. Returns false once the nexthops are exhausted, or if the
+// route has none of its own (e.g. blackholes).
+bool netstack_route_nexthop_next(const struct netstack_route* nr, size_t* iter,
+                                 netstack_route_nexthop* rnh);
+
 static inline bool
 netstack_route_cacheinfo(const struct netstack_route* nr,
                          struct rta_cacheinfo* cinfo){
@@ -749,6 +1037,149 @@ netstack_route_protstr(unsigned proto){
   }
 }
 
+// Functions for inspecting netstack_rules (policy routing rules, see
+// ip-rule(8)). Unlike the other objects, rules can be shared beyond their
+// callbacks (see netstack_rule_match()).
+const struct rtattr* netstack_rule_attr(const struct netstack_rule* nr, int attridx);
+unsigned netstack_rule_family(const struct netstack_rule* nr);
+int netstack_rule_nsid(const struct netstack_rule* nr);
+uint32_t netstack_rule_priority(const struct netstack_rule* nr);
+uint32_t netstack_rule_table(const struct netstack_rule* nr); // FRA_TABLE if present
+unsigned netstack_rule_action(const struct netstack_rule* nr); // FR_ACT_*
+unsigned netstack_rule_flags(const struct netstack_rule* nr);  // FIB_RULE_*
+unsigned netstack_rule_src_len(const struct netstack_rule* nr);
+unsigned netstack_rule_dst_len(const struct netstack_rule* nr);
+unsigned netstack_rule_tos(const struct netstack_rule* nr);
+
+static inline bool
+netstack_rule_inverted(const struct netstack_rule* nr){
+  return netstack_rule_flags(nr) & FIB_RULE_INVERT;
+}
+
+// The firewall mark selected by the rule, and the mask applied to packets'
+// marks before comparison. Returns false if the rule doesn't select on marks.
+static inline bool
+netstack_rule_fwmark(const struct netstack_rule* nr, uint32_t* mark, uint32_t* mask){
+  if(!netstack_rtattrcpy_exact(netstack_rule_attr(nr, FRA_FWMARK), mark, sizeof(*mark))){
+    return false;
+  }
+  if(!netstack_rtattrcpy_exact(netstack_rule_attr(nr, FRA_FWMASK), mask, sizeof(*mask))){
+    *mask = 0xffffffffu;
+  }
+  return true;
+}
+
+// Copy the name of the input (output) interface selected by the rule into
+// name, which must have room for IFNAMSIZ bytes. Returns NULL if the rule
+// doesn't select on it.
+static inline char*
+netstack_rule_ifname(const struct netstack_rule* nr, int attr, char* name){
+  const struct rtattr* rta = netstack_rule_attr(nr, attr);
+  if(rta == NULL || RTA_PAYLOAD(rta) == 0 || RTA_PAYLOAD(rta) > IFNAMSIZ){
+    return NULL;
+  }
+  memcpy(name, RTA_DATA(rta), RTA_PAYLOAD(rta));
+  name[RTA_PAYLOAD(rta) - 1] = '\0';
+  return name;
+}
+
+static inline char*
+netstack_rule_iifname(const struct netstack_rule* nr, char* name){
+  return netstack_rule_ifname(nr, FRA_IIFNAME, name);
+}
+
+static inline char*
+netstack_rule_oifname(const struct netstack_rule* nr, char* name){
+  return netstack_rule_ifname(nr, FRA_OIFNAME, name);
+}
+
+static inline bool
+netstack_rule_str(const struct netstack_rule* nr, int attr, char* buf,
+                  size_t buflen, unsigned* family){
+  const struct rtattr* nrrta = netstack_rule_attr(nr, attr);
+  if(nrrta == NULL){
+    return false;
+  }
+  *family = netstack_rule_family(nr);
+  if(!netstack_rtattr_l3addrstr(*family, nrrta, buf, buflen)){
+    return false;
+  }
+  return true;
+}
+
+// Presentation forms of the source (FRA_SRC) and destination (FRA_DST)
+// prefixes. Returns false if the rule doesn't select on them.
+static inline bool
+netstack_rule_srcstr(const struct netstack_rule* nr, char* buf, size_t buflen,
+                     unsigned* family){
+  return netstack_rule_str(nr, FRA_SRC, buf, buflen, family);
+}
+
+static inline bool
+netstack_rule_dststr(const struct netstack_rule* nr, char* buf, size_t buflen,
+                     unsigned* family){
+  return netstack_rule_str(nr, FRA_DST, buf, buflen, family);
+}
+
+static inline const char*
+netstack_rule_actionstr(unsigned action){
+  switch(action){
+    case FR_ACT_TO_TBL: return "lookup";
+    case FR_ACT_GOTO: return "goto";
+    case FR_ACT_NOP: return "nop";
+    case FR_ACT_BLACKHOLE: return "blackhole";
+    case FR_ACT_UNREACHABLE: return "unreachable";
+    case FR_ACT_PROHIBIT: return "prohibit";
+    default: return "?";
+  }
+}
+
+// Functions for inspecting netstack_nexthops (nexthop objects, see
+// ip-nexthop(8)). Like rules, nexthops can be shared beyond their callbacks
+// (see netstack_nexthop_share_byid()).
+const struct rtattr* netstack_nexthop_attr(const struct netstack_nexthop* nh, int attridx);
+unsigned netstack_nexthop_family(const struct netstack_nexthop* nh); // AF_UNSPEC for groups
+int netstack_nexthop_nsid(const struct netstack_nexthop* nh);
+uint32_t netstack_nexthop_id(const struct netstack_nexthop* nh);
+unsigned netstack_nexthop_flags(const struct netstack_nexthop* nh); // RTNH_F_*
+unsigned netstack_nexthop_protocol(const struct netstack_nexthop* nh);
+unsigned netstack_nexthop_scope(const struct netstack_nexthop* nh);
+int netstack_nexthop_oif(const struct netstack_nexthop* nh); // 0 if none
+bool netstack_nexthop_blackhole(const struct netstack_nexthop* nh);
+// Copy the gateway (4 or 16 bytes) into gw, returning its family, or
+// AF_UNSPEC (without touching gw) if there's none.
+unsigned netstack_nexthop_gateway(const struct netstack_nexthop* nh, void* gw);
+// Members of a nexthop group (0 for other nexthops), and the idx'th member's
+// id and weight. Returns false if there's no such member.
+unsigned netstack_nexthop_groupcount(const struct netstack_nexthop* nh);
+bool netstack_nexthop_group(const struct netstack_nexthop* nh, unsigned idx,
+                            uint32_t* id, unsigned* weight);
+
+// Functions for inspecting netstack_tcs (queueing disciplines and their
+// classes, see tc(8)). Like rules, these can be shared beyond their callbacks
+// (see netstack_tc_share()).
+const struct rtattr* netstack_tc_attr(const struct netstack_tc* nt, int attridx);
+int netstack_tc_nsid(const struct netstack_tc* nt);
+bool netstack_tc_class(const struct netstack_tc* nt); // false for qdiscs
+int netstack_tc_index(const struct netstack_tc* nt);
+uint32_t netstack_tc_handle(const struct netstack_tc* nt); // classid, for classes
+uint32_t netstack_tc_parent(const struct netstack_tc* nt); // TC_H_ROOT, etc.
+// Copy the kind (e.g. "htb", "fq_codel") into buf, which must be at least
+// IFNAMSIZ bytes. Returns false if there's none.
+bool netstack_tc_kind(const struct netstack_tc* nt, char* buf);
+
+// Statistics of a qdisc or class, from TCA_STATS2 (or the older TCA_STATS).
+// Rates are those of the kernel's estimator, if one is attached.
+typedef struct netstack_tc_stats {
+  uint64_t bytes, packets;
+  uint32_t qlen, backlog, drops, requeues, overlimits;
+  uint64_t bps, pps;
+  uint64_t updated_nsec; // CLOCK_MONOTONIC of the last refresh, if cached
+} netstack_tc_stats;
+
+// Decode the object's own statistics into st.
+void netstack_tc_stats_get(const struct netstack_tc* nt, netstack_tc_stats* st);
+
 typedef enum {
   NETSTACK_MOD, // a non-destructive event about an object
   NETSTACK_DEL, // an object that is going away
@@ -760,6 +1191,22 @@ typedef void (*netstack_iface_cb)(const struct netstack_iface*, netstack_event_e
 typedef void (*netstack_addr_cb)(const struct netstack_addr*, netstack_event_e, void*);
 typedef void (*netstack_route_cb)(const struct netstack_route*, netstack_event_e, void*);
 typedef void (*netstack_neigh_cb)(const struct netstack_neigh*, netstack_event_e, void*);
+typedef void (*netstack_rule_cb)(const struct netstack_rule*, netstack_event_e, void*);
+typedef void (*netstack_nexthop_cb)(const struct netstack_nexthop*, netstack_event_e, void*);
+typedef void (*netstack_tc_cb)(const struct netstack_tc*, netstack_event_e, void*);
+
+// Selects links for the iface_include and iface_exclude options. A link
+// matches if it satisfies any criterion. Unused criteria are NULL or 0, but
+// at least one must be used. Indices are only compared for local links.
+typedef struct netstack_iface_filter {
+  const char* const* names; // NULL-terminated fnmatch(3) patterns
+  // NULL-terminated IFLA_INFO_KINDs ("veth", "bridge"...). "" matches links
+  // without any kind, such as physical devices and loopback.
+  const char* const* kinds;
+  const int* ifindices; // ifindex_count of them
+  unsigned ifindex_count;
+  int master; // enslaved to this link (bridge, bond, vrf...)
+} netstack_iface_filter;
 
 // The default for all members is false or the appropriate zero representation.
 // It is invalid to supply a non-NULL curry together with a NULL callback for
@@ -774,8 +1221,15 @@ typedef struct netstack_opts {
   void* route_curry;
   netstack_neigh_cb neigh_cb;
   void* neigh_curry;
+  netstack_rule_cb rule_cb;
+  void* rule_curry;
+  netstack_nexthop_cb nexthop_cb;
+  void* nexthop_curry;
+  netstack_tc_cb tc_cb;
+  void* tc_curry;
   // If set, do not cache the corresponding type of object.
   bool iface_notrack, addr_notrack, route_notrack, neigh_notrack;
+  bool rule_notrack, nexthop_notrack, fdb_notrack, tc_notrack;
   // Policy for initial object dump. _ASYNC will cause events for existing
   // objects, but netstack_create() may return before they've been received.
   // _BLOCK blocks netstack_create() from returning until all initial
@@ -785,6 +1239,54 @@ typedef struct netstack_opts {
     NETSTACK_INITIAL_EVENTS_BLOCK,
     NETSTACK_INITIAL_EVENTS_NONE,
   } initial_events;
+  // If set, receive events from all network namespaces having an nsid in our
+  // own, and track their links. Peer links are dumped as their nsids become
+  // known; their addresses, routes and neighbors are learned only from events.
+  // Objects report their origin via netstack_*_nsid().
+  bool all_nsids;
+  // If set, no threads are created. The caller must instead watch the fd
+  // returned by netstack_get_fd() for readability, and call netstack_process()
+  // from a single thread, upon which all callbacks will be invoked. Requests
+  // are transmitted as they're queued, or as earlier requests complete therein.
+  // _BLOCK initial events are collected within netstack_create().
+  bool threadless;
+  // If set, receive via io_uring: a multishot recvmsg is kept posted using a
+  // ring of provided buffers, and completions are handled in batches. Falls
+  // back to recvmsg() if io_uring (or its multishot recvmsg, Linux 6.0+) is
+  // unavailable. Invalid with threadless.
+  bool io_uring;
+  // If set, netstack_iface_share_byidx() and netstack_iface_share_byname()
+  // consult a small per-thread cache before the shared hash. A hit takes no
+  // lock. Each cache entry retains a share on its iface until the thread's
+  // next miss following a change to the iface cache (or the thread's exit).
+  // These shares are not counted in live_shares nor zombie_shares.
+  bool lookup_cache;
+  // If set, track the ethtool channels, rings, coalescing parameters, and
+  // offload features of local links via ethtool-netlink (Linux 5.6+), kept
+  // current by ethtool notifications. See netstack_iface_ethtool(). Requires
+  // that ifaces be tracked. Invalid with threadless.
+  bool ethtool;
+  // If non-zero, sample the stats of all local links every sample_interval_ms
+  // milliseconds using RTM_GETSTATS, from a library-owned thread (or, with
+  // threadless, from within netstack_process(), which ought then be called at
+  // least that often). Samples are retained per link in a ring of
+  // sample_depth entries (NETSTACK_SAMPLE_DEPTH_DEFAULT if 0, and at most
+  // NETSTACK_SAMPLE_DEPTH_MAX), from which netstack_iface_rates() derives
+  // rates. sample_depth alone retains samples from
+  // netstack_iface_stats_refresh_sync() without starting the sampler.
+  unsigned sample_interval_ms;
+  unsigned sample_depth;
+  // If iface_include is non-NULL, only links it matches are tracked. Links
+  // matched by iface_exclude never are. Messages regarding other links, and
+  // their addresses, neighbors, FDB entries, qdiscs, nexthops, and routes
+  // having an RTA_OIF, are discarded before any object is built, reaching
+  // neither the cache nor callbacks. Multipath routes, and routes using
+  // nexthop objects (RTA_NH_ID), are kept. A tracked link ceasing to match
+  // (i.e. upon rename or enslavement) is delivered as a NETSTACK_DEL. A local
+  // link coming to match has its objects dumped (everything is redumped on
+  // kernels lacking NETLINK_GET_STRICT_CHK). Both filters are copied.
+  const netstack_iface_filter* iface_include;
+  const netstack_iface_filter* iface_exclude;
   // logging callback. if NULL, the library will not log. netstack_stderr_diag
   // can be provided to dump to stderr, or provide your own function.
   void (*diagfxn)(const char* fmt, ...);
@@ -798,11 +1300,307 @@ void netstack_stderr_diag(const char* fmt, ...);
 struct netstack* netstack_create(const netstack_opts* opts);
 int netstack_destroy(struct netstack* ns);
 
+// The netlink socket underlying the netstack, for use in the caller's event
+// loop with the threadless option. Do not read from, write to, or close it.
+int netstack_get_fd(const struct netstack* ns);
+
+// Threadless mode only: receive and dispatch available netlink messages,
+// without blocking. Datagrams are handled whole, and no more are read once
+// budget messages have been handled; a budget of 0 or less drains the socket.
+// Returns the number of messages handled, or -1 on error (including use
+// without the threadless option).
+int netstack_process(struct netstack* ns, int budget);
+
+// Arbitrary rtnetlink requests can be issued over the netstack's socket. The
+// message is copied, and NLM_F_REQUEST is set; NLM_F_ACK is set on all but
+// dumps (RTM_GET* with NLM_F_DUMP). Requests are transmitted in order of
+// submission. Dumps go out one at a time, but several other requests may be
+// outstanding at once. Any objects in the kernel's answers are handled just
+// like events, i.e. they update the cache and invoke callbacks.
+//
+// Once the kernel answers the request (or it fails to be sent, or the
+// netstack is destroyed), it is complete. If cb is non-NULL, it is then
+// invoked with curry from a netstack thread (or, with threadless, from within
+// netstack_process() or the submitting call). Alternatively, wait for the
+// request with netstack_request_wait().
+typedef void (*netstack_request_cb)(struct netstack*, const struct netstack_request*, void*);
+
+// Returns a handle, which must be released with netstack_request_release(),
+// or NULL on failure. The handle remains valid after the netstack is
+// destroyed.
+struct netstack_request* netstack_request_submit(struct netstack* ns,
+                                                 const struct nlmsghdr* nlh,
+                                                 netstack_request_cb cb, void* curry);
+
+// Wait up to timeout_ms (forever if negative) for the request to complete.
+// Returns 0 once it has, or -1 on timeout. With threadless, this processes
+// the socket, and must be called from the processing thread.
+//
+// Neither this nor the other calls waiting on the kernel's answers
+// (netstack_iface_stats_refresh_sync(), and the batch calls) may be made from
+// callbacks: those run on the netstack's threads (or with threadless, within
+// netstack_process()), which must be free to send requests and receive the
+// answers. Such calls fail with EDEADLK, as does netstack_process() itself.
+// Submit the request with a netstack_request_cb instead.
+int netstack_request_wait(struct netstack* ns, const struct netstack_request* req,
+                          int timeout_ms);
+
+bool netstack_request_done(const struct netstack_request* req);
+
+// 0 on success, otherwise a negative errno (-EINPROGRESS until completion).
+int netstack_request_error(const struct netstack_request* req);
+
+// The extended acknowledgement's message and the offset into the request of
+// the offending attribute, if the kernel provided them (NULL and -1 if not).
+const char* netstack_request_extack(const struct netstack_request* req);
+int netstack_request_extack_offset(const struct netstack_request* req);
+
+void netstack_request_release(struct netstack_request* req);
+
+// Routes to be added or deleted in bulk. Addresses are in network byte order,
+// and of the length implied by family (AF_INET or AF_INET6). Zero values
+// select the defaults of ip-route(8): the main table, RTPROT_STATIC, and
+// RTN_UNICAST. When deleting, a zero protocol or type matches any, and the
+// gateway, oif and priority are matched only if provided.
+typedef struct netstack_route_spec {
+  int family;
+  unsigned char dst[16];
+  unsigned dst_len;          // prefix length; 0 for a default route
+  bool has_gateway;
+  unsigned char gateway[16]; // used iff has_gateway
+  int oif;                   // outgoing ifindex, or 0
+  uint32_t table;
+  uint32_t priority;         // metric, or 0
+  unsigned char protocol;    // RTPROT_*
+  unsigned char type;        // RTN_*
+} netstack_route_spec;
+
+// The kernel caps its extended ack messages at 80 bytes. The offending
+// attribute's offset isn't reported, since it would refer to the message we
+// built, rather than to anything the caller supplied.
+#define NETSTACK_EXTACK_LEN 80
+
+typedef struct netstack_batch_result {
+  int error;         // 0, or a negative errno
+  char extack[NETSTACK_EXTACK_LEN]; // the kernel's explanation, if any
+} netstack_batch_result;
+
+// Replace existing objects, rather than failing with -EEXIST.
+#define NETSTACK_BATCH_REPLACE 0x1u
+// Don't return until the netstack has processed the events resulting from the
+// batch, so that its cache (and callbacks) reflect the changes.
+#define NETSTACK_BATCH_SYNC    0x2u
+
+// Add or delete n routes, packing hundreds of messages into each sendmsg().
+// Only some ask for acknowledgement; the kernel answers the rest only upon
+// failure. Blocks until the kernel has answered all of them. If results is
+// non-NULL, it must have room for n elements, and results[i] describes the
+// outcome for routes[i]. Returns the number of routes which failed, or -1 if
+// the batch could not be attempted (with EDEADLK if called from a callback;
+// see netstack_request_wait()). The route changes arrive as events.
+int netstack_route_add_batch(struct netstack* ns, const netstack_route_spec* routes,
+                             size_t n, unsigned flags, netstack_batch_result* results);
+int netstack_route_del_batch(struct netstack* ns, const netstack_route_spec* routes,
+                             size_t n, unsigned flags, netstack_batch_result* results);
+
+// Links to be created, modified, or deleted in bulk. A link is identified by
+// index, or by name if index is 0 (when modifying, a name given along with an
+// index renames the link). New links require a kind (e.g. "dummy", "veth",
+// "bridge"); a veth's peer may be named. Zero values are left unchanged. Only
+// the bits of flags present in change (e.g. IFF_UP) are applied.
+typedef struct netstack_link_spec {
+  int index;
+  char name[IFNAMSIZ];
+  char kind[16];             // IFLA_INFO_KIND, used only when creating
+  char peer[IFNAMSIZ];       // veth peer, used only when creating
+  unsigned mtu;
+  unsigned txqlen;
+  int master;                // ifindex of the master device (e.g. a bridge)
+  unsigned flags, change;    // IFF_*
+  unsigned char l2addr[32];
+  size_t l2addr_len;         // 0 to leave the hardware address unchanged
+} netstack_link_spec;
+
+// Addresses to be added or deleted in bulk, following ip-address(8). addr is
+// the local address, in network byte order; peer is the remote end of a
+// point-to-point link. flags are IFA_F_*. Zero lifetimes mean forever.
+typedef struct netstack_addr_spec {
+  int family;                // AF_INET or AF_INET6
+  int index;                 // interface
+  unsigned char addr[16];
+  unsigned prefixlen;
+  bool has_peer;
+  unsigned char peer[16];    // used iff has_peer
+  unsigned char scope;       // RT_SCOPE_*
+  uint32_t flags;
+  uint32_t valid_lft, preferred_lft; // seconds, used only when adding
+  char label[IFNAMSIZ];      // IPv4 only
+} netstack_addr_spec;
+
+// A batch of operations, applied in the order they were added. Each operation
+// is sent as its own message, so a failure doesn't prevent or undo the
+// others; each gets its own result. Specifications are copied, and checked
+// upon commit. A batch can be committed any number of times, to any netstack.
+struct netstack_batch* netstack_batch_create(void);
+void netstack_batch_destroy(struct netstack_batch* nb);
+// Remove all operations, so that the batch can be reused.
+void netstack_batch_clear(struct netstack_batch* nb);
+size_t netstack_batch_count(const struct netstack_batch* nb);
+
+// Append an operation. Returns 0, or -1 on failure (with errno set to EINVAL
+// if the specification is NULL, or ENOMEM).
+int netstack_batch_link_add(struct netstack_batch* nb, const netstack_link_spec* ls);
+int netstack_batch_link_set(struct netstack_batch* nb, const netstack_link_spec* ls);
+int netstack_batch_link_del(struct netstack_batch* nb, const netstack_link_spec* ls);
+int netstack_batch_addr_add(struct netstack_batch* nb, const netstack_addr_spec* as);
+int netstack_batch_addr_del(struct netstack_batch* nb, const netstack_addr_spec* as);
+int netstack_batch_route_add(struct netstack_batch* nb, const netstack_route_spec* rs);
+int netstack_batch_route_del(struct netstack_batch* nb, const netstack_route_spec* rs);
+
+// Send the batch, as with netstack_route_add_batch(). results, if non-NULL,
+// must have room for netstack_batch_count() elements. Returns the number of
+// operations which failed, or -1 if the batch could not be attempted (or, with
+// NETSTACK_BATCH_SYNC, if the netstack could not be synchronized). An operation
+// whose answer was lost to an overrun reports -ENOBUFS, though it might well
+// have taken effect.
+int netstack_batch_commit(struct netstack* ns, const struct netstack_batch* nb,
+                          unsigned flags, netstack_batch_result* results);
+
 // Count of interfaces in the active store, and bytes used to represent them in
 // total. If iface_notrack is set, these will always return 0.
 unsigned netstack_iface_count(const struct netstack* ns);
 uint64_t netstack_iface_bytes(const struct netstack* ns);
 
+// Count of routes and neighbors in the local namespace's caches (see
+// netstack_resolve()). These are 0 if route_notrack (neigh_notrack) is set.
+unsigned netstack_route_count(const struct netstack* ns);
+unsigned netstack_neigh_count(const struct netstack* ns);
+
+// A bridge forwarding database entry, as cached from AF_BRIDGE neighbors.
+typedef struct netstack_fdb_entry {
+  int port;               // ifindex through which the MAC is reached
+  unsigned state;         // NUD_* (NUD_REACHABLE or NUD_STALE if learned)
+  unsigned flags;         // NTF_*
+  unsigned dst_family;    // family of the remote (e.g. VXLAN), or AF_UNSPEC
+  unsigned char dst[16];  // valid iff dst_family isn't AF_UNSPEC
+} netstack_fdb_entry;
+
+// Find the port of the bridge master (for entries without a master, such as
+// a VXLAN device's own, the device itself) having mac (ETH_ALEN bytes) on
+// vlan (0 if untagged), filling in fe. Returns 0 on success, or -1 with errno
+// set to ENOENT if there's no such entry, or to EOPNOTSUPP if fdb_notrack is
+// set. Only the local namespace is cached. Entries the bridge would flush
+// from a port going down, and all those of a link going away, are dropped
+// even if we miss the kernel's notifications.
+int netstack_fdb_lookup(const struct netstack* ns, int master, uint16_t vlan,
+                        const void* mac, netstack_fdb_entry* fe);
+// Count of cached FDB entries, and of those on port. These are 0 if
+// fdb_notrack is set.
+unsigned netstack_fdb_count(const struct netstack* ns);
+unsigned netstack_fdb_port_count(const struct netstack* ns, int port);
+
+// Count of rules of all families in the local namespace's rule cache. This is
+// 0 if rule_notrack is set.
+unsigned netstack_rule_count(const struct netstack* ns);
+
+// The first rule of family (AF_INET or AF_INET6), in order of priority, which
+// selects the flow from src to dst (in network byte order; either may be NULL
+// for the unspecified address) having fwmark, arriving through ifindex iif (0
+// for locally-originated traffic, which the rules see as arriving through the
+// loopback) and leaving through oif (or 0, if not yet known). Goto rules are
+// followed, and nop rules passed over. The flow is taken to have a TOS of 0,
+// and neither protocol nor ports; rules selecting on ports, protocols, uids,
+// tunnel ids, or l3mdevs never match. Interfaces are matched by index, that
+// of the link bearing the rule's iif or oif name according to the iface
+// cache; with iface_notrack, rules selecting on interfaces never match.
+// Matching is a walk of the priority-sorted cache, skipping rules which
+// select some other single fwmark. Returns a share which must be released
+// with netstack_rule_abandon(), or NULL with errno set to ENOENT if no rule
+// matched, or EOPNOTSUPP if rules aren't being cached.
+const struct netstack_rule* netstack_rule_match(struct netstack* ns, int family,
+                                                const void* src, const void* dst,
+                                                uint32_t fwmark, int iif, int oif);
+void netstack_rule_abandon(const struct netstack_rule* nr);
+
+// Count of nexthop objects (including groups) in the local namespace's
+// nexthop cache. This is 0 if nexthop_notrack is set.
+unsigned netstack_nexthop_count(const struct netstack* ns);
+
+// Share the cached nexthop object having id, which must be released with
+// netstack_nexthop_abandon(), or return NULL with errno set to ENOENT if
+// there is none, or EOPNOTSUPP if nexthops aren't being cached. The kernel
+// drops nexthops whose links go down or away (and groups left empty, and
+// routes using any of them) without telling us; the cache does likewise.
+const struct netstack_nexthop* netstack_nexthop_share_byid(const struct netstack* ns,
+                                                           uint32_t id);
+void netstack_nexthop_abandon(const struct netstack_nexthop* nh);
+
+// Count of qdiscs and classes in the local namespace's traffic control
+// cache. This is 0 if tc_notrack is set.
+unsigned netstack_tc_count(const struct netstack* ns);
+
+// Share the cached qdisc attached at parent (TC_H_ROOT, TC_H_INGRESS, or a
+// classid) of ifindex, or (if isclass is set) the class with classid handle,
+// which must be released with netstack_tc_abandon(). Qdiscs are found by
+// where they're attached, since the kernel's default qdiscs all have handle
+// 0. Returns NULL with errno set to ENOENT if there's none, or EOPNOTSUPP if
+// traffic control objects aren't being cached. A qdisc's deletion takes its
+// classes, and the qdiscs beneath them, along with it.
+const struct netstack_tc* netstack_tc_share(const struct netstack* ns, bool isclass,
+                                            int ifindex, uint32_t handle);
+void netstack_tc_abandon(const struct netstack_tc* nt);
+
+// Copy the latest statistics of the qdisc (class) netstack_tc_share() would
+// find into st, without taking a share. Returns 0, or -1 with errno set as
+// for netstack_tc_share().
+int netstack_tc_stats_latest(const struct netstack* ns, bool isclass, int ifindex,
+                             uint32_t handle, netstack_tc_stats* st);
+
+// Request a dump of all qdiscs, and of the classes of each interface having a
+// cached qdisc other than noqueue (the kernel only dumps classes interface by
+// interface; they're otherwise learned only as they change). Refreshes
+// changing nothing but statistics update the cache in place, without
+// callbacks or new objects. Returns 0 once the requests are queued, or -1.
+int netstack_tc_refresh(struct netstack* ns);
+
+// Where a packet would go, according to the cache.
+typedef struct netstack_resolution {
+  uint32_t table;            // table of the matching route
+  unsigned type;             // its RTN_* (e.g. RTN_UNICAST, RTN_LOCAL)
+  unsigned dst_len;          // its prefix length
+  uint32_t priority;         // its metric
+  int oif;                   // outgoing ifindex, or 0
+  bool has_gateway;
+  unsigned gw_family;        // the gateway's, which may differ from dst's
+  unsigned char gateway[16]; // valid iff has_gateway
+  bool has_prefsrc;
+  unsigned char prefsrc[16]; // valid iff has_prefsrc
+  unsigned nud_state;        // NUD_* of the next hop's neighbor, or 0 if none
+  size_t lladdr_len;         // 0 if the next hop's lladdr is unknown
+  unsigned char lladdr[32];
+} netstack_resolution;
+
+// Resolve the destination dst (AF_INET or AF_INET6, in network byte order)
+// entirely from the cache: the policy rules select tables, in which the
+// longest-prefix match is found, the first usable nexthop of which is then
+// looked up among the neighbors (for unicast routes). Nexthops last reported
+// with RTNH_F_DEAD or RTNH_F_LINKDOWN aren't usable, and routes without a
+// usable nexthop are passed over; of IPv4 routes differing only in their
+// nexthops (see `ip route append`), the first usable one is taken. Routes
+// using nexthop objects go by the cached object (the first usable member,
+// for groups), if nexthops are being cached. src (may be NULL), mark, and
+// iif (0 for locally-originated traffic) are matched against the cached rules
+// as by netstack_rule_match() (so with iface_notrack, rules selecting on
+// interfaces never match); if no rules are cached (see rule_notrack), the
+// local, main, and default tables are consulted in turn. A blackhole,
+// unreachable, or prohibit rule yields a resolution of only that type.
+// Returns 0 if a route was found (including e.g. blackholes; check type), or
+// -1 with errno set to ENETUNREACH if none was, or to EOPNOTSUPP if routes
+// aren't being cached. Only the local namespace is cached.
+int netstack_resolve(struct netstack* ns, int family, const void* dst,
+                     const void* src, uint32_t mark, int iif,
+                     netstack_resolution* res);
+
 // Take a reference on some netstack iface for read-only use in the client.
 // There is no copy, but the object still needs to be freed by a call to
 // netstack_iface_abandon().
@@ -815,6 +1613,23 @@ const struct netstack_iface* netstack_iface_share_byidx(struct netstack* ns, int
 struct netstack_iface* netstack_iface_copy_byname(struct netstack* ns, const char* name);
 struct netstack_iface* netstack_iface_copy_byidx(struct netstack* ns, int idx);
 
+// Lookups in the namespace identified by nsid (see netstack_iface_nsid()). The
+// functions above are equivalent to these with NETSTACK_NSID_LOCAL.
+const struct netstack_iface* netstack_iface_share_byname_nsid(struct netstack* ns, int nsid, const char* name);
+const struct netstack_iface* netstack_iface_share_byidx_nsid(struct netstack* ns, int nsid, int idx);
+struct netstack_iface* netstack_iface_copy_byname_nsid(struct netstack* ns, int nsid, const char* name);
+struct netstack_iface* netstack_iface_copy_byidx_nsid(struct netstack* ns, int nsid, int idx);
+
+// Share n netstack_ifaces at once from the local namespace, taking the lock
+// only once. out must have room for n elements; out[i] is set to the share
+// corresponding to idxs[i] (or names[i]), or NULL if there is no such
+// interface. Each non-NULL element must be abandoned. Returns the number of
+// interfaces found.
+size_t netstack_iface_share_byidx_batch(struct netstack* ns, const int* idxs, size_t n,
+                                        const struct netstack_iface** out);
+size_t netstack_iface_share_byname_batch(struct netstack* ns, const char* const* names,
+                                         size_t n, const struct netstack_iface** out);
+
 // Copy/share a netstack_iface to which we already have a handle, for
 // instance directly from the callback context. This is faster than the
 // alternatives, as it needn't perform a lookup.
@@ -833,6 +1648,9 @@ int netstack_print_iface(const struct netstack_iface* ni, FILE* out);
 int netstack_print_addr(const struct netstack_addr* na, FILE* out);
 int netstack_print_route(const struct netstack_route* nr, FILE* out);
 int netstack_print_neigh(const struct netstack_neigh* nn, FILE* out);
+int netstack_print_rule(const struct netstack_rule* nr, FILE* out);
+int netstack_print_nexthop(const struct netstack_nexthop* nh, FILE* out);
+int netstack_print_tc(const struct netstack_tc* nt, FILE* out);
 int netstack_print_stats(const netstack_stats* stats, FILE* out);
 
 // State for streaming enumerations (enumerations taking place over several
@@ -879,6 +1697,135 @@ int netstack_iface_enumerate(const struct netstack* ns,
                              void* objs, size_t* obytes,
                              netstack_enumerator* streamer);
 
+// A flat, position-independent serialization of any object, suitable for
+// writing to disk, sending over a socket, or mapping at any address. Every
+// offset is relative to the start of the record, every section is 4-byte
+// aligned, and records can be concatenated (each begins at the previous one's
+// start plus len, which is always a multiple of 4). All fields, including the netlink header and attributes,
+// are in the byte order of the host which serialized them, as in netlink
+// itself; a record of the other byte order shows up as a bad magic.
+#define NETSTACK_BLOB_MAGIC   0x4b54534eu // "NSTK" on little-endian hosts
+#define NETSTACK_BLOB_VERSION 1u
+
+typedef enum {
+  NETSTACK_OBJ_IFACE = 1,
+  NETSTACK_OBJ_ADDR,
+  NETSTACK_OBJ_ROUTE,
+  NETSTACK_OBJ_NEIGH,
+  NETSTACK_OBJ_RULE,
+  NETSTACK_OBJ_NEXTHOP,
+  NETSTACK_OBJ_TC,
+} netstack_obj_e;
+
+#define NETSTACK_BLOB_TCCLASS 0x1u // flags: a tc class, rather than a qdisc
+#define NETSTACK_BLOB_DELETED 0x2u // flags: a deleted object's last state
+
+typedef struct netstack_blob {
+  uint32_t magic;     // NETSTACK_BLOB_MAGIC
+  uint16_t version;   // NETSTACK_BLOB_VERSION
+  uint16_t type;      // netstack_obj_e
+  uint32_t len;       // total bytes in the record, including this header
+  int32_t nsid;       // NETSTACK_NSID_LOCAL, or the peer namespace's nsid
+  uint32_t flags;     // NETSTACK_BLOB_*
+  uint32_t msgoff, msglen;   // the netlink header (struct ifinfomsg, etc.)
+  uint32_t attroff, attrlen; // the attributes, as received from the kernel
+  // The optional index: idxcount uint32_ts, the ith being the offset (biased
+  // by one, so 0 means absent) of attribute type i within the attributes.
+  uint32_t idxoff, idxcount;
+} netstack_blob;
+
+// Serialize the object into buf, which must be 4-byte aligned. Returns the
+// size of the serialization, writing it only if that doesn't exceed len (so
+// a NULL buf and 0 len can be used to size it). With NETSTACK_SERIALIZE_INDEX,
+// the index is included, so that views can find attributes in constant time.
+// Returns -1 with errno set to EINVAL on a misaligned buf or unknown flags.
+#define NETSTACK_SERIALIZE_INDEX 0x1u
+
+ssize_t netstack_iface_serialize(const struct netstack_iface* ni, void* buf,
+                                 size_t len, unsigned flags);
+ssize_t netstack_addr_serialize(const struct netstack_addr* na, void* buf,
+                                size_t len, unsigned flags);
+ssize_t netstack_route_serialize(const struct netstack_route* nr, void* buf,
+                                 size_t len, unsigned flags);
+ssize_t netstack_neigh_serialize(const struct netstack_neigh* nn, void* buf,
+                                 size_t len, unsigned flags);
+ssize_t netstack_rule_serialize(const struct netstack_rule* nr, void* buf,
+                                size_t len, unsigned flags);
+ssize_t netstack_nexthop_serialize(const struct netstack_nexthop* nh, void* buf,
+                                   size_t len, unsigned flags);
+ssize_t netstack_tc_serialize(const struct netstack_tc* nt, void* buf,
+                              size_t len, unsigned flags);
+
+// A read-only view of a serialized object, pointing into the caller's buffer
+// (which must outlive it). Nothing is copied.
+typedef struct netstack_view {
+  netstack_obj_e type;
+  int nsid;
+  unsigned flags;            // NETSTACK_BLOB_*
+  const void* msg;           // the netlink header, e.g. struct ifinfomsg
+  size_t msglen;
+  const struct rtattr* attrs;
+  size_t attrlen;
+  const uint32_t* index;     // NULL if the record has no index
+  unsigned idxcount;
+  size_t len;                // the record's total length
+} netstack_view;
+
+// Validate the record at the start of buf (which must be 4-byte aligned),
+// and set up v over it. The header is checked against the object type, and
+// the attributes (and index) are checked for consistency, so that untrusted
+// records can be viewed safely. Returns 0, or -1 with errno set to EINVAL
+// (misaligned, truncated, or malformed), EPROTO (bad magic, or another type
+// of object), or EPROTONOSUPPORT (a newer version).
+int netstack_iface_view(const void* buf, size_t len, netstack_view* v);
+int netstack_addr_view(const void* buf, size_t len, netstack_view* v);
+int netstack_route_view(const void* buf, size_t len, netstack_view* v);
+int netstack_neigh_view(const void* buf, size_t len, netstack_view* v);
+int netstack_rule_view(const void* buf, size_t len, netstack_view* v);
+int netstack_nexthop_view(const void* buf, size_t len, netstack_view* v);
+int netstack_tc_view(const void* buf, size_t len, netstack_view* v);
+
+// View the record of any type at *off in a buffer of concatenated records,
+// advancing *off past it. Returns 1, 0 once the buffer is exhausted, or -1
+// as for the typed views.
+int netstack_view_next(const void* buf, size_t len, size_t* off, netstack_view* v);
+
+// The attribute of type attridx, or NULL if there is none. This is o(1) for
+// types covered by the index, and otherwise a walk of the attributes.
+const struct rtattr* netstack_view_attr(const netstack_view* v, int attridx);
+
+// Every change to the iface, route, neighbor, nexthop, FDB, and tc caches
+// advances the netstack's generation, and stamps the changed object with it.
+// Refreshes of tc statistics changing nothing else (see
+// netstack_tc_stats_latest()) aren't changes.
+uint64_t netstack_generation(const struct netstack* ns);
+
+// Serialize (as with netstack_iface_serialize()) the cached ifaces modified
+// after generation gen, and the last state of those deleted after it (marked
+// with NETSTACK_BLOB_DELETED), as concatenated records in order of
+// generation, into buf (4-byte aligned) of *len bytes. Apply them in order
+// to bring a copy up to date. A gen of 0 yields every cached object, and no
+// deletions. *newgen is set to the generation to pass next time, and *len
+// to the bytes written. The cost is proportional to the changes since gen,
+// not the size of the cache. Returns the number of records, or -1 with errno
+// set to ENOBUFS (*len is then set to the space required, though more may
+// be needed by the next call), ESTALE (deletions since gen have been
+// forgotten; start over from 0), or EOPNOTSUPP (the class isn't cached).
+// Deletions are remembered from the first call on, up to 1024 per class.
+int netstack_iface_enumerate_since(const struct netstack* ns, uint64_t gen, void* buf,
+                                   size_t* len, unsigned flags, uint64_t* newgen);
+int netstack_route_enumerate_since(const struct netstack* ns, uint64_t gen, void* buf,
+                                   size_t* len, unsigned flags, uint64_t* newgen);
+int netstack_neigh_enumerate_since(const struct netstack* ns, uint64_t gen, void* buf,
+                                   size_t* len, unsigned flags, uint64_t* newgen);
+int netstack_nexthop_enumerate_since(const struct netstack* ns, uint64_t gen, void* buf,
+                                     size_t* len, unsigned flags, uint64_t* newgen);
+// FDB entries are serialized as neighbors (of family AF_BRIDGE).
+int netstack_fdb_enumerate_since(const struct netstack* ns, uint64_t gen, void* buf,
+                                 size_t* len, unsigned flags, uint64_t* newgen);
+int netstack_tc_enumerate_since(const struct netstack* ns, uint64_t gen, void* buf,
+                                size_t* len, unsigned flags, uint64_t* newgen);
+
 #ifdef __cplusplus
 }
 #else
@@ -911,6 +1858,27 @@ vnetstack_print_neigh(const struct netstack_neigh* nn, netstack_event_e etype, v
   fputc(etype == NETSTACK_DEL ? '*' : ' ', vf);
   netstack_print_neigh(nn, vf);
 }
+
+static inline void
+vnetstack_print_rule(const struct netstack_rule* nr, netstack_event_e etype, void* vf){
+  fputc('P', vf);
+  fputc(etype == NETSTACK_DEL ? '*' : ' ', vf);
+  netstack_print_rule(nr, vf);
+}
+
+static inline void
+vnetstack_print_nexthop(const struct netstack_nexthop* nh, netstack_event_e etype, void* vf){
+  fputc('H', vf);
+  fputc(etype == NETSTACK_DEL ? '*' : ' ', vf);
+  netstack_print_nexthop(nh, vf);
+}
+
+static inline void
+vnetstack_print_tc(const struct netstack_tc* nt, netstack_event_e etype, void* vf){
+  fputc('Q', vf);
+  fputc(etype == NETSTACK_DEL ? '*' : ' ', vf);
+  netstack_print_tc(nt, vf);
+}
 #endif
 
 #endif
@@ -3,9 +3,98 @@
 #include <signal.h>
 #include <string.h>
 #include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/un.h>
+#include <sys/socket.h>
 #include <netstack.h>
 
-int main(void){
+static void
+usage(const char* argv0, FILE* out){
+  fprintf(out, "usage: %s [ -m metricsock ] [ -x pattern ]\n", argv0);
+  fprintf(out, " -m metricsock: serve OpenMetrics on a unix socket at this path\n");
+  fprintf(out, " -x pattern: ignore links whose names match this glob\n");
+}
+
+typedef struct metricsrv {
+  struct netstack* ns;
+  int fd;
+} metricsrv;
+
+// Write the full metrics to each client which connects, then hang up.
+static void*
+metrics_thread(void* vms){
+  metricsrv* ms = vms;
+  size_t len = BUFSIZ;
+  char* buf = malloc(len);
+  if(buf == NULL){
+    return NULL;
+  }
+  int cfd;
+  while((cfd = accept(ms->fd, NULL, NULL)) >= 0){
+    int r;
+    while((r = netstack_write_metrics(ms->ns, buf, len)) >= 0 && (size_t)r >= len){
+      char* tmp = realloc(buf, r + 1);
+      if(tmp == NULL){
+        break;
+      }
+      buf = tmp;
+      len = r + 1;
+    }
+    if(r >= 0 && (size_t)r < len){
+      size_t off = 0;
+      ssize_t w;
+      while(off < (size_t)r && (w = write(cfd, buf + off, r - off)) > 0){
+        off += w;
+      }
+    }
+    close(cfd);
+  }
+  fprintf(stderr, "Couldn't accept metrics client (%s)\n", strerror(errno));
+  free(buf);
+  return NULL;
+}
+
+static int
+metrics_listen(const char* path){
+  struct sockaddr_un sun;
+  if(strlen(path) >= sizeof(sun.sun_path)){
+    fprintf(stderr, "Socket path too long: %s\n", path);
+    return -1;
+  }
+  memset(&sun, 0, sizeof(sun));
+  sun.sun_family = AF_UNIX;
+  strcpy(sun.sun_path, path);
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if(fd < 0){
+    fprintf(stderr, "Couldn't create unix socket (%s)\n", strerror(errno));
+    return -1;
+  }
+  unlink(path);
+  if(bind(fd, (const struct sockaddr*)&sun, sizeof(sun)) || listen(fd, 8)){
+    fprintf(stderr, "Couldn't listen at %s (%s)\n", path, strerror(errno));
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+int main(int argc, char** argv){
+  const char* metricpath = NULL;
+  const char* excluded[] = { NULL, NULL, };
+  int c;
+  while((c = getopt(argc, argv, "hm:x:")) != -1){
+    switch(c){
+      case 'm': metricpath = optarg; break;
+      case 'x': excluded[0] = optarg; break;
+      case 'h': usage(argv[0], stdout); return EXIT_SUCCESS;
+      default: usage(argv[0], stderr); return EXIT_FAILURE;
+    }
+  }
+  if(optind < argc){
+    usage(argv[0], stderr);
+    return EXIT_FAILURE;
+  }
   sigset_t sigset;
   sigemptyset(&sigset);
   sigaddset(&sigset, SIGTERM);
@@ -20,8 +109,18 @@ int main(void){
     .route_curry = stdout,
     .neigh_cb = vnetstack_print_neigh,
     .neigh_curry = stdout,
+    .rule_cb = vnetstack_print_rule,
+    .rule_curry = stdout,
+    .nexthop_cb = vnetstack_print_nexthop,
+    .nexthop_curry = stdout,
+    .tc_cb = vnetstack_print_tc,
+    .tc_curry = stdout,
     .diagfxn = netstack_stderr_diag,
   };
+  const netstack_iface_filter exclude = { .names = excluded, };
+  if(excluded[0]){
+    nopts.iface_exclude = &exclude;
+  }
   struct netstack* ns = netstack_create(&nopts);
   if(ns == NULL){
     return EXIT_FAILURE;
@@ -30,6 +129,17 @@ int main(void){
     fprintf(stderr, "Couldn't block signals (%s)\n", strerror(errno));
     return EXIT_FAILURE;
   }
+  metricsrv ms = { .ns = ns, .fd = -1, };
+  pthread_t metricstid;
+  if(metricpath){
+    if((ms.fd = metrics_listen(metricpath)) < 0){
+      return EXIT_FAILURE;
+    }
+    if(pthread_create(&metricstid, NULL, metrics_thread, &ms)){
+      fprintf(stderr, "Couldn't launch metrics thread\n");
+      return EXIT_FAILURE;
+    }
+  }
   int sig;
   printf("Waiting on signal...\n");
   struct timespec ts = { .tv_sec = 5, .tv_nsec = 0, };
@@ -46,6 +156,12 @@ int main(void){
     }
   }
   printf("Got signal %d, cleaning up...\n", sig);
+  if(metricpath){
+    pthread_cancel(metricstid);
+    pthread_join(metricstid, NULL);
+    close(ms.fd);
+    unlink(metricpath);
+  }
   if(netstack_destroy(ns)){
     return EXIT_FAILURE;
   }
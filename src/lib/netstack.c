@@ -1,3 +1,4 @@
+#include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <stdio.h>
@@ -5,20 +6,40 @@
 #include <stdarg.h>
 #include <stdlib.h>
 #include <limits.h>
+#include <stddef.h>
 #include <string.h>
+#include <stdalign.h>
+#include <assert.h>
 #include <dirent.h>
+#include <fnmatch.h>
+#include <poll.h>
 #include <pthread.h>
+#include <time.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
 #include <stdatomic.h>
 #include <arpa/inet.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netlink/msg.h>
 #include <linux/if_link.h>
+#include <linux/veth.h>
+#include <linux/if_ether.h>
 #include <linux/netlink.h>
 #include <netlink/socket.h>
 #include <netlink/netlink.h>
 #include <linux/rtnetlink.h>
+#include <linux/fib_rules.h>
+#include <linux/nexthop.h>
+#include <linux/gen_stats.h>
+#include <linux/pkt_sched.h>
+#include <linux/net_namespace.h>
+#include <linux/io_uring.h>
+#include <linux/sock_diag.h>
+#include <linux/genetlink.h>
+#include <linux/ethtool_netlink.h>
 #include "netstack.h"
 
 // convert an RTA into a uint64_t
@@ -35,6 +56,34 @@ rtattrtou32(const struct rtattr* rta, uint32_t* ul){
 // generally not be clashes with a linear mod map.
 #define IFACE_HASH_SLOTS 256
 
+// Cached objects of a class are kept in order of their last modification, in
+// a list threaded through their gen_links, for netstack_*_enumerate_since().
+typedef struct gen_link {
+  struct gen_link *gprev, *gnext;
+  uint64_t gen; // ns->generation at the object's last modification
+} gen_link;
+
+#define GEN_OWNER(gl, type) ((type*)((char*)(gl) - offsetof(type, glink)))
+
+#define TOMBSTONES 1024 // deletions remembered per class
+
+// A deleted object, serialized with NETSTACK_BLOB_DELETED.
+typedef struct tombstone {
+  uint64_t gen;
+  void* rec; // NULL if we couldn't serialize it
+  size_t len;
+} tombstone;
+
+// The modification order of a class, and its recent deletions. Tombstones
+// are only kept once someone has asked for them; until then (and as they're
+// overwritten), the horizon advances, and enumerations from before it fail.
+typedef struct changelog {
+  gen_link *oldest, *newest;
+  tombstone* tombs; // ring of TOMBSTONES, or NULL
+  unsigned tombnext, tombcount;
+  uint64_t horizon;
+} changelog;
+
 // each of these types corresponds to a different rtnetlink message type. we
 // copy the payload directly from the netlink message to rtabuf, but that form
 // requires o(n) to get to any given attribute. we store a table of n offsets
@@ -45,6 +94,7 @@ rtattrtou32(const struct rtattr* rta, uint32_t* ul){
 // will retrieve the value via lookup if less than the MAX against which we
 // were compiled, and do an o(n) check otherwise.
 typedef struct netstack_iface {
+  netstack_iface_hotfields hot; // must come first; see netstack_iface_hot()
   struct ifinfomsg ifi;
   char name[IFNAMSIZ]; // NUL-terminated, safely processed from IFLA_NAME
   struct rtattr* rtabuf; // copied directly from message
@@ -55,16 +105,69 @@ typedef struct netstack_iface {
   // They are 1-biased so that 0 works as a sentinel, indicating no attr.
   size_t rta_index[__IFLA_MAX];
   bool unknown_attrs; // are there attrs >= __IFLA_MAX?
+  int nsid; // NETSTACK_NSID_LOCAL, or the peer namespace's nsid
+  // MSI IRQ range, discovered from sysfs on first use. Every RTM_NEWLINK and
+  // RTM_DELLINK (including renames) yields a new object, so the cache is
+  // never stale relative to the object holding it. irqstate is an irqcache_e.
+  atomic_int irqstate;
+  unsigned long minirq, maxirq;
   struct netstack_iface* hnext; // next in the idx-hashed table ns->iface_slots
+  gen_link glink; // in ns->iface_log, while cached
   atomic_int refcount; // netstack and/or client(s) can share objects
+  atomic_int tlrefs; // those of refcount held by thread-local lookup caches
 } netstack_iface;
 
+typedef enum {
+  IRQCACHE_UNKNOWN, // not yet looked up
+  IRQCACHE_BUSY,    // some thread is scanning sysfs
+  IRQCACHE_VALID,   // minirq and maxirq are valid
+  IRQCACHE_NONE,    // no MSI IRQs were found
+} irqcache_e;
+
+// Topology snapshots (see netstack_iface_topology()). These are immutable once
+// built, and shared by refcount between the netstack caching them and any
+// number of callers.
+typedef struct topo_irq {
+  int irq;
+  char* name;                   // action name from /proc/interrupts, or NULL
+  bool has_affinity;
+  netstack_cpumask affinity;    // from /proc/irq/N/smp_affinity_list
+} topo_irq;
+
+typedef struct topo_queue {
+  int irq;                      // serving IRQ, or -1 if unknown
+  bool has_cpus;
+  netstack_cpumask cpus;        // rps_cpus (rx-N) or xps_cpus (tx-N)
+} topo_queue;
+
+typedef struct netstack_topology {
+  atomic_int refcount;
+  int numa_node;
+  unsigned irqcount;
+  topo_irq* irqs;               // sorted by IRQ number
+  unsigned rxqcount, txqcount;
+  topo_queue* rxqs;
+  topo_queue* txqs;
+} netstack_topology;
+
+// A topology cached by the netstack for local link ifindex. It survives the
+// link's RTM_NEWLINKs (which replace the netstack_iface), and is dropped along
+// with the link.
+typedef struct topo_entry {
+  int ifindex;
+  netstack_topology* topo;
+  struct topo_entry* next;
+} topo_entry;
+
+static_assert(offsetof(netstack_iface, hot) == 0, "hot block must lead netstack_iface");
+
 typedef struct netstack_addr {
   struct ifaddrmsg ifa;
   struct rtattr* rtabuf;        // copied directly from message
   size_t rtabuflen;
   size_t rta_index[__IFA_MAX];
   bool unknown_attrs;  // are there attrs >= __IFA_MAX?
+  int nsid;
 } netstack_addr;
 
 typedef struct netstack_neigh {
@@ -73,6 +176,7 @@ typedef struct netstack_neigh {
   size_t rtabuflen;
   size_t rta_index[__NDA_MAX];
   bool unknown_attrs;  // are there attrs >= __NDA_MAX?
+  int nsid;
 } netstack_neigh;
 
 typedef struct netstack_route {
@@ -81,33 +185,414 @@ typedef struct netstack_route {
   size_t rtabuflen;
   size_t rta_index[__RTA_MAX];
   bool unknown_attrs;  // are there attrs >= __RTA_MAX?
+  uint16_t nlflags;    // NLM_F_* of the message announcing it
+  int nsid;
 } netstack_route;
 
+// Rules are shared (unlike the other non-iface objects), since
+// netstack_rule_match() hands out references to those in the rule cache.
+typedef struct netstack_rule {
+  struct fib_rule_hdr frh;
+  struct rtattr* rtabuf;        // copied directly from message
+  size_t rtabuflen;
+  size_t rta_index[__FRA_MAX];
+  bool unknown_attrs;  // are there attrs >= __FRA_MAX?
+  int nsid;
+  atomic_int refcount;
+} netstack_rule;
+
+// Nexthop objects (see ip-nexthop(8)) are shared like rules, via
+// netstack_nexthop_share_byid().
+typedef struct netstack_nexthop {
+  struct nhmsg nh;
+  struct rtattr* rtabuf;        // copied directly from message
+  size_t rtabuflen;
+  size_t rta_index[__NHA_MAX];
+  bool unknown_attrs;  // are there attrs >= __NHA_MAX?
+  int nsid;
+  atomic_int refcount;
+} netstack_nexthop;
+
+// Queueing disciplines and traffic classes (see tc(8)) both arrive as tcmsgs,
+// and share this representation. They're shared like rules, via
+// netstack_tc_share().
+typedef struct netstack_tc {
+  struct tcmsg tcm;
+  struct rtattr* rtabuf;        // copied directly from message
+  size_t rtabuflen;
+  size_t rta_index[__TCA_MAX];
+  bool unknown_attrs;  // are there attrs >= __TCA_MAX?
+  bool isclass;        // a class, rather than a qdisc
+  int nsid;
+  atomic_int refcount;
+} netstack_tc;
+
+// Fields written by different parties are kept on distinct cache lines, lest
+// lookups on many threads bounce a line with one another and the rxthread.
+#define CACHELINE 64
+
+// Upper bounds of the dump duration histogram buckets, in nanoseconds. There
+// is one further bucket for everything larger.
+static const uint64_t dump_buckets[] = {
+  1000000ull, 10000000ull, 100000000ull, 1000000000ull, 10000000000ull,
+};
+#define DUMP_BUCKETS (sizeof(dump_buckets) / sizeof(*dump_buckets) + 1)
+
+// Counters bumped by lookups are sharded across one cache line per configured
+// CPU (up to this many), summed by netstack_sample_stats(). Each thread sticks
+// to a single shard.
+#define STAT_SHARDS_MAX 1024
+
+typedef struct lookup_shard {
+  alignas(CACHELINE) atomic_uintmax_t lookup_copies;
+  atomic_uintmax_t lookup_shares;
+  atomic_uintmax_t lookup_failures;
+  atomic_uintmax_t tlcache_hits, tlcache_misses;
+} lookup_shard;
+
 // trie on names
 typedef struct name_node {
   netstack_iface *iface;        // iface at this node, can be NULL
   struct name_node* array[256]; // array of pointers to name_nodes
 } name_node;
 
+// In multi-namespace mode, each peer namespace gets its own name trie. The
+// local namespace's trie lives directly in the netstack.
+typedef struct nsid_trie {
+  int nsid;
+  name_node* trie;
+} nsid_trie;
+
+// A request on the rtnetlink socket (see netstack_request_submit()). Requests
+// are transmitted in order of submission. Only one dump can be outstanding on
+// a netlink socket, so dumps go out one at a time, but up to REQ_WINDOW other
+// requests asking for acknowledgement can be on the wire at once (these are
+// answered in order). The window is kept small, since answers the kernel
+// can't fit into our receive buffer are dropped (along with any events).
+// Requests not asking for acknowledgement (see route_batch()) are answered
+// only upon failure, and are complete once a later request is answered; the
+// last request queued must always ask. At most REQ_SENT_MAX requests of any
+// kind are on the wire. Consecutive non-dump requests are written together,
+// up to TX_BATCH_MSGS or TX_BATCH_BYTES per sendmsg(). Each request is
+// assigned a sequence number upon transmission, by which the kernel's answer
+// (NLMSG_DONE or NLMSG_ERROR) is matched to it. Everything but refs and done
+// is guarded by the netstack's txlock until completion, and immutable after.
+#define REQ_WINDOW 32
+#define REQ_SENT_MAX 2048
+#define TX_BATCH_MSGS 512
+#define TX_BATCH_BYTES 65536
+typedef struct netstack_request {
+  struct netstack_request* next; // in the queue, or on the wire
+  struct nlmsghdr* nlh;  // seq and port are filled in upon transmission
+  bool dump;             // NLM_F_DUMP was set
+  uint64_t sent;         // CLOCK_MONOTONIC ns of transmission
+  netstack_request_cb cb;
+  void* curry;
+  int error;             // 0 or a negative errno, valid once done
+  char* extack;          // NLMSGERR_ATTR_MSG, if one was provided
+  int extack_off;        // NLMSGERR_ATTR_OFFS, or -1
+  atomic_bool done;
+  atomic_int refs;       // one for the netstack until completion, plus handles
+} netstack_request;
+
+// Link statistics from RTM_GETSTATS (see netstack_iface_stats_refresh_sync()),
+// kept apart from the netstack_ifaces so that refreshing counters needn't
+// replace those objects. Only the rxthread writes slots. Readers take no lock,
+// instead using the sequence counter to detect (and retry across) concurrent
+// updates; everything is atomic so that such races are well-defined. Slots
+// are never freed before the netstack, but are recycled once their link goes
+// away, and are found via a hash on the ifindex. Each update also appends a
+// sample to the slot's ring (of ns->sample_depth entries), from which
+// netstack_iface_rates() derives rates.
+#define STATS_WORDS (sizeof(struct rtnl_link_stats64) / sizeof(uint64_t))
+// A sample is a timestamp followed by the first SAMPLE_COUNTERS words of the
+// rtnl_link_stats64: rx/tx packets, bytes, errors, and drops.
+#define SAMPLE_COUNTERS 8
+#define SAMPLE_WORDS (1 + SAMPLE_COUNTERS)
+typedef struct stats_slot {
+  atomic_uint seq;              // odd while an update is in progress
+  atomic_int ifindex;           // 0 when free for reuse
+  atomic_uint_fast64_t nsec;    // CLOCK_MONOTONIC time of the last update
+  atomic_uint_fast64_t words[STATS_WORDS]; // a struct rtnl_link_stats64
+  _Atomic(struct stats_slot*) next;
+  atomic_uint_fast64_t samples; // samples ever written since (re)use
+  atomic_uint_fast64_t ring[];  // sample_depth samples of SAMPLE_WORDS
+} stats_slot;
+
+// Initial size of the rxbuf. The kernel caps its dump datagrams at 32KiB,
+// unless a single object needs more. Should a datagram nonetheless be
+// truncated, it is lost (see rx_lost()), and the rxbuf is grown to fit.
+#define RXBUF_BYTES 65536
+// Requested receive buffer of the rtnetlink socket.
+#define SOCK_RCVBUF_BYTES (4 * 1024 * 1024)
+
+// io_uring receive backend (the io_uring option). A multishot recvmsg is kept
+// posted against the netlink socket, drawing from a ring of provided buffers,
+// and completions are reaped in batches. Each provided buffer holds a struct
+// io_uring_recvmsg_out, the source address, the control data, and a datagram;
+// the kernel caps its dump datagrams at 32KiB, which URING_BUF_BYTES exceeds.
+// Anything larger is truncated, and handled as a loss (see rx_lost()).
+#define URING_BUFS 8
+#define URING_BUF_BYTES 65536
+#define URING_RECV 1 // user_data of the multishot recvmsg
+#define URING_STOP 2 // user_data of the eventfd poll signaling shutdown
+
+typedef struct nsuring {
+  int fd;       // io_uring
+  int efd;      // eventfd written by netstack_destroy()
+  void* sqring; // mmapped SQ ring (and CQ ring, if IORING_FEAT_SINGLE_MMAP)
+  size_t sqringlen;
+  void* cqring;
+  size_t cqringlen;
+  struct io_uring_sqe* sqes;
+  size_t sqeslen;
+  unsigned *sqhead, *sqtail, *sqmask, *sqarray;
+  unsigned *cqhead, *cqtail, *cqmask;
+  struct io_uring_cqe* cqes;
+  struct io_uring_buf_ring* bufring; // URING_BUFS entries
+  char* bufs; // URING_BUFS * URING_BUF_BYTES
+  uint16_t buftail; // our copy of bufring's tail
+  int64_t drops; // the socket's drop count as of our last look, or -1
+  struct msghdr mh; // template for the multishot recvmsg (sizes only)
+} nsuring;
+
+// A cached route, hashed by its (masked) destination and prefix length
+// within its table. Routes differing only in TOS or priority share a key.
+// Those using a nexthop object are also chained among its users (see
+// nh_user_link()).
+typedef struct fib_node {
+  struct fib_node* hnext;
+  struct fib_table* table;
+  unsigned char dst[16];
+  unsigned dst_len;
+  unsigned tos;
+  uint32_t priority;
+  uint32_t nhid;               // RTA_NH_ID, or 0
+  int oif;                     // IPv4 only: oif and gateway of the first hop
+  unsigned char gw[16];
+  struct fib_node* nhnext;     // among the users of nhid
+  struct fib_node** nhprev;    // NULL if not chained
+  gen_link glink; // in ns->route_log
+  netstack_route* nr;
+} fib_node;
+
+// The routes of one table of one family. plens counts the routes having each
+// prefix length, so that longest-prefix match needn't probe absent ones.
+typedef struct fib_table {
+  struct fib_table* next;
+  int family;
+  uint32_t id;
+  fib_node** hash;
+  size_t buckets; // a power of 2
+  unsigned count;
+  unsigned plens[129];
+} fib_table;
+
+// A cached neighbor, hashed by family, interface, and destination.
+typedef struct neigh_node {
+  struct neigh_node* hnext;
+  int family;
+  int ifindex;
+  unsigned char dst[16];
+  gen_link glink; // in ns->neigh_log
+  netstack_neigh* nn;
+} neigh_node;
+
+// A cached bridge forwarding database entry, hashed by master (the bridge,
+// or for entries without one, the device itself), vlan, and MAC.
+enum { FDB_BY_PORT, FDB_BY_MASTER, FDB_CHAINS };
+
+typedef struct fdb_node {
+  struct fdb_node* hnext;
+  int master;
+  int port;
+  uint16_t vlan;     // 0 if untagged
+  bool bridged;      // learned by (or added to) a bridge, rather than self
+  unsigned char mac[ETH_ALEN];
+  gen_link glink; // in ns->fdb_log
+  // Doubly linked through the fdb_port of port (FDB_BY_PORT) and master
+  // (FDB_BY_MASTER), so purges needn't scan the hash.
+  struct fdb_node* cnext[FDB_CHAINS];
+  struct fdb_node* cprev[FDB_CHAINS];
+  netstack_neigh* nn;
+} fdb_node;
+
+// Cached FDB entries of a link: those on it as a port (with their count),
+// and those of it as a master. A sorted array of these is kept, holding
+// each link with any entries; the chains' heads move along with it.
+typedef struct fdb_port {
+  int ifindex;
+  unsigned count;
+  fdb_node* chains[FDB_CHAINS];
+} fdb_port;
+
+// A cached qdisc or class, hashed by kind, ifindex, and key. Refreshes
+// changing nothing but its statistics update stats in place.
+typedef struct tc_node {
+  struct tc_node* hnext;
+  int ifindex;
+  uint32_t key;    // the parent of a qdisc (their handles needn't be unique)
+  uint32_t handle; // or the handle (classid) of a class
+  uint32_t parent;
+  bool isclass;
+  netstack_tc_stats stats;
+  gen_link glink; // in ns->tc_log
+  netstack_tc* tc;
+} tc_node;
+
+// A cached nexthop object, hashed by id, decoded for resolution. Groups refer
+// to their members by id, as do routes to nexthops, so replacing a nexthop
+// needn't touch anything which uses it.
+typedef struct nh_node {
+  struct nh_node* hnext;
+  uint32_t id;
+  int oif;                         // 0 for groups and blackholes
+  bool blackhole;
+  int gwfamily;                    // AF_UNSPEC if there's no gateway
+  unsigned char gateway[16];
+  const struct nexthop_grp* group; // members within nh's rtabuf, or NULL
+  unsigned groupcount;
+  fib_node* users;                 // routes using this nexthop by id
+  gen_link glink;                  // in ns->nh_log
+  netstack_nexthop* nh;
+} nh_node;
+
+// A cached policy rule, its selectors decoded for matching. Rules we can't
+// evaluate against a (src, dst, fwmark, iif, oif) flow (those selecting on
+// ports, protocols, uids, tunnel ids, or l3mdevs) never match. Prefixes are
+// kept as masked integers. Like the kernel, we match interfaces by index,
+// that of the link currently bearing the rule's name (see fib_rules_relink()).
+typedef struct rule_node {
+  uint32_t priority;
+  unsigned action;      // FR_ACT_*
+  uint32_t table;       // FR_ACT_TO_TBL
+  uint32_t target;      // FR_ACT_GOTO
+  bool invert;          // FIB_RULE_INVERT
+  bool unmatchable;
+  unsigned tos;
+  uint64_t src[2], srcmask[2], dst[2], dstmask[2];
+  uint32_t mark, mask;
+  char iifname[IFNAMSIZ], oifname[IFNAMSIZ]; // empty if unset
+  int iif, oif;         // ifindices of those names, or 0 if there's no such link
+  int suppress_prefixlen; // -1 if unset
+  netstack_rule* nr;
+} rule_node;
+
+// Position of a rule selecting exactly one fwmark.
+typedef struct rule_mark {
+  uint32_t mark;
+  unsigned idx;
+} rule_mark;
+
+// The rules of one family, sorted by priority. Rules of equal priority are
+// in order of their arrival, as in the kernel. Rules selecting exactly one
+// fwmark (the common way of steering marked traffic to its own table) are
+// indexed by it in marked, and only the rest are in general, so that a walk
+// need only visit the rules which might select the flow's mark (see
+// rule_cursor). Without the index, every rule is visited.
+typedef struct rule_set {
+  rule_node* rules;
+  unsigned count, size;
+  unsigned named; // rules with iif or oif selectors
+  bool indexed;
+  unsigned* general;  // indices into rules, ascending
+  unsigned gcount;
+  rule_mark* marked;  // sorted by mark, then index
+  unsigned mcount;
+} rule_set;
+
+// A netstack_iface_filter, copied at creation. ifindices are sorted.
+typedef struct iface_filter {
+  char** names;
+  char** kinds;
+  int* ifindices;
+  unsigned ifindex_count;
+  int master;
+} iface_filter;
+
+// The last known flags of a local link, for iface_notrack (see link_flags_swap()).
+typedef struct link_flags {
+  int ifindex;
+  unsigned flags;
+} link_flags;
+
 typedef struct netstack {
+  // Read-mostly configuration, set up in netstack_init()
   struct nl_sock* nl;  // netlink connection abstraction from libnl
   pthread_t rxtid;
   pthread_t txtid;
-  // We can only have one command of the class e.g. DUMP outstanding at a time.
-  // Queue up any others for transmission when possible.
-  // Iff txqueue[dequeueidx] == -1, there are no messages to send.
-  // Iff txqueue[queueidx] >= 0, there is no room to enqueue messages.
-  int txqueue[128];
-  int dequeueidx, queueidx;
-  // Unset by the txthread, set by the rxthread (and initializer).
-  pthread_cond_t txcond;
+  // The dumpers appropriate to our subscriptions, reissued to resync after the
+  // kernel drops messages on us. There are dumpercount of them.
+  int dumpers[8];
+  int dumpercount;
+  char* rxbuf; // rxbuf_size bytes, used only by the rxthread
+  size_t rxbuf_size;
+  bool processing; // threadless only: within netstack_process()
+  nsuring* uring; // non-NULL iff the io_uring backend is in use
+  struct nsethtool* ethtool; // non-NULL iff the ethtool option is in use
+  uint64_t uid; // unique across all netstacks created by this process
+  lookup_shard* shards; // statistics written by lookups, see lookup_stats()
+  unsigned shard_count;
+  netstack_opts opts; // copied wholesale in netstack_create()
+  iface_filter *include, *exclude; // iface_include and iface_exclude, or NULL
+  // Links turned away by the filters, as (nsid << 32 | ifindex), sorted. Used
+  // only by the thread handling messages, to discard objects on those links.
+  uint64_t* turned_away;
+  unsigned turned_count, turned_size;
+  // Local links admitted after having been turned away, whose objects are to
+  // be dumped once the datagram at hand is handled (see redump_links()), and
+  // the rtnetlink socket with strict checking used to dump them, or -1 if the
+  // kernel won't filter dumps by link. Used only by the thread handling
+  // messages.
+  int* redumps;
+  unsigned redump_count, redump_size;
+  int strictnl;
+  // With iface_notrack, the flags of each local link, sorted by ifindex. Used
+  // only by the thread handling messages.
+  link_flags* lflags;
+  unsigned lflag_count, lflag_size;
+  // Requests awaiting transmission, in order of submission. Guarded by txlock.
+  struct netstack_request *queued, **queuedtail;
+  // Requests on the wire: at most one dump, and up to REQ_WINDOW others, in
+  // order of transmission. Guarded by txlock.
+  struct netstack_request* dumpreq;
+  struct netstack_request *sent, **senttail;
+  unsigned sentcount;
+  unsigned sentacks; // those of sentcount asking for acknowledgement
+  bool txbusy; // a sendmsg() is underway without txlock; see tx_next_locked()
+  uint32_t nextseq; // never 0, which the kernel uses for notifications
+  // Completed requests having callbacks yet to be invoked, in order of
+  // completion; see requests_complete(). Guarded by txlock.
+  struct netstack_request *finished, **finishedtail;
+  // The txthread waits on txcond for something it can transmit.
+  alignas(CACHELINE) pthread_cond_t txcond;
   pthread_mutex_t txlock;
-  atomic_bool clear_to_send;
-  // Statistics
-  atomic_uintmax_t netlink_errors;
+  // Broadcast with each request completion. Uses CLOCK_MONOTONIC.
+  pthread_cond_t reqcond;
+  // Link stats sampling (sample_interval_ms). The sampler thread (or in
+  // threadless mode, netstack_process()) queues an RTM_GETSTATS dump each
+  // interval, unless the previous one is still outstanding.
+  unsigned sample_depth; // samples retained per link; 0 disables the rings
+  pthread_t samplertid;   // valid iff sampling
+  bool sampling;
+  uint64_t sample_next;   // threadless only: CLOCK_MONOTONIC ns of next sample
+  struct netstack_request* sample_req; // most recent sample request, or NULL
+  // Bumped (under hashlock) with every change to the iface cache. Read without
+  // the lock by thread-local lookup cache hits; see tlcache_share(). Kept off
+  // the read-mostly lines above, which every lookup touches.
+  alignas(CACHELINE) atomic_uint_fast64_t iface_gen;
+  // Bumped with every change to the iface, route, and neighbor caches, under
+  // the lock of the cache being changed; see netstack_generation(). Route and
+  // neighbor churn mustn't disturb iface_gen's readers, so it gets its own line.
+  alignas(CACHELINE) atomic_uint_fast64_t generation;
+  // Statistics written only by the rxthread
+  alignas(CACHELINE) atomic_uintmax_t netlink_errors;
   atomic_uintmax_t user_callbacks_total;
-  atomic_uintmax_t lookup_copies, lookup_shares, lookup_failures;
   atomic_uintmax_t iface_events, addr_events, route_events, neigh_events;
+  atomic_uintmax_t rule_events, nexthop_events, tc_events;
+  atomic_uintmax_t parse_failures, overruns, resyncs, filtered;
+  atomic_uintmax_t dumps, dump_nsec_total, dump_nsec_max;
+  atomic_uintmax_t dump_histogram[DUMP_BUCKETS]; // not cumulative
   // Guards iface_hash and the hnext pointer of all netstack_ifaces. Does not
   // guard netstack_ifaces' reference counts *aside from* the case when we've
   // just looked the object up, and are about to share it. We must make that
@@ -115,33 +600,334 @@ typedef struct netstack {
   // us. Clients needn't take this lock when downing the reference count, since
   // if it hits 0 under their watch, it cannot be in the netstack hash any
   // longer (or it would still have a reference).
-  pthread_mutex_t hashlock;
+  alignas(CACHELINE) pthread_mutex_t hashlock;
   netstack_iface* iface_hash[IFACE_HASH_SLOTS];
   unsigned iface_count; // ifaces currently in the active cache
   uint64_t iface_bytes; // bytes occupied (not including metadata) in cache
   uint64_t nonce; // incremented with every change to invalidate streamings
-  name_node* name_trie; // all netstack_iface objects, indexed by name
-  netstack_opts opts; // copied wholesale in netstack_create()
+  name_node* name_trie; // local netstack_iface objects, indexed by name
+  // Name tries for peer namespaces we know about (all_nsids mode only).
+  nsid_trie* nsid_tries;
+  unsigned nsid_count;
+  // netstack_ifaces which have left the cache while still shared by clients,
+  // linked through hnext. We retain our reference until we're the only holder.
+  netstack_iface* zombies;
+  changelog iface_log;
+  _Atomic(stats_slot*) stats_slots[IFACE_HASH_SLOTS];
+  // Topologies built by netstack_iface_topology(), by local ifindex. Guarded
+  // by topolock; they're only built and swapped on demand.
+  pthread_mutex_t topolock;
+  topo_entry* topo_hash[IFACE_HASH_SLOTS];
+  // Routes, neighbors, rules, nexthops, FDB entries, and traffic control
+  // objects of the local namespace, unless the corresponding notrack is set,
+  // for netstack_resolve() and friends. fiblock guards all of it.
+  alignas(CACHELINE) pthread_mutex_t fiblock;
+  fib_table* fib_tables;
+  unsigned route_count;
+  neigh_node** neigh_hash;
+  size_t neigh_buckets; // a power of 2, or 0 before the first neighbor
+  unsigned neigh_count;
+  changelog route_log, neigh_log, nh_log, fdb_log, tc_log;
+  rule_set rules4, rules6;
+  nh_node** nh_hash;
+  size_t nh_buckets; // a power of 2, or 0 before the first nexthop
+  unsigned nh_count;
+  fib_node* nh_orphans; // routes using nexthops we don't have
+  // Bridge FDB entries (AF_BRIDGE neighbors), unless fdb_notrack
+  fdb_node** fdb_hash;
+  size_t fdb_buckets; // a power of 2, or 0 before the first entry
+  unsigned fdb_count;
+  fdb_port* fdb_ports; // sorted by ifindex
+  unsigned fdb_portcount, fdb_portsize;
+  // Qdiscs and classes, unless tc_notrack
+  tc_node** tc_hash;
+  size_t tc_buckets; // a power of 2, or 0 before the first qdisc
+  unsigned tc_count;
 } netstack;
 
-// add a request to the txqueue, if there's room
+// Source of netstack uids, which are never reused.
+static atomic_uint_fast64_t next_uid = 1;
+
+// One shard per configured CPU, so that as many lookup threads as we have
+// CPUs needn't share any line. Determined once, so that every netstack has the
+// same number of shards, and a thread's shard is valid for all of them.
+static unsigned stat_shards;
+static pthread_once_t stat_shards_once = PTHREAD_ONCE_INIT;
+
+static void
+stat_shards_init(void){
+  long cpus = sysconf(_SC_NPROCESSORS_CONF);
+  if(cpus < 1){
+    stat_shards = 1;
+  }else{
+    stat_shards = cpus > STAT_SHARDS_MAX ? STAT_SHARDS_MAX : cpus;
+  }
+}
+
+// Each thread is assigned a shard upon its first lookup, round-robin.
+static atomic_uint next_shard;
+static __thread int thread_shard = -1;
+
+static inline lookup_shard*
+lookup_stats(netstack* ns){
+  if(thread_shard < 0){
+    thread_shard = atomic_fetch_add(&next_shard, 1) % stat_shards;
+  }
+  return &ns->shards[thread_shard];
+}
+
+static void tx_pump_locked(netstack* ns);
+// What fib_purge_link() drops for a link
+#define PURGE_ROUTES4  0x1u // IPv4 routes going out only through it
+#define PURGE_ROUTES6  0x2u // IPv6 routes going out only through it
+#define PURGE_NEIGHS   0x4u // neighbors on it
+#define PURGE_NEXTHOPS 0x8u // nexthops through it, and routes using them
+#define PURGE_FDB      0x10u // FDB entries on it, or of it as a bridge
+#define PURGE_FDB_DYN  0x20u // dynamically-learned bridge FDB entries on it
+#define PURGE_TC       0x40u // qdiscs and classes on it
+static void fib_purge_link(netstack* ns, int ifindex, unsigned what);
+static void fib_rules_relink(netstack* ns, int idx, const char* name);
+static void ethtool_query(netstack* ns, int ifindex);
+static void ethtool_forget(netstack* ns, int ifindex);
+static bool ethtool_synced(const netstack* ns);
+static void stats_slot_release(netstack* ns, int ifindex);
+
+// Allocate a request for a message of len bytes (zeroed). The netstack holds
+// the only reference.
+static netstack_request*
+request_alloc(size_t len){
+  netstack_request* req = malloc(sizeof(*req));
+  if(req == NULL){
+    return NULL;
+  }
+  if((req->nlh = malloc(len)) == NULL){
+    free(req);
+    return NULL;
+  }
+  memset(req->nlh, 0, len);
+  req->next = NULL;
+  req->dump = false;
+  req->sent = 0;
+  req->cb = NULL;
+  req->curry = NULL;
+  req->error = 0;
+  req->extack = NULL;
+  req->extack_off = -1;
+  atomic_init(&req->done, false);
+  atomic_init(&req->refs, 1);
+  return req;
+}
+
+// Only rtnetlink GET requests (the third of each group of four types) can
+// be dumps. For others, NLM_F_ROOT and NLM_F_MATCH mean something else.
+static bool
+request_is_dump(const struct nlmsghdr* nlh){
+  return nlh->nlmsg_type >= RTM_BASE && (nlh->nlmsg_type - RTM_BASE) % 4 == 2
+          && (nlh->nlmsg_flags & NLM_F_DUMP);
+}
+
+// A request of type and flags (NLM_F_REQUEST is implied), having len bytes of
+// payload copied from body.
+static netstack_request*
+request_create(int type, int flags, const void* body, size_t len){
+  netstack_request* req = request_alloc(NLMSG_SPACE(len));
+  if(req){
+    req->nlh->nlmsg_len = NLMSG_LENGTH(len);
+    req->nlh->nlmsg_type = type;
+    req->nlh->nlmsg_flags = NLM_F_REQUEST | flags;
+    req->dump = request_is_dump(req->nlh);
+    memcpy(NLMSG_DATA(req->nlh), body, len);
+  }
+  return req;
+}
+
+// Append an attribute to the request's message.
 static int
-queue_request(netstack* ns, int req){
-  bool queued = false;
+request_put_attr(netstack_request* req, int type, const void* data, size_t len){
+  size_t off = NLMSG_ALIGN(req->nlh->nlmsg_len);
+  size_t total = off + RTA_SPACE(len);
+  struct nlmsghdr* nlh = realloc(req->nlh, total);
+  if(nlh == NULL){
+    return -1;
+  }
+  memset((char*)nlh + nlh->nlmsg_len, 0, total - nlh->nlmsg_len);
+  struct rtattr* rta = (struct rtattr*)((char*)nlh + off);
+  rta->rta_type = type;
+  rta->rta_len = RTA_LENGTH(len);
+  if(len){
+    memcpy(RTA_DATA(rta), data, len);
+  }
+  nlh->nlmsg_len = total;
+  req->nlh = nlh;
+  return 0;
+}
+
+// Open a nested attribute, optionally led by hlen bytes of hdr. Returns its
+// offset, to be passed to request_nest_end() once its contents are added, or
+// -1 on failure.
+static int
+request_nest_start(netstack_request* req, int type, const void* hdr, size_t hlen){
+  int off = NLMSG_ALIGN(req->nlh->nlmsg_len);
+  if(request_put_attr(req, type, hdr, hlen)){
+    return -1;
+  }
+  return off;
+}
+
+static void
+request_nest_end(netstack_request* req, int off){
+  struct rtattr* rta = (struct rtattr*)((char*)req->nlh + off);
+  rta->rta_len = req->nlh->nlmsg_len - off;
+}
+
+static void
+request_release(netstack_request* req){
+  if(atomic_fetch_sub(&req->refs, 1) == 1){
+    free(req->extack);
+    free(req->nlh);
+    free(req);
+  }
+}
+
+static void requests_complete(netstack* ns);
+
+// Queue the list of requests from head through tail for transmission, handing
+// our references to the netstack.
+static void
+request_enqueue_list(netstack* ns, netstack_request* head, netstack_request* tail){
   pthread_mutex_lock(&ns->txlock);
-  if(ns->txqueue[ns->queueidx] == -1){
-    ns->txqueue[ns->queueidx] = req;
-    if(++ns->queueidx == sizeof(ns->txqueue) / sizeof(*ns->txqueue)){
-      ns->queueidx = 0;
-    }
-    if(ns->queueidx != ns->dequeueidx){
-      ns->txqueue[ns->queueidx] = -1;
-    }
-    queued = true;
+  *ns->queuedtail = head;
+  ns->queuedtail = &tail->next;
+  if(ns->opts.threadless){ // there's no txthread to wake up
+    tx_pump_locked(ns);
   }
   pthread_mutex_unlock(&ns->txlock);
   pthread_cond_signal(&ns->txcond);
-  return queued ? 0 : -1;
+  if(ns->opts.threadless){ // invoke callbacks of any which failed to send
+    requests_complete(ns);
+  }
+}
+
+static inline void
+request_enqueue(netstack* ns, netstack_request* req){
+  request_enqueue_list(ns, req, req);
+}
+
+// Dumps of qdiscs and classes take a full tcmsg. Classes are only dumped for
+// the link ifindex.
+static netstack_request*
+tc_dump_request(int type, int ifindex){
+  struct tcmsg tcm = {
+    .tcm_family = AF_UNSPEC,
+    .tcm_ifindex = ifindex,
+  };
+  return request_create(type, NLM_F_DUMP, &tcm, sizeof(tcm));
+}
+
+// Dumps of the local namespace use a bare rtgenmsg, save those of nexthops
+// and qdiscs, which insist upon full headers. Peer namespaces must be
+// specified with IFLA_TARGET_NETNSID, following a full ifinfomsg.
+static netstack_request*
+dump_request(int type, int nsid){
+  if(nsid == NETSTACK_NSID_LOCAL && type == RTM_GETQDISC){
+    return tc_dump_request(type, 0);
+  }
+  if(nsid == NETSTACK_NSID_LOCAL && type == RTM_GETNEXTHOP){
+    struct nhmsg nhm = {
+      .nh_family = AF_UNSPEC,
+    };
+    return request_create(type, NLM_F_DUMP, &nhm, sizeof(nhm));
+  }
+  if(nsid == NETSTACK_NSID_LOCAL){
+    struct rtgenmsg rt = {
+      .rtgen_family = AF_UNSPEC,
+    };
+    return request_create(type, NLM_F_DUMP, &rt, sizeof(rt));
+  }
+  struct ifinfomsg ifi = {
+    .ifi_family = AF_UNSPEC,
+  };
+  netstack_request* req = request_create(type, NLM_F_DUMP, &ifi, sizeof(ifi));
+  int32_t id = nsid;
+  if(req && request_put_attr(req, IFLA_TARGET_NETNSID, &id, sizeof(id))){
+    request_release(req);
+    return NULL;
+  }
+  return req;
+}
+
+// A dump of type's objects on link ifindex alone, for a socket with strict
+// checking. Addresses are filtered by the header's index, and neighbors, routes
+// and nexthops by attribute. Qdiscs can't be filtered by link.
+static netstack_request*
+link_dump_request(int type, int ifindex){
+  netstack_request* req;
+  int atype;
+  switch(type){
+    case RTM_GETADDR:{
+      struct ifaddrmsg ifa = {
+        .ifa_family = AF_UNSPEC,
+        .ifa_index = ifindex,
+      };
+      return request_create(type, NLM_F_DUMP, &ifa, sizeof(ifa));
+    }case RTM_GETNEIGH:{
+      struct ndmsg nd = {
+        .ndm_family = AF_UNSPEC,
+      };
+      req = request_create(type, NLM_F_DUMP, &nd, sizeof(nd));
+      atype = NDA_IFINDEX;
+      break;
+    }case RTM_GETROUTE:{
+      struct rtmsg rt = {
+        .rtm_family = AF_UNSPEC,
+      };
+      req = request_create(type, NLM_F_DUMP, &rt, sizeof(rt));
+      atype = RTA_OIF;
+      break;
+    }case RTM_GETNEXTHOP:{
+      struct nhmsg nhm = {
+        .nh_family = AF_UNSPEC,
+      };
+      req = request_create(type, NLM_F_DUMP, &nhm, sizeof(nhm));
+      atype = NHA_OIF;
+      break;
+    }default:
+      return tc_dump_request(type, 0);
+  }
+  uint32_t idx = ifindex;
+  if(req && request_put_attr(req, atype, &idx, sizeof(idx))){
+    request_release(req);
+    return NULL;
+  }
+  return req;
+}
+
+// RTM_GETSTATS for ifindex, or all links if 0. A request for a single link is
+// answered without NLMSG_DONE, so it asks for an acknowledgement instead.
+static netstack_request*
+stats_request(int ifindex){
+  struct if_stats_msg ifsm = {
+    .family = AF_UNSPEC,
+    .ifindex = ifindex,
+    .filter_mask = IFLA_STATS_FILTER_BIT(IFLA_STATS_LINK_64),
+  };
+  return request_create(RTM_GETSTATS, ifindex ? NLM_F_ACK : NLM_F_DUMP,
+                        &ifsm, sizeof(ifsm));
+}
+
+static inline int
+queue_request_nsid(netstack* ns, int type, int nsid){
+  netstack_request* req = dump_request(type, nsid);
+  if(req == NULL){
+    return -1;
+  }
+  request_enqueue(ns, req);
+  return 0;
+}
+
+static inline int
+queue_request(netstack* ns, int req){
+  return queue_request_nsid(ns, req, NETSTACK_NSID_LOCAL);
 }
 
 static void
@@ -199,24 +985,254 @@ name_trie_purge(name_node** node, const char* name){
   return name_trie_exchange(node, NULL, name);
 }
 
+// Local interfaces hash by index alone; peer namespaces are offset.
 static inline int
-iface_hash(const netstack* ns, int index){
-  return index % (sizeof(ns->iface_hash) / sizeof(*ns->iface_hash));
+iface_hash(const netstack* ns, int nsid, int index){
+  unsigned key = (unsigned)index + (unsigned)(nsid + 1) * 61u;
+  return key % (sizeof(ns->iface_hash) / sizeof(*ns->iface_hash));
 }
 
-// Sits on blocking nl_recvmsgs()
-static void*
-netstack_rx_thread(void* vns){
+// Find the name trie for nsid, creating an entry for the namespace if create
+// is set. Returns NULL if the namespace is unknown (or on allocation failure).
+// Call with hashlock held.
+static name_node**
+name_trie_for(netstack* ns, int nsid, bool create){
+  if(nsid == NETSTACK_NSID_LOCAL){
+    return &ns->name_trie;
+  }
+  unsigned z;
+  for(z = 0 ; z < ns->nsid_count ; ++z){
+    if(ns->nsid_tries[z].nsid == nsid){
+      return &ns->nsid_tries[z].trie;
+    }
+  }
+  if(!create){
+    return NULL;
+  }
+  nsid_trie* tmp = realloc(ns->nsid_tries, sizeof(*tmp) * (ns->nsid_count + 1));
+  if(tmp == NULL){
+    return NULL;
+  }
+  ns->nsid_tries = tmp;
+  tmp[ns->nsid_count].nsid = nsid;
+  tmp[ns->nsid_count].trie = NULL;
+  return &tmp[ns->nsid_count++].trie;
+}
+
+static inline uint64_t
+monotonic_nsec(void){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// The kernel dropped messages on us, so our cache can no longer be trusted.
+// Requeue all our dumpers to bring it back into sync.
+static int
+resync(netstack* ns){
+  int z;
+  for(z = 0 ; z < ns->dumpercount ; ++z){
+    if(queue_request(ns, ns->dumpers[z])){
+      return -1;
+    }
+  }
+  return 0;
+}
+
+static inline bool
+seq_before(uint32_t a, uint32_t b){
+  return (int32_t)(a - b) < 0;
+}
+
+// Record the outcome of req, which has been taken off the queue or the wire,
+// and wake anyone waiting on it. Its callback, if any, is deferred to
+// requests_complete(). Call with txlock held.
+static void
+request_finish_locked(netstack* ns, netstack_request* req, int error,
+                      const char* extack, int extack_off){
+  req->error = error;
+  req->extack = extack ? strdup(extack) : NULL;
+  req->extack_off = extack_off;
+  atomic_store(&req->done, true);
+  pthread_cond_broadcast(&ns->reqcond);
+  pthread_cond_signal(&ns->txcond); // there might now be room on the wire
+  if(req->cb){
+    req->next = NULL;
+    *ns->finishedtail = req;
+    ns->finishedtail = &req->next;
+  }else{
+    request_release(req);
+  }
+}
+
+// Invoke the callbacks of finished requests, and drop our references to them.
+// Call without txlock held.
+static void
+requests_complete(netstack* ns){
+  pthread_mutex_lock(&ns->txlock);
+  netstack_request* req = ns->finished;
+  ns->finished = NULL;
+  ns->finishedtail = &ns->finished;
+  pthread_mutex_unlock(&ns->txlock);
+  if(req == NULL){
+    return;
+  }
+  int oldcancelstate;
+  pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldcancelstate);
+  while(req){
+    netstack_request* next = req->next;
+    req->cb(ns, req, req->curry);
+    request_release(req);
+    req = next;
+  }
+  pthread_setcancelstate(oldcancelstate, &oldcancelstate);
+}
+
+// Take the oldest non-dump request off the wire. Call with txlock held.
+static netstack_request*
+sent_pop_locked(netstack* ns){
+  netstack_request* req = ns->sent;
+  if((ns->sent = req->next) == NULL){
+    ns->senttail = &ns->sent;
+  }
+  --ns->sentcount;
+  if(req->nlh->nlmsg_flags & NLM_F_ACK){
+    --ns->sentacks;
+  }
+  return req;
+}
+
+// Fail all requests (other than any dump) on the wire with error. Call with
+// txlock held.
+static void
+sent_fail_locked(netstack* ns, int error){
+  while(ns->sent){
+    request_finish_locked(ns, sent_pop_locked(ns), error, NULL, -1);
+  }
+}
+
+// Is there room on the wire for req? Call with txlock held.
+static bool
+tx_room_locked(const netstack* ns, const netstack_request* req){
+  if(req->dump){
+    return ns->dumpreq == NULL;
+  }
+  if(ns->sentcount >= REQ_SENT_MAX){
+    return false;
+  }
+  return !(req->nlh->nlmsg_flags & NLM_F_ACK) || ns->sentacks < REQ_WINDOW;
+}
+
+static void
+tx_relock(void* vns){
   netstack* ns = vns;
-  int ret;
-  while((ret = nl_recvmsgs_default(ns->nl)) == 0){
-    // FIXME ensure it matched what we expect?
-    ns->clear_to_send = true;
-    pthread_cond_broadcast(&ns->txcond);
+  pthread_mutex_lock(&ns->txlock);
+  ns->txbusy = false;
+}
+
+// Transmit the request at the head of the queue, along with as many of the
+// non-dump requests following it as fit, if there's room on the wire. Returns
+// true if any requests were dequeued. Call with txlock held. The lock is
+// dropped around sendmsg(), which can block until we've received enough to
+// make room for the kernel's answers; the requests are put on the wire first,
+// since those answers can arrive before sendmsg() returns. txbusy keeps
+// transmissions (and thus sequence numbers) in order meanwhile.
+static bool
+tx_next_locked(netstack* ns){
+  if(ns->txbusy){
+    return false;
   }
-  ns->opts.diagfxn("Error rxing from netlink socket (%s)\n", nl_geterror(ret));
-  // FIXME recover?
-  return NULL;
+  struct iovec iov[TX_BATCH_MSGS];
+  size_t bytes = 0;
+  int n = 0;
+  netstack_request* req;
+  const uint64_t now = monotonic_nsec();
+  const uint32_t port = nl_socket_get_local_port(ns->nl);
+  if(ns->nextseq == 0){
+    ++ns->nextseq;
+  }
+  const uint32_t firstseq = ns->nextseq;
+  while((req = ns->queued) && n < TX_BATCH_MSGS && tx_room_locked(ns, req)){
+    if(n && (req->dump || bytes + req->nlh->nlmsg_len > TX_BATCH_BYTES)){
+      break;
+    }
+    if(ns->nextseq == 0){ // can't be in the middle of a batch
+      break;
+    }
+    if((ns->queued = req->next) == NULL){
+      ns->queuedtail = &ns->queued;
+    }
+    req->next = NULL;
+    req->nlh->nlmsg_seq = ns->nextseq++;
+    req->nlh->nlmsg_pid = port;
+    req->sent = now;
+    iov[n].iov_base = req->nlh;
+    iov[n].iov_len = req->nlh->nlmsg_len;
+    bytes += req->nlh->nlmsg_len;
+    ++n;
+    if(req->dump){
+      ns->dumpreq = req;
+      break;
+    }
+    *ns->senttail = req;
+    ns->senttail = &req->next;
+    ++ns->sentcount;
+    if(req->nlh->nlmsg_flags & NLM_F_ACK){
+      ++ns->sentacks;
+    }
+  }
+  if(n == 0){
+    return false;
+  }
+  const uint32_t lastseq = ns->nextseq - 1;
+  struct sockaddr_nl sa = {
+    .nl_family = AF_NETLINK,
+  };
+  struct msghdr mh = {
+    .msg_name = &sa,
+    .msg_namelen = sizeof(sa),
+    .msg_iov = iov,
+    .msg_iovlen = n,
+  };
+  ns->txbusy = true;
+  pthread_mutex_unlock(&ns->txlock);
+  int err = 0;
+  pthread_cleanup_push(tx_relock, ns);
+  if(sendmsg(nl_socket_get_fd(ns->nl), &mh, 0) < 0){
+    err = errno;
+  }
+  pthread_cleanup_pop(1);
+  if(err == 0){
+    return true;
+  }
+  ns->opts.diagfxn("Couldn't send %d netlink request(s) (%s)\n", n, strerror(err));
+  // nothing was delivered, so nothing can have been answered, but the batch
+  // might have been failed out from under us following an overrun
+  if(ns->dumpreq && ns->dumpreq->nlh->nlmsg_seq == firstseq){
+    req = ns->dumpreq;
+    ns->dumpreq = NULL;
+    request_finish_locked(ns, req, -err, NULL, -1);
+    return true;
+  }
+  netstack_request** pp = &ns->sent;
+  netstack_request* prev = NULL;
+  while( (req = *pp) ){
+    const uint32_t seq = req->nlh->nlmsg_seq;
+    if(seq_before(seq, firstseq) || seq_before(lastseq, seq)){
+      prev = req;
+      pp = &req->next;
+      continue;
+    }
+    if((*pp = req->next) == NULL){
+      ns->senttail = prev ? &prev->next : &ns->sent;
+    }
+    --ns->sentcount;
+    if(req->nlh->nlmsg_flags & NLM_F_ACK){
+      --ns->sentacks;
+    }
+    request_finish_locked(ns, req, -err, NULL, -1);
+  }
+  return true;
 }
 
 static void
@@ -225,26 +1241,28 @@ tx_cancel_clean(void* vns){
   pthread_mutex_unlock(&ns->txlock);
 }
 
-// Sits on condition variable, transmitting when there's data in the txqueue
+// In threadless mode, requests are transmitted as soon as they're queued, or
+// as soon as there's room on the wire. Call with txlock held.
+static void
+tx_pump_locked(netstack* ns){
+  while(tx_next_locked(ns)){
+    ;
+  }
+}
+
+// Sits on condition variable, transmitting when there's room on the wire for
+// the request at the head of the queue.
 static void*
 netstack_tx_thread(void* vns){
   netstack* ns = vns;
   while(true){
     pthread_mutex_lock(&ns->txlock);
     pthread_cleanup_push(tx_cancel_clean, ns);
-    while(!ns->clear_to_send || ns->txqueue[ns->dequeueidx] == -1){
+    while(!tx_next_locked(ns)){
       pthread_cond_wait(&ns->txcond, &ns->txlock);
     }
-    ns->clear_to_send = false;
-    struct rtgenmsg rt = {
-      .rtgen_family = AF_UNSPEC,
-    };
-    if(nl_send_simple(ns->nl, ns->txqueue[ns->dequeueidx],
-                      NLM_F_REQUEST|NLM_F_DUMP, &rt, sizeof(rt)) < 0){
-      // FIXME do what?
-    }
-    ns->txqueue[ns->dequeueidx++] = -1;
     pthread_cleanup_pop(1);
+    requests_complete(ns); // any which failed to send
   }
   return NULL;
 }
@@ -269,6 +1287,12 @@ iface_rta_handler(netstack_iface* ni, const struct ifinfomsg* ifi,
       return false;
     }
     memcpy(ni->name, RTA_DATA(rta), nlen + 1);
+  }else if(rta->rta_type == IFLA_TARGET_NETNSID){
+    // present in replies to dumps targeting a peer namespace
+    int32_t nsid;
+    if(netstack_rtattrcpy_exact(rta, &nsid, sizeof(nsid))){
+      ni->nsid = nsid;
+    }
   }
   ni->rta_index[rta->rta_type] = rtaoff + 1;
   return true;
@@ -285,6 +1309,12 @@ addr_rta_handler(netstack_addr* na, const struct ifaddrmsg* ifa,
     na->unknown_attrs = true;
     return true;
   }
+  if(rta->rta_type == IFA_TARGET_NETNSID){
+    int32_t nsid;
+    if(netstack_rtattrcpy_exact(rta, &nsid, sizeof(nsid))){
+      na->nsid = nsid;
+    }
+  }
   na->rta_index[rta->rta_type] = rtaoff + 1;
   return true;
 }
@@ -319,6 +1349,48 @@ neigh_rta_handler(netstack_neigh* nn, const struct ndmsg* nd,
   return true;
 }
 
+static bool
+rule_rta_handler(netstack_rule* nr, const struct fib_rule_hdr* frh,
+                 size_t rtaoff, int* rlen __attribute__ ((unused))){
+  const struct rtattr* rta = (const struct rtattr*)
+    (((const char*)(nr->rtabuf)) + rtaoff);
+  memcpy(&nr->frh, frh, sizeof(*frh));
+  if(rta->rta_type > FRA_MAX){
+    nr->unknown_attrs = true;
+    return true;
+  }
+  nr->rta_index[rta->rta_type] = rtaoff + 1;
+  return true;
+}
+
+static bool
+nexthop_rta_handler(netstack_nexthop* nh, const struct nhmsg* nhm,
+                    size_t rtaoff, int* rlen __attribute__ ((unused))){
+  const struct rtattr* rta = (const struct rtattr*)
+    (((const char*)(nh->rtabuf)) + rtaoff);
+  memcpy(&nh->nh, nhm, sizeof(*nhm));
+  if(rta->rta_type > NHA_MAX){
+    nh->unknown_attrs = true;
+    return true;
+  }
+  nh->rta_index[rta->rta_type] = rtaoff + 1;
+  return true;
+}
+
+static bool
+tc_rta_handler(netstack_tc* tc, const struct tcmsg* tcm, size_t rtaoff, bool isclass){
+  const struct rtattr* rta = (const struct rtattr*)
+    (((const char*)(tc->rtabuf)) + rtaoff);
+  memcpy(&tc->tcm, tcm, sizeof(*tcm));
+  tc->isclass = isclass;
+  if(rta->rta_type > TCA_MAX){
+    tc->unknown_attrs = true;
+    return true;
+  }
+  tc->rta_index[rta->rta_type] = rtaoff + 1;
+  return true;
+}
+
 // FIXME xmacro all of these out
 static bool
 viface_rta_handler(void* v1, const void* v2, size_t rtaoff, int* rlen){
@@ -340,6 +1412,28 @@ vneigh_rta_handler(void* v1, const void* v2, size_t rtaoff, int* rlen){
   return neigh_rta_handler(v1, v2, rtaoff, rlen);
 }
 
+static bool
+vrule_rta_handler(void* v1, const void* v2, size_t rtaoff, int* rlen){
+  return rule_rta_handler(v1, v2, rtaoff, rlen);
+}
+
+static bool
+vnexthop_rta_handler(void* v1, const void* v2, size_t rtaoff, int* rlen){
+  return nexthop_rta_handler(v1, v2, rtaoff, rlen);
+}
+
+static bool
+vqdisc_rta_handler(void* v1, const void* v2, size_t rtaoff, int* rlen){
+  (void)rlen;
+  return tc_rta_handler(v1, v2, rtaoff, false);
+}
+
+static bool
+vtclass_rta_handler(void* v1, const void* v2, size_t rtaoff, int* rlen){
+  (void)rlen;
+  return tc_rta_handler(v1, v2, rtaoff, true);
+}
+
 static inline void*
 memdup(const void* v, size_t n){
   void* ret = malloc(n);
@@ -360,64 +1454,189 @@ rtas_dup(const struct rtattr* rtas, int rlen,
   return ret;
 }
 
+// Decode the attributes of the hot block from the indexed rtabuf. Called once
+// all attributes have been indexed, before the object is published.
+static void
+decode_iface_hot(netstack_iface* ni){
+  netstack_iface_hotfields* hot = &ni->hot;
+  hot->master = -1;
+  hot->operstate = IF_OPER_UNKNOWN;
+  netstack_rtattrcpy_exact(netstack_iface_attr(ni, IFLA_MTU), &hot->mtu, sizeof(hot->mtu));
+  netstack_rtattrcpy_exact(netstack_iface_attr(ni, IFLA_TXQLEN), &hot->txqlen, sizeof(hot->txqlen));
+  netstack_rtattrcpy_exact(netstack_iface_attr(ni, IFLA_GROUP), &hot->group, sizeof(hot->group));
+  netstack_rtattrcpy_exact(netstack_iface_attr(ni, IFLA_MASTER), &hot->master, sizeof(hot->master));
+  netstack_rtattrcpy_exact(netstack_iface_attr(ni, IFLA_LINK), &hot->link, sizeof(hot->link));
+  netstack_rtattrcpy_exact(netstack_iface_attr(ni, IFLA_OPERSTATE), &hot->operstate, sizeof(hot->operstate));
+  if(netstack_rtattrcpy_exact(netstack_iface_attr(ni, IFLA_CARRIER), &hot->carrier, sizeof(hot->carrier))){
+    hot->present |= NETSTACK_IFACE_HOT_CARRIER;
+  }
+  size_t alen = sizeof(hot->l2addr);
+  if(netstack_rtattrcpy(netstack_iface_attr(ni, IFLA_ADDRESS), hot->l2addr, &alen)){
+    hot->l2addrlen = alen;
+    hot->present |= NETSTACK_IFACE_HOT_L2ADDR;
+  }
+  if(netstack_rtattrcpy_exact(netstack_iface_attr(ni, IFLA_STATS64), &hot->stats64, sizeof(hot->stats64))){
+    hot->present |= NETSTACK_IFACE_HOT_STATS;
+  }else{
+    // Fall back to lame 32-bit stats, which share the leading fields' order
+    struct rtnl_link_stats s32;
+    if(netstack_rtattrcpy_exact(netstack_iface_attr(ni, IFLA_STATS), &s32, sizeof(s32))){
+      const uint32_t* from = (const uint32_t*)&s32;
+      uint64_t* to = (uint64_t*)&hot->stats64;
+      size_t z;
+      for(z = 0 ; z < sizeof(s32) / sizeof(*from) ; ++z){
+        to[z] = from[z];
+      }
+      hot->present |= NETSTACK_IFACE_HOT_STATS;
+    }
+  }
+}
+
 static netstack_iface*
-create_iface(const struct rtattr* rtas, int rlen){
+create_iface(const struct rtattr* rtas, int rlen, int nsid){
   netstack_iface* ni;
   ni = malloc(sizeof(*ni));
   memset(ni, 0, sizeof(*ni));
   atomic_init(&ni->refcount, 1);
+  ni->nsid = nsid;
+  ni->rtabuflen = rlen;
   ni->rtabuf = rtas_dup(rtas, rlen, ni->rta_index,
                         sizeof(ni->rta_index) / sizeof(*ni->rta_index));
   return ni;
 }
 
+// Deep copy of a netstack_iface, including its index (which is all relative
+// offsets, and thus needn't be recomputed).
+static netstack_iface*
+dup_iface(const netstack_iface* ni){
+  netstack_iface* ret = malloc(sizeof(*ret));
+  if(ret){
+    memcpy(ret, ni, sizeof(*ni));
+    if((ret->rtabuf = memdup(ni->rtabuf, ni->rtabuflen)) == NULL && ni->rtabuflen){
+      free(ret);
+      return NULL;
+    }
+    ret->hnext = NULL;
+    atomic_init(&ret->refcount, 1);
+    atomic_init(&ret->tlrefs, 0);
+    int irqstate = atomic_load_explicit(&ni->irqstate, memory_order_acquire);
+    if(irqstate == IRQCACHE_BUSY){
+      irqstate = IRQCACHE_UNKNOWN;
+    }
+    atomic_init(&ret->irqstate, irqstate);
+  }
+  return ret;
+}
+
 static inline void*
-vcreate_iface(const struct rtattr* rtas, int rlen){
-  return create_iface(rtas, rlen);
+vcreate_iface(const struct rtattr* rtas, int rlen, int nsid){
+  return create_iface(rtas, rlen, nsid);
 }
 
 static netstack_addr*
-create_addr(const struct rtattr* rtas, int rlen){
+create_addr(const struct rtattr* rtas, int rlen, int nsid){
   netstack_addr* na;
   na = malloc(sizeof(*na));
   memset(na, 0, sizeof(*na));
+  na->nsid = nsid;
+  na->rtabuflen = rlen;
   na->rtabuf = rtas_dup(rtas, rlen, na->rta_index,
                         sizeof(na->rta_index) / sizeof(*na->rta_index));
   return na;
 }
 
 static inline void*
-vcreate_addr(const struct rtattr* rtas, int rlen){
-  return create_addr(rtas, rlen);
+vcreate_addr(const struct rtattr* rtas, int rlen, int nsid){
+  return create_addr(rtas, rlen, nsid);
 }
 
 static netstack_route*
-create_route(const struct rtattr* rtas, int rlen){
+create_route(const struct rtattr* rtas, int rlen, int nsid){
   netstack_route* nr;
   nr = malloc(sizeof(*nr));
   memset(nr, 0, sizeof(*nr));
+  nr->nsid = nsid;
+  nr->rtabuflen = rlen;
   nr->rtabuf = rtas_dup(rtas, rlen, nr->rta_index,
                         sizeof(nr->rta_index) / sizeof(*nr->rta_index));
   return nr;
 }
 
 static inline void*
-vcreate_route(const struct rtattr* rtas, int rlen){
-  return create_route(rtas, rlen);
+vcreate_route(const struct rtattr* rtas, int rlen, int nsid){
+  return create_route(rtas, rlen, nsid);
 }
 
 static netstack_neigh*
-create_neigh(const struct rtattr* rtas, int rlen){
+create_neigh(const struct rtattr* rtas, int rlen, int nsid){
   netstack_neigh* nn;
   nn = malloc(sizeof(*nn));
   memset(nn, 0, sizeof(*nn));
+  nn->nsid = nsid;
+  nn->rtabuflen = rlen;
   nn->rtabuf = rtas_dup(rtas, rlen, nn->rta_index,
                         sizeof(nn->rta_index) / sizeof(*nn->rta_index));
   return nn;
 }
 
 static inline void*
-vcreate_neigh(const struct rtattr* rtas, int rlen){ return create_neigh(rtas, rlen); }
+vcreate_neigh(const struct rtattr* rtas, int rlen, int nsid){
+  return create_neigh(rtas, rlen, nsid);
+}
+
+static netstack_rule*
+create_rule(const struct rtattr* rtas, int rlen, int nsid){
+  netstack_rule* nr;
+  nr = malloc(sizeof(*nr));
+  memset(nr, 0, sizeof(*nr));
+  atomic_init(&nr->refcount, 1);
+  nr->nsid = nsid;
+  nr->rtabuflen = rlen;
+  nr->rtabuf = rtas_dup(rtas, rlen, nr->rta_index,
+                        sizeof(nr->rta_index) / sizeof(*nr->rta_index));
+  return nr;
+}
+
+static inline void*
+vcreate_rule(const struct rtattr* rtas, int rlen, int nsid){
+  return create_rule(rtas, rlen, nsid);
+}
+
+static netstack_nexthop*
+create_nexthop(const struct rtattr* rtas, int rlen, int nsid){
+  netstack_nexthop* nh;
+  nh = malloc(sizeof(*nh));
+  memset(nh, 0, sizeof(*nh));
+  atomic_init(&nh->refcount, 1);
+  nh->nsid = nsid;
+  nh->rtabuflen = rlen;
+  nh->rtabuf = rtas_dup(rtas, rlen, nh->rta_index,
+                        sizeof(nh->rta_index) / sizeof(*nh->rta_index));
+  return nh;
+}
+
+static inline void*
+vcreate_nexthop(const struct rtattr* rtas, int rlen, int nsid){
+  return create_nexthop(rtas, rlen, nsid);
+}
+
+static netstack_tc*
+create_tc(const struct rtattr* rtas, int rlen, int nsid){
+  netstack_tc* tc;
+  tc = malloc(sizeof(*tc));
+  memset(tc, 0, sizeof(*tc));
+  atomic_init(&tc->refcount, 1);
+  tc->nsid = nsid;
+  tc->rtabuflen = rlen;
+  tc->rtabuf = rtas_dup(rtas, rlen, tc->rta_index,
+                        sizeof(tc->rta_index) / sizeof(*tc->rta_index));
+  return tc;
+}
+
+static inline void*
+vcreate_tc(const struct rtattr* rtas, int rlen, int nsid){
+  return create_tc(rtas, rlen, nsid);
+}
 
 static void
 netstack_iface_destroy(netstack_iface* ni){
@@ -451,10 +1670,40 @@ static void free_neigh(netstack_neigh* nn){
   }
 }
 
+static void free_rule(netstack_rule* nr){
+  if(nr){
+    if(atomic_fetch_sub(&nr->refcount, 1) == 1){
+      free(nr->rtabuf);
+      free(nr);
+    }
+  }
+}
+
+static void free_nexthop(netstack_nexthop* nh){
+  if(nh){
+    if(atomic_fetch_sub(&nh->refcount, 1) == 1){
+      free(nh->rtabuf);
+      free(nh);
+    }
+  }
+}
+
+static void free_tc(netstack_tc* tc){
+  if(tc){
+    if(atomic_fetch_sub(&tc->refcount, 1) == 1){
+      free(tc->rtabuf);
+      free(tc);
+    }
+  }
+}
+
 static inline void vfree_iface(void* vni){ netstack_iface_destroy(vni); }
 static inline void vfree_addr(void* va){ free_addr(va); }
 static inline void vfree_route(void* vr){ free_route(vr); }
 static inline void vfree_neigh(void* vn){ free_neigh(vn); }
+static inline void vfree_rule(void* vr){ free_rule(vr); }
+static inline void vfree_nexthop(void* vnh){ free_nexthop(vnh); }
+static inline void vfree_tc(void* vtc){ free_tc(vtc); }
 
 #ifndef NDA_RTA
 #define NDA_RTA(r) \
@@ -486,7 +1735,7 @@ validate_enumeration_flags(const uint32_t* offsets, int n, void* objs,
 // Size, in bytes, necessary to represent this ni (varies from ni to ni)
 static inline size_t
 netstack_iface_size(const netstack_iface* ni){
-  return sizeof(ni) + ni->rtabuflen;
+  return sizeof(*ni) + ni->rtabuflen;
 }
 
 unsigned netstack_iface_count(const netstack* ns){
@@ -506,8 +1755,13 @@ int netstack_iface_stats_refresh(netstack* ns){
   return 0;
 }
 
+// sysfs reflects our own namespace, where a peer's link name might be used
+// by some unrelated device.
 static int
-netstack_iface_irqinfo(const netstack_iface* ni, unsigned long* minirq, unsigned long* maxirq){
+scan_iface_irqs(const netstack_iface* ni, unsigned long* minirq, unsigned long* maxirq){
+  if(ni->nsid != NETSTACK_NSID_LOCAL){
+    return -1;
+  }
   int sfd = open("/sys/class/net", O_CLOEXEC | O_DIRECTORY | O_RDONLY);
   if(sfd < 0){
     return -1;
@@ -555,6 +1809,38 @@ netstack_iface_irqinfo(const netstack_iface* ni, unsigned long* minirq, unsigned
   return 0;
 }
 
+// Returns the cached MSI IRQ range, scanning sysfs only on the first call
+// against this object. Should some other thread be mid-scan, we perform our
+// own (uncached) scan rather than waiting on it.
+static int
+netstack_iface_irqinfo(const netstack_iface* ni, unsigned long* minirq, unsigned long* maxirq){
+  netstack_iface* mni = (netstack_iface*)ni; // cache is internally mutable
+  int state = atomic_load_explicit(&mni->irqstate, memory_order_acquire);
+  if(state == IRQCACHE_UNKNOWN){
+    if(!atomic_compare_exchange_strong_explicit(&mni->irqstate, &state, IRQCACHE_BUSY,
+                                                memory_order_acquire, memory_order_acquire)){
+      if(state == IRQCACHE_UNKNOWN || state == IRQCACHE_BUSY){
+        return scan_iface_irqs(ni, minirq, maxirq);
+      }
+    }else{
+      if(scan_iface_irqs(ni, &mni->minirq, &mni->maxirq)){
+        state = IRQCACHE_NONE;
+      }else{
+        state = IRQCACHE_VALID;
+      }
+      atomic_store_explicit(&mni->irqstate, state, memory_order_release);
+    }
+  }else if(state == IRQCACHE_BUSY){
+    return scan_iface_irqs(ni, minirq, maxirq);
+  }
+  if(state != IRQCACHE_VALID){
+    return -1;
+  }
+  *minirq = mni->minirq;
+  *maxirq = mni->maxirq;
+  return 0;
+}
+
 int netstack_iface_irq(const netstack_iface* ni, unsigned qidx){
   unsigned long min, max;
   if(netstack_iface_irqinfo(ni, &min, &max) < 0){
@@ -579,588 +1865,6954 @@ unsigned netstack_iface_irqcount(const struct netstack_iface* ni){
   return max - min + 1;
 }
 
-int netstack_iface_enumerate(const netstack* ns, uint32_t* offsets, int* n,
-                             void* objs, size_t* obytes,
-                             netstack_enumerator* streamer){
-  if(!validate_enumeration_flags(offsets, *n, objs, *obytes, streamer)){
+// Read a small sysfs or procfs file into buf, NUL-terminating it. Returns the
+// number of bytes read, or -1 on error.
+static ssize_t
+read_small_file(int dirfd, const char* path, char* buf, size_t len){
+  int fd = openat(dirfd, path, O_CLOEXEC | O_RDONLY);
+  if(fd < 0){
     return -1;
   }
-  int copied = 0;
-  uint64_t copied_bytes = 0;
-  netstack* unsafe_ns = (netstack*)ns;
-  unsigned sslot = streamer ? streamer->slot : 0; // FIXME hnext
-  pthread_mutex_lock(&unsafe_ns->hashlock);
-  if(streamer && streamer->nonce && streamer->nonce != ns->nonce){
-    pthread_mutex_unlock(&unsafe_ns->hashlock);
-    return -1;
+  size_t off = 0;
+  ssize_t r = 0;
+  while(off + 1 < len && (r = read(fd, buf + off, len - 1 - off)) > 0){
+    off += r;
   }
-  const size_t tsize = ns->iface_bytes;
-  if(tsize > *obytes && !streamer){ // no streamer means atomic request
-    *obytes = tsize;
-    *n = ns->iface_count;
-    pthread_mutex_unlock(&unsafe_ns->hashlock);
+  close(fd);
+  if(r < 0){
     return -1;
   }
-  unsigned z;
-  const netstack_iface* ni;
-  for(z = sslot ; z < sizeof(ns->iface_hash) / sizeof(*ns->iface_hash) ; ++z){
-    ni = ns->iface_hash[z];
-    while(ni){
-      if(copied == *n){
-        goto exhausted;
-      }
-      const size_t nisize = netstack_iface_size(ni);
-      if(*obytes - copied_bytes < nisize){
-        goto exhausted;
-      }
-      offsets[copied] = copied_bytes; // where the new netstack_iface starts
-      netstack_iface* targni = (netstack_iface*)((char*)objs + copied_bytes);
-      memcpy(targni, ni, sizeof(*ni));
-      copied_bytes += sizeof(*ni);
-      targni->hnext = NULL;
-      // These don't need to be freed up -- all the resources have been
-      // provided by the caller. We only free when refs == 1, so init to 0.
-      atomic_init(&targni->refcount, 0);
-      targni->rtabuf = (struct rtattr*)((char*)objs + copied_bytes);
-      memcpy(targni->rtabuf, ni->rtabuf, ni->rtabuflen);
-      copied_bytes += ni->rtabuflen;
-      // copied_bytes ought have increased by netstack_iface_size() in total
-      ni = ni->hnext;
-      ++copied;
-    }
-  }
-exhausted:
-  // if we're not yet done, just out of memory, we need to set up streaming.
-  // either way, set our new values.
-  if(z < sizeof(ns->iface_hash) / sizeof(*ns->iface_hash) || ni){
-    *n -= copied;
-    *obytes -= copied_bytes;
-    streamer->nonce = ns->nonce;
-    streamer->slot = z;
-    if(ni){
-      streamer->hnext = (uintptr_t)ni->hnext;
-    }else{
-      streamer->hnext = 0;
-    }
-  }else{
-    *n = 0;
-    *obytes = 0;
-    streamer->nonce = 0;
-    streamer->slot = 0;
-    streamer->hnext = 0;
-  }
-  pthread_mutex_unlock(&unsafe_ns->hashlock);
-  return copied;
+  buf[off] = '\0';
+  return off;
 }
 
-static inline void
-viface_cb(netstack* ns, netstack_event_e etype, void* vni){
-  netstack_iface* ni = vni;
-  // We might be replacing some previous element. If so, that one comes out of
-  // the hash as replaced, and should have its refcount dropped.
-  netstack_iface* replaced = NULL;
-  const size_t nisize = netstack_iface_size(ni);
-  int hidx = iface_hash(ns, ni->ifi.ifi_index);
-  // If we're not tracking interfaces, we don't need to manipulate the cache at
-  // all, so skip all of this. We furthermore free the object before return.
-  if(!ns->opts.iface_notrack){
-    pthread_mutex_lock(&ns->hashlock);
-    netstack_iface** tmp = &ns->iface_hash[hidx];
-    if(etype != NETSTACK_DEL){ // insert into caches
-      name_trie_add(&ns->name_trie, ni);
-      ni->hnext = *tmp; // we always insert into the front of hlist
-      *tmp = ni;
-      tmp = &ni->hnext;
-      ++ns->iface_count;
-      ns->iface_bytes += nisize;
-    }else{ // purge from caches
-      netstack_iface* purged = name_trie_purge(&ns->name_trie, ni->name);
-      if(purged){
-        --ns->iface_count;
-        ns->iface_bytes -= netstack_iface_size(purged);
-      }
+// Parse a cpulist (e.g. "0-3,8,10-11\n") as found in smp_affinity_list.
+static int
+parse_cpulist(const char* s, netstack_cpumask* mask){
+  memset(mask, 0, sizeof(*mask));
+  while(*s && *s != '\n'){
+    char* e;
+    unsigned long lo = strtoul(s, &e, 10);
+    if(e == s){
+      return -1;
     }
-    while(*tmp){ // need to see if one ought be removed (matches our key)
-      if((*tmp)->ifi.ifi_index == ni->ifi.ifi_index){
-        replaced = *tmp;
-        *tmp = (*tmp)->hnext;
-        break;
+    unsigned long hi = lo;
+    if(*e == '-'){
+      s = e + 1;
+      hi = strtoul(s, &e, 10);
+      if(e == s){
+        return -1;
       }
-      tmp = &(*tmp)->hnext;
     }
-    // We might have changed names (but retained our index). In this case, we've
-    // already added the new name (and iface) to the name_trie. In the case where
-    // we retained the name and idx, we've replaced the object in the name_trie.
-    // For the former case, we need remove the old name.
-    if(replaced && strcmp(ni->name, replaced->name)){
-      name_trie_purge(&ns->name_trie, replaced->name);
-      --ns->iface_count;
-      ns->iface_bytes -= netstack_iface_size(replaced);
+    if(hi < lo || hi >= NETSTACK_MAX_CPUS){
+      return -1;
     }
-    pthread_mutex_unlock(&ns->hashlock);
-    if(replaced){
-      netstack_iface_destroy(replaced);
+    for(unsigned long c = lo ; c <= hi ; ++c){
+      mask->bits[c / 64] |= 1ull << (c % 64);
+    }
+    s = e;
+    if(*s == ','){
+      ++s;
+    }else if(*s && *s != '\n'){
+      return -1;
     }
   }
-  if(ns->opts.iface_cb){
-    ns->opts.iface_cb(ni, etype, ns->opts.iface_curry);
-    atomic_fetch_add(&ns->user_callbacks_total, 1);
-  }
-  if(etype == NETSTACK_DEL || ns->opts.iface_notrack){
-    netstack_iface_destroy(ni);
-  }
-  atomic_fetch_add(&ns->iface_events, 1);
+  return 0;
 }
 
-static inline void
-vaddr_cb(netstack* ns, netstack_event_e etype, void* vna){
-  if(ns->opts.addr_cb){
-    ns->opts.addr_cb(vna, etype, ns->opts.addr_curry);
-    atomic_fetch_add(&ns->user_callbacks_total, 1);
+// Parse a hexadecimal cpumask (e.g. "ff,ffffffff\n") as found in rps_cpus.
+// The kernel zero-pads each comma-delimited 32-bit group, so we can simply
+// walk the nibbles from least to most significant, skipping commas.
+static int
+parse_cpumask(const char* s, netstack_cpumask* mask){
+  memset(mask, 0, sizeof(*mask));
+  size_t len = strcspn(s, "\n");
+  unsigned bit = 0;
+  while(len){
+    const char c = s[--len];
+    if(c == ','){
+      continue;
+    }
+    if(!isxdigit((unsigned char)c)){
+      return -1;
+    }
+    const int nib = isdigit((unsigned char)c) ? c - '0' : tolower((unsigned char)c) - 'a' + 10;
+    for(int b = 0 ; b < 4 ; ++b){
+      if(nib & (1 << b)){
+        if(bit + b >= NETSTACK_MAX_CPUS){
+          return -1;
+        }
+        mask->bits[(bit + b) / 64] |= 1ull << ((bit + b) % 64);
+      }
+    }
+    bit += 4;
   }
-  atomic_fetch_add(&ns->addr_events, 1);
-  free_addr(vna);
+  return 0;
 }
 
-static inline void
-vroute_cb(netstack* ns, netstack_event_e etype, void* vnr){
-  if(ns->opts.route_cb){
-    ns->opts.route_cb(vnr, etype, ns->opts.route_curry);
-    atomic_fetch_add(&ns->user_callbacks_total, 1);
-  }
-  atomic_fetch_add(&ns->route_events, 1);
-  free_route(vnr);
+static int
+topo_irq_cmp(const void* va, const void* vb){
+  const topo_irq* a = va;
+  const topo_irq* b = vb;
+  return a->irq < b->irq ? -1 : a->irq > b->irq;
 }
 
-static inline void
-vneigh_cb(netstack* ns, netstack_event_e etype, void* vnn){
-  if(ns->opts.neigh_cb){
-    ns->opts.neigh_cb(vnn, etype, ns->opts.neigh_curry);
-    atomic_fetch_add(&ns->user_callbacks_total, 1);
+// Collect the device's MSI vectors from device/msi_irqs, sorted.
+static int
+topology_irqs(netstack_topology* nt, int ndfd){
+  int mfd = openat(ndfd, "device/msi_irqs", O_CLOEXEC | O_DIRECTORY | O_RDONLY);
+  if(mfd < 0){
+    return 0; // no MSI vectors; not an error
   }
-  atomic_fetch_add(&ns->neigh_events, 1);
-  free_neigh(vnn);
+  DIR* d = fdopendir(mfd);
+  if(!d){
+    close(mfd);
+    return -1;
+  }
+  unsigned alloced = 0;
+  struct dirent* dent;
+  while( (dent = readdir(d)) ){
+    char* endp;
+    unsigned long irq = strtoul(dent->d_name, &endp, 10);
+    if(*endp || endp == dent->d_name || irq > INT_MAX){
+      continue;
+    }
+    if(nt->irqcount == alloced){
+      unsigned na = alloced ? alloced * 2 : 16;
+      topo_irq* tmp = realloc(nt->irqs, sizeof(*tmp) * na);
+      if(tmp == NULL){
+        closedir(d);
+        return -1;
+      }
+      nt->irqs = tmp;
+      alloced = na;
+    }
+    topo_irq* ti = &nt->irqs[nt->irqcount++];
+    memset(ti, 0, sizeof(*ti));
+    ti->irq = irq;
+  }
+  closedir(d);
+  if(nt->irqcount){
+    qsort(nt->irqs, nt->irqcount, sizeof(*nt->irqs), topo_irq_cmp);
+  }
+  return 0;
 }
 
-static int
-msg_handler_internal(struct nl_msg* msg, netstack* ns){
-  struct nlmsghdr* nhdr = nlmsg_hdr(msg);
-  int nlen = nhdr->nlmsg_len;
-  while(nlmsg_ok(nhdr, nlen)){
-    const int ntype = nhdr->nlmsg_type;
-    const struct rtattr *rta = NULL;
-    const struct ifinfomsg* ifi = NLMSG_DATA(nhdr);
-    const struct ifaddrmsg* ifa = NLMSG_DATA(nhdr);
-    const struct rtmsg* rt = NLMSG_DATA(nhdr);
-    const struct ndmsg* nd = NLMSG_DATA(nhdr);
-    const void* hdr = NULL; // aliases one of the NLMSG_DATA lvalues above
-    size_t hdrsize = 0; // size of leading object (hdr), depends on message type
-    // processor for rtattr objects in this type regime. takes the newly-created
-    // netstack_* object (newobj), the leading type-dependent object (aliased
-    // by hdr), the offset of the RTA being handled, and &rlen.
-    bool (*pfxn)(void*, const void*, size_t, int*);
-    void (*dfxn)(void*); // destroyer of this type of object
-    void (*cfxn)(netstack*, netstack_event_e, void*); // user callback wrapper
-    void* (*gfxn)(const struct rtattr*, int); // constructor
-    netstack_event_e etype;
-    switch(ntype){
-      case RTM_DELLINK: // intentional fallthrough
-      case RTM_NEWLINK:
-        hdr = ifi;
-        rta = IFLA_RTA(ifi);
-        hdrsize = sizeof(*ifi);
-        pfxn = viface_rta_handler;
-        dfxn = vfree_iface;
-        cfxn = viface_cb;
-        gfxn = vcreate_iface;
-        etype = (ntype == RTM_DELLINK) ? NETSTACK_DEL : NETSTACK_MOD;
-        break;
-      case RTM_DELADDR: // intentional fallthrough
-      case RTM_NEWADDR:
-        hdr = ifa;
-        rta = IFA_RTA(ifa);
-        hdrsize = sizeof(*ifa);
-        pfxn = vaddr_rta_handler;
-        dfxn = vfree_addr;
-        cfxn = vaddr_cb;
-        gfxn = vcreate_addr;
-        etype = (ntype == RTM_DELADDR) ? NETSTACK_DEL : NETSTACK_MOD;
-        break;
-      case RTM_DELROUTE: // intentional fallthrough
-      case RTM_NEWROUTE:
-        hdr = rt;
-        rta = RTM_RTA(rt);
-        hdrsize = sizeof(*rt);
-        pfxn = vroute_rta_handler;
-        dfxn = vfree_route;
-        cfxn = vroute_cb;
-        gfxn = vcreate_route;
-        etype = (ntype == RTM_DELROUTE) ? NETSTACK_DEL : NETSTACK_MOD;
-        break;
-      case RTM_DELNEIGH: // intentional fallthrough
-      case RTM_NEWNEIGH:
-        hdr = nd;
-        rta = NDA_RTA(nd);
-        hdrsize = sizeof(*nd);
-        pfxn = vneigh_rta_handler;
-        dfxn = vfree_neigh;
-        cfxn = vneigh_cb;
-        gfxn = vcreate_neigh;
-        etype = (ntype == RTM_DELNEIGH) ? NETSTACK_DEL : NETSTACK_MOD;
-        break;
-      default: ns->opts.diagfxn("Unknown nl type: %d\n", ntype); break;
+// Look up the action names of our vectors in /proc/interrupts. Each relevant
+// line is "IRQ: <per-cpu counts> <chip> <hwirq> <action>"; the action name is
+// the last field.
+static void
+topology_irq_names(netstack_topology* nt){
+  FILE* fp = fopen("/proc/interrupts", "re");
+  if(fp == NULL){
+    return;
+  }
+  char* line = NULL;
+  size_t llen = 0;
+  ssize_t r;
+  while((r = getline(&line, &llen, fp)) > 0){
+    char* endp;
+    long irq = strtol(line, &endp, 10);
+    if(endp == line || *endp != ':'){
+      continue;
     }
-    if(hdrsize == 0){
-      break;
+    topo_irq key = { .irq = irq, };
+    topo_irq* ti = bsearch(&key, nt->irqs, nt->irqcount, sizeof(*nt->irqs), topo_irq_cmp);
+    if(ti == NULL || ti->name){
+      continue;
     }
-    const struct rtattr* riter = rta;
-    // FIXME factor all of this out probably
-    int rlen = nlen - NLMSG_LENGTH(hdrsize);
-    void* newobj = gfxn(rta, rlen);
-    // always there is an RTA extraction pfxn
-    while(RTA_OK(riter, rlen)){
-      if(!pfxn(newobj, hdr, (char*)riter - (char*)rta, &rlen)){
-        break;
-      }
-      riter = RTA_NEXT(riter, rlen);
+    while(r && isspace((unsigned char)line[r - 1])){
+      line[--r] = '\0';
     }
-    if(rlen){
-      dfxn(newobj);
-      ns->opts.diagfxn("Netlink attr was invalid, %db left\n", rlen);
-      return NL_SKIP;
+    char* name = line + r;
+    while(name > endp + 1 && !isspace((unsigned char)name[-1])){
+      --name;
+    }
+    if(*name){
+      ti->name = strdup(name);
     }
-    cfxn(ns, etype, newobj);
-    nhdr = nlmsg_next(nhdr, &nlen);
   }
-  if(nlen){
-    ns->opts.diagfxn("Netlink message was invalid, %db left\n", nlen);
-    return NL_SKIP;
+  free(line);
+  fclose(fp);
+}
+
+static void
+topology_irq_affinities(netstack_topology* nt){
+  int pfd = open("/proc/irq", O_CLOEXEC | O_DIRECTORY | O_RDONLY);
+  if(pfd < 0){
+    return;
+  }
+  char path[32];
+  char buf[BUFSIZ];
+  for(unsigned i = 0 ; i < nt->irqcount ; ++i){
+    topo_irq* ti = &nt->irqs[i];
+    snprintf(path, sizeof(path), "%d/smp_affinity_list", ti->irq);
+    if(read_small_file(pfd, path, buf, sizeof(buf)) >= 0){
+      ti->has_affinity = !parse_cpulist(buf, &ti->affinity);
+    }
   }
-  return NL_OK;
+  close(pfd);
 }
 
+// Best-effort classification of a vector's action name as serving a queue.
+// We strip any "@pci:..." suffix and the device name itself (which might end
+// in digits), and require a trailing queue index. Returns the index, setting
+// *rx and *tx according to the directions served, or -1 if this doesn't look
+// like a per-queue vector.
 static int
-msg_handler(struct nl_msg* msg, void* vns){
-  int oldcancelstate, ret;
-  pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldcancelstate);
-  ret = msg_handler_internal(msg, vns);
-  pthread_setcancelstate(oldcancelstate, &oldcancelstate);
-  return ret;
-}
-
-static int
-err_handler(struct sockaddr_nl* nla, struct nlmsgerr* nlerr, void* vns){
-  netstack* ns = vns;
-  ns->opts.diagfxn("Netlink error (fam %d) %d (%s)\n", nla->nl_family,
-          -nlerr->error, strerror(-nlerr->error));
-  atomic_fetch_add(&ns->netlink_errors, 1);
-  return NL_OK;
-}
-
-void netstack_stderr_diag(const char* fmt, ...){
-  va_list va;
-  va_start(va, fmt);
-  vfprintf(stderr, fmt, va);
-  va_end(va);
-}
-
-static void
-null_diagfxn(const char* fmt, ...){
-  (void)fmt;
-}
-
-static bool
-validate_options(const netstack_opts* nopts){
-  // NULL? No problem! All zeroes maps to all defaults, is all good!
-  if(nopts == NULL){
-    return true;
+irq_queue(const char* name, const char* devname, bool* rx, bool* tx){
+  size_t devlen = strlen(devname);
+  if(strncmp(name, devname, devlen) == 0){
+    name += devlen;
   }
-  // Without a callback, do not allow a meaningless curry to be specified
-  if(nopts->iface_curry && !nopts->iface_cb){
-    return false;
+  char lname[64];
+  size_t len = strcspn(name, "@");
+  if(len >= sizeof(lname)){
+    return -1;
   }
-  if(nopts->addr_curry && !nopts->addr_cb){
-    return false;
+  for(size_t z = 0 ; z < len ; ++z){
+    lname[z] = tolower((unsigned char)name[z]);
   }
-  if(nopts->route_curry && !nopts->route_cb){
-    return false;
+  lname[len] = '\0';
+  size_t end = len;
+  while(end && isdigit((unsigned char)lname[end - 1])){
+    --end;
   }
-  if(nopts->neigh_curry && !nopts->neigh_cb){
-    return false;
+  if(end == len || end == 0){
+    return -1;
   }
-  // Must have at least some kind of action configured (callback or track)
-  if(!nopts->addr_cb && !nopts->neigh_cb && !nopts->route_cb && !nopts->iface_cb){
-    if(nopts->addr_notrack && nopts->neigh_notrack && nopts->route_notrack && nopts->iface_notrack){
-      return false;
-    }
+  if(strstr(lname, "async") || strstr(lname, "config") || strstr(lname, "misc")){
+    return -1;
   }
-  return true;
-}
-
-// Filter the specified netlink dumper message from dumpmsgs, if it happens to
-// be there. *dumpcount will be updated in that case.
-static void
-filter_netlink_dumper(int* dumpmsgs, int* dumpcount, int dumper){
-  int z;
-  for(z = 0 ; z < *dumpcount ; ++z){
-    if(dumpmsgs[z] == dumper){
-      dumpmsgs[z] = dumpmsgs[--*dumpcount];
-      break;
-    }
+  *rx = strstr(lname, "rx") || strstr(lname, "input");
+  *tx = strstr(lname, "tx") || strstr(lname, "output");
+  if(!*rx && !*tx){ // combined channel, e.g. "eth0-3" or "mlx5_comp3"
+    *rx = *tx = true;
   }
+  unsigned long q = strtoul(lname + end, NULL, 10);
+  return q > INT_MAX ? -1 : (int)q;
 }
 
-// Determine which groups we want to subscribe to based off the
-// netstack_options, and subscribe to them. dumpmsgs will be filtered based
-// off what we subscribe to; it ought contain at first all possible dumpers,
-// of which there are dumpcount. the number remaining will be stored there.
-static int
-subscribe_to_netlink(const netstack* ns, int* dumpmsgs, int* dumpcount){
-  // We don't use nl_socket_add_memberships due to its weird varargs API.
-  if(ns->opts.iface_cb || !ns->opts.iface_notrack){
-    if(nl_socket_add_memberships(ns->nl, RTNLGRP_LINK, NFNLGRP_NONE)){
-      return -1;
-    }
-  }else{
-    filter_netlink_dumper(dumpmsgs, dumpcount, RTM_GETLINK);
+// Count the rx-N or tx-N queues in the device's queues/ directory.
+static unsigned
+topology_queue_count(int qfd, const char* prefix){
+  int dfd = openat(qfd, ".", O_CLOEXEC | O_DIRECTORY | O_RDONLY);
+  if(dfd < 0){
+    return 0;
   }
-  if(ns->opts.addr_cb || !ns->opts.addr_notrack){
-    if(nl_socket_add_memberships(ns->nl, RTNLGRP_IPV4_IFADDR,
-                                 RTNLGRP_IPV6_IFADDR, NFNLGRP_NONE)){
-      return -1;
-    }
-  }else{
-    filter_netlink_dumper(dumpmsgs, dumpcount, RTM_GETADDR);
+  DIR* d = fdopendir(dfd);
+  if(!d){
+    close(dfd);
+    return 0;
   }
-  if(ns->opts.route_cb || !ns->opts.route_notrack){
-    if(nl_socket_add_memberships(ns->nl, RTNLGRP_IPV4_ROUTE,
-                                 RTNLGRP_IPV6_ROUTE, NFNLGRP_NONE)){
-      return -1;
+  size_t plen = strlen(prefix);
+  unsigned count = 0;
+  struct dirent* dent;
+  while( (dent = readdir(d)) ){
+    if(strncmp(dent->d_name, prefix, plen)){
+      continue;
     }
-  }else{
-    filter_netlink_dumper(dumpmsgs, dumpcount, RTM_GETROUTE);
-  }
-  if(ns->opts.neigh_cb || !ns->opts.neigh_notrack){
-    if(nl_socket_add_memberships(ns->nl, RTNLGRP_NEIGH, NFNLGRP_NONE)){
-      return -1;
+    char* endp;
+    unsigned long q = strtoul(dent->d_name + plen, &endp, 10);
+    if(*endp || endp == dent->d_name + plen || q >= UINT_MAX){
+      continue;
+    }
+    if(q + 1 > count){
+      count = q + 1;
     }
-  }else{
-    filter_netlink_dumper(dumpmsgs, dumpcount, RTM_GETNEIGH);
   }
-  return 0;
+  closedir(d);
+  return count;
 }
 
-struct nl_sock*
-nl_socket_connect(int family){
-  struct nl_sock *nls;
-  if((nls = nl_socket_alloc()) == NULL){
+static topo_queue*
+topology_queues(int qfd, const char* prefix, const char* maskfile, unsigned count){
+  topo_queue* qs = calloc(count ? count : 1, sizeof(*qs));
+  if(qs == NULL){
     return NULL;
   }
-  nl_socket_disable_seq_check(nls);
-  if(nl_connect(nls, family)){
-    nl_socket_free(nls);
-    return NULL;
+  char path[64];
+  char buf[BUFSIZ];
+  for(unsigned q = 0 ; q < count ; ++q){
+    qs[q].irq = -1;
+    snprintf(path, sizeof(path), "%s%u/%s", prefix, q, maskfile);
+    if(qfd >= 0 && read_small_file(qfd, path, buf, sizeof(buf)) >= 0){
+      qs[q].has_cpus = !parse_cpumask(buf, &qs[q].cpus);
+    }
   }
-  return nls;
+  return qs;
 }
 
-static int
-netstack_init(netstack* ns, const netstack_opts* opts){
-  if(!validate_options(opts)){
-    return -1;
-  }
-  // Get an initial dump of all entities, then updates via subscription.
-  int dumpmsgs[] = {
-    RTM_GETLINK,
-    RTM_GETADDR,
-    RTM_GETNEIGH,
-    RTM_GETROUTE,
-  };
-  if(opts){
-    memcpy(&ns->opts, opts, sizeof(*opts));
-  }else{
-    memset(&ns->opts, 0, sizeof(ns->opts));
+static void
+free_topology(netstack_topology* nt){
+  if(nt){
+    for(unsigned i = 0 ; i < nt->irqcount ; ++i){
+      free(nt->irqs[i].name);
+    }
+    free(nt->irqs);
+    free(nt->rxqs);
+    free(nt->txqs);
+    free(nt);
   }
-  if(ns->opts.diagfxn == NULL){
-    ns->opts.diagfxn = null_diagfxn;
+}
+
+// Build a topology for ni from sysfs and procfs. Its refcount is 1. Like
+// scan_iface_irqs(), this is only meaningful for local links.
+static netstack_topology*
+build_topology(const netstack_iface* ni){
+  if(ni->nsid != NETSTACK_NSID_LOCAL){
+    return NULL;
   }
-  ns->nonce = 1;
-  ns->dequeueidx = 0;
-  ns->clear_to_send = true;
-  ns->name_trie = NULL;
-  ns->iface_count = 0;
-  ns->iface_bytes = 0;
-  memset(&ns->iface_hash, 0, sizeof(ns->iface_hash));
-  if((ns->nl = nl_socket_connect(NETLINK_ROUTE)) == NULL){
-    return -1;
+  int sfd = open("/sys/class/net", O_CLOEXEC | O_DIRECTORY | O_RDONLY);
+  if(sfd < 0){
+    return NULL;
   }
-  int dumpercount = sizeof(dumpmsgs) / sizeof(*dumpmsgs);
-  if(subscribe_to_netlink(ns, dumpmsgs, &dumpercount)){
-    nl_socket_free(ns->nl);
-    return -1;
+  int ndfd = openat(sfd, ni->name, O_CLOEXEC | O_DIRECTORY | O_RDONLY);
+  close(sfd);
+  if(ndfd < 0){
+    return NULL;
   }
-  if(ns->opts.initial_events != NETSTACK_INITIAL_EVENTS_NONE){
-    memcpy(ns->txqueue, dumpmsgs, sizeof(dumpmsgs));
-    ns->txqueue[dumpercount] = -1;
-    ns->queueidx = dumpercount;
-  }else{
-    ns->txqueue[0] = -1;
-    ns->queueidx = 0;
+  netstack_topology* nt = calloc(1, sizeof(*nt));
+  if(nt == NULL){
+    close(ndfd);
+    return NULL;
   }
-  ns->netlink_errors = 0;
-  ns->user_callbacks_total = 0;
-  ns->lookup_copies = ns->lookup_shares = ns->lookup_failures = 0;
-  ns->iface_events = ns->addr_events = ns->route_events = ns->neigh_events = 0;
-  // Passes this netstack object to libnl. The nl_sock thus must be destroyed
-  // before the netstack itself is.
-  if(nl_socket_modify_cb(ns->nl, NL_CB_VALID, NL_CB_CUSTOM, msg_handler, ns)){
-    nl_socket_free(ns->nl);
-    return -1;
+  atomic_init(&nt->refcount, 1);
+  nt->numa_node = -1;
+  char buf[BUFSIZ];
+  if(read_small_file(ndfd, "device/numa_node", buf, sizeof(buf)) > 0){
+    nt->numa_node = strtol(buf, NULL, 10);
   }
-  if(nl_socket_modify_err_cb(ns->nl, NL_CB_CUSTOM, err_handler, ns)){
-    nl_socket_free(ns->nl);
-    return -1;
+  if(topology_irqs(nt, ndfd)){
+    close(ndfd);
+    free_topology(nt);
+    return NULL;
   }
-  if(pthread_mutex_init(&ns->hashlock, NULL)){
-    nl_socket_free(ns->nl);
-    return -1;
+  if(nt->irqcount){
+    topology_irq_names(nt);
+    topology_irq_affinities(nt);
   }
-  if(pthread_mutex_init(&ns->txlock, NULL)){
-    pthread_mutex_destroy(&ns->hashlock);
-    nl_socket_free(ns->nl);
-    return -1;
+  int qfd = openat(ndfd, "queues", O_CLOEXEC | O_DIRECTORY | O_RDONLY);
+  close(ndfd);
+  if(qfd >= 0){
+    nt->rxqcount = topology_queue_count(qfd, "rx-");
+    nt->txqcount = topology_queue_count(qfd, "tx-");
   }
-  if(pthread_cond_init(&ns->txcond, NULL)){
-    pthread_mutex_destroy(&ns->txlock);
-    pthread_mutex_destroy(&ns->hashlock);
-    nl_socket_free(ns->nl);
-    return -1;
+  nt->rxqs = topology_queues(qfd, "rx-", "rps_cpus", nt->rxqcount);
+  nt->txqs = topology_queues(qfd, "tx-", "xps_cpus", nt->txqcount);
+  if(qfd >= 0){
+    close(qfd);
   }
-  if(pthread_create(&ns->rxtid, NULL, netstack_rx_thread, ns)){
-    pthread_cond_destroy(&ns->txcond);
-    pthread_mutex_destroy(&ns->txlock);
-    pthread_mutex_destroy(&ns->hashlock);
-    nl_socket_free(ns->nl);
-    return -1;
+  if(nt->rxqs == NULL || nt->txqs == NULL){
+    free_topology(nt);
+    return NULL;
   }
-  if(pthread_create(&ns->txtid, NULL, netstack_tx_thread, ns)){
-    pthread_cancel(ns->rxtid);
-    pthread_join(ns->txtid, NULL);
-    pthread_cond_destroy(&ns->txcond);
-    pthread_mutex_destroy(&ns->txlock);
-    pthread_mutex_destroy(&ns->hashlock);
-    nl_socket_free(ns->nl);
-    return -1;
+  // the first vector claiming a queue wins
+  for(unsigned i = 0 ; i < nt->irqcount ; ++i){
+    bool rx, tx;
+    int q;
+    if(nt->irqs[i].name == NULL || (q = irq_queue(nt->irqs[i].name, ni->name, &rx, &tx)) < 0){
+      continue;
+    }
+    if(rx && (unsigned)q < nt->rxqcount && nt->rxqs[q].irq < 0){
+      nt->rxqs[q].irq = nt->irqs[i].irq;
+    }
+    if(tx && (unsigned)q < nt->txqcount && nt->txqs[q].irq < 0){
+      nt->txqs[q].irq = nt->irqs[i].irq;
+    }
   }
-  if(ns->opts.initial_events == NETSTACK_INITIAL_EVENTS_BLOCK){
-    pthread_mutex_lock(&ns->txlock);
-    while(!ns->clear_to_send || ns->txqueue[ns->dequeueidx] != -1){
-      pthread_cond_wait(&ns->txcond, &ns->txlock);
+  return nt;
+}
+
+static inline topo_entry**
+topo_slot(netstack* ns, int ifindex){
+  return &ns->topo_hash[(unsigned)ifindex % IFACE_HASH_SLOTS];
+}
+
+// The entry caching ifindex's topology, or NULL. Call with topolock held.
+static topo_entry*
+topo_entry_locked(netstack* ns, int ifindex){
+  topo_entry* te;
+  for(te = *topo_slot(ns, ifindex) ; te ; te = te->next){
+    if(te->ifindex == ifindex){
+      return te;
     }
-    pthread_mutex_unlock(&ns->txlock);
   }
-  return 0;
+  return NULL;
 }
 
-netstack* netstack_create(const netstack_opts* nopts){
-  netstack* ns = malloc(sizeof(*ns));
-  if(ns){
-    if(netstack_init(ns, nopts)){
-      free(ns);
+// Cache nt (taking a reference) for ifindex, returning any topology it
+// replaces (whose reference passes to the caller). nt goes uncached if no
+// entry can be allocated. Call with topolock held.
+static netstack_topology*
+topo_swap_locked(netstack* ns, int ifindex, netstack_topology* nt){
+  topo_entry* te = topo_entry_locked(ns, ifindex);
+  if(te == NULL){
+    if((te = malloc(sizeof(*te))) == NULL){
       return NULL;
     }
+    te->ifindex = ifindex;
+    te->topo = NULL;
+    te->next = *topo_slot(ns, ifindex);
+    *topo_slot(ns, ifindex) = te;
   }
-  return ns;
+  netstack_topology* old = te->topo;
+  atomic_fetch_add(&nt->refcount, 1);
+  te->topo = nt;
+  return old;
 }
 
-// Downref all netstack_iface objects remaining in our cache. This might not
-// actually free them all; some might still be shared with the caller.
+// Drop the topology of local link ifindex, which has gone away.
 static void
-destroy_iface_cache(netstack* ns){
-  size_t z;
-  for(z = 0 ; z < sizeof(ns->iface_hash) / sizeof(*ns->iface_hash) ; ++z){
-    netstack_iface* ni = ns->iface_hash[z];
-    while(ni){
-      netstack_iface* tmp = ni->hnext;
-      netstack_iface_destroy(ni);
-      ni = tmp;
+topo_forget(netstack* ns, int ifindex){
+  topo_entry* te = NULL;
+  pthread_mutex_lock(&ns->topolock);
+  topo_entry** prev;
+  for(prev = topo_slot(ns, ifindex) ; *prev ; prev = &(*prev)->next){
+    if((*prev)->ifindex == ifindex){
+      te = *prev;
+      *prev = te->next;
+      break;
     }
   }
+  pthread_mutex_unlock(&ns->topolock);
+  if(te){
+    netstack_topology_abandon(te->topo);
+    free(te);
+  }
 }
 
-int netstack_destroy(netstack* ns){
-  int ret = 0;
-  if(ns){
-    if(pthread_cancel(ns->rxtid) == 0 && pthread_cancel(ns->txtid) == 0){
-      ret |= pthread_join(ns->txtid, NULL);
-      ret |= pthread_join(ns->rxtid, NULL);
-    }else{
-      ret = -1;
+static void
+destroy_topo_cache(netstack* ns){
+  size_t z;
+  for(z = 0 ; z < sizeof(ns->topo_hash) / sizeof(*ns->topo_hash) ; ++z){
+    topo_entry* te;
+    while( (te = ns->topo_hash[z]) ){
+      ns->topo_hash[z] = te->next;
+      netstack_topology_abandon(te->topo);
+      free(te);
     }
-    nl_socket_free(ns->nl);
-    ret |= pthread_cond_destroy(&ns->txcond);
-    ret |= pthread_mutex_destroy(&ns->txlock);
-    ret |= pthread_mutex_destroy(&ns->hashlock);
-    destroy_iface_cache(ns);
-    destroy_name_trie(ns->name_trie);
-    free(ns);
   }
-  return ret;
 }
 
-static netstack_iface*
-netstack_iface_byname(const name_node* array, const char* name){
-  while(array){
-    if(!*name){
-      return array->iface;
-    }
-    array = array->array[*(const unsigned char*)(name++)];
+const netstack_topology* netstack_iface_topology(netstack* ns, const netstack_iface* ni){
+  if(ni->nsid != NETSTACK_NSID_LOCAL){
+    return NULL;
   }
-  return NULL;
+  const int ifindex = ni->ifi.ifi_index;
+  netstack_topology* nt = NULL;
+  pthread_mutex_lock(&ns->topolock);
+  topo_entry* te = topo_entry_locked(ns, ifindex);
+  if(te && (nt = te->topo)){
+    atomic_fetch_add(&nt->refcount, 1);
+  }
+  pthread_mutex_unlock(&ns->topolock);
+  if(nt){
+    return nt;
+  }
+  // build without the lock held; if we lose a race, use the winner's
+  if((nt = build_topology(ni)) == NULL){
+    return NULL;
+  }
+  pthread_mutex_lock(&ns->topolock);
+  te = topo_entry_locked(ns, ifindex);
+  if(te && te->topo){
+    netstack_topology* theirs = te->topo;
+    atomic_fetch_add(&theirs->refcount, 1);
+    pthread_mutex_unlock(&ns->topolock);
+    free_topology(nt);
+    return theirs;
+  }
+  topo_swap_locked(ns, ifindex, nt);
+  pthread_mutex_unlock(&ns->topolock);
+  return nt;
 }
 
-netstack_iface* netstack_iface_copy_byname(netstack* ns, const char* name){
-  netstack_iface* ret;
-  pthread_mutex_lock(&ns->hashlock);
-  netstack_iface* ni = netstack_iface_byname(ns->name_trie, name);
-  if(ni){
-    ret = create_iface(ni->rtabuf, ni->rtabuflen);
-  }else{
-    ret = NULL;
+const netstack_topology* netstack_iface_topology_refresh(netstack* ns, const netstack_iface* ni){
+  netstack_topology* nt = build_topology(ni);
+  if(nt == NULL){
+    return NULL;
   }
-  pthread_mutex_unlock(&ns->hashlock);
-  if(ret){
-    ++ns->lookup_copies;
-  }else{
-    ++ns->lookup_failures;
+  pthread_mutex_lock(&ns->topolock);
+  netstack_topology* old = topo_swap_locked(ns, ni->ifi.ifi_index, nt);
+  pthread_mutex_unlock(&ns->topolock);
+  netstack_topology_abandon(old);
+  return nt;
+}
+
+void netstack_topology_abandon(const netstack_topology* nt){
+  if(nt){
+    netstack_topology* mnt = (netstack_topology*)nt;
+    if(atomic_fetch_sub(&mnt->refcount, 1) == 1){
+      free_topology(mnt);
+    }
   }
-  return ret;
 }
 
-const netstack_iface* netstack_iface_share_byname(netstack* ns, const char* name){
+int netstack_topology_numa_node(const netstack_topology* nt){
+  return nt->numa_node;
+}
+
+unsigned netstack_topology_irqcount(const netstack_topology* nt){
+  return nt->irqcount;
+}
+
+int netstack_topology_irq(const netstack_topology* nt, unsigned n){
+  if(n >= nt->irqcount){
+    return -1;
+  }
+  return nt->irqs[n].irq;
+}
+
+const char* netstack_topology_irq_name(const netstack_topology* nt, unsigned n){
+  if(n >= nt->irqcount){
+    return NULL;
+  }
+  return nt->irqs[n].name;
+}
+
+bool netstack_topology_irq_affinity(const netstack_topology* nt, unsigned n,
+                                    netstack_cpumask* mask){
+  if(n >= nt->irqcount || !nt->irqs[n].has_affinity){
+    return false;
+  }
+  memcpy(mask, &nt->irqs[n].affinity, sizeof(*mask));
+  return true;
+}
+
+unsigned netstack_topology_rxqueues(const netstack_topology* nt){
+  return nt->rxqcount;
+}
+
+unsigned netstack_topology_txqueues(const netstack_topology* nt){
+  return nt->txqcount;
+}
+
+int netstack_topology_rxqueue_irq(const netstack_topology* nt, unsigned q){
+  if(q >= nt->rxqcount){
+    return -1;
+  }
+  return nt->rxqs[q].irq;
+}
+
+int netstack_topology_txqueue_irq(const netstack_topology* nt, unsigned q){
+  if(q >= nt->txqcount){
+    return -1;
+  }
+  return nt->txqs[q].irq;
+}
+
+bool netstack_topology_rps_cpus(const netstack_topology* nt, unsigned q,
+                                netstack_cpumask* mask){
+  if(q >= nt->rxqcount || !nt->rxqs[q].has_cpus){
+    return false;
+  }
+  memcpy(mask, &nt->rxqs[q].cpus, sizeof(*mask));
+  return true;
+}
+
+bool netstack_topology_xps_cpus(const netstack_topology* nt, unsigned q,
+                                netstack_cpumask* mask){
+  if(q >= nt->txqcount || !nt->txqs[q].has_cpus){
+    return false;
+  }
+  memcpy(mask, &nt->txqs[q].cpus, sizeof(*mask));
+  return true;
+}
+
+int netstack_iface_enumerate(const netstack* ns, uint32_t* offsets, int* n,
+                             void* objs, size_t* obytes,
+                             netstack_enumerator* streamer){
+  if(!validate_enumeration_flags(offsets, *n, objs, *obytes, streamer)){
+    return -1;
+  }
+  int copied = 0;
+  uint64_t copied_bytes = 0;
+  netstack* unsafe_ns = (netstack*)ns;
+  unsigned sslot = streamer ? streamer->slot : 0; // FIXME hnext
+  pthread_mutex_lock(&unsafe_ns->hashlock);
+  if(streamer && streamer->nonce && streamer->nonce != ns->nonce){
+    pthread_mutex_unlock(&unsafe_ns->hashlock);
+    return -1;
+  }
+  const size_t tsize = ns->iface_bytes;
+  if(tsize > *obytes && !streamer){ // no streamer means atomic request
+    *obytes = tsize;
+    *n = ns->iface_count;
+    pthread_mutex_unlock(&unsafe_ns->hashlock);
+    return -1;
+  }
+  unsigned z;
+  const netstack_iface* ni;
+  for(z = sslot ; z < sizeof(ns->iface_hash) / sizeof(*ns->iface_hash) ; ++z){
+    ni = ns->iface_hash[z];
+    while(ni){
+      if(copied == *n){
+        goto exhausted;
+      }
+      const size_t nisize = netstack_iface_size(ni);
+      if(*obytes - copied_bytes < nisize){
+        goto exhausted;
+      }
+      offsets[copied] = copied_bytes; // where the new netstack_iface starts
+      netstack_iface* targni = (netstack_iface*)((char*)objs + copied_bytes);
+      memcpy(targni, ni, sizeof(*ni));
+      copied_bytes += sizeof(*ni);
+      targni->hnext = NULL;
+      targni->glink.gprev = targni->glink.gnext = NULL;
+      // These don't need to be freed up -- all the resources have been
+      // provided by the caller. We only free when refs == 1, so init to 0.
+      atomic_init(&targni->refcount, 0);
+      atomic_init(&targni->tlrefs, 0);
+      atomic_init(&targni->irqstate, IRQCACHE_UNKNOWN);
+      targni->rtabuf = (struct rtattr*)((char*)objs + copied_bytes);
+      memcpy(targni->rtabuf, ni->rtabuf, ni->rtabuflen);
+      copied_bytes += ni->rtabuflen;
+      // copied_bytes ought have increased by netstack_iface_size() in total
+      ni = ni->hnext;
+      ++copied;
+    }
+  }
+exhausted:
+  // if we're not yet done, just out of memory, we need to set up streaming.
+  // either way, set our new values.
+  if(z < sizeof(ns->iface_hash) / sizeof(*ns->iface_hash) || ni){
+    *n -= copied;
+    *obytes -= copied_bytes;
+    streamer->nonce = ns->nonce;
+    streamer->slot = z;
+    if(ni){
+      streamer->hnext = (uintptr_t)ni->hnext;
+    }else{
+      streamer->hnext = 0;
+    }
+  }else{
+    *n = 0;
+    *obytes = 0;
+    streamer->nonce = 0;
+    streamer->slot = 0;
+    streamer->hnext = 0;
+  }
+  pthread_mutex_unlock(&unsafe_ns->hashlock);
+  return copied;
+}
+
+#define BLOB_ALIGN(x) (((x) + 3u) & ~(size_t)3u)
+
+// Lay out a netstack_blob over the object's netlink header, attributes, and
+// (1-biased, rtabuf-relative) attribute index.
+static ssize_t
+serialize_obj(netstack_obj_e type, int nsid, uint32_t bflags,
+              const void* msg, size_t msglen,
+              const struct rtattr* rtabuf, size_t rtabuflen,
+              const size_t* rta_index, size_t idxcount,
+              void* buf, size_t len, unsigned flags){
+  if((uintptr_t)buf % 4 || (flags & ~NETSTACK_SERIALIZE_INDEX)){
+    errno = EINVAL;
+    return -1;
+  }
+  if(!(flags & NETSTACK_SERIALIZE_INDEX)){
+    idxcount = 0;
+  }
+  const size_t msgoff = BLOB_ALIGN(sizeof(netstack_blob));
+  const size_t attroff = msgoff + BLOB_ALIGN(msglen);
+  const size_t idxoff = attroff + BLOB_ALIGN(rtabuflen);
+  const size_t total = idxoff + idxcount * sizeof(uint32_t);
+  if(total > len){
+    return total;
+  }
+  char* b = buf;
+  netstack_blob hdr = {
+    .magic = NETSTACK_BLOB_MAGIC,
+    .version = NETSTACK_BLOB_VERSION,
+    .type = type,
+    .len = total,
+    .nsid = nsid,
+    .flags = bflags,
+    .msgoff = msgoff,
+    .msglen = msglen,
+    .attroff = attroff,
+    .attrlen = rtabuflen,
+    .idxoff = idxcount ? idxoff : 0,
+    .idxcount = idxcount,
+  };
+  memset(b, 0, idxoff); // zero the padding, lest we leak it
+  memcpy(b, &hdr, sizeof(hdr));
+  memcpy(b + msgoff, msg, msglen);
+  memcpy(b + attroff, rtabuf, rtabuflen);
+  uint32_t* idx = (uint32_t*)(b + idxoff);
+  size_t z;
+  for(z = 0 ; z < idxcount ; ++z){
+    idx[z] = rta_index[z];
+  }
+  return total;
+}
+
+static inline ssize_t
+iface_serialize(const netstack_iface* ni, uint32_t bflags, void* buf, size_t len, unsigned flags){
+  return serialize_obj(NETSTACK_OBJ_IFACE, ni->nsid, bflags, &ni->ifi, sizeof(ni->ifi),
+                       ni->rtabuf, ni->rtabuflen, ni->rta_index,
+                       sizeof(ni->rta_index) / sizeof(*ni->rta_index), buf, len, flags);
+}
+
+ssize_t netstack_iface_serialize(const netstack_iface* ni, void* buf, size_t len, unsigned flags){
+  return iface_serialize(ni, 0, buf, len, flags);
+}
+
+ssize_t netstack_addr_serialize(const netstack_addr* na, void* buf, size_t len, unsigned flags){
+  return serialize_obj(NETSTACK_OBJ_ADDR, na->nsid, 0, &na->ifa, sizeof(na->ifa),
+                       na->rtabuf, na->rtabuflen, na->rta_index,
+                       sizeof(na->rta_index) / sizeof(*na->rta_index), buf, len, flags);
+}
+
+static inline ssize_t
+route_serialize(const netstack_route* nr, uint32_t bflags, void* buf, size_t len, unsigned flags){
+  return serialize_obj(NETSTACK_OBJ_ROUTE, nr->nsid, bflags, &nr->rt, sizeof(nr->rt),
+                       nr->rtabuf, nr->rtabuflen, nr->rta_index,
+                       sizeof(nr->rta_index) / sizeof(*nr->rta_index), buf, len, flags);
+}
+
+ssize_t netstack_route_serialize(const netstack_route* nr, void* buf, size_t len, unsigned flags){
+  return route_serialize(nr, 0, buf, len, flags);
+}
+
+static inline ssize_t
+neigh_serialize(const netstack_neigh* nn, uint32_t bflags, void* buf, size_t len, unsigned flags){
+  return serialize_obj(NETSTACK_OBJ_NEIGH, nn->nsid, bflags, &nn->nd, sizeof(nn->nd),
+                       nn->rtabuf, nn->rtabuflen, nn->rta_index,
+                       sizeof(nn->rta_index) / sizeof(*nn->rta_index), buf, len, flags);
+}
+
+ssize_t netstack_neigh_serialize(const netstack_neigh* nn, void* buf, size_t len, unsigned flags){
+  return neigh_serialize(nn, 0, buf, len, flags);
+}
+
+ssize_t netstack_rule_serialize(const netstack_rule* nr, void* buf, size_t len, unsigned flags){
+  return serialize_obj(NETSTACK_OBJ_RULE, nr->nsid, 0, &nr->frh, sizeof(nr->frh),
+                       nr->rtabuf, nr->rtabuflen, nr->rta_index,
+                       sizeof(nr->rta_index) / sizeof(*nr->rta_index), buf, len, flags);
+}
+
+static ssize_t
+nexthop_serialize(const netstack_nexthop* nh, uint32_t bflags, void* buf, size_t len, unsigned flags){
+  return serialize_obj(NETSTACK_OBJ_NEXTHOP, nh->nsid, bflags, &nh->nh, sizeof(nh->nh),
+                       nh->rtabuf, nh->rtabuflen, nh->rta_index,
+                       sizeof(nh->rta_index) / sizeof(*nh->rta_index), buf, len, flags);
+}
+
+ssize_t netstack_nexthop_serialize(const netstack_nexthop* nh, void* buf, size_t len, unsigned flags){
+  return nexthop_serialize(nh, 0, buf, len, flags);
+}
+
+static ssize_t
+tc_serialize(const netstack_tc* nt, uint32_t bflags, void* buf, size_t len, unsigned flags){
+  return serialize_obj(NETSTACK_OBJ_TC, nt->nsid, bflags | (nt->isclass ? NETSTACK_BLOB_TCCLASS : 0),
+                       &nt->tcm, sizeof(nt->tcm), nt->rtabuf, nt->rtabuflen, nt->rta_index,
+                       sizeof(nt->rta_index) / sizeof(*nt->rta_index), buf, len, flags);
+}
+
+ssize_t netstack_tc_serialize(const netstack_tc* nt, void* buf, size_t len, unsigned flags){
+  return tc_serialize(nt, 0, buf, len, flags);
+}
+
+// The netlink header each type of object requires, or 0 for unknown types.
+static size_t
+blob_msglen(unsigned type){
+  switch(type){
+    case NETSTACK_OBJ_IFACE: return sizeof(struct ifinfomsg);
+    case NETSTACK_OBJ_ADDR: return sizeof(struct ifaddrmsg);
+    case NETSTACK_OBJ_ROUTE: return sizeof(struct rtmsg);
+    case NETSTACK_OBJ_NEIGH: return sizeof(struct ndmsg);
+    case NETSTACK_OBJ_RULE: return sizeof(struct fib_rule_hdr);
+    case NETSTACK_OBJ_NEXTHOP: return sizeof(struct nhmsg);
+    case NETSTACK_OBJ_TC: return sizeof(struct tcmsg);
+    default: return 0;
+  }
+}
+
+// Is the section [off, off + slen) 4-byte aligned, clear of the header, and
+// within the record?
+static inline bool
+blob_section_ok(size_t off, size_t slen, size_t len){
+  return off % 4 == 0 && off >= sizeof(netstack_blob) && off <= len && slen <= len - off;
+}
+
+// Validate the record at buf, of type (or any type, if 0), setting up v.
+static int
+view_obj(const void* buf, size_t len, unsigned type, netstack_view* v){
+  if(buf == NULL || v == NULL || (uintptr_t)buf % 4 || len < sizeof(netstack_blob)){
+    errno = EINVAL;
+    return -1;
+  }
+  const netstack_blob* hdr = buf;
+  if(hdr->magic != NETSTACK_BLOB_MAGIC || (type && hdr->type != type)){
+    errno = EPROTO;
+    return -1;
+  }
+  if(hdr->version > NETSTACK_BLOB_VERSION){
+    errno = EPROTONOSUPPORT;
+    return -1;
+  }
+  const size_t msglen = blob_msglen(hdr->type);
+  if(msglen == 0){
+    errno = EPROTO;
+    return -1;
+  }
+  if(hdr->len < sizeof(*hdr) || hdr->len > len || hdr->len % 4 || hdr->msglen < msglen ||
+     !blob_section_ok(hdr->msgoff, hdr->msglen, hdr->len) ||
+     !blob_section_ok(hdr->attroff, hdr->attrlen, hdr->len) ||
+     (hdr->idxcount && (!blob_section_ok(hdr->idxoff, 0, hdr->len) ||
+                        hdr->idxcount > (hdr->len - hdr->idxoff) / sizeof(uint32_t)))){
+    errno = EINVAL;
+    return -1;
+  }
+  const char* b = buf;
+  const struct rtattr* attrs = (const struct rtattr*)(b + hdr->attroff);
+  const struct rtattr* rta = attrs;
+  int rlen = hdr->attrlen;
+  while(RTA_OK(rta, rlen)){
+    rta = RTA_NEXT(rta, rlen);
+  }
+  if(rlen){
+    errno = EINVAL;
+    return -1;
+  }
+  const uint32_t* idx = hdr->idxcount ? (const uint32_t*)(b + hdr->idxoff) : NULL;
+  uint32_t z;
+  for(z = 0 ; z < hdr->idxcount ; ++z){
+    if(idx[z] == 0){
+      continue;
+    }
+    // an indexed attribute must lie within the attributes, and be its type
+    const size_t off = idx[z] - 1;
+    if(off % 4 || off + sizeof(struct rtattr) > hdr->attrlen ||
+       ((const struct rtattr*)((const char*)attrs + off))->rta_type != z ||
+       ((const struct rtattr*)((const char*)attrs + off))->rta_len > hdr->attrlen - off ||
+       ((const struct rtattr*)((const char*)attrs + off))->rta_len < sizeof(struct rtattr)){
+      errno = EINVAL;
+      return -1;
+    }
+  }
+  v->type = hdr->type;
+  v->nsid = hdr->nsid;
+  v->flags = hdr->flags;
+  v->msg = b + hdr->msgoff;
+  v->msglen = hdr->msglen;
+  v->attrs = attrs;
+  v->attrlen = hdr->attrlen;
+  v->index = idx;
+  v->idxcount = hdr->idxcount;
+  v->len = hdr->len;
+  return 0;
+}
+
+int netstack_iface_view(const void* buf, size_t len, netstack_view* v){
+  return view_obj(buf, len, NETSTACK_OBJ_IFACE, v);
+}
+
+int netstack_addr_view(const void* buf, size_t len, netstack_view* v){
+  return view_obj(buf, len, NETSTACK_OBJ_ADDR, v);
+}
+
+int netstack_route_view(const void* buf, size_t len, netstack_view* v){
+  return view_obj(buf, len, NETSTACK_OBJ_ROUTE, v);
+}
+
+int netstack_neigh_view(const void* buf, size_t len, netstack_view* v){
+  return view_obj(buf, len, NETSTACK_OBJ_NEIGH, v);
+}
+
+int netstack_rule_view(const void* buf, size_t len, netstack_view* v){
+  return view_obj(buf, len, NETSTACK_OBJ_RULE, v);
+}
+
+int netstack_nexthop_view(const void* buf, size_t len, netstack_view* v){
+  return view_obj(buf, len, NETSTACK_OBJ_NEXTHOP, v);
+}
+
+int netstack_tc_view(const void* buf, size_t len, netstack_view* v){
+  return view_obj(buf, len, NETSTACK_OBJ_TC, v);
+}
+
+int netstack_view_next(const void* buf, size_t len, size_t* off, netstack_view* v){
+  if(off == NULL || *off > len){
+    errno = EINVAL;
+    return -1;
+  }
+  if(*off == len){
+    return 0;
+  }
+  if(view_obj((const char*)buf + *off, len - *off, 0, v)){
+    return -1;
+  }
+  *off += v->len;
+  return 1;
+}
+
+const struct rtattr* netstack_view_attr(const netstack_view* v, int attridx){
+  if(attridx < 0){
+    return NULL;
+  }
+  if(v->index && (unsigned)attridx < v->idxcount){
+    return index_into_rta(v->attrs, v->index[attridx]);
+  }
+  return netstack_extract_rta_attr(v->attrs, v->attrlen, attridx);
+}
+
+// Serialize the object owning a gen_link.
+typedef ssize_t (*gen_serializer)(const gen_link*, uint32_t, void*, size_t, unsigned);
+
+static ssize_t
+iface_link_serialize(const gen_link* gl, uint32_t bflags, void* buf, size_t len, unsigned flags){
+  return iface_serialize(GEN_OWNER(gl, netstack_iface), bflags, buf, len, flags);
+}
+
+static ssize_t
+route_link_serialize(const gen_link* gl, uint32_t bflags, void* buf, size_t len, unsigned flags){
+  return route_serialize(GEN_OWNER(gl, fib_node)->nr, bflags, buf, len, flags);
+}
+
+static ssize_t
+neigh_link_serialize(const gen_link* gl, uint32_t bflags, void* buf, size_t len, unsigned flags){
+  return neigh_serialize(GEN_OWNER(gl, neigh_node)->nn, bflags, buf, len, flags);
+}
+
+static ssize_t
+nh_link_serialize(const gen_link* gl, uint32_t bflags, void* buf, size_t len, unsigned flags){
+  return nexthop_serialize(GEN_OWNER(gl, nh_node)->nh, bflags, buf, len, flags);
+}
+
+static ssize_t
+fdb_link_serialize(const gen_link* gl, uint32_t bflags, void* buf, size_t len, unsigned flags){
+  return neigh_serialize(GEN_OWNER(gl, fdb_node)->nn, bflags, buf, len, flags);
+}
+
+static ssize_t
+tc_link_serialize(const gen_link* gl, uint32_t bflags, void* buf, size_t len, unsigned flags){
+  return tc_serialize(GEN_OWNER(gl, tc_node)->tc, bflags, buf, len, flags);
+}
+
+// Stamp gl with gen, and make it the newest of cl.
+static inline void
+changelog_add(changelog* cl, gen_link* gl, uint64_t gen){
+  gl->gen = gen;
+  gl->gnext = NULL;
+  gl->gprev = cl->newest;
+  if(cl->newest){
+    cl->newest->gnext = gl;
+  }else{
+    cl->oldest = gl;
+  }
+  cl->newest = gl;
+}
+
+static inline void
+changelog_remove(changelog* cl, gen_link* gl){
+  if(gl->gprev){
+    gl->gprev->gnext = gl->gnext;
+  }else{
+    cl->oldest = gl->gnext;
+  }
+  if(gl->gnext){
+    gl->gnext->gprev = gl->gprev;
+  }else{
+    cl->newest = gl->gprev;
+  }
+  gl->gprev = gl->gnext = NULL;
+}
+
+// The idx'th newest tombstone.
+static inline tombstone*
+changelog_tomb(const changelog* cl, unsigned idx){
+  return &cl->tombs[(cl->tombnext + TOMBSTONES - 1 - idx) % TOMBSTONES];
+}
+
+// Remove gl, which is being deleted at gen, from cl, leaving a tombstone.
+static void
+changelog_bury(changelog* cl, gen_link* gl, uint64_t gen, gen_serializer ser){
+  changelog_remove(cl, gl);
+  if(cl->tombs == NULL){
+    cl->horizon = gen;
+    return;
+  }
+  tombstone* t = &cl->tombs[cl->tombnext];
+  if(cl->tombcount == TOMBSTONES){
+    cl->horizon = t->gen;
+    free(t->rec);
+  }else{
+    ++cl->tombcount;
+  }
+  cl->tombnext = (cl->tombnext + 1) % TOMBSTONES;
+  t->gen = gen;
+  ssize_t len = ser(gl, NETSTACK_BLOB_DELETED, NULL, 0, 0);
+  if(len <= 0 || (t->rec = malloc(len)) == NULL){
+    t->rec = NULL;
+    cl->horizon = gen;
+    return;
+  }
+  ser(gl, NETSTACK_BLOB_DELETED, t->rec, len, 0);
+  t->len = len;
+}
+
+static void
+changelog_destroy(changelog* cl){
+  if(cl->tombs){
+    unsigned z;
+    for(z = 0 ; z < cl->tombcount ; ++z){
+      free(changelog_tomb(cl, z)->rec);
+    }
+    free(cl->tombs);
+  }
+}
+
+// Serialize the objects of cl modified since gen, and the tombstones of
+// those deleted since, in order of generation, into buf. The cost is
+// proportional to the changes since gen. Call with cl's lock held.
+static int
+changelog_collect(changelog* cl, uint64_t since, gen_serializer ser,
+                  void* buf, size_t* len, unsigned flags){
+  if(cl->tombs == NULL && (cl->tombs = calloc(TOMBSTONES, sizeof(*cl->tombs))) == NULL){
+    return -1;
+  }
+  // a fresh start needs no tombstones
+  if(since && since < cl->horizon){
+    errno = ESTALE;
+    return -1;
+  }
+  const gen_link* gl = cl->newest;
+  if(gl && gl->gen <= since){
+    gl = NULL;
+  }
+  while(gl && gl->gprev && gl->gprev->gen > since){
+    gl = gl->gprev;
+  }
+  unsigned tn = 0; // tombstones to emit, being the newest
+  while(since && tn < cl->tombcount && changelog_tomb(cl, tn)->gen > since){
+    ++tn;
+  }
+  char* b = buf;
+  size_t used = 0;
+  bool full = false; // once a record doesn't fit, write no more
+  int count = 0;
+  while(gl || tn){
+    ssize_t s;
+    const tombstone* t = tn ? changelog_tomb(cl, tn - 1) : NULL;
+    if(t && (!gl || t->gen < gl->gen)){
+      --tn;
+      if(t->rec == NULL){
+        continue;
+      }
+      s = t->len;
+      if(!full && used + s <= *len){
+        memcpy(b + used, t->rec, s);
+      }
+    }else{
+      s = ser(gl, 0, full ? NULL : b + used, full || used > *len ? 0 : *len - used, flags);
+      if(s < 0){
+        return -1;
+      }
+      gl = gl->gnext;
+    }
+    if(used + s > *len){
+      full = true;
+    }
+    used += s;
+    ++count;
+  }
+  if(full){
+    *len = used;
+    errno = ENOBUFS;
+    return -1;
+  }
+  *len = used;
+  return count;
+}
+
+uint64_t netstack_generation(const netstack* ns){
+  return atomic_load(&ns->generation);
+}
+
+int netstack_iface_enumerate_since(const netstack* ns, uint64_t gen, void* buf,
+                                   size_t* len, unsigned flags, uint64_t* newgen){
+  netstack* unsafe_ns = (netstack*)ns;
+  if(len == NULL || newgen == NULL || (buf == NULL && *len) || (uintptr_t)buf % 4){
+    errno = EINVAL;
+    return -1;
+  }
+  if(ns->opts.iface_notrack){
+    errno = EOPNOTSUPP;
+    return -1;
+  }
+  pthread_mutex_lock(&unsafe_ns->hashlock);
+  int ret = changelog_collect(&unsafe_ns->iface_log, gen, iface_link_serialize, buf, len, flags);
+  *newgen = atomic_load(&ns->generation);
+  pthread_mutex_unlock(&unsafe_ns->hashlock);
+  return ret;
+}
+
+// Collect from cl, one of the changelogs guarded by fiblock, unless notrack.
+static int
+fib_enumerate_since(const netstack* ns, changelog* cl, gen_serializer ser, bool notrack,
+                    uint64_t gen, void* buf, size_t* len, unsigned flags, uint64_t* newgen){
+  netstack* unsafe_ns = (netstack*)ns;
+  if(len == NULL || newgen == NULL || (buf == NULL && *len) || (uintptr_t)buf % 4){
+    errno = EINVAL;
+    return -1;
+  }
+  if(notrack){
+    errno = EOPNOTSUPP;
+    return -1;
+  }
+  pthread_mutex_lock(&unsafe_ns->fiblock);
+  int ret = changelog_collect(cl, gen, ser, buf, len, flags);
+  *newgen = atomic_load(&ns->generation);
+  pthread_mutex_unlock(&unsafe_ns->fiblock);
+  return ret;
+}
+
+int netstack_route_enumerate_since(const netstack* ns, uint64_t gen, void* buf,
+                                   size_t* len, unsigned flags, uint64_t* newgen){
+  return fib_enumerate_since(ns, &((netstack*)ns)->route_log, route_link_serialize,
+                             ns->opts.route_notrack, gen, buf, len, flags, newgen);
+}
+
+int netstack_neigh_enumerate_since(const netstack* ns, uint64_t gen, void* buf,
+                                   size_t* len, unsigned flags, uint64_t* newgen){
+  return fib_enumerate_since(ns, &((netstack*)ns)->neigh_log, neigh_link_serialize,
+                             ns->opts.neigh_notrack, gen, buf, len, flags, newgen);
+}
+
+int netstack_nexthop_enumerate_since(const netstack* ns, uint64_t gen, void* buf,
+                                     size_t* len, unsigned flags, uint64_t* newgen){
+  return fib_enumerate_since(ns, &((netstack*)ns)->nh_log, nh_link_serialize,
+                             ns->opts.nexthop_notrack, gen, buf, len, flags, newgen);
+}
+
+int netstack_fdb_enumerate_since(const netstack* ns, uint64_t gen, void* buf,
+                                 size_t* len, unsigned flags, uint64_t* newgen){
+  return fib_enumerate_since(ns, &((netstack*)ns)->fdb_log, fdb_link_serialize,
+                             ns->opts.fdb_notrack, gen, buf, len, flags, newgen);
+}
+
+int netstack_tc_enumerate_since(const netstack* ns, uint64_t gen, void* buf,
+                                size_t* len, unsigned flags, uint64_t* newgen){
+  return fib_enumerate_since(ns, &((netstack*)ns)->tc_log, tc_link_serialize,
+                             ns->opts.tc_notrack, gen, buf, len, flags, newgen);
+}
+
+static netstack_iface*
+netstack_iface_byname(const name_node* array, const char* name);
+
+// References on ni held by clients, excluding our own and those of lookup
+// caches. The two counts aren't read atomically, so clamp at 0.
+static inline unsigned
+client_shares(const netstack_iface* ni){
+  const int shares = atomic_load(&ni->refcount) - 1 - atomic_load(&ni->tlrefs);
+  return shares > 0 ? shares : 0;
+}
+
+// Drop our reference on any zombies which are no longer shared by anyone else.
+// Nothing can acquire a new reference on a zombie save through an existing
+// one, so seeing a refcount of 1 means we're the last holder. Call with
+// hashlock held.
+static void
+reap_zombies(netstack* ns){
+  netstack_iface** z = &ns->zombies;
+  while(*z){
+    netstack_iface* ni = *z;
+    if(atomic_load(&ni->refcount) == 1){
+      *z = ni->hnext;
+      netstack_iface_destroy(ni);
+    }else{
+      z = &ni->hnext;
+    }
+  }
+}
+
+// An object has left the cache. If clients still hold shares, it becomes a
+// zombie; otherwise, our reference is dropped. Call with hashlock held.
+static void
+retire_iface(netstack* ns, netstack_iface* ni){
+  reap_zombies(ns);
+  if(atomic_load(&ni->refcount) > 1){
+    ni->hnext = ns->zombies;
+    ns->zombies = ni;
+  }else{
+    netstack_iface_destroy(ni);
+  }
+}
+
+// Without the iface cache, no replaced object tells us a link's previous
+// flags. Record ifindex's new flags (or forget it, if del), returning true
+// and its previous flags through prev, if they were known.
+static bool
+link_flags_swap(netstack* ns, int ifindex, unsigned flags, bool del, unsigned* prev){
+  unsigned lo = 0, hi = ns->lflag_count;
+  while(lo < hi){
+    const unsigned mid = lo + (hi - lo) / 2;
+    if(ns->lflags[mid].ifindex < ifindex){
+      lo = mid + 1;
+    }else{
+      hi = mid;
+    }
+  }
+  if(lo < ns->lflag_count && ns->lflags[lo].ifindex == ifindex){
+    *prev = ns->lflags[lo].flags;
+    if(del){
+      memmove(&ns->lflags[lo], &ns->lflags[lo + 1],
+              sizeof(*ns->lflags) * (ns->lflag_count - lo - 1));
+      --ns->lflag_count;
+    }else{
+      ns->lflags[lo].flags = flags;
+    }
+    return true;
+  }
+  if(del){
+    return false;
+  }
+  if(ns->lflag_count == ns->lflag_size){
+    const unsigned nsize = ns->lflag_size ? ns->lflag_size * 2 : 16;
+    link_flags* tmp = realloc(ns->lflags, sizeof(*tmp) * nsize);
+    if(tmp == NULL){
+      return false; // we'll merely miss the next transition
+    }
+    ns->lflags = tmp;
+    ns->lflag_size = nsize;
+  }
+  memmove(&ns->lflags[lo + 1], &ns->lflags[lo],
+          sizeof(*ns->lflags) * (ns->lflag_count - lo));
+  ns->lflags[lo].ifindex = ifindex;
+  ns->lflags[lo].flags = flags;
+  ++ns->lflag_count;
+  return false;
+}
+
+static inline void
+viface_cb(netstack* ns, netstack_event_e etype, void* vni){
+  netstack_iface* ni = vni;
+  decode_iface_hot(ni);
+  // We might be replacing some previous element. If so, that one comes out of
+  // the hash as replaced, and should have its refcount dropped.
+  netstack_iface* replaced = NULL;
+  // Flushes follow only known transitions, so these are false unless we
+  // replace something (or, without the cache, remember the link's flags).
+  bool wasup = false;
+  bool hadcarrier = false;
+  // Does this change which link bears some name?
+  bool renamed = etype == NETSTACK_DEL;
+  const size_t nisize = netstack_iface_size(ni);
+  int hidx = iface_hash(ns, ni->nsid, ni->ifi.ifi_index);
+  // If we're not tracking interfaces, we don't need to manipulate the cache at
+  // all, so skip all of this. We furthermore free the object before return.
+  if(!ns->opts.iface_notrack){
+    pthread_mutex_lock(&ns->hashlock);
+    const uint64_t gen = atomic_fetch_add(&ns->generation, 1) + 1;
+    netstack_iface** tmp = &ns->iface_hash[hidx];
+    name_node** trie = name_trie_for(ns, ni->nsid, etype != NETSTACK_DEL);
+    if(etype != NETSTACK_DEL){ // insert into caches
+      if(trie){
+        name_trie_add(trie, ni);
+      }
+      changelog_add(&ns->iface_log, &ni->glink, gen);
+      ni->hnext = *tmp; // we always insert into the front of hlist
+      *tmp = ni;
+      tmp = &ni->hnext;
+      ++ns->iface_count;
+      ns->iface_bytes += nisize;
+    }
+    while(*tmp){ // need to see if one ought be removed (matches our key)
+      if((*tmp)->ifi.ifi_index == ni->ifi.ifi_index && (*tmp)->nsid == ni->nsid){
+        replaced = *tmp;
+        *tmp = (*tmp)->hnext;
+        break;
+      }
+      tmp = &(*tmp)->hnext;
+    }
+    // The idx-hashed table is authoritative for our counts. If we replaced an
+    // object, it no longer counts. In the case where we retained the name and
+    // idx, we've already replaced the object in the name_trie. If we changed
+    // names (but retained our index), or are deleting, we need remove the old
+    // name, assuming it still refers to the replaced object.
+    if(replaced){
+      wasup = replaced->ifi.ifi_flags & IFF_UP;
+      hadcarrier = replaced->ifi.ifi_flags & (IFF_RUNNING | IFF_LOWER_UP);
+      renamed |= strcmp(ni->name, replaced->name) != 0;
+      --ns->iface_count;
+      ns->iface_bytes -= netstack_iface_size(replaced);
+      if(trie && (etype == NETSTACK_DEL || strcmp(ni->name, replaced->name))){
+        if(netstack_iface_byname(*trie, replaced->name) == replaced){
+          name_trie_purge(trie, replaced->name);
+        }
+      }
+      if(etype == NETSTACK_DEL){
+        changelog_bury(&ns->iface_log, &replaced->glink, gen, iface_link_serialize);
+      }else{
+        changelog_remove(&ns->iface_log, &replaced->glink);
+      }
+      retire_iface(ns, replaced);
+    }else{
+      renamed = true;
+    }
+    atomic_fetch_add_explicit(&ns->iface_gen, 1, memory_order_release);
+    pthread_mutex_unlock(&ns->hashlock);
+    if(renamed && ni->nsid == NETSTACK_NSID_LOCAL){
+      fib_rules_relink(ns, ni->ifi.ifi_index, etype == NETSTACK_DEL ? NULL : ni->name);
+    }
+  }else if(ni->nsid == NETSTACK_NSID_LOCAL){
+    unsigned prev;
+    if(link_flags_swap(ns, ni->ifi.ifi_index, ni->ifi.ifi_flags, etype == NETSTACK_DEL, &prev)){
+      wasup = prev & IFF_UP;
+      hadcarrier = prev & (IFF_RUNNING | IFF_LOWER_UP);
+    }
+  }
+  // ethtool state is keyed by index, and thus survives renames. New links are
+  // queried directly, once the initial ethtool dumps have been completed.
+  if(etype == NETSTACK_DEL && ni->nsid == NETSTACK_NSID_LOCAL){
+    stats_slot_release(ns, ni->ifi.ifi_index);
+  }
+  // The kernel silently flushes IPv4 routes when their link goes down, all
+  // routes and neighbors when it goes away, and nexthops (along with the
+  // IPv4 routes using them) on either, or upon loss of carrier. Bridges do
+  // announce flushing their ports' learned entries in those cases, but a
+  // big flush can overrun us, and these ought not be left behind.
+  if(ni->nsid == NETSTACK_NSID_LOCAL){
+    if(etype == NETSTACK_DEL){
+      fib_purge_link(ns, ni->ifi.ifi_index, PURGE_ROUTES4 | PURGE_ROUTES6 |
+                                            PURGE_NEIGHS | PURGE_NEXTHOPS | PURGE_FDB |
+                                            PURGE_TC);
+      topo_forget(ns, ni->ifi.ifi_index);
+    }else if(wasup && !(ni->ifi.ifi_flags & IFF_UP)){
+      fib_purge_link(ns, ni->ifi.ifi_index, PURGE_ROUTES4 | PURGE_NEXTHOPS | PURGE_FDB_DYN);
+    }else if(hadcarrier && !(ni->ifi.ifi_flags & (IFF_RUNNING | IFF_LOWER_UP))){
+      fib_purge_link(ns, ni->ifi.ifi_index, PURGE_NEXTHOPS | PURGE_FDB_DYN);
+    }
+  }
+  if(ns->ethtool && ni->nsid == NETSTACK_NSID_LOCAL){
+    if(etype == NETSTACK_DEL){
+      ethtool_forget(ns, ni->ifi.ifi_index);
+    }else if(!replaced && ethtool_synced(ns)){
+      ethtool_query(ns, ni->ifi.ifi_index);
+    }
+  }
+  if(ns->opts.iface_cb){
+    ns->opts.iface_cb(ni, etype, ns->opts.iface_curry);
+    atomic_fetch_add(&ns->user_callbacks_total, 1);
+  }
+  if(etype == NETSTACK_DEL || ns->opts.iface_notrack){
+    netstack_iface_destroy(ni);
+  }
+  atomic_fetch_add(&ns->iface_events, 1);
+}
+
+static inline size_t
+family_addrlen(int family){
+  return family == AF_INET ? 4 : family == AF_INET6 ? 16 : 0;
+}
+
+// Copy the first plen bits of the alen-byte addr to out, zeroing the rest.
+static void
+prefix_mask(unsigned char* out, const void* addr, size_t alen, unsigned plen){
+  const unsigned char* a = addr;
+  size_t z;
+  for(z = 0 ; z < alen ; ++z){
+    if(plen >= 8){
+      out[z] = a[z];
+      plen -= 8;
+    }else{
+      out[z] = a[z] & (unsigned char)(0xff00u >> plen);
+      plen = 0;
+    }
+  }
+  for( ; z < 16 ; ++z){
+    out[z] = 0;
+  }
+}
+
+// FNV-1a over the address, seeded by the discriminant (prefix length or
+// ifindex).
+static inline size_t
+fib_hash(const unsigned char* addr, size_t alen, unsigned disc){
+  uint64_t h = 14695981039346656037ull ^ disc;
+  size_t z;
+  for(z = 0 ; z < alen ; ++z){
+    h = (h ^ addr[z]) * 1099511628211ull;
+  }
+  return h ^ (h >> 32);
+}
+
+static inline uint32_t
+route_table_id(const netstack_route* nr){
+  uint32_t table;
+  if(netstack_rtattrcpy_exact(netstack_route_attr(nr, RTA_TABLE), &table, sizeof(table))){
+    return table;
+  }
+  return nr->rt.rtm_table;
+}
+
+// Find the table, creating it if requested. Call with fiblock held.
+static fib_table*
+fib_table_get(netstack* ns, int family, uint32_t id, bool create){
+  fib_table* ft;
+  for(ft = ns->fib_tables ; ft ; ft = ft->next){
+    if(ft->family == family && ft->id == id){
+      return ft;
+    }
+  }
+  if(!create || (ft = malloc(sizeof(*ft))) == NULL){
+    return NULL;
+  }
+  memset(ft, 0, sizeof(*ft));
+  ft->buckets = 64;
+  if((ft->hash = calloc(ft->buckets, sizeof(*ft->hash))) == NULL){
+    free(ft);
+    return NULL;
+  }
+  ft->family = family;
+  ft->id = id;
+  ft->next = ns->fib_tables;
+  ns->fib_tables = ft;
+  return ft;
+}
+
+// Double the buckets once the table's load exceeds 1. Failure to grow only
+// costs us speed.
+static void
+fib_table_grow(fib_table* ft){
+  const size_t alen = family_addrlen(ft->family);
+  size_t nbuckets = ft->buckets * 2;
+  fib_node** nhash = calloc(nbuckets, sizeof(*nhash));
+  if(nhash == NULL){
+    return;
+  }
+  size_t z;
+  for(z = 0 ; z < ft->buckets ; ++z){
+    fib_node* fn;
+    while( (fn = ft->hash[z]) ){
+      ft->hash[z] = fn->hnext;
+      fib_node** b = &nhash[fib_hash(fn->dst, alen, fn->dst_len) & (nbuckets - 1)];
+      fn->hnext = *b;
+      *b = fn;
+    }
+  }
+  free(ft->hash);
+  ft->hash = nhash;
+  ft->buckets = nbuckets;
+}
+
+// Look up the nexthop id, or NULL. Call with fiblock held.
+static nh_node*
+nh_lookup(const netstack* ns, uint32_t id){
+  if(ns->nh_buckets == 0){
+    return NULL;
+  }
+  nh_node* nd;
+  for(nd = ns->nh_hash[id & (ns->nh_buckets - 1)] ; nd ; nd = nd->hnext){
+    if(nd->id == id){
+      break;
+    }
+  }
+  return nd;
+}
+
+static inline uint32_t
+route_nhid(const netstack_route* nr){
+  uint32_t id = 0;
+  netstack_rtattrcpy_exact(netstack_route_attr(nr, RTA_NH_ID), &id, sizeof(id));
+  return id;
+}
+
+static void
+nh_user_push(fib_node** head, fib_node* fn){
+  if( (fn->nhnext = *head) ){
+    fn->nhnext->nhprev = &fn->nhnext;
+  }
+  fn->nhprev = head;
+  *head = fn;
+}
+
+// Chain fn onto the users of its nexthop, or onto the orphans if we don't
+// have it (yet). Call with fiblock held, and nexthops being tracked.
+static void
+nh_user_link(netstack* ns, fib_node* fn){
+  nh_node* nd = nh_lookup(ns, fn->nhid);
+  nh_user_push(nd ? &nd->users : &ns->nh_orphans, fn);
+}
+
+static void
+nh_user_unlink(fib_node* fn){
+  if(fn->nhprev){
+    if( (*fn->nhprev = fn->nhnext) ){
+      fn->nhnext->nhprev = fn->nhprev;
+    }
+    fn->nhprev = NULL;
+  }
+}
+
+// Move the users of one nexthop onto another's chain (replacing it).
+static void
+nh_users_move(nh_node* from, nh_node* to){
+  if( (to->users = from->users) ){
+    to->users->nhprev = &to->users;
+  }
+  from->users = NULL;
+}
+
+// Take fn out of its table, burying it. Call with fiblock held.
+static void
+fib_unlink_locked(netstack* ns, fib_node* fn){
+  fib_table* ft = fn->table;
+  const size_t alen = family_addrlen(ft->family);
+  fib_node** pp = &ft->hash[fib_hash(fn->dst, alen, fn->dst_len) & (ft->buckets - 1)];
+  while(*pp != fn){
+    pp = &(*pp)->hnext;
+  }
+  *pp = fn->hnext;
+  --ft->count;
+  --ft->plens[fn->dst_len];
+  --ns->route_count;
+  nh_user_unlink(fn);
+  changelog_bury(&ns->route_log, &fn->glink,
+                 atomic_fetch_add(&ns->generation, 1) + 1, route_link_serialize);
+}
+
+// The kernel keeps IPv4 routes differing only in their nexthops (those added
+// with `ip route append` or `prepend`) alongside one another, so we key them by
+// their first hop as well. IPv6 siblings are announced as one multipath route.
+static void
+fib_first_hop(const netstack_route* nr, uint32_t nhid, int* oif, unsigned char* gw){
+  *oif = 0;
+  memset(gw, 0, 16);
+  if(nr->rt.rtm_family != AF_INET || nhid){
+    return;
+  }
+  netstack_route_nexthop rnh;
+  size_t iter = 0;
+  if(netstack_route_nexthop_next(nr, &iter, &rnh)){
+    *oif = rnh.oif;
+    memcpy(gw, rnh.gateway, sizeof(rnh.gateway));
+  }
+}
+
+// Take ownership of nr, a route of the local namespace, adding it to (or for
+// NETSTACK_DEL, removing it from) the FIB. A route announced as replacing
+// another replaces the first with its destination, TOS, and priority, unless
+// one with the same first hop is present, as in the kernel.
+static void
+fib_route_update(netstack* ns, netstack_route* nr, netstack_event_e etype){
+  const int family = nr->rt.rtm_family;
+  const size_t alen = family_addrlen(family);
+  if(alen == 0 || nr->rt.rtm_dst_len > alen * 8 || (nr->rt.rtm_flags & RTM_F_CLONED)){
+    free_route(nr);
+    return;
+  }
+  unsigned char dst[16] = {};
+  size_t dlen = alen;
+  const struct rtattr* rta = netstack_route_attr(nr, RTA_DST);
+  if(rta && !netstack_rtattrcpy(rta, dst, &dlen)){
+    free_route(nr);
+    return;
+  }
+  prefix_mask(dst, dst, alen, nr->rt.rtm_dst_len);
+  uint32_t priority = 0;
+  netstack_rtattrcpy_exact(netstack_route_attr(nr, RTA_PRIORITY), &priority, sizeof(priority));
+  const uint32_t id = route_table_id(nr);
+  const uint32_t nhid = route_nhid(nr);
+  int oif;
+  unsigned char gw[16];
+  fib_first_hop(nr, nhid, &oif, gw);
+  fib_node* old = NULL;
+  pthread_mutex_lock(&ns->fiblock);
+  const uint64_t gen = atomic_fetch_add(&ns->generation, 1) + 1;
+  fib_table* ft = fib_table_get(ns, family, id, etype != NETSTACK_DEL);
+  if(ft){
+    fib_node** pp = &ft->hash[fib_hash(dst, alen, nr->rt.rtm_dst_len) & (ft->buckets - 1)];
+    fib_node** first = NULL;
+    for( ; *pp ; pp = &(*pp)->hnext){
+      fib_node* fn = *pp;
+      if(fn->dst_len == nr->rt.rtm_dst_len && fn->tos == nr->rt.rtm_tos &&
+         fn->priority == priority && !memcmp(fn->dst, dst, alen)){
+        if(fn->nhid == nhid && fn->oif == oif && !memcmp(fn->gw, gw, sizeof(gw))){
+          break;
+        }
+        if(first == NULL){
+          first = pp;
+        }
+      }
+    }
+    // A replacement takes the place of the first sibling (absent one with
+    // the same first hop). A new sibling goes after the others if appended,
+    // and otherwise (e.g. with `ip route prepend`) before them. Those we dump
+    // come in order, to be appended.
+    if(*pp == NULL && first && etype != NETSTACK_DEL){
+      if(nr->nlflags & NLM_F_REPLACE){
+        pp = first;
+        old = *pp;
+      }else if((nr->nlflags & NLM_F_CREATE) && !(nr->nlflags & NLM_F_APPEND)){
+        pp = first;
+      }
+    }else{
+      old = *pp;
+    }
+    if(old){
+      *pp = old->hnext;
+      --ft->count;
+      --ft->plens[old->dst_len];
+      --ns->route_count;
+      nh_user_unlink(old);
+      if(etype == NETSTACK_DEL){
+        changelog_bury(&ns->route_log, &old->glink, gen, route_link_serialize);
+      }else{
+        changelog_remove(&ns->route_log, &old->glink);
+      }
+    }
+    fib_node* fn;
+    if(etype != NETSTACK_DEL && (fn = malloc(sizeof(*fn)))){
+      memcpy(fn->dst, dst, sizeof(fn->dst));
+      fn->dst_len = nr->rt.rtm_dst_len;
+      fn->tos = nr->rt.rtm_tos;
+      fn->priority = priority;
+      fn->table = ft;
+      fn->nhid = nhid;
+      fn->oif = oif;
+      memcpy(fn->gw, gw, sizeof(fn->gw));
+      fn->nhprev = NULL;
+      if(fn->nhid && !ns->opts.nexthop_notrack){
+        nh_user_link(ns, fn);
+      }
+      fn->nr = nr;
+      nr = NULL;
+      changelog_add(&ns->route_log, &fn->glink, gen);
+      fn->hnext = *pp;
+      *pp = fn;
+      ++ft->count;
+      ++ft->plens[fn->dst_len];
+      ++ns->route_count;
+      if(ft->count > ft->buckets){
+        fib_table_grow(ft);
+      }
+    }
+  }
+  pthread_mutex_unlock(&ns->fiblock);
+  if(old){
+    free_route(old->nr);
+    free(old);
+  }
+  free_route(nr);
+}
+
+// Nexthops the kernel flags thus aren't used.
+#define RTNH_F_UNUSABLE (RTNH_F_DEAD | RTNH_F_LINKDOWN)
+
+// Find the first usable nexthop of nr, filling in res's oif and gateway (and
+// its type, for blackhole nexthop objects). Routes using nexthop objects go by
+// the cached object, falling back to the compatibility attributes if we
+// haven't got it. Groups resolve to their first usable member still around.
+// Returns false if the route has nexthops, but all of them were flagged
+// RTNH_F_DEAD or RTNH_F_LINKDOWN when last announced. Call with fiblock held.
+static bool
+fib_route_hop(const netstack* ns, const netstack_route* nr, netstack_resolution* res){
+  const uint32_t nhid = route_nhid(nr);
+  const nh_node* nhn = nhid ? nh_lookup(ns, nhid) : NULL;
+  if(nhn && nhn->group){
+    const nh_node* member = NULL;
+    bool any = false;
+    unsigned z;
+    for(z = 0 ; z < nhn->groupcount && member == NULL ; ++z){
+      const nh_node* m = nh_lookup(ns, nhn->group[z].id);
+      if(m){
+        any = true;
+        if(!(m->nh->nh.nh_flags & RTNH_F_UNUSABLE)){
+          member = m;
+        }
+      }
+    }
+    if(any && member == NULL){
+      return false;
+    }
+    nhn = member;
+  }else if(nhn && (nhn->nh->nh.nh_flags & RTNH_F_UNUSABLE)){
+    return false;
+  }
+  if(nhn){
+    if(nhn->blackhole){
+      res->type = RTN_BLACKHOLE;
+      return true;
+    }
+    res->oif = nhn->oif;
+    if( (res->gw_family = nhn->gwfamily) ){
+      res->has_gateway = true;
+      memcpy(res->gateway, nhn->gateway, sizeof(res->gateway));
+    }
+    return true;
+  }
+  netstack_route_nexthop rnh;
+  size_t iter = 0;
+  bool any = false;
+  while(netstack_route_nexthop_next(nr, &iter, &rnh)){
+    if(!(rnh.flags & RTNH_F_UNUSABLE)){
+      res->oif = rnh.oif;
+      if( (res->gw_family = rnh.gw_family) ){
+        res->has_gateway = true;
+        memcpy(res->gateway, rnh.gateway, sizeof(res->gateway));
+      }
+      return true;
+    }
+    any = true;
+  }
+  return !any;
+}
+
+// Longest-prefix match of dst within ft, among routes having a usable nexthop
+// (see fib_route_hop()). Among routes for the best prefix, one with a matching
+// TOS is preferred to a TOS-agnostic one, and then the lowest priority wins,
+// the first of equals. Call with fiblock held.
+static const netstack_route*
+fib_table_lookup(const netstack* ns, const fib_table* ft, const void* dst, unsigned tos){
+  const size_t alen = family_addrlen(ft->family);
+  int plen;
+  for(plen = alen * 8 ; plen >= 0 ; --plen){
+    if(ft->plens[plen] == 0){
+      continue;
+    }
+    unsigned char masked[16];
+    prefix_mask(masked, dst, alen, plen);
+    const fib_node* best = NULL;
+    const fib_node* fn;
+    for(fn = ft->hash[fib_hash(masked, alen, plen) & (ft->buckets - 1)] ; fn ; fn = fn->hnext){
+      if(fn->dst_len != (unsigned)plen || memcmp(fn->dst, masked, alen)){
+        continue;
+      }
+      if(fn->tos && fn->tos != tos){
+        continue;
+      }
+      if(best == NULL || (fn->tos && !best->tos) ||
+         (fn->tos == best->tos && fn->priority < best->priority)){
+        netstack_resolution scratch;
+        if(fib_route_hop(ns, fn->nr, &scratch)){
+          best = fn;
+        }
+      }
+    }
+    if(best){
+      return best->nr;
+    }
+  }
+  return NULL;
+}
+
+// Does nr go out only through ifindex?
+static bool
+route_only_via(const netstack_route* nr, int ifindex){
+  uint32_t oif;
+  if(netstack_rtattrcpy_exact(netstack_route_attr(nr, RTA_OIF), &oif, sizeof(oif))){
+    return (int)oif == ifindex;
+  }
+  const struct rtattr* mp = netstack_route_attr(nr, RTA_MULTIPATH);
+  if(mp == NULL){
+    return false;
+  }
+  const struct rtnexthop* rtnh = RTA_DATA(mp);
+  int len = RTA_PAYLOAD(mp);
+  bool any = false;
+  // RTNH_OK() reads rtnh_len before checking that there's room for it
+  while(len >= (int)sizeof(*rtnh) && RTNH_OK(rtnh, len)){
+    if(rtnh->rtnh_ifindex != ifindex){
+      return false;
+    }
+    any = true;
+    len -= NLMSG_ALIGN(rtnh->rtnh_len);
+    rtnh = RTNH_NEXT(rtnh);
+  }
+  return any;
+}
+
+static inline size_t
+fdb_hash(int master, uint16_t vlan, const unsigned char* mac){
+  unsigned char key[ETH_ALEN + sizeof(vlan)];
+  memcpy(key, mac, ETH_ALEN);
+  memcpy(key + ETH_ALEN, &vlan, sizeof(vlan));
+  return fib_hash(key, sizeof(key), master);
+}
+
+// Find the FDB entry's slot. Call with fiblock held, and fdb_buckets
+// non-zero.
+static fdb_node**
+fdb_find(const netstack* ns, int master, uint16_t vlan, const unsigned char* mac){
+  fdb_node** pp = &ns->fdb_hash[fdb_hash(master, vlan, mac) & (ns->fdb_buckets - 1)];
+  for( ; *pp ; pp = &(*pp)->hnext){
+    const fdb_node* fd = *pp;
+    if(fd->master == master && fd->vlan == vlan && !memcmp(fd->mac, mac, ETH_ALEN)){
+      break;
+    }
+  }
+  return pp;
+}
+
+// Index of the first entry of fdb_ports having at least ifindex.
+static unsigned
+fdb_port_find(const netstack* ns, int ifindex){
+  unsigned lo = 0, hi = ns->fdb_portcount;
+  while(lo < hi){
+    unsigned mid = lo + (hi - lo) / 2;
+    if(ns->fdb_ports[mid].ifindex < ifindex){
+      lo = mid + 1;
+    }else{
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+static unsigned
+fdb_port_entries(const netstack* ns, int ifindex){
+  unsigned z = fdb_port_find(ns, ifindex);
+  if(z < ns->fdb_portcount && ns->fdb_ports[z].ifindex == ifindex){
+    return ns->fdb_ports[z].count;
+  }
+  return 0;
+}
+
+static inline int
+fdb_chain_key(const fdb_node* fd, int chain){
+  return chain == FDB_BY_PORT ? fd->port : fd->master;
+}
+
+// The fdb_port of ifindex, created (empty) if necessary and create is set.
+// Pointers into fdb_ports are invalidated by adding or dropping ports. Call
+// with fiblock held.
+static fdb_port*
+fdb_port_get(netstack* ns, int ifindex, bool create){
+  unsigned z = fdb_port_find(ns, ifindex);
+  if(z < ns->fdb_portcount && ns->fdb_ports[z].ifindex == ifindex){
+    return &ns->fdb_ports[z];
+  }
+  if(!create){
+    return NULL;
+  }
+  if(ns->fdb_portcount == ns->fdb_portsize){
+    unsigned nsize = ns->fdb_portsize ? ns->fdb_portsize * 2 : 16;
+    fdb_port* tmp = realloc(ns->fdb_ports, sizeof(*tmp) * nsize);
+    if(tmp == NULL){
+      return NULL;
+    }
+    ns->fdb_ports = tmp;
+    ns->fdb_portsize = nsize;
+  }
+  memmove(&ns->fdb_ports[z + 1], &ns->fdb_ports[z],
+          sizeof(*ns->fdb_ports) * (ns->fdb_portcount - z));
+  ++ns->fdb_portcount;
+  memset(&ns->fdb_ports[z], 0, sizeof(ns->fdb_ports[z]));
+  ns->fdb_ports[z].ifindex = ifindex;
+  return &ns->fdb_ports[z];
+}
+
+// Drop the fdb_port of ifindex if it no longer has any entries. Call with
+// fiblock held.
+static void
+fdb_port_reap(netstack* ns, int ifindex){
+  unsigned z = fdb_port_find(ns, ifindex);
+  if(z < ns->fdb_portcount && ns->fdb_ports[z].ifindex == ifindex){
+    const fdb_port* fp = &ns->fdb_ports[z];
+    if(fp->chains[FDB_BY_PORT] == NULL && fp->chains[FDB_BY_MASTER] == NULL){
+      memmove(&ns->fdb_ports[z], &ns->fdb_ports[z + 1],
+              sizeof(*ns->fdb_ports) * (ns->fdb_portcount - z - 1));
+      --ns->fdb_portcount;
+    }
+  }
+}
+
+static void
+fdb_chain_unlink(netstack* ns, fdb_node* fd, int chain){
+  if(fd->cprev[chain]){
+    fd->cprev[chain]->cnext[chain] = fd->cnext[chain];
+  }else{
+    fdb_port_get(ns, fdb_chain_key(fd, chain), false)->chains[chain] = fd->cnext[chain];
+  }
+  if(fd->cnext[chain]){
+    fd->cnext[chain]->cprev[chain] = fd->cprev[chain];
+  }
+  if(chain == FDB_BY_PORT){
+    --fdb_port_get(ns, fd->port, false)->count;
+  }
+}
+
+// Put fd on the chains of its port and master, failing (with fd on neither)
+// if their fdb_ports can't be allocated. Call with fiblock held.
+static int
+fdb_chains_link(netstack* ns, fdb_node* fd){
+  int chain;
+  for(chain = 0 ; chain < FDB_CHAINS ; ++chain){
+    fdb_port* fp = fdb_port_get(ns, fdb_chain_key(fd, chain), true);
+    if(fp == NULL){
+      while(chain--){
+        fdb_chain_unlink(ns, fd, chain);
+        fdb_port_reap(ns, fdb_chain_key(fd, chain));
+      }
+      return -1;
+    }
+    fd->cprev[chain] = NULL;
+    if( (fd->cnext[chain] = fp->chains[chain]) ){
+      fd->cnext[chain]->cprev[chain] = fd;
+    }
+    fp->chains[chain] = fd;
+    if(chain == FDB_BY_PORT){
+      ++fp->count;
+    }
+  }
+  return 0;
+}
+
+// Take fd off its port's and master's chains, dropping either fdb_port
+// left without entries. Call with fiblock held.
+static void
+fdb_chains_unlink(netstack* ns, fdb_node* fd){
+  int chain;
+  for(chain = 0 ; chain < FDB_CHAINS ; ++chain){
+    fdb_chain_unlink(ns, fd, chain);
+  }
+  fdb_port_reap(ns, fd->port);
+  fdb_port_reap(ns, fd->master);
+}
+
+// Take fd out of the cache, burying it in the changelog, and chain it onto
+// *fdbs. Call with fiblock held.
+static void
+fdb_purge_entry(netstack* ns, fdb_node* fd, fdb_node** fdbs){
+  fdb_node** pp = fdb_find(ns, fd->master, fd->vlan, fd->mac);
+  *pp = fd->hnext;
+  --ns->fdb_count;
+  fdb_chains_unlink(ns, fd);
+  changelog_bury(&ns->fdb_log, &fd->glink,
+                 atomic_fetch_add(&ns->generation, 1) + 1, fdb_link_serialize);
+  fd->hnext = *fdbs;
+  *fdbs = fd;
+}
+
+// Take the FDB entries on ifindex (and with PURGE_FDB, those of ifindex as
+// a bridge) out of the cache, chaining them onto *fdbs. With only
+// PURGE_FDB_DYN, just those the bridge itself would flush from a port going
+// down: the ones it learned, rather than those added or externally learned.
+// Only ifindex's own chains are walked. Call with fiblock held.
+static void
+fdb_purge_locked(netstack* ns, int ifindex, unsigned what, fdb_node** fdbs){
+  const fdb_port* fp = fdb_port_get(ns, ifindex, false);
+  if(fp == NULL){
+    return;
+  }
+  fdb_node* fd = fp->chains[FDB_BY_PORT];
+  while(fd){
+    fdb_node* next = fd->cnext[FDB_BY_PORT];
+    if((what & PURGE_FDB) ||
+       (fd->bridged && (fd->nn->nd.ndm_state & (NUD_REACHABLE | NUD_STALE)) &&
+        !(fd->nn->nd.ndm_flags & NTF_EXT_LEARNED))){
+      fdb_purge_entry(ns, fd, fdbs);
+    }
+    fd = next;
+  }
+  if(!(what & PURGE_FDB)){
+    return;
+  }
+  // the port's entries are gone, and with them perhaps its fdb_port
+  if( (fp = fdb_port_get(ns, ifindex, false)) ){
+    while( (fd = fp->chains[FDB_BY_MASTER]) ){
+      fdb_purge_entry(ns, fd, fdbs);
+      if((fp = fdb_port_get(ns, ifindex, false)) == NULL){
+        break;
+      }
+    }
+  }
+}
+
+static inline size_t
+tc_hash(bool isclass, int ifindex, uint32_t key){
+  unsigned char k[sizeof(key) + 1];
+  memcpy(k, &key, sizeof(key));
+  k[sizeof(key)] = isclass;
+  return fib_hash(k, sizeof(k), ifindex);
+}
+
+// Find the qdisc's (class's) slot. Call with fiblock held, and tc_buckets
+// non-zero.
+static tc_node**
+tc_find(const netstack* ns, bool isclass, int ifindex, uint32_t key){
+  tc_node** pp = &ns->tc_hash[tc_hash(isclass, ifindex, key) & (ns->tc_buckets - 1)];
+  for( ; *pp ; pp = &(*pp)->hnext){
+    const tc_node* tn = *pp;
+    if(tn->key == key && tn->ifindex == ifindex && tn->isclass == isclass){
+      break;
+    }
+  }
+  return pp;
+}
+
+// Take the nodes satisfying pred out of the tc cache, chaining them onto
+// *tcs. Call with fiblock held.
+static void
+tc_purge_locked(netstack* ns, tc_node** tcs,
+                bool (*pred)(const tc_node*, int, uint32_t), int ifindex, uint32_t major){
+  size_t z;
+  for(z = 0 ; z < ns->tc_buckets ; ++z){
+    tc_node** pp = &ns->tc_hash[z];
+    while(*pp){
+      tc_node* tn = *pp;
+      if(pred(tn, ifindex, major)){
+        *pp = tn->hnext;
+        --ns->tc_count;
+        changelog_bury(&ns->tc_log, &tn->glink,
+                       atomic_fetch_add(&ns->generation, 1) + 1, tc_link_serialize);
+        tn->hnext = *tcs;
+        *tcs = tn;
+      }else{
+        pp = &tn->hnext;
+      }
+    }
+  }
+}
+
+static bool
+tc_on(const tc_node* tn, int ifindex, uint32_t major){
+  (void)major;
+  return tn->ifindex == ifindex;
+}
+
+// Is tn a class of the qdisc major, or a qdisc attached to one of them? The
+// root and ingress attachment points share the ingress qdisc's major.
+static bool
+tc_beneath(const tc_node* tn, int ifindex, uint32_t major){
+  if(tn->ifindex != ifindex){
+    return false;
+  }
+  if(tn->isclass){
+    return TC_H_MAJ(tn->handle) == major;
+  }
+  return TC_H_MAJ(tn->parent) == major && tn->parent != TC_H_ROOT &&
+         tn->parent != TC_H_INGRESS;
+}
+
+// The kernel destroys a qdisc's classes, and the qdiscs attached to them,
+// along with it, announcing only the deletion of the qdisc itself. Take
+// them (and theirs, in turn) out of the cache, chaining them onto *tcs.
+// Call with fiblock held.
+static void
+tc_purge_beneath_locked(netstack* ns, int ifindex, uint32_t major, tc_node** tcs){
+  tc_node* purged = NULL;
+  tc_purge_locked(ns, &purged, tc_beneath, ifindex, major);
+  while(purged){
+    tc_node* tn = purged;
+    purged = tn->hnext;
+    tn->hnext = *tcs;
+    *tcs = tn;
+    if(!tn->isclass && TC_H_MAJ(tn->handle) != major){
+      tc_purge_beneath_locked(ns, ifindex, TC_H_MAJ(tn->handle), tcs);
+    }
+  }
+}
+
+static void
+free_tc_list(tc_node* tcs){
+  while(tcs){
+    tc_node* tn = tcs;
+    tcs = tn->hnext;
+    free_tc(tn->tc);
+    free(tn);
+  }
+}
+
+// Does the nexthop group nd have any members left? The kernel drops members
+// flushed along with their links without telling us. Call with fiblock held.
+static bool
+nh_group_live(const netstack* ns, const nh_node* nd){
+  unsigned z;
+  for(z = 0 ; z < nd->groupcount ; ++z){
+    if(nh_lookup(ns, nd->group[z].id)){
+      return true;
+    }
+  }
+  return false;
+}
+
+// Take the routes using the purged nexthops nhs (along with any orphans) out
+// of the FIB, chaining them onto *routes. Call with fiblock held.
+static void
+nh_purge_routes_locked(netstack* ns, nh_node* nhs, fib_node** routes){
+  fib_node* fn;
+  for( ; nhs ; nhs = nhs->hnext){
+    while( (fn = nhs->users) ){
+      fib_unlink_locked(ns, fn);
+      fn->hnext = *routes;
+      *routes = fn;
+    }
+  }
+  while( (fn = ns->nh_orphans) ){
+    fib_unlink_locked(ns, fn);
+    fn->hnext = *routes;
+    *routes = fn;
+  }
+}
+
+// Take the nexthops matching pred out of the cache, chaining them onto *nhs.
+// Call with fiblock held.
+static void
+nh_purge_locked(netstack* ns, nh_node** nhs,
+                bool (*pred)(const netstack*, const nh_node*, int), int ifindex){
+  size_t z;
+  for(z = 0 ; z < ns->nh_buckets ; ++z){
+    nh_node** pp = &ns->nh_hash[z];
+    while(*pp){
+      nh_node* nd = *pp;
+      if(pred(ns, nd, ifindex)){
+        *pp = nd->hnext;
+        --ns->nh_count;
+        changelog_bury(&ns->nh_log, &nd->glink,
+                       atomic_fetch_add(&ns->generation, 1) + 1, nh_link_serialize);
+        nd->hnext = *nhs;
+        *nhs = nd;
+      }else{
+        pp = &nd->hnext;
+      }
+    }
+  }
+}
+
+static bool
+nh_via(const netstack* ns, const nh_node* nd, int ifindex){
+  (void)ns;
+  return nd->oif == ifindex;
+}
+
+static bool
+nh_group_dead(const netstack* ns, const nh_node* nd, int ifindex){
+  (void)ifindex;
+  return nd->group && !nh_group_live(ns, nd);
+}
+
+static void
+free_fib_lists(fib_node* routes, neigh_node* neighs, nh_node* nhs, fdb_node* fdbs){
+  while(routes){
+    fib_node* fn = routes;
+    routes = fn->hnext;
+    free_route(fn->nr);
+    free(fn);
+  }
+  while(neighs){
+    neigh_node* nd = neighs;
+    neighs = nd->hnext;
+    free_neigh(nd->nn);
+    free(nd);
+  }
+  while(nhs){
+    nh_node* nd = nhs;
+    nhs = nd->hnext;
+    free_nexthop(nd->nh);
+    free(nd);
+  }
+  while(fdbs){
+    fdb_node* fd = fdbs;
+    fdbs = fd->hnext;
+    free_neigh(fd->nn);
+    free(fd);
+  }
+}
+
+// Drop from the caches what the kernel flushes without telling us when
+// ifindex goes down or away (see PURGE_*). Nexthop groups left without
+// members go too, as do the routes using any purged nexthop.
+static void
+fib_purge_link(netstack* ns, int ifindex, unsigned what){
+  fib_node* routes = NULL;
+  neigh_node* neighs = NULL;
+  nh_node* nhs = NULL;
+  fdb_node* fdbs = NULL;
+  tc_node* tcs = NULL;
+  pthread_mutex_lock(&ns->fiblock);
+  if(what & (PURGE_FDB | PURGE_FDB_DYN)){
+    fdb_purge_locked(ns, ifindex, what, &fdbs);
+  }
+  if(what & PURGE_TC){
+    tc_purge_locked(ns, &tcs, tc_on, ifindex, 0);
+  }
+  if(what & PURGE_NEXTHOPS){
+    nh_purge_locked(ns, &nhs, nh_via, ifindex);
+    if(nhs){
+      nh_purge_locked(ns, &nhs, nh_group_dead, ifindex);
+      nh_purge_routes_locked(ns, nhs, &routes);
+    }
+  }
+  fib_table* ft;
+  for(ft = ns->fib_tables ; ft ; ft = ft->next){
+    if(!(what & (ft->family == AF_INET ? PURGE_ROUTES4 : PURGE_ROUTES6))){
+      continue;
+    }
+    size_t z;
+    for(z = 0 ; z < ft->buckets ; ++z){
+      fib_node** pp = &ft->hash[z];
+      while(*pp){
+        fib_node* fn = *pp;
+        if(route_only_via(fn->nr, ifindex)){
+          *pp = fn->hnext;
+          --ft->count;
+          --ft->plens[fn->dst_len];
+          --ns->route_count;
+          nh_user_unlink(fn);
+          changelog_bury(&ns->route_log, &fn->glink,
+                         atomic_fetch_add(&ns->generation, 1) + 1, route_link_serialize);
+          fn->hnext = routes;
+          routes = fn;
+        }else{
+          pp = &fn->hnext;
+        }
+      }
+    }
+  }
+  size_t z;
+  for(z = 0 ; (what & PURGE_NEIGHS) && z < ns->neigh_buckets ; ++z){
+    neigh_node** pp = &ns->neigh_hash[z];
+    while(*pp){
+      neigh_node* nd = *pp;
+      if(nd->ifindex == ifindex){
+        *pp = nd->hnext;
+        --ns->neigh_count;
+        changelog_bury(&ns->neigh_log, &nd->glink,
+                       atomic_fetch_add(&ns->generation, 1) + 1, neigh_link_serialize);
+        nd->hnext = neighs;
+        neighs = nd;
+      }else{
+        pp = &nd->hnext;
+      }
+    }
+  }
+  pthread_mutex_unlock(&ns->fiblock);
+  free_fib_lists(routes, neighs, nhs, fdbs);
+  free_tc_list(tcs);
+}
+
+static void
+destroy_fib(netstack* ns){
+  fib_table* ft;
+  while( (ft = ns->fib_tables) ){
+    ns->fib_tables = ft->next;
+    size_t z;
+    for(z = 0 ; z < ft->buckets ; ++z){
+      fib_node* fn;
+      while( (fn = ft->hash[z]) ){
+        ft->hash[z] = fn->hnext;
+        free_route(fn->nr);
+        free(fn);
+      }
+    }
+    free(ft->hash);
+    free(ft);
+  }
+  size_t z;
+  for(z = 0 ; z < ns->neigh_buckets ; ++z){
+    neigh_node* nd;
+    while( (nd = ns->neigh_hash[z]) ){
+      ns->neigh_hash[z] = nd->hnext;
+      free_neigh(nd->nn);
+      free(nd);
+    }
+  }
+  free(ns->neigh_hash);
+  changelog_destroy(&ns->route_log);
+  changelog_destroy(&ns->neigh_log);
+  changelog_destroy(&ns->nh_log);
+  changelog_destroy(&ns->fdb_log);
+  changelog_destroy(&ns->tc_log);
+  unsigned r;
+  for(r = 0 ; r < ns->rules4.count ; ++r){
+    free_rule(ns->rules4.rules[r].nr);
+  }
+  free(ns->rules4.rules);
+  free(ns->rules4.general);
+  free(ns->rules4.marked);
+  for(r = 0 ; r < ns->rules6.count ; ++r){
+    free_rule(ns->rules6.rules[r].nr);
+  }
+  free(ns->rules6.rules);
+  free(ns->rules6.general);
+  free(ns->rules6.marked);
+  for(z = 0 ; z < ns->nh_buckets ; ++z){
+    nh_node* nd;
+    while( (nd = ns->nh_hash[z]) ){
+      ns->nh_hash[z] = nd->hnext;
+      free_nexthop(nd->nh);
+      free(nd);
+    }
+  }
+  free(ns->nh_hash);
+  for(z = 0 ; z < ns->fdb_buckets ; ++z){
+    fdb_node* fd;
+    while( (fd = ns->fdb_hash[z]) ){
+      ns->fdb_hash[z] = fd->hnext;
+      free_neigh(fd->nn);
+      free(fd);
+    }
+  }
+  free(ns->fdb_hash);
+  free(ns->fdb_ports);
+  for(z = 0 ; z < ns->tc_buckets ; ++z){
+    free_tc_list(ns->tc_hash[z]);
+  }
+  free(ns->tc_hash);
+}
+
+static inline size_t
+neigh_bucket(const netstack* ns, int ifindex, const unsigned char* dst, size_t alen){
+  return fib_hash(dst, alen, ifindex) & (ns->neigh_buckets - 1);
+}
+
+// Double the neighbor buckets (from nothing, to start). Call with fiblock held.
+static void
+neigh_hash_grow(netstack* ns){
+  size_t nbuckets = ns->neigh_buckets ? ns->neigh_buckets * 2 : 256;
+  neigh_node** nhash = calloc(nbuckets, sizeof(*nhash));
+  if(nhash == NULL){
+    return;
+  }
+  size_t z;
+  for(z = 0 ; z < ns->neigh_buckets ; ++z){
+    neigh_node* nd;
+    while( (nd = ns->neigh_hash[z]) ){
+      ns->neigh_hash[z] = nd->hnext;
+      neigh_node** b = &nhash[fib_hash(nd->dst, family_addrlen(nd->family), nd->ifindex)
+                               & (nbuckets - 1)];
+      nd->hnext = *b;
+      *b = nd;
+    }
+  }
+  free(ns->neigh_hash);
+  ns->neigh_hash = nhash;
+  ns->neigh_buckets = nbuckets;
+}
+
+// Find the neighbor's slot. Call with fiblock held, and neigh_buckets
+// non-zero.
+static neigh_node**
+neigh_find(netstack* ns, int family, int ifindex, const unsigned char* dst){
+  const size_t alen = family_addrlen(family);
+  neigh_node** pp = &ns->neigh_hash[neigh_bucket(ns, ifindex, dst, alen)];
+  for( ; *pp ; pp = &(*pp)->hnext){
+    const neigh_node* nd = *pp;
+    if(nd->family == family && nd->ifindex == ifindex && !memcmp(nd->dst, dst, alen)){
+      break;
+    }
+  }
+  return pp;
+}
+
+// Take ownership of nn, an IPv4 or IPv6 neighbor of the local namespace,
+// adding it to (or for NETSTACK_DEL, removing it from) the neighbor cache.
+// Proxy entries aren't neighbors, and are ignored.
+static void
+fib_neigh_update(netstack* ns, netstack_neigh* nn, netstack_event_e etype){
+  const int family = nn->nd.ndm_family;
+  const size_t alen = family_addrlen(family);
+  unsigned char dst[16] = {};
+  if(alen == 0 || (nn->nd.ndm_flags & NTF_PROXY) ||
+     !netstack_rtattrcpy_exact(netstack_neigh_attr(nn, NDA_DST), dst, alen)){
+    free_neigh(nn);
+    return;
+  }
+  neigh_node* old = NULL;
+  pthread_mutex_lock(&ns->fiblock);
+  const uint64_t gen = atomic_fetch_add(&ns->generation, 1) + 1;
+  if(ns->neigh_buckets == 0){
+    neigh_hash_grow(ns);
+  }
+  if(ns->neigh_buckets){
+    neigh_node** pp = neigh_find(ns, family, nn->nd.ndm_ifindex, dst);
+    if( (old = *pp) ){
+      *pp = old->hnext;
+      --ns->neigh_count;
+      if(etype == NETSTACK_DEL){
+        changelog_bury(&ns->neigh_log, &old->glink, gen, neigh_link_serialize);
+      }else{
+        changelog_remove(&ns->neigh_log, &old->glink);
+      }
+    }
+    neigh_node* nd;
+    if(etype != NETSTACK_DEL && (nd = malloc(sizeof(*nd)))){
+      nd->family = family;
+      nd->ifindex = nn->nd.ndm_ifindex;
+      memcpy(nd->dst, dst, sizeof(nd->dst));
+      nd->nn = nn;
+      nn = NULL;
+      changelog_add(&ns->neigh_log, &nd->glink, gen);
+      nd->hnext = *pp;
+      *pp = nd;
+      if(++ns->neigh_count > ns->neigh_buckets){
+        neigh_hash_grow(ns);
+      }
+    }
+  }
+  pthread_mutex_unlock(&ns->fiblock);
+  if(old){
+    free_neigh(old->nn);
+    free(old);
+  }
+  free_neigh(nn);
+}
+
+// Double the FDB buckets (from nothing, to start). Call with fiblock held.
+static void
+fdb_hash_grow(netstack* ns){
+  size_t nbuckets = ns->fdb_buckets ? ns->fdb_buckets * 2 : 256;
+  fdb_node** nhash = calloc(nbuckets, sizeof(*nhash));
+  if(nhash == NULL){
+    return;
+  }
+  size_t z;
+  for(z = 0 ; z < ns->fdb_buckets ; ++z){
+    fdb_node* fd;
+    while( (fd = ns->fdb_hash[z]) ){
+      ns->fdb_hash[z] = fd->hnext;
+      fdb_node** b = &nhash[fdb_hash(fd->master, fd->vlan, fd->mac) & (nbuckets - 1)];
+      fd->hnext = *b;
+      *b = fd;
+    }
+  }
+  free(ns->fdb_hash);
+  ns->fdb_hash = nhash;
+  ns->fdb_buckets = nbuckets;
+}
+
+// Take ownership of nn, an AF_BRIDGE neighbor of the local namespace, adding
+// it to (or for NETSTACK_DEL, removing it from) the FDB cache. Entries of a
+// bridge carry NDA_MASTER; the rest (e.g. a VXLAN device's remotes) belong
+// to their device alone. Entries without an Ethernet address are ignored.
+static void
+fib_fdb_update(netstack* ns, netstack_neigh* nn, netstack_event_e etype){
+  unsigned char mac[ETH_ALEN];
+  if(!netstack_rtattrcpy_exact(netstack_neigh_attr(nn, NDA_LLADDR), mac, sizeof(mac))){
+    free_neigh(nn);
+    return;
+  }
+  uint16_t vlan = 0;
+  netstack_rtattrcpy_exact(netstack_neigh_attr(nn, NDA_VLAN), &vlan, sizeof(vlan));
+  uint32_t master;
+  const bool bridged = netstack_rtattrcpy_exact(netstack_neigh_attr(nn, NDA_MASTER),
+                                                &master, sizeof(master));
+  if(!bridged){
+    master = nn->nd.ndm_ifindex;
+  }
+  fdb_node* old = NULL;
+  pthread_mutex_lock(&ns->fiblock);
+  const uint64_t gen = atomic_fetch_add(&ns->generation, 1) + 1;
+  if(ns->fdb_buckets == 0){
+    fdb_hash_grow(ns);
+  }
+  if(ns->fdb_buckets){
+    fdb_node** pp = fdb_find(ns, master, vlan, mac);
+    if( (old = *pp) ){
+      *pp = old->hnext;
+      --ns->fdb_count;
+      fdb_chains_unlink(ns, old);
+      if(etype == NETSTACK_DEL){
+        changelog_bury(&ns->fdb_log, &old->glink, gen, fdb_link_serialize);
+      }else{
+        changelog_remove(&ns->fdb_log, &old->glink);
+      }
+    }
+    fdb_node* fd;
+    if(etype != NETSTACK_DEL && (fd = malloc(sizeof(*fd)))){
+      fd->master = master;
+      fd->port = nn->nd.ndm_ifindex;
+      fd->vlan = vlan;
+      fd->bridged = bridged;
+      memcpy(fd->mac, mac, sizeof(fd->mac));
+      if(fdb_chains_link(ns, fd)){
+        free(fd);
+      }else{
+        fd->nn = nn;
+        nn = NULL;
+        changelog_add(&ns->fdb_log, &fd->glink, gen);
+        fd->hnext = *pp;
+        *pp = fd;
+        if(++ns->fdb_count > ns->fdb_buckets){
+          fdb_hash_grow(ns);
+        }
+      }
+    }
+  }
+  pthread_mutex_unlock(&ns->fiblock);
+  if(old){
+    free_neigh(old->nn);
+    free(old);
+  }
+  free_neigh(nn);
+}
+
+// Copy the interface name attribute attr of nr into name (IFNAMSIZ bytes),
+// or make it empty if there is no such (valid) attribute.
+static void
+rule_ifname(const netstack_rule* nr, int attr, char* name){
+  const struct rtattr* rta = netstack_rule_attr(nr, attr);
+  name[0] = '\0';
+  if(rta && RTA_PAYLOAD(rta) && RTA_PAYLOAD(rta) <= IFNAMSIZ){
+    memcpy(name, RTA_DATA(rta), RTA_PAYLOAD(rta));
+    name[IFNAMSIZ - 1] = '\0';
+  }
+}
+
+// Decode the prefix attribute attr of nr, plen bits long, into prefix and
+// mask (the address, if any, being masked).
+static void
+rule_prefix(const netstack_rule* nr, int attr, size_t alen, unsigned plen,
+            uint64_t* prefix, uint64_t* mask){
+  unsigned char ones[16], bytes[16] = {};
+  memset(ones, 0xff, sizeof(ones));
+  prefix_mask(bytes, ones, alen, plen);
+  memcpy(mask, bytes, sizeof(bytes));
+  memset(bytes, 0, sizeof(bytes));
+  if(netstack_rtattrcpy_exact(netstack_rule_attr(nr, attr), bytes, alen)){
+    prefix_mask(bytes, bytes, alen, plen);
+  }
+  memcpy(prefix, bytes, sizeof(bytes));
+}
+
+// Decode the selectors and action of nr into rn. Returns false unless nr is
+// an IPv4 or IPv6 rule. Interface indices are left for rule_resolve_ifaces().
+static bool
+rule_decode(netstack_rule* nr, rule_node* rn){
+  const size_t alen = family_addrlen(nr->frh.family);
+  if(alen == 0 || nr->frh.src_len > alen * 8 || nr->frh.dst_len > alen * 8){
+    return false;
+  }
+  memset(rn, 0, sizeof(*rn));
+  rn->nr = nr;
+  netstack_rtattrcpy_exact(netstack_rule_attr(nr, FRA_PRIORITY), &rn->priority,
+                           sizeof(rn->priority));
+  rn->action = nr->frh.action;
+  rn->table = nr->frh.table;
+  netstack_rtattrcpy_exact(netstack_rule_attr(nr, FRA_TABLE), &rn->table, sizeof(rn->table));
+  netstack_rtattrcpy_exact(netstack_rule_attr(nr, FRA_GOTO), &rn->target, sizeof(rn->target));
+  rn->invert = nr->frh.flags & FIB_RULE_INVERT;
+  rn->tos = nr->frh.tos;
+  rule_prefix(nr, FRA_SRC, alen, nr->frh.src_len, rn->src, rn->srcmask);
+  rule_prefix(nr, FRA_DST, alen, nr->frh.dst_len, rn->dst, rn->dstmask);
+  if(netstack_rtattrcpy_exact(netstack_rule_attr(nr, FRA_FWMARK), &rn->mark, sizeof(rn->mark))){
+    rn->mask = 0xffffffffu;
+  }
+  netstack_rtattrcpy_exact(netstack_rule_attr(nr, FRA_FWMASK), &rn->mask, sizeof(rn->mask));
+  rule_ifname(nr, FRA_IIFNAME, rn->iifname);
+  rule_ifname(nr, FRA_OIFNAME, rn->oifname);
+  int32_t spl = -1;
+  netstack_rtattrcpy_exact(netstack_rule_attr(nr, FRA_SUPPRESS_PREFIXLEN), &spl, sizeof(spl));
+  rn->suppress_prefixlen = spl;
+  uint8_t u8 = 0;
+  if(netstack_rtattrcpy_exact(netstack_rule_attr(nr, FRA_IP_PROTO), &u8, sizeof(u8)) && u8){
+    rn->unmatchable = true;
+  }
+  u8 = 0;
+  if(netstack_rtattrcpy_exact(netstack_rule_attr(nr, FRA_L3MDEV), &u8, sizeof(u8)) && u8){
+    rn->unmatchable = true;
+  }
+  if(netstack_rule_attr(nr, FRA_TUN_ID) || netstack_rule_attr(nr, FRA_SPORT_RANGE) ||
+     netstack_rule_attr(nr, FRA_DPORT_RANGE)){
+    rn->unmatchable = true;
+  }
+  // The kernel only reports uid ranges other than the full one
+  struct fib_rule_uid_range uids;
+  if(netstack_rtattrcpy_exact(netstack_rule_attr(nr, FRA_UID_RANGE), &uids, sizeof(uids)) &&
+     (uids.start != 0 || uids.end != 0xffffffffu)){
+    rn->unmatchable = true;
+  }
+  return true;
+}
+
+// Are a and b the same rule? The kernel toggles the detached flags as their
+// interfaces come and go, and the unresolved flag as goto targets come and
+// go, without telling us, so those are disregarded.
+static bool
+rule_same(const netstack_rule* a, const netstack_rule* b){
+  const uint32_t transient = FIB_RULE_IIF_DETACHED | FIB_RULE_OIF_DETACHED |
+                             FIB_RULE_UNRESOLVED;
+  struct fib_rule_hdr ah = a->frh;
+  struct fib_rule_hdr bh = b->frh;
+  ah.flags &= ~transient;
+  bh.flags &= ~transient;
+  return !memcmp(&ah, &bh, sizeof(ah)) && a->rtabuflen == b->rtabuflen &&
+         !memcmp(a->rtabuf, b->rtabuf, a->rtabuflen);
+}
+
+static inline rule_set*
+rule_set_of(netstack* ns, int family){
+  return family == AF_INET ? &ns->rules4 : &ns->rules6;
+}
+
+// Index of the first rule of rs having at least priority.
+static unsigned
+rule_set_find(const rule_set* rs, uint32_t priority){
+  unsigned lo = 0, hi = rs->count;
+  while(lo < hi){
+    unsigned mid = lo + (hi - lo) / 2;
+    if(rs->rules[mid].priority < priority){
+      lo = mid + 1;
+    }else{
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+static inline bool
+rule_named(const rule_node* rn){
+  return rn->iifname[0] || rn->oifname[0];
+}
+
+// Index of the local link named name, or 0 if there's none we know of. Takes
+// hashlock, so call without fiblock.
+static int
+rule_ifindex(netstack* ns, const char* name){
+  int ret = 0;
+  if(name[0] && !ns->opts.iface_notrack){
+    pthread_mutex_lock(&ns->hashlock);
+    name_node** trie = name_trie_for(ns, NETSTACK_NSID_LOCAL, false);
+    const netstack_iface* ni = trie ? netstack_iface_byname(*trie, name) : NULL;
+    if(ni){
+      ret = ni->ifi.ifi_index;
+    }
+    pthread_mutex_unlock(&ns->hashlock);
+  }
+  return ret;
+}
+
+// Rebuild the fwmark index of rs. Should it fail, walks visit every rule.
+// Call with fiblock held.
+static void
+rule_set_index(rule_set* rs){
+  rs->indexed = false;
+  rs->gcount = rs->mcount = 0;
+  if(rs->count == 0){
+    return;
+  }
+  unsigned* general = realloc(rs->general, sizeof(*general) * rs->count);
+  if(general == NULL){
+    return;
+  }
+  rs->general = general;
+  rule_mark* marked = realloc(rs->marked, sizeof(*marked) * rs->count);
+  if(marked == NULL){
+    return;
+  }
+  rs->marked = marked;
+  unsigned z;
+  for(z = 0 ; z < rs->count ; ++z){
+    const rule_node* rn = &rs->rules[z];
+    if(rn->unmatchable){
+      continue;
+    }
+    if(!rn->invert && rn->mask == 0xffffffffu){
+      rs->marked[rs->mcount].mark = rn->mark;
+      rs->marked[rs->mcount].idx = z;
+      ++rs->mcount;
+    }else{
+      rs->general[rs->gcount++] = z;
+    }
+  }
+  // insertion sort by mark, stable so indices stay ascending within a mark.
+  // marks usually arrive in order, and rules rarely change.
+  for(z = 1 ; z < rs->mcount ; ++z){
+    rule_mark rm = rs->marked[z];
+    unsigned i = z;
+    while(i && rs->marked[i - 1].mark > rm.mark){
+      rs->marked[i] = rs->marked[i - 1];
+      --i;
+    }
+    rs->marked[i] = rm;
+  }
+  rs->indexed = true;
+}
+
+// Point the rules' interface selectors naming the local link idx at it, and
+// away from it those which no longer do. name is the link's name, or NULL if
+// it has gone away. Call without fiblock.
+static void
+fib_rules_relink(netstack* ns, int idx, const char* name){
+  pthread_mutex_lock(&ns->fiblock);
+  rule_set* sets[] = { &ns->rules4, &ns->rules6, };
+  size_t s;
+  for(s = 0 ; s < sizeof(sets) / sizeof(*sets) ; ++s){
+    rule_set* rs = sets[s];
+    unsigned z;
+    for(z = 0 ; rs->named && z < rs->count ; ++z){
+      rule_node* rn = &rs->rules[z];
+      if(rn->iifname[0]){
+        rn->iif = name && !strcmp(rn->iifname, name) ? idx : rn->iif == idx ? 0 : rn->iif;
+      }
+      if(rn->oifname[0]){
+        rn->oif = name && !strcmp(rn->oifname, name) ? idx : rn->oif == idx ? 0 : rn->oif;
+      }
+    }
+  }
+  pthread_mutex_unlock(&ns->fiblock);
+}
+
+// Take ownership of nr, a rule of the local namespace, adding it to (or for
+// NETSTACK_DEL, removing it from) the rule cache. A new rule goes after any
+// others of the same priority, as in the kernel. Resyncs re-announce rules
+// we already have, which replace their cached selves.
+static void
+fib_rule_update(netstack* ns, netstack_rule* nr, netstack_event_e etype){
+  rule_node rn;
+  if(!rule_decode(nr, &rn)){
+    free_rule(nr);
+    return;
+  }
+  rn.iif = rule_ifindex(ns, rn.iifname);
+  rn.oif = rule_ifindex(ns, rn.oifname);
+  netstack_rule* old = NULL;
+  pthread_mutex_lock(&ns->fiblock);
+  rule_set* rs = rule_set_of(ns, nr->frh.family);
+  unsigned z = rule_set_find(rs, rn.priority);
+  bool found = false;
+  while(z < rs->count && rs->rules[z].priority == rn.priority){
+    if(rule_same(rs->rules[z].nr, nr)){
+      found = true;
+      break;
+    }
+    ++z;
+  }
+  if(found){
+    old = rs->rules[z].nr;
+    rs->named -= rule_named(&rs->rules[z]);
+    if(etype == NETSTACK_DEL){
+      memmove(&rs->rules[z], &rs->rules[z + 1], sizeof(*rs->rules) * (rs->count - z - 1));
+      --rs->count;
+    }else{
+      rs->rules[z] = rn;
+      rs->named += rule_named(&rn);
+      nr = NULL;
+    }
+  }else if(etype != NETSTACK_DEL){
+    if(rs->count == rs->size){
+      unsigned nsize = rs->size ? rs->size * 2 : 16;
+      rule_node* tmp = realloc(rs->rules, sizeof(*tmp) * nsize);
+      if(tmp){
+        rs->rules = tmp;
+        rs->size = nsize;
+      }
+    }
+    if(rs->count < rs->size){
+      memmove(&rs->rules[z + 1], &rs->rules[z], sizeof(*rs->rules) * (rs->count - z));
+      rs->rules[z] = rn;
+      ++rs->count;
+      rs->named += rule_named(&rn);
+      nr = NULL;
+    }
+  }
+  if(found || nr == NULL){
+    rule_set_index(rs);
+  }
+  pthread_mutex_unlock(&ns->fiblock);
+  free_rule(old);
+  free_rule(nr);
+}
+
+// Double the nexthop buckets (from nothing, to start). Ids are usually handed
+// out sequentially, so they're used directly. Call with fiblock held.
+static void
+nh_hash_grow(netstack* ns){
+  size_t nbuckets = ns->nh_buckets ? ns->nh_buckets * 2 : 64;
+  nh_node** nhash = calloc(nbuckets, sizeof(*nhash));
+  if(nhash == NULL){
+    return;
+  }
+  size_t z;
+  for(z = 0 ; z < ns->nh_buckets ; ++z){
+    nh_node* nd;
+    while( (nd = ns->nh_hash[z]) ){
+      ns->nh_hash[z] = nd->hnext;
+      nh_node** b = &nhash[nd->id & (nbuckets - 1)];
+      nd->hnext = *b;
+      *b = nd;
+    }
+  }
+  free(ns->nh_hash);
+  ns->nh_hash = nhash;
+  ns->nh_buckets = nbuckets;
+}
+
+// Find the nexthop's slot. Call with fiblock held, and nh_buckets non-zero.
+static nh_node**
+nh_find(netstack* ns, uint32_t id){
+  nh_node** pp = &ns->nh_hash[id & (ns->nh_buckets - 1)];
+  while(*pp && (*pp)->id != id){
+    pp = &(*pp)->hnext;
+  }
+  return pp;
+}
+
+// Decode nh into nd. Returns false if nh has no id.
+static bool
+nh_decode(netstack_nexthop* nh, nh_node* nd){
+  memset(nd, 0, sizeof(*nd));
+  nd->nh = nh;
+  if(!netstack_rtattrcpy_exact(netstack_nexthop_attr(nh, NHA_ID), &nd->id, sizeof(nd->id))){
+    return false;
+  }
+  nd->blackhole = netstack_nexthop_attr(nh, NHA_BLACKHOLE) != NULL;
+  uint32_t oif;
+  if(netstack_rtattrcpy_exact(netstack_nexthop_attr(nh, NHA_OIF), &oif, sizeof(oif))){
+    nd->oif = oif;
+  }
+  // an IPv4 route can use an IPv6 gateway, so go by the attribute's length
+  const struct rtattr* gw = netstack_nexthop_attr(nh, NHA_GATEWAY);
+  if(gw && (RTA_PAYLOAD(gw) == 4 || RTA_PAYLOAD(gw) == 16)){
+    nd->gwfamily = RTA_PAYLOAD(gw) == 4 ? AF_INET : AF_INET6;
+    memcpy(nd->gateway, RTA_DATA(gw), RTA_PAYLOAD(gw));
+  }
+  const struct rtattr* grp = netstack_nexthop_attr(nh, NHA_GROUP);
+  if(grp && RTA_PAYLOAD(grp) >= sizeof(*nd->group)){
+    nd->group = RTA_DATA(grp);
+    nd->groupcount = RTA_PAYLOAD(grp) / sizeof(*nd->group);
+  }
+  return true;
+}
+
+// Move the orphaned routes using nd onto its chain. Call with fiblock held.
+static void
+nh_adopt_orphans(netstack* ns, nh_node* nd){
+  fib_node* fn = ns->nh_orphans;
+  while(fn){
+    fib_node* next = fn->nhnext;
+    if(fn->nhid == nd->id){
+      nh_user_unlink(fn);
+      nh_user_push(&nd->users, fn);
+    }
+    fn = next;
+  }
+}
+
+// Take ownership of nh, a nexthop of the local namespace, adding it to (or
+// for NETSTACK_DEL, removing it from) the nexthop cache. The kernel drops the
+// routes using a deleted nexthop without telling us, so we do likewise.
+static void
+fib_nexthop_update(netstack* ns, netstack_nexthop* nh, netstack_event_e etype){
+  nh_node* nd = malloc(sizeof(*nd));
+  if(nd == NULL || !nh_decode(nh, nd)){
+    free(nd);
+    free_nexthop(nh);
+    return;
+  }
+  nh_node* old = NULL;
+  fib_node* routes = NULL;
+  pthread_mutex_lock(&ns->fiblock);
+  const uint64_t gen = atomic_fetch_add(&ns->generation, 1) + 1;
+  if(ns->nh_buckets == 0){
+    nh_hash_grow(ns);
+  }
+  if(ns->nh_buckets){
+    nh_node** pp = nh_find(ns, nd->id);
+    if( (old = *pp) ){
+      *pp = old->hnext;
+      old->hnext = NULL;
+      --ns->nh_count;
+      if(etype == NETSTACK_DEL){
+        changelog_bury(&ns->nh_log, &old->glink, gen, nh_link_serialize);
+      }else{
+        changelog_remove(&ns->nh_log, &old->glink);
+      }
+    }
+    if(etype != NETSTACK_DEL){
+      if(old){
+        nh_users_move(old, nd);
+      }else{
+        nh_adopt_orphans(ns, nd);
+      }
+      changelog_add(&ns->nh_log, &nd->glink, gen);
+      nd->hnext = *pp;
+      *pp = nd;
+      nd = NULL;
+      if(++ns->nh_count > ns->nh_buckets){
+        nh_hash_grow(ns);
+      }
+    }else if(old){
+      nh_purge_routes_locked(ns, old, &routes);
+    }
+  }
+  pthread_mutex_unlock(&ns->fiblock);
+  free_fib_lists(routes, NULL, old, NULL);
+  if(nd){
+    free_nexthop(nd->nh);
+    free(nd);
+  }
+}
+
+// Copy the leading len bytes of rta's payload (or fewer, if it's shorter)
+// into the zeroed dst. The kernel appends fields to these structures.
+static inline void
+rta_copy_prefix(const struct rtattr* rta, void* dst, size_t len){
+  if(rta){
+    memcpy(dst, RTA_DATA(rta), RTA_PAYLOAD(rta) < len ? RTA_PAYLOAD(rta) : len);
+  }
+}
+
+// Decode the nested TCA_STATS2 attribute or, lacking it, the legacy
+// TCA_STATS into st. The packet count of gnet_stats_basic is only 32 bits;
+// TCA_STATS_PKT64 (Linux 5.5+) carries the full count.
+static void
+tc_stats_decode(const struct rtattr* stats2, const struct rtattr* stats, netstack_tc_stats* st){
+  memset(st, 0, sizeof(*st));
+  if(stats2){
+    const struct rtattr* nest = RTA_DATA(stats2);
+    const size_t nlen = RTA_PAYLOAD(stats2);
+    struct gnet_stats_basic basic = {};
+    rta_copy_prefix(netstack_extract_rta_attr(nest, nlen, TCA_STATS_BASIC), &basic, sizeof(basic));
+    st->bytes = basic.bytes;
+    st->packets = basic.packets;
+    uint64_t pkt64;
+    if(netstack_rtattrcpy_exact(netstack_extract_rta_attr(nest, nlen, TCA_STATS_PKT64),
+                                &pkt64, sizeof(pkt64))){
+      st->packets = pkt64;
+    }
+    struct gnet_stats_queue q = {};
+    rta_copy_prefix(netstack_extract_rta_attr(nest, nlen, TCA_STATS_QUEUE), &q, sizeof(q));
+    st->qlen = q.qlen;
+    st->backlog = q.backlog;
+    st->drops = q.drops;
+    st->requeues = q.requeues;
+    st->overlimits = q.overlimits;
+    const struct rtattr* est = netstack_extract_rta_attr(nest, nlen, TCA_STATS_RATE_EST64);
+    if(est){
+      struct gnet_stats_rate_est64 r = {};
+      rta_copy_prefix(est, &r, sizeof(r));
+      st->bps = r.bps;
+      st->pps = r.pps;
+    }else if( (est = netstack_extract_rta_attr(nest, nlen, TCA_STATS_RATE_EST)) ){
+      struct gnet_stats_rate_est r = {};
+      rta_copy_prefix(est, &r, sizeof(r));
+      st->bps = r.bps;
+      st->pps = r.pps;
+    }
+  }else if(stats){
+    struct tc_stats ts = {};
+    rta_copy_prefix(stats, &ts, sizeof(ts));
+    st->bytes = ts.bytes;
+    st->packets = ts.packets;
+    st->qlen = ts.qlen;
+    st->backlog = ts.backlog;
+    st->drops = ts.drops;
+    st->overlimits = ts.overlimits;
+    st->bps = ts.bps;
+    st->pps = ts.pps;
+  }
+}
+
+static inline bool
+tc_statsattr(int type){
+  return type == TCA_STATS || type == TCA_STATS2 || type == TCA_XSTATS;
+}
+
+// Does the message (tcm, followed by rlen bytes of rtas) describe tc, save
+// perhaps for statistics? The kernel reports a qdisc's refcount in tcm_info.
+static bool
+tc_same(const netstack_tc* tc, const struct tcmsg* tcm, const struct rtattr* rtas, int rlen){
+  if(tc->tcm.tcm_handle != tcm->tcm_handle || tc->tcm.tcm_parent != tcm->tcm_parent ||
+     (tc->isclass && tc->tcm.tcm_info != tcm->tcm_info)){
+    return false;
+  }
+  const struct rtattr* a = tc->rtabuf;
+  int alen = tc->rtabuflen;
+  for( ; ; ){
+    while(RTA_OK(a, alen) && tc_statsattr(a->rta_type)){
+      a = RTA_NEXT(a, alen);
+    }
+    while(RTA_OK(rtas, rlen) && tc_statsattr(rtas->rta_type)){
+      rtas = RTA_NEXT(rtas, rlen);
+    }
+    if(!RTA_OK(a, alen) || !RTA_OK(rtas, rlen)){
+      return RTA_OK(a, alen) == RTA_OK(rtas, rlen);
+    }
+    if(a->rta_len != rtas->rta_len || memcmp(a, rtas, a->rta_len)){
+      return false;
+    }
+    a = RTA_NEXT(a, alen);
+    rtas = RTA_NEXT(rtas, rlen);
+  }
+}
+
+// A refresh of a cached qdisc (class) changing nothing but its statistics
+// updates them in place, sparing us an object, and the user a callback.
+// Returns true if nhdr was such a refresh.
+static bool
+tc_refresh_in_place(netstack* ns, const struct nlmsghdr* nhdr, bool isclass){
+  const struct tcmsg* tcm = NLMSG_DATA(nhdr);
+  const int rlen = nhdr->nlmsg_len - NLMSG_LENGTH(sizeof(*tcm));
+  if(rlen < 0){
+    return false;
+  }
+  const struct rtattr* rtas = (const struct rtattr*)((const char*)tcm + NLMSG_ALIGN(sizeof(*tcm)));
+  const uint32_t key = isclass ? tcm->tcm_handle : tcm->tcm_parent;
+  bool ret = false;
+  pthread_mutex_lock(&ns->fiblock);
+  if(ns->tc_buckets){
+    tc_node* tn = *tc_find(ns, isclass, tcm->tcm_ifindex, key);
+    if(tn && tc_same(tn->tc, tcm, rtas, rlen)){
+      tc_stats_decode(netstack_extract_rta_attr(rtas, rlen, TCA_STATS2),
+                      netstack_extract_rta_attr(rtas, rlen, TCA_STATS), &tn->stats);
+      tn->stats.updated_nsec = monotonic_nsec();
+      ret = true;
+    }
+  }
+  pthread_mutex_unlock(&ns->fiblock);
+  return ret;
+}
+
+// Double the tc buckets (from nothing, to start). Call with fiblock held.
+static void
+tc_hash_grow(netstack* ns){
+  size_t nbuckets = ns->tc_buckets ? ns->tc_buckets * 2 : 64;
+  tc_node** nhash = calloc(nbuckets, sizeof(*nhash));
+  if(nhash == NULL){
+    return;
+  }
+  size_t z;
+  for(z = 0 ; z < ns->tc_buckets ; ++z){
+    tc_node* tn;
+    while( (tn = ns->tc_hash[z]) ){
+      ns->tc_hash[z] = tn->hnext;
+      tc_node** b = &nhash[tc_hash(tn->isclass, tn->ifindex, tn->key) & (nbuckets - 1)];
+      tn->hnext = *b;
+      *b = tn;
+    }
+  }
+  free(ns->tc_hash);
+  ns->tc_hash = nhash;
+  ns->tc_buckets = nbuckets;
+}
+
+// Take ownership of tc, a qdisc or class of the local namespace, adding it to
+// (or for NETSTACK_DEL, removing it from) the tc cache. Qdiscs are keyed by
+// where they're attached, classes by their handles.
+static void
+fib_tc_update(netstack* ns, netstack_tc* tc, netstack_event_e etype){
+  tc_node* tn = malloc(sizeof(*tn));
+  if(tn == NULL){
+    free_tc(tc);
+    return;
+  }
+  tn->ifindex = tc->tcm.tcm_ifindex;
+  tn->handle = tc->tcm.tcm_handle;
+  tn->parent = tc->tcm.tcm_parent;
+  tn->isclass = tc->isclass;
+  tn->key = tn->isclass ? tn->handle : tn->parent;
+  tn->tc = tc;
+  tc_stats_decode(netstack_tc_attr(tc, TCA_STATS2), netstack_tc_attr(tc, TCA_STATS), &tn->stats);
+  tn->stats.updated_nsec = monotonic_nsec();
+  tc_node* purged = NULL;
+  pthread_mutex_lock(&ns->fiblock);
+  const uint64_t gen = atomic_fetch_add(&ns->generation, 1) + 1;
+  if(ns->tc_buckets == 0){
+    tc_hash_grow(ns);
+  }
+  if(ns->tc_buckets){
+    tc_node** pp = tc_find(ns, tn->isclass, tn->ifindex, tn->key);
+    tc_node* old;
+    if( (old = *pp) ){
+      *pp = old->hnext;
+      --ns->tc_count;
+      if(etype == NETSTACK_DEL){
+        changelog_bury(&ns->tc_log, &old->glink, gen, tc_link_serialize);
+      }else{
+        changelog_remove(&ns->tc_log, &old->glink);
+      }
+      old->hnext = purged;
+      purged = old;
+    }
+    if(etype != NETSTACK_DEL){
+      changelog_add(&ns->tc_log, &tn->glink, gen);
+      tn->hnext = *pp;
+      *pp = tn;
+      tn = NULL;
+      if(++ns->tc_count > ns->tc_buckets){
+        tc_hash_grow(ns);
+      }
+    }else if(!tc->isclass){
+      tc_purge_beneath_locked(ns, tc->tcm.tcm_ifindex, TC_H_MAJ(tc->tcm.tcm_handle), &purged);
+    }
+  }
+  pthread_mutex_unlock(&ns->fiblock);
+  free_tc_list(purged);
+  if(tn){
+    free_tc(tn->tc);
+    free(tn);
+  }
+}
+
+static inline void
+vaddr_cb(netstack* ns, netstack_event_e etype, void* vna){
+  if(ns->opts.addr_cb){
+    ns->opts.addr_cb(vna, etype, ns->opts.addr_curry);
+    atomic_fetch_add(&ns->user_callbacks_total, 1);
+  }
+  atomic_fetch_add(&ns->addr_events, 1);
+  free_addr(vna);
+}
+
+static inline void
+vroute_cb(netstack* ns, netstack_event_e etype, void* vnr){
+  if(ns->opts.route_cb){
+    ns->opts.route_cb(vnr, etype, ns->opts.route_curry);
+    atomic_fetch_add(&ns->user_callbacks_total, 1);
+  }
+  atomic_fetch_add(&ns->route_events, 1);
+  netstack_route* nr = vnr;
+  if(nr->nsid == NETSTACK_NSID_LOCAL && !ns->opts.route_notrack){
+    fib_route_update(ns, nr, etype);
+  }else{
+    free_route(nr);
+  }
+}
+
+static inline void
+vneigh_cb(netstack* ns, netstack_event_e etype, void* vnn){
+  if(ns->opts.neigh_cb){
+    ns->opts.neigh_cb(vnn, etype, ns->opts.neigh_curry);
+    atomic_fetch_add(&ns->user_callbacks_total, 1);
+  }
+  atomic_fetch_add(&ns->neigh_events, 1);
+  netstack_neigh* nn = vnn;
+  if(nn->nsid != NETSTACK_NSID_LOCAL){
+    free_neigh(nn);
+  }else if(nn->nd.ndm_family == AF_BRIDGE){
+    if(!ns->opts.fdb_notrack){
+      fib_fdb_update(ns, nn, etype);
+    }else{
+      free_neigh(nn);
+    }
+  }else if(!ns->opts.neigh_notrack){
+    fib_neigh_update(ns, nn, etype);
+  }else{
+    free_neigh(nn);
+  }
+}
+
+static inline void
+vrule_cb(netstack* ns, netstack_event_e etype, void* vnr){
+  if(ns->opts.rule_cb){
+    ns->opts.rule_cb(vnr, etype, ns->opts.rule_curry);
+    atomic_fetch_add(&ns->user_callbacks_total, 1);
+  }
+  atomic_fetch_add(&ns->rule_events, 1);
+  netstack_rule* nr = vnr;
+  if(nr->nsid == NETSTACK_NSID_LOCAL && !ns->opts.rule_notrack){
+    fib_rule_update(ns, nr, etype);
+  }else{
+    free_rule(nr);
+  }
+}
+
+static inline void
+vnexthop_cb(netstack* ns, netstack_event_e etype, void* vnh){
+  if(ns->opts.nexthop_cb){
+    ns->opts.nexthop_cb(vnh, etype, ns->opts.nexthop_curry);
+    atomic_fetch_add(&ns->user_callbacks_total, 1);
+  }
+  atomic_fetch_add(&ns->nexthop_events, 1);
+  netstack_nexthop* nh = vnh;
+  if(nh->nsid == NETSTACK_NSID_LOCAL && !ns->opts.nexthop_notrack){
+    fib_nexthop_update(ns, nh, etype);
+  }else{
+    free_nexthop(nh);
+  }
+}
+
+static inline void
+vtc_cb(netstack* ns, netstack_event_e etype, void* vtc){
+  if(ns->opts.tc_cb){
+    ns->opts.tc_cb(vtc, etype, ns->opts.tc_curry);
+    atomic_fetch_add(&ns->user_callbacks_total, 1);
+  }
+  atomic_fetch_add(&ns->tc_events, 1);
+  netstack_tc* tc = vtc;
+  if(tc->nsid == NETSTACK_NSID_LOCAL && !ns->opts.tc_notrack){
+    fib_tc_update(ns, tc, etype);
+  }else{
+    free_tc(tc);
+  }
+}
+
+// Link filters (the iface_include and iface_exclude options). Links are
+// judged upon their RTM_NEWLINKs. Those turned away are remembered, so that
+// objects on them can be discarded by index alone.
+static netstack_iface* netstack_iface_byidx(const netstack* ns, int nsid, int idx);
+
+static void
+free_strvec(char** v){
+  if(v){
+    char** s;
+    for(s = v ; *s ; ++s){
+      free(*s);
+    }
+    free(v);
+  }
+}
+
+// A NULL v is copied as NULL. Returns false on allocation failure.
+static bool
+dup_strvec(const char* const* v, char*** dup){
+  *dup = NULL;
+  if(v == NULL){
+    return true;
+  }
+  size_t n = 0;
+  while(v[n]){
+    ++n;
+  }
+  if((*dup = calloc(n + 1, sizeof(**dup))) == NULL){
+    return false;
+  }
+  size_t z;
+  for(z = 0 ; z < n ; ++z){
+    if(((*dup)[z] = strdup(v[z])) == NULL){
+      free_strvec(*dup);
+      *dup = NULL;
+      return false;
+    }
+  }
+  return true;
+}
+
+static void
+free_iface_filter(iface_filter* f){
+  if(f){
+    free_strvec(f->names);
+    free_strvec(f->kinds);
+    free(f->ifindices);
+    free(f);
+  }
+}
+
+static int
+ifindex_cmp(const void* va, const void* vb){
+  const int a = *(const int*)va;
+  const int b = *(const int*)vb;
+  return a < b ? -1 : a > b;
+}
+
+static iface_filter*
+compile_iface_filter(const netstack_iface_filter* nf){
+  iface_filter* f = calloc(1, sizeof(*f));
+  if(f == NULL){
+    return NULL;
+  }
+  if(!dup_strvec(nf->names, &f->names) || !dup_strvec(nf->kinds, &f->kinds)){
+    free_iface_filter(f);
+    return NULL;
+  }
+  if(nf->ifindex_count){
+    if((f->ifindices = malloc(sizeof(*f->ifindices) * nf->ifindex_count)) == NULL){
+      free_iface_filter(f);
+      return NULL;
+    }
+    memcpy(f->ifindices, nf->ifindices, sizeof(*f->ifindices) * nf->ifindex_count);
+    qsort(f->ifindices, nf->ifindex_count, sizeof(*f->ifindices), ifindex_cmp);
+    f->ifindex_count = nf->ifindex_count;
+  }
+  f->master = nf->master;
+  return f;
+}
+
+// An rtnetlink socket with NETLINK_GET_STRICT_CHK, whereby dumps can be
+// filtered (by link, among other things). Returns -1 if unsupported.
+static int
+strict_socket(void){
+  int sd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+  if(sd < 0){
+    return -1;
+  }
+  int one = 1;
+  if(setsockopt(sd, SOL_NETLINK, NETLINK_GET_STRICT_CHK, &one, sizeof(one))){
+    close(sd);
+    return -1;
+  }
+  return sd;
+}
+
+static int
+compile_iface_filters(netstack* ns){
+  ns->include = ns->exclude = NULL;
+  ns->turned_away = NULL;
+  ns->turned_count = ns->turned_size = 0;
+  ns->redumps = NULL;
+  ns->redump_count = ns->redump_size = 0;
+  ns->strictnl = -1;
+  if(ns->opts.iface_include){
+    if((ns->include = compile_iface_filter(ns->opts.iface_include)) == NULL){
+      return -1;
+    }
+  }
+  if(ns->opts.iface_exclude){
+    if((ns->exclude = compile_iface_filter(ns->opts.iface_exclude)) == NULL){
+      free_iface_filter(ns->include);
+      return -1;
+    }
+  }
+  // the caller's filters needn't outlive netstack_create()
+  ns->opts.iface_include = ns->opts.iface_exclude = NULL;
+  if((ns->include || ns->exclude) && (ns->strictnl = strict_socket()) < 0){
+    ns->opts.diagfxn("No strict netlink checking (%s), links will resync\n", strerror(errno));
+  }
+  return 0;
+}
+
+static void
+destroy_iface_filters(netstack* ns){
+  free_iface_filter(ns->include);
+  free_iface_filter(ns->exclude);
+  free(ns->turned_away);
+  free(ns->redumps);
+  if(ns->strictnl >= 0){
+    close(ns->strictnl);
+  }
+}
+
+static bool
+iface_filter_matches(const iface_filter* f, int nsid, int ifindex,
+                     const char* name, const char* kind, int master){
+  char** s;
+  if(name && f->names){
+    for(s = f->names ; *s ; ++s){
+      if(fnmatch(*s, name, 0) == 0){
+        return true;
+      }
+    }
+  }
+  if(f->kinds){
+    for(s = f->kinds ; *s ; ++s){
+      if(strcmp(*s, kind ? kind : "") == 0){
+        return true;
+      }
+    }
+  }
+  if(nsid == NETSTACK_NSID_LOCAL){
+    if(f->master && f->master == master){
+      return true;
+    }
+    if(f->ifindex_count && bsearch(&ifindex, f->ifindices, f->ifindex_count,
+                                   sizeof(*f->ifindices), ifindex_cmp)){
+      return true;
+    }
+  }
+  return false;
+}
+
+static const char*
+rta_string(const struct rtattr* rta){
+  if(RTA_PAYLOAD(rta) && strnlen(RTA_DATA(rta), RTA_PAYLOAD(rta)) < RTA_PAYLOAD(rta)){
+    return RTA_DATA(rta);
+  }
+  return NULL;
+}
+
+// The name, kind, and master of a link message, any of which might be
+// absent (NULL or 0), pointing into the message.
+static void
+link_filter_attrs(const struct rtattr* rta, int rlen, const char** name,
+                  const char** kind, int* master){
+  *name = *kind = NULL;
+  *master = 0;
+  while(RTA_OK(rta, rlen)){
+    if(rta->rta_type == IFLA_IFNAME){
+      *name = rta_string(rta);
+    }else if(rta->rta_type == IFLA_MASTER && RTA_PAYLOAD(rta) == sizeof(uint32_t)){
+      *master = *(const uint32_t*)RTA_DATA(rta);
+    }else if(rta->rta_type == IFLA_LINKINFO){
+      const struct rtattr* k = netstack_extract_rta_attr(RTA_DATA(rta), RTA_PAYLOAD(rta),
+                                                         IFLA_INFO_KIND);
+      if(k){
+        *kind = rta_string(k);
+      }
+    }
+    rta = RTA_NEXT(rta, rlen);
+  }
+}
+
+static inline uint64_t
+turned_key(int nsid, int ifindex){
+  return (uint64_t)(uint32_t)nsid << 32u | (uint32_t)ifindex;
+}
+
+// Index of key in turned_away, or where it ought be inserted.
+static unsigned
+turned_search(const netstack* ns, uint64_t key){
+  unsigned lo = 0, hi = ns->turned_count;
+  while(lo < hi){
+    const unsigned mid = lo + (hi - lo) / 2;
+    if(ns->turned_away[mid] < key){
+      lo = mid + 1;
+    }else{
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+static bool
+turned_has(const netstack* ns, uint64_t key){
+  const unsigned z = turned_search(ns, key);
+  return z < ns->turned_count && ns->turned_away[z] == key;
+}
+
+static int
+turned_add(netstack* ns, uint64_t key){
+  const unsigned z = turned_search(ns, key);
+  if(z < ns->turned_count && ns->turned_away[z] == key){
+    return 0;
+  }
+  if(ns->turned_count == ns->turned_size){
+    const unsigned nsize = ns->turned_size ? ns->turned_size * 2 : 16;
+    uint64_t* tmp = realloc(ns->turned_away, sizeof(*tmp) * nsize);
+    if(tmp == NULL){
+      return -1;
+    }
+    ns->turned_away = tmp;
+    ns->turned_size = nsize;
+  }
+  memmove(&ns->turned_away[z + 1], &ns->turned_away[z],
+          sizeof(*ns->turned_away) * (ns->turned_count - z));
+  ns->turned_away[z] = key;
+  ++ns->turned_count;
+  return 0;
+}
+
+// Returns true if key was present.
+static bool
+turned_remove(netstack* ns, uint64_t key){
+  const unsigned z = turned_search(ns, key);
+  if(z == ns->turned_count || ns->turned_away[z] != key){
+    return false;
+  }
+  memmove(&ns->turned_away[z], &ns->turned_away[z + 1],
+          sizeof(*ns->turned_away) * (ns->turned_count - z - 1));
+  --ns->turned_count;
+  return true;
+}
+
+// Learn the objects of local link ifindex, which we've been discarding, once
+// the datagram at hand has been handled. Without strict checking, we can't
+// dump only its objects, and instead dump everything.
+static int
+link_redump(netstack* ns, int ifindex){
+  if(ns->strictnl < 0){
+    return resync(ns);
+  }
+  if(ns->redump_count == ns->redump_size){
+    const unsigned nsize = ns->redump_size ? ns->redump_size * 2 : 16;
+    int* tmp = realloc(ns->redumps, sizeof(*tmp) * nsize);
+    if(tmp == NULL){
+      return resync(ns);
+    }
+    ns->redumps = tmp;
+    ns->redump_size = nsize;
+  }
+  ns->redumps[ns->redump_count++] = ifindex;
+  return 0;
+}
+
+// Peer namespaces can reuse one another's indices.
+static void
+turned_forget_nsid(netstack* ns, int nsid){
+  unsigned z, kept = 0;
+  for(z = 0 ; z < ns->turned_count ; ++z){
+    if((int)(uint32_t)(ns->turned_away[z] >> 32u) != nsid){
+      ns->turned_away[kept++] = ns->turned_away[z];
+    }
+  }
+  ns->turned_count = kept;
+}
+
+static bool
+link_filtered(netstack* ns, int ntype, const struct ifinfomsg* ifi,
+              const struct rtattr* rta, int rlen, int nsid, netstack_event_e* etype){
+  const uint64_t key = turned_key(nsid, ifi->ifi_index);
+  if(ntype == RTM_DELLINK){
+    return turned_remove(ns, key);
+  }
+  const char *name, *kind;
+  int master;
+  link_filter_attrs(rta, rlen, &name, &kind, &master);
+  if((!ns->include || iface_filter_matches(ns->include, nsid, ifi->ifi_index, name, kind, master)) &&
+     (!ns->exclude || !iface_filter_matches(ns->exclude, nsid, ifi->ifi_index, name, kind, master))){
+    // we've been discarding this link's objects, and must relearn them
+    if(turned_remove(ns, key) && nsid == NETSTACK_NSID_LOCAL && link_redump(ns, ifi->ifi_index)){
+      ns->opts.diagfxn("Couldn't redump for link %d\n", ifi->ifi_index);
+    }
+    return false;
+  }
+  if(turned_add(ns, key)){
+    ns->opts.diagfxn("Couldn't filter link %d (%s)\n", ifi->ifi_index, strerror(errno));
+  }
+  bool cached = false;
+  if(!ns->opts.iface_notrack){
+    pthread_mutex_lock(&ns->hashlock);
+    cached = netstack_iface_byidx(ns, nsid, ifi->ifi_index);
+    pthread_mutex_unlock(&ns->hashlock);
+  }
+  // a link we've been tracking goes away, as far as the user is concerned
+  if(cached){
+    *etype = NETSTACK_DEL;
+    return false;
+  }
+  return true;
+}
+
+static int
+rta_ifindex(const struct rtattr* rta, int rlen, int rtype){
+  const struct rtattr* oif = netstack_extract_rta_attr(rta, rlen, rtype);
+  if(oif == NULL || RTA_PAYLOAD(oif) != sizeof(uint32_t)){
+    return 0;
+  }
+  return *(const uint32_t*)RTA_DATA(oif);
+}
+
+// Ought this message be discarded, according to the link filters? This runs
+// before any object is built. A cached link being turned away is instead
+// passed along as a deletion, through etype.
+static bool
+iface_filtered(netstack* ns, int ntype, const void* hdr, const struct rtattr* rta,
+               int rlen, int nsid, netstack_event_e* etype){
+  int ifindex;
+  switch(ntype){
+    case RTM_DELLINK: // intentional fallthrough
+    case RTM_NEWLINK:
+      return link_filtered(ns, ntype, hdr, rta, rlen, nsid, etype);
+    case RTM_DELADDR: // intentional fallthrough
+    case RTM_NEWADDR:
+      ifindex = ((const struct ifaddrmsg*)hdr)->ifa_index;
+      break;
+    case RTM_DELNEIGH: // intentional fallthrough
+    case RTM_NEWNEIGH:
+      ifindex = ((const struct ndmsg*)hdr)->ndm_ifindex;
+      break;
+    case RTM_DELQDISC: // intentional fallthrough
+    case RTM_NEWQDISC: // intentional fallthrough
+    case RTM_DELTCLASS: // intentional fallthrough
+    case RTM_NEWTCLASS:
+      ifindex = ((const struct tcmsg*)hdr)->tcm_ifindex;
+      break;
+    // multipath routes and nexthop groups are kept, whatever their paths, as
+    // are routes using nexthop objects (RTA_NH_ID), which have no RTA_OIF
+    case RTM_DELROUTE: // intentional fallthrough
+    case RTM_NEWROUTE:
+      ifindex = rta_ifindex(rta, rlen, RTA_OIF);
+      break;
+    case RTM_DELNEXTHOP: // intentional fallthrough
+    case RTM_NEWNEXTHOP:
+      ifindex = rta_ifindex(rta, rlen, NHA_OIF);
+      break;
+    default:
+      return false;
+  }
+  return ifindex && ns->turned_count && turned_has(ns, turned_key(nsid, ifindex));
+}
+
+// Forget every interface of a peer namespace which has gone away (or lost its
+// nsid), calling back with NETSTACK_DEL for each.
+static void
+purge_nsid(netstack* ns, int nsid){
+  netstack_iface* purged = NULL;
+  pthread_mutex_lock(&ns->hashlock);
+  size_t z;
+  for(z = 0 ; z < sizeof(ns->iface_hash) / sizeof(*ns->iface_hash) ; ++z){
+    netstack_iface** tmp = &ns->iface_hash[z];
+    while(*tmp){
+      netstack_iface* ni = *tmp;
+      if(ni->nsid == nsid){
+        *tmp = ni->hnext;
+        --ns->iface_count;
+        ns->iface_bytes -= netstack_iface_size(ni);
+        changelog_bury(&ns->iface_log, &ni->glink,
+                       atomic_fetch_add(&ns->generation, 1) + 1, iface_link_serialize);
+        ni->hnext = purged;
+        purged = ni;
+      }else{
+        tmp = &ni->hnext;
+      }
+    }
+  }
+  unsigned n;
+  for(n = 0 ; n < ns->nsid_count ; ++n){
+    if(ns->nsid_tries[n].nsid == nsid){
+      destroy_name_trie(ns->nsid_tries[n].trie);
+      ns->nsid_tries[n] = ns->nsid_tries[--ns->nsid_count];
+      break;
+    }
+  }
+  atomic_fetch_add_explicit(&ns->iface_gen, 1, memory_order_release);
+  pthread_mutex_unlock(&ns->hashlock);
+  turned_forget_nsid(ns, nsid);
+  while(purged){
+    netstack_iface* ni = purged;
+    purged = ni->hnext;
+    if(ns->opts.iface_cb){
+      ns->opts.iface_cb(ni, NETSTACK_DEL, ns->opts.iface_curry);
+      atomic_fetch_add(&ns->user_callbacks_total, 1);
+    }
+    atomic_fetch_add(&ns->iface_events, 1);
+    pthread_mutex_lock(&ns->hashlock);
+    retire_iface(ns, ni);
+    pthread_mutex_unlock(&ns->hashlock);
+  }
+}
+
+// RTM_NEWNSID and RTM_DELNSID announce the assignment and removal of ids for
+// peer namespaces. Learning of a new one, we dump its links.
+static int
+nsid_handler(netstack* ns, const struct nlmsghdr* nhdr){
+  const struct rtgenmsg* rtg = NLMSG_DATA(nhdr);
+  const struct rtattr* rta = (const struct rtattr*)
+    ((const char*)rtg + NLMSG_ALIGN(sizeof(*rtg)));
+  int rlen = nhdr->nlmsg_len - NLMSG_LENGTH(NLMSG_ALIGN(sizeof(*rtg)));
+  if(rlen < 0){
+    return -1;
+  }
+  const struct rtattr* nsrta = netstack_extract_rta_attr(rta, rlen, NETNSA_NSID);
+  int32_t nsid;
+  if(!netstack_rtattrcpy_exact(nsrta, &nsid, sizeof(nsid))){
+    return -1;
+  }
+  if(nsid < 0){
+    return 0;
+  }
+  if(nhdr->nlmsg_type == RTM_DELNSID){
+    purge_nsid(ns, nsid);
+  }else if(ns->opts.iface_cb || !ns->opts.iface_notrack){
+    pthread_mutex_lock(&ns->hashlock);
+    name_trie_for(ns, nsid, true);
+    pthread_mutex_unlock(&ns->hashlock);
+    if(queue_request_nsid(ns, RTM_GETLINK, nsid)){
+      ns->opts.diagfxn("Couldn't queue link dump for nsid %d\n", nsid);
+    }
+  }
+  return 0;
+}
+
+// Handle a single rtnetlink message. nsid is that of the namespace whence the
+// message originated, as reported via NETLINK_LISTEN_ALL_NSID.
+static inline _Atomic(stats_slot*)*
+stats_chain(netstack* ns, int ifindex){
+  return &ns->stats_slots[(unsigned)ifindex % IFACE_HASH_SLOTS];
+}
+
+// Find the slot for ifindex. Any thread may call this, but the result must be
+// verified within a read section, as the slot could be recycled at any time.
+static stats_slot*
+stats_slot_find(netstack* ns, int ifindex){
+  stats_slot* ss = atomic_load_explicit(stats_chain(ns, ifindex), memory_order_acquire);
+  while(ss){
+    if(atomic_load_explicit(&ss->ifindex, memory_order_relaxed) == ifindex){
+      return ss;
+    }
+    ss = atomic_load_explicit(&ss->next, memory_order_acquire);
+  }
+  return NULL;
+}
+
+// Publish stats for ifindex, appending a sample to the ring. A NULL words
+// recycles the slot, discarding its samples. rxthread only.
+static void
+stats_slot_write(const netstack* ns, stats_slot* ss, int ifindex,
+                 const uint64_t* words, uint64_t nsec){
+  unsigned seq = atomic_load_explicit(&ss->seq, memory_order_relaxed);
+  atomic_store_explicit(&ss->seq, seq + 1, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+  atomic_store_explicit(&ss->ifindex, ifindex, memory_order_relaxed);
+  atomic_store_explicit(&ss->nsec, nsec, memory_order_relaxed);
+  size_t z;
+  for(z = 0 ; z < STATS_WORDS ; ++z){
+    atomic_store_explicit(&ss->words[z], words ? words[z] : 0, memory_order_relaxed);
+  }
+  uint64_t samples = atomic_load_explicit(&ss->samples, memory_order_relaxed);
+  if(words == NULL){
+    samples = 0;
+  }else if(ns->sample_depth){
+    atomic_uint_fast64_t* sample = &ss->ring[(samples % ns->sample_depth) * SAMPLE_WORDS];
+    atomic_store_explicit(&sample[0], nsec, memory_order_relaxed);
+    for(z = 0 ; z < SAMPLE_COUNTERS ; ++z){
+      atomic_store_explicit(&sample[1 + z], words[z], memory_order_relaxed);
+    }
+    ++samples;
+  }
+  atomic_store_explicit(&ss->samples, samples, memory_order_relaxed);
+  atomic_store_explicit(&ss->seq, seq + 2, memory_order_release);
+}
+
+// Copy out a consistent view of the slot, returning false if it doesn't (or
+// no longer) belong to ifindex.
+static bool
+stats_slot_read(stats_slot* ss, int ifindex, struct rtnl_link_stats64* stats, uint64_t* nsec){
+  uint64_t words[STATS_WORDS];
+  unsigned s1, s2;
+  int idx;
+  uint64_t n;
+  do{
+    s1 = atomic_load_explicit(&ss->seq, memory_order_acquire);
+    idx = atomic_load_explicit(&ss->ifindex, memory_order_relaxed);
+    n = atomic_load_explicit(&ss->nsec, memory_order_relaxed);
+    size_t z;
+    for(z = 0 ; z < STATS_WORDS ; ++z){
+      words[z] = atomic_load_explicit(&ss->words[z], memory_order_relaxed);
+    }
+    atomic_thread_fence(memory_order_acquire);
+    s2 = atomic_load_explicit(&ss->seq, memory_order_relaxed);
+  }while((s1 & 1) || s1 != s2);
+  if(idx != ifindex){
+    return false;
+  }
+  if(stats){
+    memcpy(stats, words, sizeof(*stats));
+  }
+  if(nsec){
+    *nsec = n;
+  }
+  return true;
+}
+
+// Find or allocate (reusing a free slot where possible) the slot for ifindex.
+// rxthread only.
+static stats_slot*
+stats_slot_get(netstack* ns, int ifindex){
+  stats_slot* ss = stats_slot_find(ns, ifindex);
+  if(ss){
+    return ss;
+  }
+  _Atomic(stats_slot*)* chain = stats_chain(ns, ifindex);
+  size_t z;
+  for(ss = atomic_load(chain) ; ss ; ss = atomic_load(&ss->next)){
+    if(atomic_load(&ss->ifindex) == 0){
+      return ss;
+    }
+  }
+  size_t ringwords = (size_t)ns->sample_depth * SAMPLE_WORDS;
+  if( (ss = malloc(sizeof(*ss) + sizeof(*ss->ring) * ringwords)) ){
+    atomic_init(&ss->seq, 0);
+    atomic_init(&ss->samples, 0);
+    for(z = 0 ; z < ringwords ; ++z){
+      atomic_init(&ss->ring[z], 0);
+    }
+    atomic_init(&ss->ifindex, 0);
+    atomic_init(&ss->nsec, 0);
+    for(z = 0 ; z < STATS_WORDS ; ++z){
+      atomic_init(&ss->words[z], 0);
+    }
+    atomic_init(&ss->next, atomic_load(chain));
+    atomic_store_explicit(chain, ss, memory_order_release);
+  }
+  return ss;
+}
+
+static void
+stats_slot_release(netstack* ns, int ifindex){
+  stats_slot* ss = stats_slot_find(ns, ifindex);
+  if(ss){
+    stats_slot_write(ns, ss, 0, NULL, 0);
+  }
+}
+
+static void
+destroy_stats_slots(netstack* ns){
+  size_t z;
+  for(z = 0 ; z < IFACE_HASH_SLOTS ; ++z){
+    stats_slot* ss = atomic_load(&ns->stats_slots[z]);
+    while(ss){
+      stats_slot* tmp = atomic_load(&ss->next);
+      free(ss);
+      ss = tmp;
+    }
+  }
+}
+
+// RTM_NEWSTATS, in reply to our RTM_GETSTATS. We only ask for
+// IFLA_STATS_LINK_64, which is a struct rtnl_link_stats64.
+static int
+stats_handler(netstack* ns, const struct nlmsghdr* nhdr){
+  const struct if_stats_msg* ifsm = NLMSG_DATA(nhdr);
+  int rlen = nhdr->nlmsg_len - NLMSG_LENGTH(sizeof(*ifsm));
+  if(rlen < 0 || ifsm->ifindex <= 0){
+    return -1;
+  }
+  const struct rtattr* rta = (const struct rtattr*)((const char*)ifsm + NLMSG_ALIGN(sizeof(*ifsm)));
+  while(RTA_OK(rta, rlen)){
+    if(rta->rta_type == IFLA_STATS_LINK_64){
+      uint64_t words[STATS_WORDS] = {0};
+      size_t len = RTA_PAYLOAD(rta) < sizeof(words) ? RTA_PAYLOAD(rta) : sizeof(words);
+      memcpy(words, RTA_DATA(rta), len);
+      stats_slot* ss = stats_slot_get(ns, ifsm->ifindex);
+      if(ss == NULL){
+        return -1;
+      }
+      stats_slot_write(ns, ss, ifsm->ifindex, words, monotonic_nsec());
+      return 0;
+    }
+    rta = RTA_NEXT(rta, rlen);
+  }
+  return 0;
+}
+
+// Are we within a callback, i.e. on the thread which receives the kernel's
+// answers, or on the txthread (which also completes requests)? Either would
+// wait forever on an answer.
+static bool
+in_callback(const netstack* ns){
+  if(ns->opts.threadless){
+    return ns->processing;
+  }
+  return pthread_equal(pthread_self(), ns->rxtid) ||
+         pthread_equal(pthread_self(), ns->txtid);
+}
+
+// In threadless mode, there's nobody else to receive the answer, so we process
+// the socket ourselves (we're required to be the processing thread).
+static int
+request_wait_threadless(netstack* ns, const netstack_request* req, uint64_t deadline){
+  struct pollfd pfd = {
+    .fd = nl_socket_get_fd(ns->nl),
+    .events = POLLIN,
+  };
+  while(!atomic_load(&req->done)){
+    int ms = -1;
+    if(deadline){
+      uint64_t now = monotonic_nsec();
+      if(now >= deadline){
+        return -1;
+      }
+      ms = (deadline - now + 999999) / 1000000;
+    }
+    if(poll(&pfd, 1, ms) < 0 && errno != EINTR){
+      return -1;
+    }
+    if(netstack_process(ns, 0) < 0){
+      return -1;
+    }
+  }
+  return 0;
+}
+
+// Wait until req is done, or the CLOCK_MONOTONIC deadline (if non-zero).
+static int
+request_wait(netstack* ns, const netstack_request* req, uint64_t deadline){
+  if(ns->opts.threadless){
+    return request_wait_threadless(ns, req, deadline);
+  }
+  struct timespec ts;
+  ts.tv_sec = deadline / 1000000000ull;
+  ts.tv_nsec = deadline % 1000000000ull;
+  int ret = 0;
+  pthread_mutex_lock(&ns->txlock);
+  while(!atomic_load(&req->done)){
+    if(deadline == 0){
+      pthread_cond_wait(&ns->reqcond, &ns->txlock);
+    }else if(pthread_cond_timedwait(&ns->reqcond, &ns->txlock, &ts) == ETIMEDOUT){
+      ret = atomic_load(&req->done) ? 0 : -1;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&ns->txlock);
+  return ret;
+}
+
+// Convert a timeout in milliseconds (forever if negative) to a deadline for
+// request_wait().
+static uint64_t
+request_deadline(int timeout_ms){
+  if(timeout_ms < 0){
+    return 0;
+  }
+  return monotonic_nsec() + (uint64_t)timeout_ms * 1000000ull;
+}
+
+netstack_request* netstack_request_submit(netstack* ns, const struct nlmsghdr* nlh,
+                                          netstack_request_cb cb, void* curry){
+  if(nlh == NULL || nlh->nlmsg_len < NLMSG_HDRLEN){
+    return NULL;
+  }
+  netstack_request* req = request_alloc(nlh->nlmsg_len);
+  if(req == NULL){
+    return NULL;
+  }
+  memcpy(req->nlh, nlh, nlh->nlmsg_len);
+  req->nlh->nlmsg_flags |= NLM_F_REQUEST;
+  if(!(req->dump = request_is_dump(req->nlh))){
+    req->nlh->nlmsg_flags |= NLM_F_ACK;
+  }
+  req->cb = cb;
+  req->curry = curry;
+  atomic_store(&req->refs, 2); // ours, and the caller's handle
+  request_enqueue(ns, req);
+  return req;
+}
+
+int netstack_request_wait(netstack* ns, const netstack_request* req, int timeout_ms){
+  if(in_callback(ns)){
+    errno = EDEADLK;
+    return -1;
+  }
+  return request_wait(ns, req, request_deadline(timeout_ms));
+}
+
+bool netstack_request_done(const netstack_request* req){
+  return atomic_load(&req->done);
+}
+
+int netstack_request_error(const netstack_request* req){
+  return atomic_load(&req->done) ? req->error : -EINPROGRESS;
+}
+
+const char* netstack_request_extack(const netstack_request* req){
+  return atomic_load(&req->done) ? req->extack : NULL;
+}
+
+int netstack_request_extack_offset(const netstack_request* req){
+  return atomic_load(&req->done) ? req->extack_off : -1;
+}
+
+void netstack_request_release(netstack_request* req){
+  if(req){
+    request_release(req);
+  }
+}
+
+// Build an RTM_NEWROUTE or RTM_DELROUTE for rs, using the defaults of
+// ip-route(8). Returns NULL (with errno set) if rs is invalid.
+static netstack_request*
+route_request(const netstack_route_spec* rs, bool add, unsigned flags){
+  size_t alen;
+  if(rs->family == AF_INET){
+    alen = 4;
+  }else if(rs->family == AF_INET6){
+    alen = 16;
+  }else{
+    errno = EINVAL;
+    return NULL;
+  }
+  if(rs->dst_len > alen * 8){
+    errno = EINVAL;
+    return NULL;
+  }
+  const uint32_t table = rs->table ? rs->table : RT_TABLE_MAIN;
+  struct rtmsg rtm = {
+    .rtm_family = rs->family,
+    .rtm_dst_len = rs->dst_len,
+    .rtm_table = table < 256 ? table : RT_TABLE_UNSPEC,
+    .rtm_protocol = rs->protocol,
+    .rtm_scope = RT_SCOPE_NOWHERE,
+    .rtm_type = rs->type,
+  };
+  int nlflags = 0;
+  if(add){
+    if(rtm.rtm_protocol == RTPROT_UNSPEC){
+      rtm.rtm_protocol = RTPROT_STATIC;
+    }
+    if(rtm.rtm_type == RTN_UNSPEC){
+      rtm.rtm_type = RTN_UNICAST;
+    }
+    switch(rtm.rtm_type){
+      case RTN_LOCAL: case RTN_NAT:
+        rtm.rtm_scope = RT_SCOPE_HOST;
+        break;
+      case RTN_BROADCAST: case RTN_MULTICAST: case RTN_ANYCAST:
+        rtm.rtm_scope = RT_SCOPE_LINK;
+        break;
+      case RTN_UNICAST:
+        rtm.rtm_scope = !rs->has_gateway && rs->oif ? RT_SCOPE_LINK : RT_SCOPE_UNIVERSE;
+        break;
+      default:
+        rtm.rtm_scope = RT_SCOPE_UNIVERSE;
+        break;
+    }
+    nlflags = NLM_F_CREATE | ((flags & NETSTACK_BATCH_REPLACE) ? NLM_F_REPLACE : NLM_F_EXCL);
+  }
+  netstack_request* req = request_create(add ? RTM_NEWROUTE : RTM_DELROUTE,
+                                         nlflags, &rtm, sizeof(rtm));
+  if(req == NULL){
+    return NULL;
+  }
+  const uint32_t oif = rs->oif;
+  if((rs->dst_len && request_put_attr(req, RTA_DST, rs->dst, alen)) ||
+     (rs->has_gateway && request_put_attr(req, RTA_GATEWAY, rs->gateway, alen)) ||
+     (oif && request_put_attr(req, RTA_OIF, &oif, sizeof(oif))) ||
+     (rs->priority && request_put_attr(req, RTA_PRIORITY, &rs->priority, sizeof(rs->priority))) ||
+     (table >= 256 && request_put_attr(req, RTA_TABLE, &table, sizeof(table)))){
+    request_release(req);
+    return NULL;
+  }
+  return req;
+}
+
+static void
+batch_result(netstack_batch_result* result, int error, const char* extack){
+  result->error = error;
+  if(extack){
+    strncpy(result->extack, extack, sizeof(result->extack) - 1);
+    result->extack[sizeof(result->extack) - 1] = '\0';
+  }else{
+    result->extack[0] = '\0';
+  }
+}
+
+// Batches are queued in groups of BATCH_GROUP requests, up to BATCH_GROUPS
+// at a time, and collected a group at a time. Only every BATCH_ACK_EVERYth
+// request (and the last of each group) asks for acknowledgement; the others
+// are answered only if they fail. Requests are built as they're queued, by
+// build(), which returns NULL (with errno set) if the ith operation is
+// invalid. Per tests/bench/routes.cpp, acknowledging every request costs
+// about 40% of route throughput, while anything from every 16th up to once
+// per group is within noise; groups of 128 to 256 beat those of 1024 by some
+// 10-20%. Both can be overridden at build time.
+#ifndef BATCH_GROUP
+#define BATCH_GROUP 256
+#endif
+#define BATCH_GROUPS 4
+#ifndef BATCH_ACK_EVERY
+#define BATCH_ACK_EVERY 64
+#endif
+
+typedef netstack_request* (*batch_build_fn)(const void* ctx, size_t i, unsigned flags);
+
+// Wait until the netstack has caught up with everything queued so far: the
+// kernel answers in order, and its events precede its answers, so once a
+// no-op is acknowledged, we've seen the events resulting from anything sent
+// before it. Any dumps resynchronizing the cache after an overrun were queued
+// ahead of it, and complete first. We try again if it's lost to an overrun.
+static int
+batch_sync(netstack* ns){
+  int err;
+  do{
+    struct nlmsghdr nop = {};
+    netstack_request* req = request_create(NLMSG_NOOP, NLM_F_ACK, &nop, 0);
+    if(req == NULL){
+      return -1;
+    }
+    atomic_store(&req->refs, 2);
+    request_enqueue(ns, req);
+    request_wait(ns, req, 0);
+    err = req->error;
+    request_release(req);
+  }while(err == -ENOBUFS);
+  if(err){
+    errno = -err;
+    return -1;
+  }
+  return 0;
+}
+
+static int
+batch_run(netstack* ns, size_t n, batch_build_fn build, const void* ctx,
+          unsigned flags, netstack_batch_result* results){
+  if(flags & ~(NETSTACK_BATCH_REPLACE | NETSTACK_BATCH_SYNC)){
+    errno = EINVAL;
+    return -1;
+  }
+  if(in_callback(ns)){
+    errno = EDEADLK;
+    return -1;
+  }
+  const size_t ringlen = BATCH_GROUP * BATCH_GROUPS;
+  netstack_request** ring = malloc(sizeof(*ring) * ringlen);
+  if(ring == NULL){
+    return -1;
+  }
+  size_t built = 0;
+  size_t collected = 0;
+  int failures = 0;
+  while(collected < n){
+    while(built < n && built - collected < ringlen){
+      size_t end = built + BATCH_GROUP < n ? built + BATCH_GROUP : n;
+      netstack_request* head = NULL;
+      netstack_request* tail = NULL;
+      for( ; built < end ; ++built){
+        netstack_request* req = build(ctx, built, flags);
+        if((ring[built % ringlen] = req) == NULL){
+          if(results){
+            batch_result(&results[built], -errno, NULL);
+          }
+          ++failures;
+          continue;
+        }
+        if(built % BATCH_ACK_EVERY == BATCH_ACK_EVERY - 1){
+          req->nlh->nlmsg_flags |= NLM_F_ACK;
+        }
+        atomic_store(&req->refs, 2);
+        if(tail){
+          tail->next = req;
+        }else{
+          head = req;
+        }
+        tail = req;
+      }
+      if(tail){
+        tail->nlh->nlmsg_flags |= NLM_F_ACK;
+        request_enqueue_list(ns, head, tail);
+      }
+    }
+    // requests complete in order, so the last of the group marks its end
+    size_t gend = collected + BATCH_GROUP < n ? collected + BATCH_GROUP : n;
+    size_t i;
+    for(i = gend ; i > collected ; --i){
+      if(ring[(i - 1) % ringlen]){
+        request_wait(ns, ring[(i - 1) % ringlen], 0);
+        break;
+      }
+    }
+    for(i = collected ; i < gend ; ++i){
+      netstack_request* req = ring[i % ringlen];
+      if(req){
+        if(req->error){
+          ++failures;
+        }
+        if(results){
+          batch_result(&results[i], req->error, req->extack);
+        }
+        request_release(req);
+      }
+    }
+    collected = gend;
+  }
+  free(ring);
+  if((flags & NETSTACK_BATCH_SYNC) && batch_sync(ns)){
+    return -1;
+  }
+  return failures;
+}
+
+static netstack_request*
+route_add_build(const void* ctx, size_t i, unsigned flags){
+  return route_request((const netstack_route_spec*)ctx + i, true, flags);
+}
+
+static netstack_request*
+route_del_build(const void* ctx, size_t i, unsigned flags){
+  return route_request((const netstack_route_spec*)ctx + i, false, flags);
+}
+
+int netstack_route_add_batch(netstack* ns, const netstack_route_spec* routes, size_t n,
+                             unsigned flags, netstack_batch_result* results){
+  return batch_run(ns, n, route_add_build, routes, flags, results);
+}
+
+int netstack_route_del_batch(netstack* ns, const netstack_route_spec* routes, size_t n,
+                             unsigned flags, netstack_batch_result* results){
+  return batch_run(ns, n, route_del_build, routes, flags, results);
+}
+
+// Build an RTM_NEWLINK (creating a link if add, otherwise modifying one),
+// RTM_SETLINK, or RTM_DELLINK for ls. Returns NULL (with errno set) if ls is
+// invalid.
+static netstack_request*
+link_request(const netstack_link_spec* ls, int type, bool add, unsigned flags){
+  const size_t namelen = strnlen(ls->name, sizeof(ls->name));
+  const size_t kindlen = strnlen(ls->kind, sizeof(ls->kind));
+  const size_t peerlen = strnlen(ls->peer, sizeof(ls->peer));
+  if(namelen == sizeof(ls->name) || kindlen == sizeof(ls->kind) ||
+     peerlen == sizeof(ls->peer) || ls->index < 0 || ls->master < 0 ||
+     ls->l2addr_len > sizeof(ls->l2addr)){
+    errno = EINVAL;
+    return NULL;
+  }
+  if(add ? (kindlen == 0 || ls->index) : (ls->index == 0 && namelen == 0)){
+    errno = EINVAL;
+    return NULL;
+  }
+  if(peerlen && strcmp(ls->kind, "veth")){
+    errno = EINVAL;
+    return NULL;
+  }
+  struct ifinfomsg ifi = {
+    .ifi_family = AF_UNSPEC,
+    .ifi_index = ls->index,
+    .ifi_flags = ls->flags & ls->change,
+    .ifi_change = ls->change,
+  };
+  int nlflags = 0;
+  if(add){
+    nlflags = NLM_F_CREATE | ((flags & NETSTACK_BATCH_REPLACE) ? 0 : NLM_F_EXCL);
+  }
+  netstack_request* req = request_create(type, nlflags, &ifi, sizeof(ifi));
+  if(req == NULL){
+    return NULL;
+  }
+  if(type == RTM_DELLINK){
+    if(namelen && request_put_attr(req, IFLA_IFNAME, ls->name, namelen + 1)){
+      goto err;
+    }
+    return req;
+  }
+  const uint32_t mtu = ls->mtu;
+  const uint32_t txqlen = ls->txqlen;
+  const uint32_t master = ls->master;
+  if((namelen && request_put_attr(req, IFLA_IFNAME, ls->name, namelen + 1)) ||
+     (mtu && request_put_attr(req, IFLA_MTU, &mtu, sizeof(mtu))) ||
+     (txqlen && request_put_attr(req, IFLA_TXQLEN, &txqlen, sizeof(txqlen))) ||
+     (master && request_put_attr(req, IFLA_MASTER, &master, sizeof(master))) ||
+     (ls->l2addr_len && request_put_attr(req, IFLA_ADDRESS, ls->l2addr, ls->l2addr_len))){
+    goto err;
+  }
+  if(add){
+    int linkinfo = request_nest_start(req, IFLA_LINKINFO, NULL, 0);
+    if(linkinfo < 0 || request_put_attr(req, IFLA_INFO_KIND, ls->kind, kindlen)){
+      goto err;
+    }
+    if(peerlen){
+      struct ifinfomsg peeri = { .ifi_family = AF_UNSPEC, };
+      int data = request_nest_start(req, IFLA_INFO_DATA, NULL, 0);
+      int peer = data < 0 ? -1 : request_nest_start(req, VETH_INFO_PEER, &peeri, sizeof(peeri));
+      if(peer < 0 || request_put_attr(req, IFLA_IFNAME, ls->peer, peerlen + 1)){
+        goto err;
+      }
+      request_nest_end(req, peer);
+      request_nest_end(req, data);
+    }
+    request_nest_end(req, linkinfo);
+  }
+  return req;
+
+err:
+  request_release(req);
+  return NULL;
+}
+
+// Build an RTM_NEWADDR or RTM_DELADDR for as, following ip-address(8).
+// Returns NULL (with errno set) if as is invalid.
+static netstack_request*
+addr_request(const netstack_addr_spec* as, bool add, unsigned flags){
+  size_t alen;
+  if(as->family == AF_INET){
+    alen = 4;
+  }else if(as->family == AF_INET6){
+    alen = 16;
+  }else{
+    errno = EINVAL;
+    return NULL;
+  }
+  const size_t labellen = strnlen(as->label, sizeof(as->label));
+  if(as->prefixlen > alen * 8 || as->index <= 0 || labellen == sizeof(as->label)){
+    errno = EINVAL;
+    return NULL;
+  }
+  struct ifaddrmsg ifa = {
+    .ifa_family = as->family,
+    .ifa_prefixlen = as->prefixlen,
+    .ifa_flags = as->flags & 0xff,
+    .ifa_scope = as->scope,
+    .ifa_index = as->index,
+  };
+  int nlflags = 0;
+  if(add){
+    nlflags = NLM_F_CREATE | ((flags & NETSTACK_BATCH_REPLACE) ? NLM_F_REPLACE : NLM_F_EXCL);
+  }
+  netstack_request* req = request_create(add ? RTM_NEWADDR : RTM_DELADDR,
+                                         nlflags, &ifa, sizeof(ifa));
+  if(req == NULL){
+    return NULL;
+  }
+  const void* address = as->has_peer ? as->peer : as->addr;
+  if(request_put_attr(req, IFA_LOCAL, as->addr, alen) ||
+     request_put_attr(req, IFA_ADDRESS, address, alen) ||
+     (labellen && request_put_attr(req, IFA_LABEL, as->label, labellen + 1))){
+    request_release(req);
+    return NULL;
+  }
+  if(add){
+    struct ifa_cacheinfo ci = {
+      .ifa_valid = as->valid_lft ? as->valid_lft : UINT32_MAX,
+    };
+    ci.ifa_prefered = as->preferred_lft ? as->preferred_lft : ci.ifa_valid;
+    if(request_put_attr(req, IFA_FLAGS, &as->flags, sizeof(as->flags)) ||
+       ((as->valid_lft || as->preferred_lft) &&
+        request_put_attr(req, IFA_CACHEINFO, &ci, sizeof(ci)))){
+      request_release(req);
+      return NULL;
+    }
+  }
+  return req;
+}
+
+typedef enum {
+  BATCH_LINK_ADD,
+  BATCH_LINK_SET,
+  BATCH_LINK_DEL,
+  BATCH_ADDR_ADD,
+  BATCH_ADDR_DEL,
+  BATCH_ROUTE_ADD,
+  BATCH_ROUTE_DEL,
+} batch_op_e;
+
+typedef struct batch_op {
+  batch_op_e op;
+  union {
+    netstack_link_spec link;
+    netstack_addr_spec addr;
+    netstack_route_spec route;
+  } spec;
+} batch_op;
+
+// Operations are recorded by value, and their messages built upon commit.
+typedef struct netstack_batch {
+  batch_op* ops;
+  size_t count, size;
+} netstack_batch;
+
+netstack_batch* netstack_batch_create(void){
+  netstack_batch* nb = malloc(sizeof(*nb));
+  if(nb){
+    nb->ops = NULL;
+    nb->count = nb->size = 0;
+  }
+  return nb;
+}
+
+void netstack_batch_destroy(netstack_batch* nb){
+  if(nb){
+    free(nb->ops);
+    free(nb);
+  }
+}
+
+size_t netstack_batch_count(const netstack_batch* nb){
+  return nb->count;
+}
+
+void netstack_batch_clear(netstack_batch* nb){
+  nb->count = 0;
+}
+
+// Copy len bytes of spec into a new operation.
+static int
+batch_append(netstack_batch* nb, batch_op_e op, const void* spec, size_t len){
+  if(spec == NULL){
+    errno = EINVAL;
+    return -1;
+  }
+  if(nb->count == nb->size){
+    size_t nsize = nb->size ? nb->size * 2 : 64;
+    batch_op* tmp = realloc(nb->ops, sizeof(*tmp) * nsize);
+    if(tmp == NULL){
+      return -1;
+    }
+    nb->ops = tmp;
+    nb->size = nsize;
+  }
+  batch_op* bo = &nb->ops[nb->count++];
+  bo->op = op;
+  memcpy(&bo->spec, spec, len);
+  return 0;
+}
+
+int netstack_batch_link_add(netstack_batch* nb, const netstack_link_spec* ls){
+  return batch_append(nb, BATCH_LINK_ADD, ls, sizeof(*ls));
+}
+
+int netstack_batch_link_set(netstack_batch* nb, const netstack_link_spec* ls){
+  return batch_append(nb, BATCH_LINK_SET, ls, sizeof(*ls));
+}
+
+int netstack_batch_link_del(netstack_batch* nb, const netstack_link_spec* ls){
+  return batch_append(nb, BATCH_LINK_DEL, ls, sizeof(*ls));
+}
+
+int netstack_batch_addr_add(netstack_batch* nb, const netstack_addr_spec* as){
+  return batch_append(nb, BATCH_ADDR_ADD, as, sizeof(*as));
+}
+
+int netstack_batch_addr_del(netstack_batch* nb, const netstack_addr_spec* as){
+  return batch_append(nb, BATCH_ADDR_DEL, as, sizeof(*as));
+}
+
+int netstack_batch_route_add(netstack_batch* nb, const netstack_route_spec* rs){
+  return batch_append(nb, BATCH_ROUTE_ADD, rs, sizeof(*rs));
+}
+
+int netstack_batch_route_del(netstack_batch* nb, const netstack_route_spec* rs){
+  return batch_append(nb, BATCH_ROUTE_DEL, rs, sizeof(*rs));
+}
+
+static netstack_request*
+batch_op_build(const void* ctx, size_t i, unsigned flags){
+  const batch_op* bo = (const batch_op*)ctx + i;
+  switch(bo->op){
+    case BATCH_LINK_ADD: return link_request(&bo->spec.link, RTM_NEWLINK, true, flags);
+    case BATCH_LINK_SET: return link_request(&bo->spec.link, RTM_SETLINK, false, flags);
+    case BATCH_LINK_DEL: return link_request(&bo->spec.link, RTM_DELLINK, false, flags);
+    case BATCH_ADDR_ADD: return addr_request(&bo->spec.addr, true, flags);
+    case BATCH_ADDR_DEL: return addr_request(&bo->spec.addr, false, flags);
+    case BATCH_ROUTE_ADD: return route_request(&bo->spec.route, true, flags);
+    case BATCH_ROUTE_DEL: return route_request(&bo->spec.route, false, flags);
+  }
+  errno = EINVAL;
+  return NULL;
+}
+
+int netstack_batch_commit(netstack* ns, const netstack_batch* nb, unsigned flags,
+                          netstack_batch_result* results){
+  return batch_run(ns, nb->count, batch_op_build, nb->ops, flags, results);
+}
+
+int netstack_iface_stats_refresh_sync(netstack* ns, int ifindex, int timeout_ms){
+  if(ifindex < 0){
+    return -1;
+  }
+  if(in_callback(ns)){
+    errno = EDEADLK;
+    return -1;
+  }
+  const uint64_t start = monotonic_nsec();
+  netstack_request* req = stats_request(ifindex);
+  if(req == NULL){
+    return -1;
+  }
+  atomic_fetch_add(&req->refs, 1);
+  request_enqueue(ns, req);
+  int r = request_wait(ns, req, request_deadline(timeout_ms));
+  if(r == 0 && req->error){ // e.g. ENODEV
+    r = -1;
+  }
+  request_release(req);
+  if(r){
+    return -1;
+  }
+  if(ifindex){
+    uint64_t nsec;
+    stats_slot* ss = stats_slot_find(ns, ifindex);
+    if(ss == NULL || !stats_slot_read(ss, ifindex, NULL, &nsec) || nsec < start){
+      return -1;
+    }
+  }
+  return 0;
+}
+
+bool netstack_iface_stats_latest(netstack* ns, int ifindex, struct rtnl_link_stats64* stats){
+  stats_slot* ss = stats_slot_find(ns, ifindex);
+  return ss && stats_slot_read(ss, ifindex, stats, NULL);
+}
+
+// Copy out a consistent view of the slot's samples, oldest first. Returns the
+// number copied (at most ns->sample_depth), or 0 if the slot doesn't belong
+// to ifindex.
+static unsigned
+stats_slot_samples(const netstack* ns, stats_slot* ss, int ifindex, uint64_t* out){
+  unsigned s1, s2;
+  int idx;
+  uint64_t samples;
+  unsigned n;
+  do{
+    s1 = atomic_load_explicit(&ss->seq, memory_order_acquire);
+    idx = atomic_load_explicit(&ss->ifindex, memory_order_relaxed);
+    samples = atomic_load_explicit(&ss->samples, memory_order_relaxed);
+    n = samples < ns->sample_depth ? samples : ns->sample_depth;
+    unsigned i;
+    for(i = 0 ; i < n ; ++i){
+      // the oldest retained sample is at samples - n
+      size_t off = ((samples - n + i) % ns->sample_depth) * SAMPLE_WORDS;
+      size_t z;
+      for(z = 0 ; z < SAMPLE_WORDS ; ++z){
+        out[i * SAMPLE_WORDS + z] = atomic_load_explicit(&ss->ring[off + z], memory_order_relaxed);
+      }
+    }
+    atomic_thread_fence(memory_order_acquire);
+    s2 = atomic_load_explicit(&ss->seq, memory_order_relaxed);
+  }while((s1 & 1) || s1 != s2);
+  return idx == ifindex ? n : 0;
+}
+
+int netstack_iface_rates(netstack* ns, int ifindex, unsigned window_ms,
+                         netstack_rates* rates){
+  stats_slot* ss;
+  if(ns->sample_depth < 2 || (ss = stats_slot_find(ns, ifindex)) == NULL){
+    return -1;
+  }
+  uint64_t samples[SAMPLE_WORDS * NETSTACK_SAMPLE_DEPTH_MAX];
+  unsigned n = stats_slot_samples(ns, ss, ifindex, samples);
+  // use the newest sample, and all those within window_ms of it
+  unsigned first = 0;
+  if(n && window_ms){
+    const uint64_t newest = samples[(n - 1) * SAMPLE_WORDS];
+    const uint64_t window = (uint64_t)window_ms * 1000000ull;
+    while(first + 1 < n && newest - samples[first * SAMPLE_WORDS] > window){
+      ++first;
+    }
+  }
+  if(n - first < 2){
+    return -1;
+  }
+  // Sum the deltas between consecutive samples. A counter which went
+  // backwards was reset (e.g. by a driver reload), so its new value is
+  // the delta since the reset.
+  uint64_t deltas[SAMPLE_COUNTERS] = {0};
+  unsigned i;
+  for(i = first + 1 ; i < n ; ++i){
+    const uint64_t* prev = &samples[(i - 1) * SAMPLE_WORDS + 1];
+    const uint64_t* cur = &samples[i * SAMPLE_WORDS + 1];
+    size_t z;
+    for(z = 0 ; z < SAMPLE_COUNTERS ; ++z){
+      deltas[z] += cur[z] >= prev[z] ? cur[z] - prev[z] : cur[z];
+    }
+  }
+  const uint64_t nsec = samples[(n - 1) * SAMPLE_WORDS] - samples[first * SAMPLE_WORDS];
+  if(nsec == 0){
+    return -1;
+  }
+  const double secs = nsec / 1e9;
+  rates->rx_pps = deltas[0] / secs;
+  rates->tx_pps = deltas[1] / secs;
+  rates->rx_bps = deltas[2] * 8 / secs;
+  rates->tx_bps = deltas[3] * 8 / secs;
+  rates->rx_errors_ps = deltas[4] / secs;
+  rates->tx_errors_ps = deltas[5] / secs;
+  rates->rx_drops_ps = deltas[6] / secs;
+  rates->tx_drops_ps = deltas[7] / secs;
+  rates->nsec = nsec;
+  rates->samples = n - first;
+  return 0;
+}
+
+// Queue a sampling dump of all links' stats, unless the last is outstanding.
+// Only the sampler (or, threadless, the processing thread) calls this.
+static void
+sample_links(netstack* ns){
+  if(ns->sample_req){
+    if(!atomic_load(&ns->sample_req->done)){
+      return;
+    }
+    request_release(ns->sample_req);
+  }
+  if((ns->sample_req = stats_request(0)) == NULL){
+    ns->opts.diagfxn("Couldn't queue stats sample\n");
+    return;
+  }
+  atomic_fetch_add(&ns->sample_req->refs, 1);
+  request_enqueue(ns, ns->sample_req);
+}
+
+static void*
+netstack_sampler_thread(void* vns){
+  netstack* ns = vns;
+  const uint64_t interval = (uint64_t)ns->opts.sample_interval_ms * 1000000ull;
+  uint64_t next = monotonic_nsec();
+  while(true){
+    next += interval;
+    struct timespec ts = {
+      .tv_sec = next / 1000000000ull,
+      .tv_nsec = next % 1000000000ull,
+    };
+    while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR){
+      ;
+    }
+    sample_links(ns);
+  }
+  return NULL;
+}
+
+// Threadless sampling: queue a sample if one is due.
+static void
+sample_if_due(netstack* ns){
+  if(ns->opts.sample_interval_ms){
+    const uint64_t now = monotonic_nsec();
+    if(now >= ns->sample_next){
+      ns->sample_next = now + (uint64_t)ns->opts.sample_interval_ms * 1000000ull;
+      sample_links(ns);
+    }
+  }
+}
+
+static int
+msg_handler_internal(netstack* ns, const struct nlmsghdr* nhdr, int nsid){
+  const int ntype = nhdr->nlmsg_type;
+  const int nlen = nhdr->nlmsg_len;
+  const struct rtattr *rta = NULL;
+  const struct ifinfomsg* ifi = NLMSG_DATA(nhdr);
+  const struct ifaddrmsg* ifa = NLMSG_DATA(nhdr);
+  const struct rtmsg* rt = NLMSG_DATA(nhdr);
+  const struct ndmsg* nd = NLMSG_DATA(nhdr);
+  const struct fib_rule_hdr* frh = NLMSG_DATA(nhdr);
+  const struct nhmsg* nhm = NLMSG_DATA(nhdr);
+  const struct tcmsg* tcm = NLMSG_DATA(nhdr);
+  const void* hdr = NULL; // aliases one of the NLMSG_DATA lvalues above
+  size_t hdrsize = 0; // size of leading object (hdr), depends on message type
+  // processor for rtattr objects in this type regime. takes the newly-created
+  // netstack_* object (newobj), the leading type-dependent object (aliased
+  // by hdr), the offset of the RTA being handled, and &rlen.
+  bool (*pfxn)(void*, const void*, size_t, int*);
+  void (*dfxn)(void*); // destroyer of this type of object
+  void (*cfxn)(netstack*, netstack_event_e, void*); // user callback wrapper
+  void* (*gfxn)(const struct rtattr*, int, int); // constructor
+  netstack_event_e etype;
+  switch(ntype){
+    case RTM_DELLINK: // intentional fallthrough
+    case RTM_NEWLINK:
+      hdr = ifi;
+      rta = IFLA_RTA(ifi);
+      hdrsize = sizeof(*ifi);
+      pfxn = viface_rta_handler;
+      dfxn = vfree_iface;
+      cfxn = viface_cb;
+      gfxn = vcreate_iface;
+      etype = (ntype == RTM_DELLINK) ? NETSTACK_DEL : NETSTACK_MOD;
+      break;
+    case RTM_DELADDR: // intentional fallthrough
+    case RTM_NEWADDR:
+      hdr = ifa;
+      rta = IFA_RTA(ifa);
+      hdrsize = sizeof(*ifa);
+      pfxn = vaddr_rta_handler;
+      dfxn = vfree_addr;
+      cfxn = vaddr_cb;
+      gfxn = vcreate_addr;
+      etype = (ntype == RTM_DELADDR) ? NETSTACK_DEL : NETSTACK_MOD;
+      break;
+    case RTM_DELROUTE: // intentional fallthrough
+    case RTM_NEWROUTE:
+      hdr = rt;
+      rta = RTM_RTA(rt);
+      hdrsize = sizeof(*rt);
+      pfxn = vroute_rta_handler;
+      dfxn = vfree_route;
+      cfxn = vroute_cb;
+      gfxn = vcreate_route;
+      etype = (ntype == RTM_DELROUTE) ? NETSTACK_DEL : NETSTACK_MOD;
+      break;
+    case RTM_DELNEIGH: // intentional fallthrough
+    case RTM_NEWNEIGH:
+      hdr = nd;
+      rta = NDA_RTA(nd);
+      hdrsize = sizeof(*nd);
+      pfxn = vneigh_rta_handler;
+      dfxn = vfree_neigh;
+      cfxn = vneigh_cb;
+      gfxn = vcreate_neigh;
+      etype = (ntype == RTM_DELNEIGH) ? NETSTACK_DEL : NETSTACK_MOD;
+      break;
+    case RTM_DELRULE: // intentional fallthrough
+    case RTM_NEWRULE:
+      hdr = frh;
+      rta = (const struct rtattr*)((const char*)frh + NLMSG_ALIGN(sizeof(*frh)));
+      hdrsize = sizeof(*frh);
+      pfxn = vrule_rta_handler;
+      dfxn = vfree_rule;
+      cfxn = vrule_cb;
+      gfxn = vcreate_rule;
+      etype = (ntype == RTM_DELRULE) ? NETSTACK_DEL : NETSTACK_MOD;
+      break;
+    case RTM_DELNEXTHOP: // intentional fallthrough
+    case RTM_NEWNEXTHOP:
+      hdr = nhm;
+      rta = (const struct rtattr*)((const char*)nhm + NLMSG_ALIGN(sizeof(*nhm)));
+      hdrsize = sizeof(*nhm);
+      pfxn = vnexthop_rta_handler;
+      dfxn = vfree_nexthop;
+      cfxn = vnexthop_cb;
+      gfxn = vcreate_nexthop;
+      etype = (ntype == RTM_DELNEXTHOP) ? NETSTACK_DEL : NETSTACK_MOD;
+      break;
+    case RTM_NEWQDISC: // intentional fallthrough
+    case RTM_NEWTCLASS:
+      if(nsid == NETSTACK_NSID_LOCAL && !ns->opts.tc_notrack &&
+         tc_refresh_in_place(ns, nhdr, ntype == RTM_NEWTCLASS)){
+        return 0;
+      }
+      // intentional fallthrough
+    case RTM_DELQDISC: // intentional fallthrough
+    case RTM_DELTCLASS:
+      hdr = tcm;
+      rta = (const struct rtattr*)((const char*)tcm + NLMSG_ALIGN(sizeof(*tcm)));
+      hdrsize = sizeof(*tcm);
+      pfxn = (ntype == RTM_NEWTCLASS || ntype == RTM_DELTCLASS) ?
+              vtclass_rta_handler : vqdisc_rta_handler;
+      dfxn = vfree_tc;
+      cfxn = vtc_cb;
+      gfxn = vcreate_tc;
+      etype = (ntype == RTM_DELQDISC || ntype == RTM_DELTCLASS) ? NETSTACK_DEL : NETSTACK_MOD;
+      break;
+    case RTM_DELNEXTHOPBUCKET: // intentional fallthrough
+    case RTM_NEWNEXTHOPBUCKET: // resilient group buckets aren't tracked
+      return 0;
+    case RTM_DELNSID: // intentional fallthrough
+    case RTM_NEWNSID:
+      if(nsid_handler(ns, nhdr)){
+        atomic_fetch_add(&ns->parse_failures, 1);
+        ns->opts.diagfxn("Invalid nsid message\n");
+        return -1;
+      }
+      return 0;
+    case RTM_NEWSTATS:
+      if(nsid == NETSTACK_NSID_LOCAL && stats_handler(ns, nhdr)){
+        atomic_fetch_add(&ns->parse_failures, 1);
+        ns->opts.diagfxn("Invalid stats message\n");
+        return -1;
+      }
+      return 0;
+    default: ns->opts.diagfxn("Unknown nl type: %d\n", ntype); break;
+  }
+  if(hdrsize == 0){
+    return 0;
+  }
+  const struct rtattr* riter = rta;
+  // FIXME factor all of this out probably
+  int rlen = nlen - NLMSG_LENGTH(hdrsize);
+  if(rlen < 0){
+    atomic_fetch_add(&ns->parse_failures, 1);
+    ns->opts.diagfxn("Netlink message was too short (%d)\n", nlen);
+    return -1;
+  }
+  if((ns->include || ns->exclude) &&
+     iface_filtered(ns, ntype, hdr, rta, rlen, nsid, &etype)){
+    atomic_fetch_add(&ns->filtered, 1);
+    return 0;
+  }
+  void* newobj = gfxn(rta, rlen, nsid);
+  // always there is an RTA extraction pfxn
+  while(RTA_OK(riter, rlen)){
+    if(!pfxn(newobj, hdr, (char*)riter - (char*)rta, &rlen)){
+      break;
+    }
+    riter = RTA_NEXT(riter, rlen);
+  }
+  if(rlen){
+    dfxn(newobj);
+    atomic_fetch_add(&ns->parse_failures, 1);
+    ns->opts.diagfxn("Netlink attr was invalid, %db left\n", rlen);
+    return -1;
+  }
+  if(ntype == RTM_NEWROUTE){
+    ((netstack_route*)newobj)->nlflags = nhdr->nlmsg_flags;
+  }
+  cfxn(ns, etype, newobj);
+  return 0;
+}
+
+// Find the request on the wire having seq, and take it off. Others are
+// answered in order, so any sent before it are finished: successfully if they
+// didn't ask for an acknowledgement, and otherwise with ENOBUFS (answers are
+// dropped when we overrun our receive buffer). Returns NULL if there is no
+// such request (e.g. it was failed following an overrun). Call with txlock
+// held.
+static netstack_request*
+request_match_locked(netstack* ns, uint32_t seq){
+  netstack_request* req = ns->dumpreq;
+  if(req && req->nlh->nlmsg_seq == seq){
+    ns->dumpreq = NULL;
+    return req;
+  }
+  while(ns->sent && seq_before(ns->sent->nlh->nlmsg_seq, seq)){
+    req = sent_pop_locked(ns);
+    request_finish_locked(ns, req, (req->nlh->nlmsg_flags & NLM_F_ACK) ?
+                          -ENOBUFS : 0, NULL, -1);
+  }
+  if(ns->sent && ns->sent->nlh->nlmsg_seq == seq){
+    return sent_pop_locked(ns);
+  }
+  return NULL;
+}
+
+// Account for the time taken by a dump.
+static void
+dump_account(netstack* ns, uint64_t nsec){
+  atomic_fetch_add(&ns->dumps, 1);
+  atomic_fetch_add(&ns->dump_nsec_total, nsec);
+  uintmax_t max = atomic_load(&ns->dump_nsec_max);
+  while(nsec > max && !atomic_compare_exchange_weak(&ns->dump_nsec_max, &max, nsec)){
+    ;
+  }
+  size_t b = 0;
+  while(b < DUMP_BUCKETS - 1 && nsec > dump_buckets[b]){
+    ++b;
+  }
+  atomic_fetch_add(&ns->dump_histogram[b], 1);
+}
+
+// Complete the request answered by nhdr, if we know of it, and transmit
+// whatever there's now room for (threadless only; otherwise, the txthread has
+// been signaled).
+static void
+request_answer(netstack* ns, const struct nlmsghdr* nhdr, int error,
+               const char* extack, int extack_off){
+  pthread_mutex_lock(&ns->txlock);
+  netstack_request* req = request_match_locked(ns, nhdr->nlmsg_seq);
+  if(req && req->dump && error == -EBUSY){
+    // the kernel is still running a dump we gave up on (see rx_lost()). it
+    // advances as we receive, so put this one back at the front of the queue.
+    if((req->next = ns->queued) == NULL){
+      ns->queuedtail = &req->next;
+    }
+    ns->queued = req;
+    pthread_cond_signal(&ns->txcond);
+  }else if(req){
+    if(req->dump){
+      dump_account(ns, monotonic_nsec() - req->sent);
+    }
+    request_finish_locked(ns, req, error, extack, extack_off);
+  }
+  if(ns->opts.threadless){
+    tx_pump_locked(ns);
+  }
+  pthread_mutex_unlock(&ns->txlock);
+}
+
+// NLMSG_DONE terminates a dump, and carries its result.
+static void
+finish_handler(netstack* ns, const struct nlmsghdr* nhdr){
+  int error = 0;
+  if(nhdr->nlmsg_len >= NLMSG_LENGTH(sizeof(error))){
+    memcpy(&error, NLMSG_DATA(nhdr), sizeof(error));
+  }
+  if(error){
+    ns->opts.diagfxn("Netlink dump error %d (%s)\n", -error, strerror(-error));
+    atomic_fetch_add(&ns->netlink_errors, 1);
+  }
+  request_answer(ns, nhdr, error, NULL, -1);
+}
+
+// Extract the extended acknowledgement, if any, following the nlmsgerr (and
+// the echoed request, unless it was capped).
+static void
+extack_parse(const struct nlmsghdr* nhdr, const struct nlmsgerr* nlerr,
+             const char** msg, int* off){
+  *msg = NULL;
+  *off = -1;
+  if(!(nhdr->nlmsg_flags & NLM_F_ACK_TLVS)){
+    return;
+  }
+  size_t payload = sizeof(*nlerr);
+  if(!(nhdr->nlmsg_flags & NLM_F_CAPPED)){
+    if(nlerr->msg.nlmsg_len < NLMSG_HDRLEN){
+      return;
+    }
+    payload += nlerr->msg.nlmsg_len - NLMSG_HDRLEN;
+  }
+  if(nhdr->nlmsg_len < NLMSG_LENGTH(NLMSG_ALIGN(payload))){
+    return;
+  }
+  int rlen = nhdr->nlmsg_len - NLMSG_LENGTH(NLMSG_ALIGN(payload));
+  const struct rtattr* rta = (const struct rtattr*)
+    ((const char*)NLMSG_DATA(nhdr) + NLMSG_ALIGN(payload));
+  while(RTA_OK(rta, rlen)){
+    const int type = rta->rta_type & NLA_TYPE_MASK;
+    if(type == NLMSGERR_ATTR_MSG){
+      if(RTA_PAYLOAD(rta) && strnlen(RTA_DATA(rta), RTA_PAYLOAD(rta)) < RTA_PAYLOAD(rta)){
+        *msg = RTA_DATA(rta);
+      }
+    }else if(type == NLMSGERR_ATTR_OFFS){
+      uint32_t o;
+      if(netstack_rtattrcpy_exact(rta, &o, sizeof(o)) && o <= INT_MAX){
+        *off = o;
+      }
+    }
+    rta = RTA_NEXT(rta, rlen);
+  }
+}
+
+// NLMSG_ERROR answers a request. An error of 0 is an acknowledgement.
+static void
+err_handler(netstack* ns, const struct nlmsghdr* nhdr){
+  const struct nlmsgerr* nlerr = NLMSG_DATA(nhdr);
+  if(nhdr->nlmsg_len < NLMSG_LENGTH(sizeof(*nlerr))){
+    atomic_fetch_add(&ns->parse_failures, 1);
+    return;
+  }
+  const char* extack;
+  int extack_off;
+  extack_parse(nhdr, nlerr, &extack, &extack_off);
+  if(nlerr->error){
+    ns->opts.diagfxn("Netlink error %d (%s)%s%s\n", -nlerr->error,
+                     strerror(-nlerr->error), extack ? ": " : "",
+                     extack ? extack : "");
+    atomic_fetch_add(&ns->netlink_errors, 1);
+  }
+  request_answer(ns, nhdr, nlerr->error, extack, extack_off);
+}
+
+// Messages from peer namespaces carry their nsid as ancillary data
+static int
+cmsg_nsid(struct msghdr* mh){
+  int nsid = NETSTACK_NSID_LOCAL;
+  struct cmsghdr* cmsg;
+  for(cmsg = CMSG_FIRSTHDR(mh) ; cmsg ; cmsg = CMSG_NXTHDR(mh, cmsg)){
+    if(cmsg->cmsg_level == SOL_NETLINK && cmsg->cmsg_type == NETLINK_LISTEN_ALL_NSID){
+      memcpy(&nsid, CMSG_DATA(cmsg), sizeof(nsid));
+    }
+  }
+  return nsid;
+}
+
+// Only the kernel (port 0) speaks for the stack. Any local process can unicast
+// to our port, and must not be able to feed us objects (libnl checked this for
+// us, back when it did our receiving).
+static bool
+rx_from_kernel(const void* name, size_t namelen){
+  struct sockaddr_nl sa;
+  if(namelen < sizeof(sa)){
+    return false;
+  }
+  memcpy(&sa, name, sizeof(sa));
+  return sa.nl_family == AF_NETLINK && sa.nl_pid == 0;
+}
+
+// We've lost some of what the kernel sent us: it dropped messages on us (err is
+// -ENOBUFS), or a datagram was truncated (-EMSGSIZE). The cache can no longer
+// be trusted, and the answers to requests on the wire might be gone. seq is
+// that of the first message of a truncated datagram, or 0.
+static void
+rx_lost(netstack* ns, int err, uint32_t seq){
+  // queue the dumps before completing anything, so that anyone queueing a
+  // request upon completion (see batch_sync()) gets it answered after them
+  if(resync(ns) == 0){
+    atomic_fetch_add(&ns->resyncs, 1);
+  }
+  pthread_mutex_lock(&ns->txlock);
+  sent_fail_locked(ns, err);
+  // a truncated datagram of the dump might have held its NLMSG_DONE. should
+  // the kernel in fact still be dumping, the next dump is answered with EBUSY,
+  // and retried (see request_answer()).
+  if(seq && ns->dumpreq && ns->dumpreq->nlh->nlmsg_seq == seq){
+    netstack_request* req = ns->dumpreq;
+    ns->dumpreq = NULL;
+    request_finish_locked(ns, req, err, NULL, -1);
+  }
+  if(ns->opts.threadless){
+    tx_pump_locked(ns);
+  }
+  pthread_mutex_unlock(&ns->txlock);
+  requests_complete(ns);
+}
+
+// Run req, a dump, to completion on strictnl, handling each object as if it
+// had arrived on our socket. Returns -1 on failure, after which strictnl is
+// left in an unknown state.
+static int
+strict_dump(netstack* ns, netstack_request* req, char* buf){
+  req->nlh->nlmsg_seq = 1;
+  if(send(ns->strictnl, req->nlh, req->nlh->nlmsg_len, 0) < 0){
+    return -1;
+  }
+  for( ; ; ){
+    struct iovec iov = {
+      .iov_base = buf,
+      .iov_len = RXBUF_BYTES,
+    };
+    struct sockaddr_nl sa;
+    struct msghdr mh = {
+      .msg_name = &sa,
+      .msg_namelen = sizeof(sa),
+      .msg_iov = &iov,
+      .msg_iovlen = 1,
+    };
+    ssize_t r = recvmsg(ns->strictnl, &mh, 0);
+    if(r < 0){
+      if(errno == EINTR){
+        continue;
+      }
+      return -1;
+    }
+    if(!rx_from_kernel(&sa, mh.msg_namelen)){
+      continue;
+    }
+    if(mh.msg_flags & MSG_TRUNC){
+      atomic_fetch_add(&ns->parse_failures, 1);
+      errno = EMSGSIZE;
+      return -1;
+    }
+    size_t len = r;
+    const struct nlmsghdr* nhdr;
+    for(nhdr = (const struct nlmsghdr*)buf ; NLMSG_OK(nhdr, len) ; nhdr = NLMSG_NEXT(nhdr, len)){
+      int error = 0;
+      if(nhdr->nlmsg_type == NLMSG_DONE){
+        if(nhdr->nlmsg_len >= NLMSG_LENGTH(sizeof(error))){
+          memcpy(&error, NLMSG_DATA(nhdr), sizeof(error));
+        }
+      }else if(nhdr->nlmsg_type == NLMSG_ERROR){
+        if(nhdr->nlmsg_len >= NLMSG_LENGTH(sizeof(error))){
+          memcpy(&error, NLMSG_DATA(nhdr), sizeof(error));
+        }
+        error = error ? error : -EPROTO;
+      }else{
+        if(nhdr->nlmsg_type != NLMSG_NOOP){
+          msg_handler_internal(ns, nhdr, NETSTACK_NSID_LOCAL);
+        }
+        continue;
+      }
+      if(error){
+        errno = -error;
+        return -1;
+      }
+      return 0;
+    }
+  }
+}
+
+// Dump the objects of link ifindex through strictnl, save those of types we
+// don't track. A link which has since disappeared has nothing to dump.
+static int
+redump_link(netstack* ns, int ifindex, char* buf){
+  int d;
+  for(d = 0 ; d < ns->dumpercount ; ++d){
+    const int type = ns->dumpers[d];
+    if(type == RTM_GETLINK || type == RTM_GETRULE || type == RTM_GETNSID){
+      continue;
+    }
+    netstack_request* req = link_dump_request(type, ifindex);
+    if(req == NULL){
+      return -1;
+    }
+    int r = strict_dump(ns, req, buf);
+    request_release(req);
+    if(r){
+      return errno == ENODEV ? 0 : -1;
+    }
+  }
+  return 0;
+}
+
+// Dump the objects of each link awaiting redump (see link_redump()), the links
+// themselves having just been handled. Should any dump fail, we give up on
+// strictnl, and resync instead.
+static void
+redump_links(netstack* ns){
+  char* buf = malloc(RXBUF_BYTES);
+  unsigned z;
+  for(z = 0 ; buf && z < ns->redump_count ; ++z){
+    if(redump_link(ns, ns->redumps[z], buf)){
+      break;
+    }
+  }
+  if(buf == NULL || z < ns->redump_count){
+    ns->opts.diagfxn("Couldn't redump link %d (%s), resyncing\n",
+                     buf ? ns->redumps[z] : 0, strerror(errno));
+    close(ns->strictnl);
+    ns->strictnl = -1;
+    resync(ns);
+  }
+  free(buf);
+  ns->redump_count = 0;
+}
+
+// Dispatch each of the messages in a received datagram of nlen bytes. msgflags
+// are those returned by recvmsg(), and kernel is whether it came from the
+// kernel (see rx_from_kernel()). Returns the number of messages handled.
+static int
+rx_dispatch(netstack* ns, const void* buf, int nlen, int msgflags, int nsid, bool kernel){
+  int oldcancelstate;
+  pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldcancelstate);
+  if(!kernel){
+    ns->opts.diagfxn("Dropped a netlink datagram not from the kernel\n");
+    nlen = 0;
+  }else if(msgflags & MSG_TRUNC){
+    atomic_fetch_add(&ns->parse_failures, 1);
+    ns->opts.diagfxn("Netlink datagram was truncated, resyncing\n");
+    const struct nlmsghdr* first = buf;
+    rx_lost(ns, -EMSGSIZE, nlen >= NLMSG_HDRLEN ? first->nlmsg_seq : 0);
+    nlen = 0;
+  }
+  const struct nlmsghdr* nhdr = buf;
+  int msgs = 0;
+  while(NLMSG_OK(nhdr, nlen)){
+    ++msgs;
+    switch(nhdr->nlmsg_type){
+      case NLMSG_NOOP: break;
+      case NLMSG_DONE: finish_handler(ns, nhdr); break;
+      case NLMSG_ERROR: err_handler(ns, nhdr); break;
+      default: msg_handler_internal(ns, nhdr, nsid); break;
+    }
+    nhdr = NLMSG_NEXT(nhdr, nlen);
+  }
+  if(nlen){
+    atomic_fetch_add(&ns->parse_failures, 1);
+    ns->opts.diagfxn("Netlink message was invalid, %db left\n", nlen);
+  }
+  if(ns->redump_count){
+    redump_links(ns);
+  }
+  requests_complete(ns);
+  pthread_setcancelstate(oldcancelstate, &oldcancelstate);
+  return msgs;
+}
+
+// Receive a single datagram into the rxbuf, and dispatch each of the messages
+// therein. Returns the number of messages handled, or -1 on error (check errno;
+// ENOBUFS indicates that the kernel dropped messages on us). A datagram too
+// large for the rxbuf is lost, but the rxbuf is grown so that the next fits.
+static int
+rx_datagram(netstack* ns, int flags){
+  char cbuf[CMSG_SPACE(sizeof(int))];
+  struct iovec iov = {
+    .iov_base = ns->rxbuf,
+    .iov_len = ns->rxbuf_size,
+  };
+  struct sockaddr_nl sa;
+  struct msghdr mh = {
+    .msg_name = &sa,
+    .msg_namelen = sizeof(sa),
+    .msg_iov = &iov,
+    .msg_iovlen = 1,
+    .msg_control = cbuf,
+    .msg_controllen = sizeof(cbuf),
+  };
+  // with MSG_TRUNC, we're told the full length of a truncated datagram
+  ssize_t r = recvmsg(nl_socket_get_fd(ns->nl), &mh, flags | MSG_TRUNC);
+  if(r < 0){
+    return -1;
+  }
+  const size_t full = r;
+  if(full > ns->rxbuf_size){
+    r = ns->rxbuf_size;
+  }
+  int msgs = rx_dispatch(ns, ns->rxbuf, r, mh.msg_flags, cmsg_nsid(&mh),
+                         rx_from_kernel(&sa, mh.msg_namelen));
+  if(full > ns->rxbuf_size){
+    size_t nsize = ns->rxbuf_size;
+    while(nsize < full){
+      nsize *= 2;
+    }
+    char* tmp = realloc(ns->rxbuf, nsize);
+    if(tmp){
+      ns->rxbuf = tmp;
+      ns->rxbuf_size = nsize;
+    }
+  }
+  return msgs;
+}
+
+// Handle a failure of rx_datagram(). Returns 0 if reception ought continue.
+static int
+rx_failure(netstack* ns){
+  if(errno == ENOBUFS){ // we overran the socket receive buffer
+    atomic_fetch_add(&ns->overruns, 1);
+    ns->opts.diagfxn("Netlink overrun, resyncing\n");
+    rx_lost(ns, -ENOBUFS, 0);
+    return 0;
+  }
+  return errno == EINTR ? 0 : -1;
+}
+
+static inline int
+uring_enter(int fd, unsigned submit, unsigned wait, unsigned flags){
+  return syscall(__NR_io_uring_enter, fd, submit, wait, flags, NULL, 0);
+}
+
+// Get the next SQE, and mark it for submission. We never have more than two
+// submissions outstanding, well within the SQ.
+static struct io_uring_sqe*
+uring_sqe(nsuring* u){
+  unsigned tail = *u->sqtail;
+  unsigned idx = tail & *u->sqmask;
+  struct io_uring_sqe* sqe = &u->sqes[idx];
+  memset(sqe, 0, sizeof(*sqe));
+  u->sqarray[idx] = idx;
+  __atomic_store_n(u->sqtail, tail + 1, __ATOMIC_RELEASE);
+  return sqe;
+}
+
+static void
+uring_prep_recv(nsuring* u, int nlfd){
+  struct io_uring_sqe* sqe = uring_sqe(u);
+  sqe->opcode = IORING_OP_RECVMSG;
+  sqe->fd = nlfd;
+  sqe->addr = (uintptr_t)&u->mh;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = 0;
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->user_data = URING_RECV;
+}
+
+static void
+uring_prep_stop(nsuring* u){
+  struct io_uring_sqe* sqe = uring_sqe(u);
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = u->efd;
+  sqe->poll32_events = POLLIN;
+  sqe->user_data = URING_STOP;
+}
+
+// Hand buffer bid back to the kernel. n is the number of buffers already
+// returned in this batch; the tail is published once the batch is complete.
+static inline void
+uring_return_buf(nsuring* u, unsigned bid, unsigned n){
+  struct io_uring_buf* buf = &u->bufring->bufs[(u->buftail + n) & (URING_BUFS - 1)];
+  buf->addr = (uintptr_t)(u->bufs + (size_t)bid * URING_BUF_BYTES);
+  buf->len = URING_BUF_BYTES;
+  buf->bid = bid;
+}
+
+// Pick apart a provided buffer filled by the multishot recvmsg, and dispatch
+// the datagram therein.
+static void
+uring_dispatch(netstack* ns, const nsuring* u, unsigned bid, int len){
+  char* buf = u->bufs + (size_t)bid * URING_BUF_BYTES;
+  const struct io_uring_recvmsg_out* out = (const struct io_uring_recvmsg_out*)buf;
+  size_t hdrlen = sizeof(*out) + u->mh.msg_namelen + u->mh.msg_controllen;
+  if(len < 0 || (size_t)len < hdrlen){
+    atomic_fetch_add(&ns->parse_failures, 1);
+    return;
+  }
+  struct msghdr cmh = {
+    .msg_control = buf + sizeof(*out) + u->mh.msg_namelen,
+    .msg_controllen = out->controllen,
+  };
+  size_t plen = len - hdrlen;
+  if(out->payloadlen < plen){
+    plen = out->payloadlen;
+  }
+  rx_dispatch(ns, buf + hdrlen, plen, out->flags, cmsg_nsid(&cmh),
+              rx_from_kernel(buf + sizeof(*out), out->namelen));
+}
+
+// Messages the kernel has dropped on the socket, or -1 if it won't say.
+static int64_t
+sock_drops(int fd){
+  uint32_t meminfo[SK_MEMINFO_VARS];
+  socklen_t len = sizeof(meminfo);
+  if(getsockopt(fd, SOL_SOCKET, SO_MEMINFO, meminfo, &len) ||
+      len <= SK_MEMINFO_DROPS * sizeof(*meminfo)){
+    return -1;
+  }
+  return meminfo[SK_MEMINFO_DROPS];
+}
+
+// Kernels with provided buffer rings but no multishot recvmsg (5.19) reject
+// the latter. Receive with recvmsg() instead, polling the eventfd alongside
+// the socket, so that netstack_destroy() needn't know the difference.
+static void
+uring_fallback(netstack* ns, const nsuring* u, int nlfd){
+  struct pollfd pfds[2] = {
+    { .fd = nlfd, .events = POLLIN, },
+    { .fd = u->efd, .events = POLLIN, },
+  };
+  while(true){
+    if(poll(pfds, 2, -1) < 0){
+      if(errno == EINTR){
+        continue;
+      }
+      break;
+    }
+    if(pfds[1].revents){
+      return;
+    }
+    if(pfds[0].revents){
+      while(rx_datagram(ns, MSG_DONTWAIT) >= 0){
+        ;
+      }
+      if(errno != EAGAIN && errno != EWOULDBLOCK && rx_failure(ns)){
+        break;
+      }
+    }
+  }
+  ns->opts.diagfxn("Error rxing from netlink socket (%s)\n", strerror(errno));
+}
+
+// Sits on io_uring_enter(), handling all available completions upon waking.
+// Exits when netstack_destroy() signals the eventfd.
+static void*
+netstack_uring_thread(void* vns){
+  netstack* ns = vns;
+  nsuring* u = ns->uring;
+  const int nlfd = nl_socket_get_fd(ns->nl);
+  uring_prep_stop(u);
+  uring_prep_recv(u, nlfd);
+  unsigned submit = 2;
+  bool done = false;
+  bool received = false; // has the multishot recvmsg ever delivered?
+  u->drops = sock_drops(nlfd);
+  while(!done){
+    if(uring_enter(u->fd, submit, 1, IORING_ENTER_GETEVENTS) < 0){
+      if(errno == EINTR){
+        continue;
+      }
+      ns->opts.diagfxn("Error waiting on io_uring (%s)\n", strerror(errno));
+      break;
+    }
+    submit = 0;
+    bool rearm = false;
+    unsigned returned = 0;
+    unsigned head = *u->cqhead;
+    const unsigned tail = __atomic_load_n(u->cqtail, __ATOMIC_ACQUIRE);
+    for( ; head != tail ; ++head){
+      const struct io_uring_cqe* cqe = &u->cqes[head & *u->cqmask];
+      if(cqe->user_data == URING_STOP){
+        done = true;
+        continue;
+      }
+      if(!(cqe->flags & IORING_CQE_F_MORE)){
+        rearm = true;
+      }
+      if(cqe->flags & IORING_CQE_F_BUFFER){
+        unsigned bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        received = true;
+        if(cqe->res >= 0){
+          uring_dispatch(ns, u, bid, cqe->res);
+        }
+        uring_return_buf(u, bid, returned++);
+      }else if(cqe->res == -ENOBUFS){
+        // Either we ran out of provided buffers, or the socket overran.
+        // The completions look the same, but only the latter drops messages,
+        // which the kernel counts.
+        const int64_t drops = sock_drops(nlfd);
+        if(drops < 0 || drops != u->drops){
+          u->drops = drops;
+          errno = ENOBUFS;
+          rx_failure(ns);
+        }
+      }else if(!received && !(cqe->flags & IORING_CQE_F_MORE) &&
+               (cqe->res == -EINVAL || cqe->res == -EOPNOTSUPP)){
+        ns->opts.diagfxn("No multishot recvmsg in io_uring, using recvmsg\n");
+        __atomic_store_n(u->cqhead, head + 1, __ATOMIC_RELEASE);
+        uring_fallback(ns, u, nlfd);
+        return NULL;
+      }else if(cqe->res < 0){
+        ns->opts.diagfxn("Error rxing from netlink socket (%s)\n", strerror(-cqe->res));
+      }
+    }
+    __atomic_store_n(u->cqhead, head, __ATOMIC_RELEASE);
+    if(returned){
+      u->buftail += returned;
+      __atomic_store_n(&u->bufring->tail, u->buftail, __ATOMIC_RELEASE);
+    }
+    if(rearm && !done){
+      uring_prep_recv(u, nlfd);
+      submit = 1;
+    }
+  }
+  return NULL;
+}
+
+static void
+uring_destroy(nsuring* u){
+  if(u){
+    if(u->bufs){
+      munmap(u->bufs, (size_t)URING_BUFS * URING_BUF_BYTES);
+    }
+    if(u->bufring){
+      munmap(u->bufring, URING_BUFS * sizeof(struct io_uring_buf));
+    }
+    if(u->sqes){
+      munmap(u->sqes, u->sqeslen);
+    }
+    if(u->cqring && u->cqring != u->sqring){
+      munmap(u->cqring, u->cqringlen);
+    }
+    if(u->sqring){
+      munmap(u->sqring, u->sqringlen);
+    }
+    if(u->efd >= 0){
+      close(u->efd);
+    }
+    if(u->fd >= 0){
+      close(u->fd);
+    }
+    free(u);
+  }
+}
+
+// Set up the io_uring, its rings, and the provided buffer ring. Returns NULL
+// if any of it is unsupported (or forbidden) by the kernel.
+static nsuring*
+uring_create(void){
+  nsuring* u = calloc(1, sizeof(*u));
+  if(u == NULL){
+    return NULL;
+  }
+  u->efd = -1;
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  if((u->fd = syscall(__NR_io_uring_setup, 4, &p)) < 0){
+    goto err;
+  }
+  if((u->efd = eventfd(0, EFD_CLOEXEC)) < 0){
+    goto err;
+  }
+  u->sqringlen = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  u->cqringlen = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if(p.features & IORING_FEAT_SINGLE_MMAP){
+    if(u->cqringlen > u->sqringlen){
+      u->sqringlen = u->cqringlen;
+    }
+  }
+  u->sqring = mmap(NULL, u->sqringlen, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+  if(u->sqring == MAP_FAILED){
+    u->sqring = NULL;
+    goto err;
+  }
+  if(p.features & IORING_FEAT_SINGLE_MMAP){
+    u->cqring = u->sqring;
+  }else{
+    u->cqring = mmap(NULL, u->cqringlen, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+    if(u->cqring == MAP_FAILED){
+      u->cqring = NULL;
+      goto err;
+    }
+  }
+  u->sqeslen = p.sq_entries * sizeof(struct io_uring_sqe);
+  u->sqes = mmap(NULL, u->sqeslen, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+  if(u->sqes == MAP_FAILED){
+    u->sqes = NULL;
+    goto err;
+  }
+  char* sq = u->sqring;
+  char* cq = u->cqring;
+  u->sqhead = (unsigned*)(sq + p.sq_off.head);
+  u->sqtail = (unsigned*)(sq + p.sq_off.tail);
+  u->sqmask = (unsigned*)(sq + p.sq_off.ring_mask);
+  u->sqarray = (unsigned*)(sq + p.sq_off.array);
+  u->cqhead = (unsigned*)(cq + p.cq_off.head);
+  u->cqtail = (unsigned*)(cq + p.cq_off.tail);
+  u->cqmask = (unsigned*)(cq + p.cq_off.ring_mask);
+  u->cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+  u->bufring = mmap(NULL, URING_BUFS * sizeof(struct io_uring_buf),
+                    PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if(u->bufring == MAP_FAILED){
+    u->bufring = NULL;
+    goto err;
+  }
+  u->bufs = mmap(NULL, (size_t)URING_BUFS * URING_BUF_BYTES,
+                 PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if(u->bufs == MAP_FAILED){
+    u->bufs = NULL;
+    goto err;
+  }
+  struct io_uring_buf_reg reg;
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = (uintptr_t)u->bufring;
+  reg.ring_entries = URING_BUFS;
+  reg.bgid = 0;
+  if(syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_PBUF_RING, &reg, 1)){
+    goto err;
+  }
+  unsigned bid;
+  for(bid = 0 ; bid < URING_BUFS ; ++bid){
+    uring_return_buf(u, bid, bid);
+  }
+  u->buftail = URING_BUFS;
+  __atomic_store_n(&u->bufring->tail, u->buftail, __ATOMIC_RELEASE);
+  u->mh.msg_namelen = sizeof(struct sockaddr_nl);
+  u->mh.msg_controllen = CMSG_SPACE(sizeof(int));
+  return u;
+
+err:
+  uring_destroy(u);
+  return NULL;
+}
+
+// Sits on blocking recvmsg()
+static void*
+netstack_rx_thread(void* vns){
+  netstack* ns = vns;
+  while(true){
+    if(rx_datagram(ns, 0) < 0){
+      if(rx_failure(ns)){
+        break;
+      }
+    }
+  }
+  ns->opts.diagfxn("Error rxing from netlink socket (%s)\n", strerror(errno));
+  // FIXME recover?
+  return NULL;
+}
+
+int netstack_get_fd(const netstack* ns){
+  return nl_socket_get_fd(ns->nl);
+}
+
+int netstack_process(netstack* ns, int budget){
+  if(!ns->opts.threadless){
+    errno = EINVAL;
+    return -1;
+  }
+  if(ns->processing){ // called from a callback
+    errno = EDEADLK;
+    return -1;
+  }
+  ns->processing = true;
+  sample_if_due(ns);
+  int processed = 0;
+  while(budget <= 0 || processed < budget){
+    int r = rx_datagram(ns, MSG_DONTWAIT);
+    if(r < 0){
+      if(errno == EAGAIN || errno == EWOULDBLOCK){
+        break;
+      }
+      if(rx_failure(ns)){
+        ns->opts.diagfxn("Error rxing from netlink socket (%s)\n", strerror(errno));
+        ns->processing = false;
+        return -1;
+      }
+    }else{
+      processed += r;
+    }
+  }
+  ns->processing = false;
+  return processed;
+}
+
+// Are any requests queued or on the wire? Call with txlock held.
+static bool
+requests_pending_locked(const netstack* ns){
+  return ns->queued || ns->dumpreq || ns->sent;
+}
+
+static bool
+requests_pending(netstack* ns){
+  pthread_mutex_lock(&ns->txlock);
+  bool ret = requests_pending_locked(ns);
+  pthread_mutex_unlock(&ns->txlock);
+  return ret;
+}
+
+// NETSTACK_INITIAL_EVENTS_BLOCK without threads: drive the initial dumps to
+// completion ourselves.
+static int
+threadless_initial_block(netstack* ns){
+  struct pollfd pfd = {
+    .fd = netstack_get_fd(ns),
+    .events = POLLIN,
+  };
+  while(requests_pending(ns)){
+    if(poll(&pfd, 1, -1) < 0){
+      if(errno != EINTR){
+        return -1;
+      }
+    }else if(netstack_process(ns, 0) < 0){
+      return -1;
+    }
+  }
+  return 0;
+}
+
+void netstack_stderr_diag(const char* fmt, ...){
+  va_list va;
+  va_start(va, fmt);
+  vfprintf(stderr, fmt, va);
+  va_end(va);
+}
+
+static void
+null_diagfxn(const char* fmt, ...){
+  (void)fmt;
+}
+
+// A filter must use at least one criterion.
+static bool
+valid_iface_filter(const netstack_iface_filter* nf){
+  if(nf == NULL){
+    return true;
+  }
+  if(nf->ifindex_count && nf->ifindices == NULL){
+    return false;
+  }
+  return nf->names || nf->kinds || nf->ifindex_count || nf->master;
+}
+
+static bool
+validate_options(const netstack_opts* nopts){
+  // NULL? No problem! All zeroes maps to all defaults, is all good!
+  if(nopts == NULL){
+    return true;
+  }
+  // The io_uring backend replaces the rxthread, which threadless lacks
+  if(nopts->threadless && nopts->io_uring){
+    return false;
+  }
+  // netstack_iface_rates() copies the ring onto its stack
+  if(nopts->sample_depth > NETSTACK_SAMPLE_DEPTH_MAX){
+    return false;
+  }
+  // ethtool state is tracked by its own thread, and keyed off tracked links
+  if(nopts->ethtool && (nopts->threadless || nopts->iface_notrack)){
+    return false;
+  }
+  // Without a callback, do not allow a meaningless curry to be specified
+  if(nopts->iface_curry && !nopts->iface_cb){
+    return false;
+  }
+  if(nopts->addr_curry && !nopts->addr_cb){
+    return false;
+  }
+  if(nopts->route_curry && !nopts->route_cb){
+    return false;
+  }
+  if(nopts->neigh_curry && !nopts->neigh_cb){
+    return false;
+  }
+  if(nopts->rule_curry && !nopts->rule_cb){
+    return false;
+  }
+  if(nopts->nexthop_curry && !nopts->nexthop_cb){
+    return false;
+  }
+  if(nopts->tc_curry && !nopts->tc_cb){
+    return false;
+  }
+  if(!valid_iface_filter(nopts->iface_include) || !valid_iface_filter(nopts->iface_exclude)){
+    return false;
+  }
+  // Must have at least some kind of action configured (callback or track)
+  if(!nopts->addr_cb && !nopts->neigh_cb && !nopts->route_cb && !nopts->iface_cb &&
+     !nopts->rule_cb && !nopts->nexthop_cb && !nopts->tc_cb){
+    if(nopts->addr_notrack && nopts->neigh_notrack && nopts->route_notrack &&
+       nopts->iface_notrack && nopts->rule_notrack && nopts->nexthop_notrack &&
+       nopts->fdb_notrack && nopts->tc_notrack){
+      return false;
+    }
+  }
+  return true;
+}
+
+// Filter the specified netlink dumper message from dumpmsgs, if it happens to
+// be there. *dumpcount will be updated in that case.
+static void
+filter_netlink_dumper(int* dumpmsgs, int* dumpcount, int dumper){
+  int z;
+  for(z = 0 ; z < *dumpcount ; ++z){
+    if(dumpmsgs[z] == dumper){
+      dumpmsgs[z] = dumpmsgs[--*dumpcount];
+      break;
+    }
+  }
+}
+
+// Determine which groups we want to subscribe to based off the
+// netstack_options, and subscribe to them. dumpmsgs will be filtered based
+// off what we subscribe to; it ought contain at first all possible dumpers,
+// of which there are dumpcount. the number remaining will be stored there.
+static int
+subscribe_to_netlink(const netstack* ns, int* dumpmsgs, int* dumpcount){
+  // We don't use nl_socket_add_memberships due to its weird varargs API.
+  if(ns->opts.iface_cb || !ns->opts.iface_notrack){
+    if(nl_socket_add_memberships(ns->nl, RTNLGRP_LINK, NFNLGRP_NONE)){
+      return -1;
+    }
+  }else{
+    filter_netlink_dumper(dumpmsgs, dumpcount, RTM_GETLINK);
+  }
+  if(ns->opts.addr_cb || !ns->opts.addr_notrack){
+    if(nl_socket_add_memberships(ns->nl, RTNLGRP_IPV4_IFADDR,
+                                 RTNLGRP_IPV6_IFADDR, NFNLGRP_NONE)){
+      return -1;
+    }
+  }else{
+    filter_netlink_dumper(dumpmsgs, dumpcount, RTM_GETADDR);
+  }
+  if(ns->opts.route_cb || !ns->opts.route_notrack){
+    if(nl_socket_add_memberships(ns->nl, RTNLGRP_IPV4_ROUTE,
+                                 RTNLGRP_IPV6_ROUTE, NFNLGRP_NONE)){
+      return -1;
+    }
+  }else{
+    filter_netlink_dumper(dumpmsgs, dumpcount, RTM_GETROUTE);
+  }
+  // FDB entries arrive as AF_BRIDGE neighbors
+  if(ns->opts.neigh_cb || !ns->opts.neigh_notrack || !ns->opts.fdb_notrack){
+    if(nl_socket_add_memberships(ns->nl, RTNLGRP_NEIGH, NFNLGRP_NONE)){
+      return -1;
+    }
+  }else{
+    filter_netlink_dumper(dumpmsgs, dumpcount, RTM_GETNEIGH);
+  }
+  if(ns->opts.rule_cb || !ns->opts.rule_notrack){
+    if(nl_socket_add_memberships(ns->nl, RTNLGRP_IPV4_RULE,
+                                 RTNLGRP_IPV6_RULE, NFNLGRP_NONE)){
+      return -1;
+    }
+  }else{
+    filter_netlink_dumper(dumpmsgs, dumpcount, RTM_GETRULE);
+  }
+  // Nexthop objects only came along with Linux 5.3. Without them, there's
+  // nothing to dump or hear about, so that's no reason to fail.
+  if(ns->opts.nexthop_cb || !ns->opts.nexthop_notrack){
+    if(nl_socket_add_memberships(ns->nl, RTNLGRP_NEXTHOP, NFNLGRP_NONE)){
+      ns->opts.diagfxn("Couldn't subscribe to nexthops\n");
+      filter_netlink_dumper(dumpmsgs, dumpcount, RTM_GETNEXTHOP);
+    }
+  }else{
+    filter_netlink_dumper(dumpmsgs, dumpcount, RTM_GETNEXTHOP);
+  }
+  if(ns->opts.tc_cb || !ns->opts.tc_notrack){
+    if(nl_socket_add_memberships(ns->nl, RTNLGRP_TC, NFNLGRP_NONE)){
+      return -1;
+    }
+  }else{
+    filter_netlink_dumper(dumpmsgs, dumpcount, RTM_GETQDISC);
+  }
+  // Peer namespaces are only tracked at the level of links (see
+  // queue_request_nsid()), so there's no need for nsid events without them.
+  if(ns->opts.all_nsids && (ns->opts.iface_cb || !ns->opts.iface_notrack)){
+    int one = 1;
+    if(setsockopt(nl_socket_get_fd(ns->nl), SOL_NETLINK, NETLINK_LISTEN_ALL_NSID,
+                  &one, sizeof(one))){
+      ns->opts.diagfxn("Couldn't listen to all nsids (%s)\n", strerror(errno));
+      return -1;
+    }
+    if(nl_socket_add_memberships(ns->nl, RTNLGRP_NSID, NFNLGRP_NONE)){
+      return -1;
+    }
+  }else{
+    filter_netlink_dumper(dumpmsgs, dumpcount, RTM_GETNSID);
+  }
+  return 0;
+}
+
+struct nl_sock*
+nl_socket_connect(int family){
+  struct nl_sock *nls;
+  if((nls = nl_socket_alloc()) == NULL){
+    return NULL;
+  }
+  nl_socket_disable_seq_check(nls);
+  if(nl_connect(nls, family)){
+    nl_socket_free(nls);
+    return NULL;
+  }
+  return nls;
+}
+
+// ethtool-netlink support (the ethtool option). This is a generic netlink
+// family, so it gets its own socket, and its own thread. That thread first
+// dumps each class of state we track, then receives notifications from the
+// family's "monitor" group. Links which appear thereafter are queried by the
+// rxthread from viface_cb(). State is cached by ifindex, and dropped when the
+// link is deleted. Only the local namespace is covered.
+typedef struct ethtool_entry {
+  int ifindex;
+  netstack_ethtool et;
+  struct ethtool_entry* next;
+} ethtool_entry;
+
+typedef struct nsethtool {
+  struct nl_sock* nl;   // NETLINK_GENERIC, joined to the monitor group
+  uint16_t family;      // resolved id of the "ethtool" family
+  pthread_t tid;
+  char* rxbuf;          // RXBUF_BYTES, used only by the ethtool thread
+  unsigned backoff_ms;  // ethtool thread only: delay after a failed receive
+  pthread_mutex_t txlock; // serializes sends between rxthread and our thread
+  // Guards everything below. Never held across a cancellation point.
+  pthread_mutex_t lock;
+  pthread_cond_t cond;  // broadcast when synced becomes true
+  atomic_bool synced;   // initial dumps are complete
+  ethtool_entry* hash[IFACE_HASH_SLOTS];
+  char* features[NETSTACK_ETHTOOL_FEATURE_MAX]; // names, learned from replies
+} nsethtool;
+
+// The classes of state we dump and query, all of which are GET requests taking
+// only a header attribute (always attribute 1, i.e. ETHTOOL_A_*_HEADER).
+static const uint8_t ethtool_gets[] = {
+  ETHTOOL_MSG_CHANNELS_GET,
+  ETHTOOL_MSG_RINGS_GET,
+  ETHTOOL_MSG_COALESCE_GET,
+  ETHTOOL_MSG_FEATURES_GET,
+};
+
+static inline ethtool_entry**
+ethtool_slot(nsethtool* et, int ifindex){
+  return &et->hash[(unsigned)ifindex % IFACE_HASH_SLOTS];
+}
+
+static bool
+ethtool_synced(const netstack* ns){
+  return atomic_load(&ns->ethtool->synced);
+}
+
+// Send an ethtool GET for cmd. An ifindex of 0 dumps all links. On success,
+// the sequence number used is written to *seq (if non-NULL).
+static int
+ethtool_send(nsethtool* et, uint8_t cmd, int ifindex, uint32_t* seq){
+  struct nl_msg* msg = nlmsg_alloc_simple(et->family, NLM_F_REQUEST | (ifindex ? 0 : NLM_F_DUMP));
+  if(msg == NULL){
+    return -1;
+  }
+  struct genlmsghdr ghdr = { .cmd = cmd, .version = ETHTOOL_GENL_VERSION, };
+  struct nlattr* hdr;
+  int ret = -1;
+  if(nlmsg_append(msg, &ghdr, sizeof(ghdr), NLMSG_ALIGNTO) == 0 &&
+     (hdr = nla_nest_start(msg, ETHTOOL_A_CHANNELS_HEADER)) &&
+     (ifindex == 0 || nla_put_u32(msg, ETHTOOL_A_HEADER_DEV_INDEX, ifindex) == 0)){
+    nla_nest_end(msg, hdr);
+    // both senders are cancelled on teardown; don't die holding the lock
+    int oldstate;
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldstate);
+    pthread_mutex_lock(&et->txlock);
+    ret = nl_send_auto(et->nl, msg);
+    pthread_mutex_unlock(&et->txlock);
+    pthread_setcancelstate(oldstate, NULL);
+    if(seq){
+      *seq = nlmsg_hdr(msg)->nlmsg_seq;
+    }
+  }
+  nlmsg_free(msg);
+  return ret < 0 ? -1 : 0;
+}
+
+static void
+ethtool_query(netstack* ns, int ifindex){
+  size_t z;
+  for(z = 0 ; z < sizeof(ethtool_gets) / sizeof(*ethtool_gets) ; ++z){
+    if(ethtool_send(ns->ethtool, ethtool_gets[z], ifindex, NULL)){
+      ns->opts.diagfxn("Couldn't query ethtool for %d (%s)\n", ifindex, strerror(errno));
+    }
+  }
+}
+
+static void
+ethtool_forget(netstack* ns, int ifindex){
+  nsethtool* et = ns->ethtool;
+  pthread_mutex_lock(&et->lock);
+  ethtool_entry** e = ethtool_slot(et, ifindex);
+  while(*e){
+    if((*e)->ifindex == ifindex){
+      ethtool_entry* tmp = *e;
+      *e = tmp->next;
+      free(tmp);
+      break;
+    }
+    e = &(*e)->next;
+  }
+  pthread_mutex_unlock(&et->lock);
+}
+
+// Find or create the entry for ifindex. Call with et->lock held.
+static ethtool_entry*
+ethtool_entry_get(nsethtool* et, int ifindex){
+  ethtool_entry** e = ethtool_slot(et, ifindex);
+  ethtool_entry* ee;
+  for(ee = *e ; ee ; ee = ee->next){
+    if(ee->ifindex == ifindex){
+      return ee;
+    }
+  }
+  if( (ee = calloc(1, sizeof(*ee))) ){
+    ee->ifindex = ifindex;
+    ee->next = *e;
+    *e = ee;
+  }
+  return ee;
+}
+
+static inline uint32_t
+ethtool_u32(struct nlattr** tb, int attr){
+  return tb[attr] ? nla_get_u32(tb[attr]) : 0;
+}
+
+// Parse an ethtool bitset. Verbose bitsets name their bits, which we learn.
+// Set bits are written to bits (of NETSTACK_ETHTOOL_FEATURE_MAX bits), if it
+// is non-NULL. Call with et->lock held.
+static int
+ethtool_bitset(nsethtool* et, struct nlattr* nla, uint64_t* bits){
+  struct nlattr* tb[ETHTOOL_A_BITSET_MAX + 1];
+  if(nla_parse_nested(tb, ETHTOOL_A_BITSET_MAX, nla, NULL)){
+    return -1;
+  }
+  const bool nomask = tb[ETHTOOL_A_BITSET_NOMASK];
+  if(bits){
+    memset(bits, 0, NETSTACK_ETHTOOL_FEATURE_MAX / 8);
+  }
+  if(tb[ETHTOOL_A_BITSET_VALUE]){ // compact form: an array of u32 words
+    if(bits){
+      const uint32_t* words = nla_data(tb[ETHTOOL_A_BITSET_VALUE]);
+      int wcount = nla_len(tb[ETHTOOL_A_BITSET_VALUE]) / sizeof(*words);
+      for(int w = 0 ; w < wcount && w < NETSTACK_ETHTOOL_FEATURE_MAX / 32 ; ++w){
+        bits[w / 2] |= (uint64_t)words[w] << (32 * (w % 2));
+      }
+    }
+    return 0;
+  }
+  if(tb[ETHTOOL_A_BITSET_BITS] == NULL){
+    return 0;
+  }
+  struct nlattr* bit;
+  int rem;
+  nla_for_each_nested(bit, tb[ETHTOOL_A_BITSET_BITS], rem){
+    struct nlattr* btb[ETHTOOL_A_BITSET_BIT_MAX + 1];
+    if(nla_parse_nested(btb, ETHTOOL_A_BITSET_BIT_MAX, bit, NULL) ||
+       btb[ETHTOOL_A_BITSET_BIT_INDEX] == NULL){
+      continue;
+    }
+    uint32_t idx = nla_get_u32(btb[ETHTOOL_A_BITSET_BIT_INDEX]);
+    if(idx >= NETSTACK_ETHTOOL_FEATURE_MAX){
+      continue;
+    }
+    if(btb[ETHTOOL_A_BITSET_BIT_NAME] && et->features[idx] == NULL){
+      et->features[idx] = strdup(nla_get_string(btb[ETHTOOL_A_BITSET_BIT_NAME]));
+    }
+    if(bits && (nomask || btb[ETHTOOL_A_BITSET_BIT_VALUE])){
+      bits[idx / 64] |= 1ull << (idx % 64);
+    }
+  }
+  return 0;
+}
+
+// Handle a GET reply or notification from the ethtool family.
+static int
+ethtool_msg(netstack* ns, struct nlmsghdr* nh){
+  nsethtool* et = ns->ethtool;
+  if(nh->nlmsg_len < NLMSG_SPACE(GENL_HDRLEN)){
+    return -1;
+  }
+  const struct genlmsghdr* gh = NLMSG_DATA(nh);
+  struct nlattr* attrs = (struct nlattr*)((char*)gh + GENL_HDRLEN);
+  int alen = nh->nlmsg_len - NLMSG_SPACE(GENL_HDRLEN);
+  // every class we track has a maximum attribute below this
+  struct nlattr* tb[ETHTOOL_A_COALESCE_MAX + 1];
+  if(nla_parse(tb, ETHTOOL_A_COALESCE_MAX, attrs, alen, NULL)){
+    return -1;
+  }
+  struct nlattr* htb[ETHTOOL_A_HEADER_MAX + 1];
+  if(tb[ETHTOOL_A_CHANNELS_HEADER] == NULL ||
+     nla_parse_nested(htb, ETHTOOL_A_HEADER_MAX, tb[ETHTOOL_A_CHANNELS_HEADER], NULL) ||
+     htb[ETHTOOL_A_HEADER_DEV_INDEX] == NULL){
+    return -1;
+  }
+  const int ifindex = nla_get_u32(htb[ETHTOOL_A_HEADER_DEV_INDEX]);
+  pthread_mutex_lock(&et->lock);
+  ethtool_entry* ee = ethtool_entry_get(et, ifindex);
+  if(ee == NULL){
+    pthread_mutex_unlock(&et->lock);
+    return -1;
+  }
+  netstack_ethtool* ne = &ee->et;
+  int ret = 0;
+  switch(gh->cmd){
+    case ETHTOOL_MSG_CHANNELS_GET_REPLY: case ETHTOOL_MSG_CHANNELS_NTF:
+      ne->channels.rx_max = ethtool_u32(tb, ETHTOOL_A_CHANNELS_RX_MAX);
+      ne->channels.tx_max = ethtool_u32(tb, ETHTOOL_A_CHANNELS_TX_MAX);
+      ne->channels.other_max = ethtool_u32(tb, ETHTOOL_A_CHANNELS_OTHER_MAX);
+      ne->channels.combined_max = ethtool_u32(tb, ETHTOOL_A_CHANNELS_COMBINED_MAX);
+      ne->channels.rx = ethtool_u32(tb, ETHTOOL_A_CHANNELS_RX_COUNT);
+      ne->channels.tx = ethtool_u32(tb, ETHTOOL_A_CHANNELS_TX_COUNT);
+      ne->channels.other = ethtool_u32(tb, ETHTOOL_A_CHANNELS_OTHER_COUNT);
+      ne->channels.combined = ethtool_u32(tb, ETHTOOL_A_CHANNELS_COMBINED_COUNT);
+      ne->present |= NETSTACK_ETHTOOL_CHANNELS;
+      break;
+    case ETHTOOL_MSG_RINGS_GET_REPLY: case ETHTOOL_MSG_RINGS_NTF:
+      ne->rings.rx_max = ethtool_u32(tb, ETHTOOL_A_RINGS_RX_MAX);
+      ne->rings.rx_mini_max = ethtool_u32(tb, ETHTOOL_A_RINGS_RX_MINI_MAX);
+      ne->rings.rx_jumbo_max = ethtool_u32(tb, ETHTOOL_A_RINGS_RX_JUMBO_MAX);
+      ne->rings.tx_max = ethtool_u32(tb, ETHTOOL_A_RINGS_TX_MAX);
+      ne->rings.rx = ethtool_u32(tb, ETHTOOL_A_RINGS_RX);
+      ne->rings.rx_mini = ethtool_u32(tb, ETHTOOL_A_RINGS_RX_MINI);
+      ne->rings.rx_jumbo = ethtool_u32(tb, ETHTOOL_A_RINGS_RX_JUMBO);
+      ne->rings.tx = ethtool_u32(tb, ETHTOOL_A_RINGS_TX);
+      ne->present |= NETSTACK_ETHTOOL_RINGS;
+      break;
+    case ETHTOOL_MSG_COALESCE_GET_REPLY: case ETHTOOL_MSG_COALESCE_NTF:
+      ne->coalesce.rx_usecs = ethtool_u32(tb, ETHTOOL_A_COALESCE_RX_USECS);
+      ne->coalesce.rx_max_frames = ethtool_u32(tb, ETHTOOL_A_COALESCE_RX_MAX_FRAMES);
+      ne->coalesce.tx_usecs = ethtool_u32(tb, ETHTOOL_A_COALESCE_TX_USECS);
+      ne->coalesce.tx_max_frames = ethtool_u32(tb, ETHTOOL_A_COALESCE_TX_MAX_FRAMES);
+      ne->coalesce.adaptive_rx = tb[ETHTOOL_A_COALESCE_USE_ADAPTIVE_RX] &&
+                                 nla_get_u8(tb[ETHTOOL_A_COALESCE_USE_ADAPTIVE_RX]);
+      ne->coalesce.adaptive_tx = tb[ETHTOOL_A_COALESCE_USE_ADAPTIVE_TX] &&
+                                 nla_get_u8(tb[ETHTOOL_A_COALESCE_USE_ADAPTIVE_TX]);
+      ne->present |= NETSTACK_ETHTOOL_COALESCE;
+      break;
+    case ETHTOOL_MSG_FEATURES_GET_REPLY: case ETHTOOL_MSG_FEATURES_NTF:
+      // the hw bitset is sent with a mask, and thus names every feature
+      if(tb[ETHTOOL_A_FEATURES_HW]){
+        ethtool_bitset(et, tb[ETHTOOL_A_FEATURES_HW], NULL);
+      }
+      if(tb[ETHTOOL_A_FEATURES_ACTIVE] == NULL ||
+         ethtool_bitset(et, tb[ETHTOOL_A_FEATURES_ACTIVE], ne->features)){
+        ret = -1;
+        break;
+      }
+      ne->present |= NETSTACK_ETHTOOL_FEATURES;
+      break;
+    default:
+      break; // some other notification from the monitor group
+  }
+  pthread_mutex_unlock(&et->lock);
+  return ret;
+}
+
+// Receive and handle one datagram. Returns 1 if it completed the dump having
+// sequence number seq (0 if we're not awaiting one), 0 if not, -1 if we were
+// overrun (or a datagram was truncated), and must resynchronize, or -2 on an
+// error from which we can't recover. Running out of memory is retried, after
+// backing off for up to a second. Datagrams not from the kernel are dropped.
+static int
+ethtool_recv(netstack* ns, uint32_t seq){
+  nsethtool* et = ns->ethtool;
+  struct iovec iov = {
+    .iov_base = et->rxbuf,
+    .iov_len = RXBUF_BYTES,
+  };
+  struct sockaddr_nl sa;
+  struct msghdr mh = {
+    .msg_name = &sa,
+    .msg_namelen = sizeof(sa),
+    .msg_iov = &iov,
+    .msg_iovlen = 1,
+  };
+  ssize_t r = recvmsg(nl_socket_get_fd(et->nl), &mh, 0);
+  if(r < 0){
+    if(errno == ENOBUFS){
+      atomic_fetch_add(&ns->overruns, 1);
+      return -1;
+    }
+    if(errno == EINTR){
+      return 0;
+    }
+    if(errno == ENOMEM){
+      et->backoff_ms = et->backoff_ms ? et->backoff_ms * 2 : 1;
+      if(et->backoff_ms > 1000){
+        et->backoff_ms = 1000;
+      }
+      struct timespec ts = {
+        .tv_sec = et->backoff_ms / 1000,
+        .tv_nsec = (et->backoff_ms % 1000) * 1000000l,
+      };
+      nanosleep(&ts, NULL);
+      return 0;
+    }
+    ns->opts.diagfxn("Error rxing from ethtool socket (%s)\n", strerror(errno));
+    return -2;
+  }
+  et->backoff_ms = 0;
+  if(!rx_from_kernel(&sa, mh.msg_namelen)){
+    ns->opts.diagfxn("Dropped an ethtool datagram not from the kernel\n");
+    return 0;
+  }
+  if(mh.msg_flags & MSG_TRUNC){
+    atomic_fetch_add(&ns->parse_failures, 1);
+    return -1;
+  }
+  int done = 0;
+  size_t len = r;
+  struct nlmsghdr* nh;
+  for(nh = (struct nlmsghdr*)et->rxbuf ; NLMSG_OK(nh, len) ; nh = NLMSG_NEXT(nh, len)){
+    if(nh->nlmsg_type == NLMSG_DONE || nh->nlmsg_type == NLMSG_ERROR){
+      // errors on direct queries (e.g. EOPNOTSUPP for rings) are expected
+      if(seq && nh->nlmsg_seq == seq){
+        done = 1;
+      }
+    }else if(nh->nlmsg_type == et->family){
+      if(ethtool_msg(ns, nh)){
+        atomic_fetch_add(&ns->parse_failures, 1);
+      }
+    }
+  }
+  return done;
+}
+
+// Query any local links which we don't yet know about. Links which arrived
+// while we were dumping might otherwise be missed.
+static void
+ethtool_sweep(netstack* ns){
+  nsethtool* et = ns->ethtool;
+  int* idxs = NULL;
+  unsigned count = 0, alloced = 0;
+  pthread_mutex_lock(&ns->hashlock);
+  size_t z;
+  for(z = 0 ; z < IFACE_HASH_SLOTS ; ++z){
+    const netstack_iface* ni;
+    for(ni = ns->iface_hash[z] ; ni ; ni = ni->hnext){
+      if(ni->nsid != NETSTACK_NSID_LOCAL){
+        continue;
+      }
+      if(count == alloced){
+        unsigned na = alloced ? alloced * 2 : 16;
+        int* tmp = realloc(idxs, sizeof(*idxs) * na);
+        if(tmp == NULL){
+          break;
+        }
+        idxs = tmp;
+        alloced = na;
+      }
+      idxs[count++] = ni->ifi.ifi_index;
+    }
+  }
+  pthread_mutex_unlock(&ns->hashlock);
+  unsigned i;
+  for(i = 0 ; i < count ; ++i){
+    bool known = false;
+    pthread_mutex_lock(&et->lock);
+    const ethtool_entry* ee;
+    for(ee = *ethtool_slot(et, idxs[i]) ; ee ; ee = ee->next){
+      if(ee->ifindex == idxs[i]){
+        known = true;
+        break;
+      }
+    }
+    pthread_mutex_unlock(&et->lock);
+    if(!known){
+      ethtool_query(ns, idxs[i]);
+    }
+  }
+  free(idxs);
+}
+
+// Wake anyone (i.e. netstack_create()) awaiting the initial dumps.
+static void
+ethtool_set_synced(nsethtool* et){
+  pthread_mutex_lock(&et->lock);
+  atomic_store(&et->synced, true);
+  pthread_cond_broadcast(&et->cond);
+  pthread_mutex_unlock(&et->lock);
+}
+
+// On an unrecoverable error, we give up, leaving the ethtool state as it is.
+static void*
+netstack_ethtool_thread(void* vns){
+  netstack* ns = vns;
+  nsethtool* et = ns->ethtool;
+  for(;;){
+    // (re)synchronize by dumping each class in turn
+    bool overrun = false;
+    size_t z;
+    for(z = 0 ; z < sizeof(ethtool_gets) / sizeof(*ethtool_gets) && !overrun ; ++z){
+      uint32_t seq;
+      if(ethtool_send(et, ethtool_gets[z], 0, &seq)){
+        ns->opts.diagfxn("Couldn't dump ethtool (%s)\n", strerror(errno));
+        continue;
+      }
+      int r;
+      while((r = ethtool_recv(ns, seq)) == 0){
+        ;
+      }
+      if(r == -2){
+        ethtool_set_synced(et);
+        return NULL;
+      }
+      overrun = r < 0;
+    }
+    if(overrun){
+      atomic_fetch_add(&ns->resyncs, 1);
+      continue;
+    }
+    if(!ethtool_synced(ns)){
+      ethtool_set_synced(et);
+    }
+    ethtool_sweep(ns);
+    int r;
+    while((r = ethtool_recv(ns, 0)) >= 0){
+      ;
+    }
+    if(r == -2){
+      return NULL;
+    }
+    atomic_fetch_add(&ns->resyncs, 1);
+  }
+  return NULL;
+}
+
+static void
+ethtool_destroy(nsethtool* et){
+  if(et){
+    size_t z;
+    for(z = 0 ; z < IFACE_HASH_SLOTS ; ++z){
+      while(et->hash[z]){
+        ethtool_entry* tmp = et->hash[z]->next;
+        free(et->hash[z]);
+        et->hash[z] = tmp;
+      }
+    }
+    for(z = 0 ; z < NETSTACK_ETHTOOL_FEATURE_MAX ; ++z){
+      free(et->features[z]);
+    }
+    pthread_cond_destroy(&et->cond);
+    pthread_mutex_destroy(&et->lock);
+    pthread_mutex_destroy(&et->txlock);
+    nl_socket_free(et->nl);
+    free(et->rxbuf);
+    free(et);
+  }
+}
+
+// Resolve the ethtool family and its monitor group using the generic netlink
+// controller. Called prior to joining any groups, so the only traffic on the
+// socket is our reply.
+static int
+ethtool_resolve(nsethtool* et, uint32_t* mcgrp){
+  struct nl_msg* msg = nlmsg_alloc_simple(GENL_ID_CTRL, NLM_F_REQUEST);
+  if(msg == NULL){
+    return -1;
+  }
+  struct genlmsghdr ghdr = { .cmd = CTRL_CMD_GETFAMILY, .version = 1, };
+  if(nlmsg_append(msg, &ghdr, sizeof(ghdr), NLMSG_ALIGNTO) ||
+     nla_put_string(msg, CTRL_ATTR_FAMILY_NAME, ETHTOOL_GENL_NAME) ||
+     nl_send_auto(et->nl, msg) < 0){
+    nlmsg_free(msg);
+    return -1;
+  }
+  nlmsg_free(msg);
+  ssize_t r = recv(nl_socket_get_fd(et->nl), et->rxbuf, RXBUF_BYTES, 0);
+  if(r < 0){
+    return -1;
+  }
+  size_t len = r;
+  struct nlmsghdr* nh = (struct nlmsghdr*)et->rxbuf;
+  if(!NLMSG_OK(nh, len) || nh->nlmsg_type != GENL_ID_CTRL ||
+     nh->nlmsg_len < NLMSG_SPACE(GENL_HDRLEN)){
+    return -1; // most likely an ENOENT error; no ethtool-netlink support
+  }
+  struct nlattr* tb[CTRL_ATTR_MAX + 1];
+  if(nla_parse(tb, CTRL_ATTR_MAX, (struct nlattr*)((char*)NLMSG_DATA(nh) + GENL_HDRLEN),
+               nh->nlmsg_len - NLMSG_SPACE(GENL_HDRLEN), NULL) ||
+     tb[CTRL_ATTR_FAMILY_ID] == NULL || tb[CTRL_ATTR_MCAST_GROUPS] == NULL){
+    return -1;
+  }
+  et->family = nla_get_u16(tb[CTRL_ATTR_FAMILY_ID]);
+  struct nlattr* grp;
+  int rem;
+  nla_for_each_nested(grp, tb[CTRL_ATTR_MCAST_GROUPS], rem){
+    struct nlattr* gtb[CTRL_ATTR_MCAST_GRP_MAX + 1];
+    if(nla_parse_nested(gtb, CTRL_ATTR_MCAST_GRP_MAX, grp, NULL) == 0 &&
+       gtb[CTRL_ATTR_MCAST_GRP_NAME] && gtb[CTRL_ATTR_MCAST_GRP_ID] &&
+       strcmp(nla_get_string(gtb[CTRL_ATTR_MCAST_GRP_NAME]), ETHTOOL_MCGRP_MONITOR_NAME) == 0){
+      *mcgrp = nla_get_u32(gtb[CTRL_ATTR_MCAST_GRP_ID]);
+      return 0;
+    }
+  }
+  return -1;
+}
+
+static nsethtool*
+ethtool_create(const netstack* ns){
+  nsethtool* et = calloc(1, sizeof(*et));
+  if(et == NULL){
+    return NULL;
+  }
+  if((et->rxbuf = malloc(RXBUF_BYTES)) == NULL){
+    free(et);
+    return NULL;
+  }
+  if((et->nl = nl_socket_connect(NETLINK_GENERIC)) == NULL){
+    free(et->rxbuf);
+    free(et);
+    return NULL;
+  }
+  uint32_t mcgrp;
+  if(ethtool_resolve(et, &mcgrp)){
+    ns->opts.diagfxn("Couldn't resolve ethtool-netlink family\n");
+    nl_socket_free(et->nl);
+    free(et->rxbuf);
+    free(et);
+    return NULL;
+  }
+  if(nl_socket_add_memberships(et->nl, mcgrp, NFNLGRP_NONE)){
+    ns->opts.diagfxn("Couldn't join ethtool monitor group\n");
+    nl_socket_free(et->nl);
+    free(et->rxbuf);
+    free(et);
+    return NULL;
+  }
+  atomic_init(&et->synced, false);
+  if(pthread_mutex_init(&et->txlock, NULL)){
+    nl_socket_free(et->nl);
+    free(et->rxbuf);
+    free(et);
+    return NULL;
+  }
+  if(pthread_mutex_init(&et->lock, NULL)){
+    pthread_mutex_destroy(&et->txlock);
+    nl_socket_free(et->nl);
+    free(et->rxbuf);
+    free(et);
+    return NULL;
+  }
+  if(pthread_cond_init(&et->cond, NULL)){
+    pthread_mutex_destroy(&et->lock);
+    pthread_mutex_destroy(&et->txlock);
+    nl_socket_free(et->nl);
+    free(et->rxbuf);
+    free(et);
+    return NULL;
+  }
+  return et;
+}
+
+bool netstack_iface_ethtool(netstack* ns, int ifindex, netstack_ethtool* ne){
+  nsethtool* et = ns->ethtool;
+  if(et == NULL){
+    return false;
+  }
+  bool ret = false;
+  pthread_mutex_lock(&et->lock);
+  const ethtool_entry* ee;
+  for(ee = *ethtool_slot(et, ifindex) ; ee ; ee = ee->next){
+    if(ee->ifindex == ifindex){
+      memcpy(ne, &ee->et, sizeof(*ne));
+      ret = true;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&et->lock);
+  return ret;
+}
+
+int netstack_ethtool_feature_index(netstack* ns, const char* name){
+  nsethtool* et = ns->ethtool;
+  if(et == NULL){
+    return -1;
+  }
+  int ret = -1;
+  pthread_mutex_lock(&et->lock);
+  int z;
+  for(z = 0 ; z < NETSTACK_ETHTOOL_FEATURE_MAX ; ++z){
+    if(et->features[z] && strcmp(et->features[z], name) == 0){
+      ret = z;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&et->lock);
+  return ret;
+}
+
+// The recvmsg() rxthread is cancelled, but the io_uring rxthread blocks in
+// io_uring_enter(), which is not a cancellation point. Signal it instead.
+// Fail all queued requests and any on the wire with ECANCELED. Only called
+// once no other thread can be transmitting or receiving.
+static void
+requests_cancel(netstack* ns){
+  pthread_mutex_lock(&ns->txlock);
+  netstack_request* req;
+  while( (req = ns->queued) ){
+    if((ns->queued = req->next) == NULL){
+      ns->queuedtail = &ns->queued;
+    }
+    request_finish_locked(ns, req, -ECANCELED, NULL, -1);
+  }
+  if( (req = ns->dumpreq) ){
+    ns->dumpreq = NULL;
+    request_finish_locked(ns, req, -ECANCELED, NULL, -1);
+  }
+  sent_fail_locked(ns, -ECANCELED);
+  pthread_mutex_unlock(&ns->txlock);
+  requests_complete(ns);
+}
+
+static int
+stop_rx_thread(netstack* ns){
+  if(ns->uring){
+    uint64_t one = 1;
+    return write(ns->uring->efd, &one, sizeof(one)) == sizeof(one) ? 0 : -1;
+  }
+  return pthread_cancel(ns->rxtid);
+}
+
+static int
+netstack_init(netstack* ns, const netstack_opts* opts){
+  if(!validate_options(opts)){
+    return -1;
+  }
+  // Get an initial dump of all entities, then updates via subscription.
+  int dumpmsgs[] = {
+    RTM_GETLINK,
+    RTM_GETADDR,
+    RTM_GETNEIGH,
+    RTM_GETNEXTHOP,
+    RTM_GETROUTE,
+    RTM_GETRULE,
+    RTM_GETQDISC,
+    RTM_GETNSID,
+  };
+  if(opts){
+    memcpy(&ns->opts, opts, sizeof(*opts));
+  }else{
+    memset(&ns->opts, 0, sizeof(ns->opts));
+  }
+  if(ns->opts.diagfxn == NULL){
+    ns->opts.diagfxn = null_diagfxn;
+  }
+  if(compile_iface_filters(ns)){
+    return -1;
+  }
+  ns->nonce = 1;
+  ns->uid = atomic_fetch_add(&next_uid, 1);
+  ns->iface_gen = 0;
+  ns->lflags = NULL;
+  ns->lflag_count = ns->lflag_size = 0;
+  ns->queued = NULL;
+  ns->queuedtail = &ns->queued;
+  ns->dumpreq = NULL;
+  ns->sent = NULL;
+  ns->senttail = &ns->sent;
+  ns->sentcount = 0;
+  ns->sentacks = 0;
+  ns->txbusy = false;
+  ns->nextseq = 1;
+  ns->finished = NULL;
+  ns->finishedtail = &ns->finished;
+  ns->sample_depth = ns->opts.sample_depth;
+  if(ns->sample_depth == 0 && ns->opts.sample_interval_ms){
+    ns->sample_depth = NETSTACK_SAMPLE_DEPTH_DEFAULT;
+  }
+  ns->sample_next = 0;
+  ns->sample_req = NULL;
+  ns->sampling = false;
+  for(size_t slot = 0 ; slot < IFACE_HASH_SLOTS ; ++slot){
+    atomic_init(&ns->stats_slots[slot], NULL);
+    ns->topo_hash[slot] = NULL;
+  }
+  ns->name_trie = NULL;
+  ns->nsid_tries = NULL;
+  ns->nsid_count = 0;
+  ns->iface_count = 0;
+  ns->iface_bytes = 0;
+  memset(&ns->iface_hash, 0, sizeof(ns->iface_hash));
+  ns->rxbuf_size = RXBUF_BYTES;
+  ns->processing = false;
+  if((ns->rxbuf = malloc(ns->rxbuf_size)) == NULL){
+    destroy_iface_filters(ns);
+    return -1;
+  }
+  ns->uring = NULL;
+  ns->ethtool = NULL;
+  if(ns->opts.io_uring){
+    if((ns->uring = uring_create()) == NULL){
+      ns->opts.diagfxn("Couldn't set up io_uring (%s), using recvmsg\n", strerror(errno));
+    }
+  }
+  if((ns->nl = nl_socket_connect(NETLINK_ROUTE)) == NULL){
+    free(ns->rxbuf);
+    uring_destroy(ns->uring);
+    destroy_iface_filters(ns);
+    return -1;
+  }
+  // answers to our requests share the receive buffer with events; make it
+  // roomy, lest we overrun it (and then need resync). SO_RCVBUF is capped by
+  // net.core.rmem_max, which SO_RCVBUFFORCE (requiring CAP_NET_ADMIN) is not.
+  int rcvbuf = SOCK_RCVBUF_BYTES;
+  if(setsockopt(nl_socket_get_fd(ns->nl), SOL_SOCKET, SO_RCVBUFFORCE, &rcvbuf, sizeof(rcvbuf))){
+    setsockopt(nl_socket_get_fd(ns->nl), SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+  }
+  // ask for extended acknowledgements, without echoes of our requests
+  int one = 1;
+  if(setsockopt(nl_socket_get_fd(ns->nl), SOL_NETLINK, NETLINK_EXT_ACK, &one, sizeof(one)) ||
+     setsockopt(nl_socket_get_fd(ns->nl), SOL_NETLINK, NETLINK_CAP_ACK, &one, sizeof(one))){
+    ns->opts.diagfxn("Couldn't enable extended acks (%s)\n", strerror(errno));
+  }
+  int dumpercount = sizeof(dumpmsgs) / sizeof(*dumpmsgs);
+  if(subscribe_to_netlink(ns, dumpmsgs, &dumpercount)){
+    nl_socket_free(ns->nl);
+    free(ns->rxbuf);
+    uring_destroy(ns->uring);
+    destroy_iface_filters(ns);
+    return -1;
+  }
+  memcpy(ns->dumpers, dumpmsgs, sizeof(*dumpmsgs) * dumpercount);
+  ns->dumpercount = dumpercount;
+  ns->zombies = NULL;
+  memset(&ns->iface_log, 0, sizeof(ns->iface_log));
+  ns->generation = 0;
+  ns->netlink_errors = 0;
+  ns->user_callbacks_total = 0;
+  unsigned shard;
+  for(shard = 0 ; shard < ns->shard_count ; ++shard){
+    ns->shards[shard].lookup_copies = 0;
+    ns->shards[shard].lookup_shares = 0;
+    ns->shards[shard].lookup_failures = 0;
+    ns->shards[shard].tlcache_hits = 0;
+    ns->shards[shard].tlcache_misses = 0;
+  }
+  int z;
+  ns->iface_events = ns->addr_events = ns->route_events = ns->neigh_events = 0;
+  ns->rule_events = ns->nexthop_events = ns->tc_events = 0;
+  ns->parse_failures = ns->overruns = ns->resyncs = ns->filtered = 0;
+  ns->dumps = ns->dump_nsec_total = ns->dump_nsec_max = 0;
+  size_t b;
+  for(b = 0 ; b < DUMP_BUCKETS ; ++b){
+    ns->dump_histogram[b] = 0;
+  }
+  if(pthread_mutex_init(&ns->hashlock, NULL)){
+    nl_socket_free(ns->nl);
+    free(ns->rxbuf);
+    uring_destroy(ns->uring);
+    destroy_iface_filters(ns);
+    return -1;
+  }
+  if(pthread_mutex_init(&ns->fiblock, NULL)){
+    pthread_mutex_destroy(&ns->hashlock);
+    nl_socket_free(ns->nl);
+    free(ns->rxbuf);
+    uring_destroy(ns->uring);
+    destroy_iface_filters(ns);
+    return -1;
+  }
+  if(pthread_mutex_init(&ns->topolock, NULL)){
+    pthread_mutex_destroy(&ns->fiblock);
+    pthread_mutex_destroy(&ns->hashlock);
+    nl_socket_free(ns->nl);
+    free(ns->rxbuf);
+    uring_destroy(ns->uring);
+    destroy_iface_filters(ns);
+    return -1;
+  }
+  ns->fib_tables = NULL;
+  ns->route_count = 0;
+  ns->neigh_hash = NULL;
+  ns->neigh_buckets = 0;
+  ns->neigh_count = 0;
+  memset(&ns->route_log, 0, sizeof(ns->route_log));
+  memset(&ns->neigh_log, 0, sizeof(ns->neigh_log));
+  memset(&ns->nh_log, 0, sizeof(ns->nh_log));
+  memset(&ns->fdb_log, 0, sizeof(ns->fdb_log));
+  memset(&ns->tc_log, 0, sizeof(ns->tc_log));
+  memset(&ns->rules4, 0, sizeof(ns->rules4));
+  memset(&ns->rules6, 0, sizeof(ns->rules6));
+  ns->nh_hash = NULL;
+  ns->nh_buckets = 0;
+  ns->nh_count = 0;
+  ns->nh_orphans = NULL;
+  ns->fdb_hash = NULL;
+  ns->fdb_buckets = 0;
+  ns->fdb_count = 0;
+  ns->fdb_ports = NULL;
+  ns->fdb_portcount = ns->fdb_portsize = 0;
+  ns->tc_hash = NULL;
+  ns->tc_buckets = 0;
+  ns->tc_count = 0;
+  if(pthread_mutex_init(&ns->txlock, NULL)){
+    pthread_mutex_destroy(&ns->hashlock);
+    pthread_mutex_destroy(&ns->fiblock);
+    pthread_mutex_destroy(&ns->topolock);
+    nl_socket_free(ns->nl);
+    free(ns->rxbuf);
+    uring_destroy(ns->uring);
+    destroy_iface_filters(ns);
+    return -1;
+  }
+  if(pthread_cond_init(&ns->txcond, NULL)){
+    pthread_mutex_destroy(&ns->txlock);
+    pthread_mutex_destroy(&ns->hashlock);
+    pthread_mutex_destroy(&ns->fiblock);
+    pthread_mutex_destroy(&ns->topolock);
+    nl_socket_free(ns->nl);
+    free(ns->rxbuf);
+    uring_destroy(ns->uring);
+    destroy_iface_filters(ns);
+    return -1;
+  }
+  pthread_condattr_t cattr;
+  bool cinit = false;
+  if(pthread_condattr_init(&cattr) == 0){
+    if(pthread_condattr_setclock(&cattr, CLOCK_MONOTONIC) == 0){
+      cinit = pthread_cond_init(&ns->reqcond, &cattr) == 0;
+    }
+    pthread_condattr_destroy(&cattr);
+  }
+  if(!cinit){
+    pthread_cond_destroy(&ns->txcond);
+    pthread_mutex_destroy(&ns->txlock);
+    pthread_mutex_destroy(&ns->hashlock);
+    pthread_mutex_destroy(&ns->fiblock);
+    pthread_mutex_destroy(&ns->topolock);
+    nl_socket_free(ns->nl);
+    free(ns->rxbuf);
+    uring_destroy(ns->uring);
+    destroy_iface_filters(ns);
+    return -1;
+  }
+  // in threadless mode, the initial dumps go out now (netstack_create()
+  // handles _BLOCK); otherwise, they await the txthread
+  if(ns->opts.initial_events != NETSTACK_INITIAL_EVENTS_NONE){
+    for(z = 0 ; z < dumpercount ; ++z){
+      if(queue_request(ns, dumpmsgs[z])){
+        requests_cancel(ns);
+        pthread_cond_destroy(&ns->reqcond);
+        pthread_cond_destroy(&ns->txcond);
+        pthread_mutex_destroy(&ns->txlock);
+        pthread_mutex_destroy(&ns->hashlock);
+        pthread_mutex_destroy(&ns->fiblock);
+        pthread_mutex_destroy(&ns->topolock);
+        nl_socket_free(ns->nl);
+        free(ns->rxbuf);
+        uring_destroy(ns->uring);
+        destroy_iface_filters(ns);
+        return -1;
+      }
+    }
+  }
+  if(ns->opts.threadless){
+    return 0;
+  }
+  if(ns->opts.ethtool){
+    if((ns->ethtool = ethtool_create(ns)) == NULL){
+      requests_cancel(ns);
+      pthread_cond_destroy(&ns->reqcond);
+      pthread_cond_destroy(&ns->txcond);
+      pthread_mutex_destroy(&ns->txlock);
+      pthread_mutex_destroy(&ns->hashlock);
+      pthread_mutex_destroy(&ns->fiblock);
+      pthread_mutex_destroy(&ns->topolock);
+      nl_socket_free(ns->nl);
+      free(ns->rxbuf);
+      uring_destroy(ns->uring);
+      destroy_iface_filters(ns);
+      return -1;
+    }
+  }
+  if(pthread_create(&ns->rxtid, NULL, ns->uring ? netstack_uring_thread
+                                   : netstack_rx_thread, ns)){
+    ethtool_destroy(ns->ethtool);
+    requests_cancel(ns);
+    pthread_cond_destroy(&ns->reqcond);
+    pthread_cond_destroy(&ns->txcond);
+    pthread_mutex_destroy(&ns->txlock);
+    pthread_mutex_destroy(&ns->hashlock);
+    pthread_mutex_destroy(&ns->fiblock);
+    pthread_mutex_destroy(&ns->topolock);
+    nl_socket_free(ns->nl);
+    free(ns->rxbuf);
+    uring_destroy(ns->uring);
+    destroy_iface_filters(ns);
+    return -1;
+  }
+  if(pthread_create(&ns->txtid, NULL, netstack_tx_thread, ns)){
+    stop_rx_thread(ns);
+    pthread_join(ns->rxtid, NULL);
+    ethtool_destroy(ns->ethtool);
+    requests_cancel(ns);
+    pthread_cond_destroy(&ns->reqcond);
+    pthread_cond_destroy(&ns->txcond);
+    pthread_mutex_destroy(&ns->txlock);
+    pthread_mutex_destroy(&ns->hashlock);
+    pthread_mutex_destroy(&ns->fiblock);
+    pthread_mutex_destroy(&ns->topolock);
+    nl_socket_free(ns->nl);
+    free(ns->rxbuf);
+    uring_destroy(ns->uring);
+    destroy_iface_filters(ns);
+    return -1;
+  }
+  if(ns->ethtool){
+    if(pthread_create(&ns->ethtool->tid, NULL, netstack_ethtool_thread, ns)){
+      stop_rx_thread(ns);
+      pthread_cancel(ns->txtid);
+      pthread_join(ns->rxtid, NULL);
+      pthread_join(ns->txtid, NULL);
+      ethtool_destroy(ns->ethtool);
+      requests_cancel(ns);
+      pthread_cond_destroy(&ns->reqcond);
+      pthread_cond_destroy(&ns->txcond);
+      pthread_mutex_destroy(&ns->txlock);
+      pthread_mutex_destroy(&ns->hashlock);
+      pthread_mutex_destroy(&ns->fiblock);
+      pthread_mutex_destroy(&ns->topolock);
+      nl_socket_free(ns->nl);
+      free(ns->rxbuf);
+      uring_destroy(ns->uring);
+      destroy_iface_filters(ns);
+      return -1;
+    }
+  }
+  if(ns->opts.initial_events == NETSTACK_INITIAL_EVENTS_BLOCK){
+    pthread_mutex_lock(&ns->txlock);
+    while(requests_pending_locked(ns)){
+      pthread_cond_wait(&ns->reqcond, &ns->txlock);
+    }
+    pthread_mutex_unlock(&ns->txlock);
+    if(ns->ethtool){
+      pthread_mutex_lock(&ns->ethtool->lock);
+      while(!ethtool_synced(ns)){
+        pthread_cond_wait(&ns->ethtool->cond, &ns->ethtool->lock);
+      }
+      pthread_mutex_unlock(&ns->ethtool->lock);
+    }
+  }
+  return 0;
+}
+
+netstack* netstack_create(const netstack_opts* nopts){
+  netstack* ns = aligned_alloc(alignof(netstack), sizeof(*ns));
+  if(ns){
+    pthread_once(&stat_shards_once, stat_shards_init);
+    ns->shard_count = stat_shards;
+    ns->shards = aligned_alloc(CACHELINE, sizeof(*ns->shards) * ns->shard_count);
+    if(ns->shards == NULL){
+      free(ns);
+      return NULL;
+    }
+    if(netstack_init(ns, nopts)){
+      free(ns->shards);
+      free(ns);
+      return NULL;
+    }
+    if(ns->opts.threadless && ns->opts.initial_events == NETSTACK_INITIAL_EVENTS_BLOCK){
+      if(threadless_initial_block(ns)){
+        netstack_destroy(ns);
+        return NULL;
+      }
+    }
+    if(ns->opts.sample_interval_ms && !ns->opts.threadless){
+      if(pthread_create(&ns->samplertid, NULL, netstack_sampler_thread, ns)){
+        netstack_destroy(ns);
+        return NULL;
+      }
+      ns->sampling = true;
+    }
+  }
+  return ns;
+}
+
+// Downref all netstack_iface objects remaining in our cache. This might not
+// actually free them all; some might still be shared with the caller.
+static void
+destroy_iface_cache(netstack* ns){
+  size_t z;
+  for(z = 0 ; z < sizeof(ns->iface_hash) / sizeof(*ns->iface_hash) ; ++z){
+    netstack_iface* ni = ns->iface_hash[z];
+    while(ni){
+      netstack_iface* tmp = ni->hnext;
+      netstack_iface_destroy(ni);
+      ni = tmp;
+    }
+  }
+  while(ns->zombies){
+    netstack_iface* tmp = ns->zombies->hnext;
+    netstack_iface_destroy(ns->zombies);
+    ns->zombies = tmp;
+  }
+  changelog_destroy(&ns->iface_log);
+}
+
+int netstack_destroy(netstack* ns){
+  int ret = 0;
+  if(ns){
+    // the sampler queues requests, so it goes before the txthread
+    if(ns->sampling){
+      if(pthread_cancel(ns->samplertid) == 0){
+        ret |= pthread_join(ns->samplertid, NULL);
+      }else{
+        ret = -1;
+      }
+    }
+    if(ns->opts.threadless){
+      // nothing to reap
+    }else if(stop_rx_thread(ns) == 0 && pthread_cancel(ns->txtid) == 0){
+      ret |= pthread_join(ns->txtid, NULL);
+      ret |= pthread_join(ns->rxtid, NULL);
+    }else{
+      ret = -1;
+    }
+    // the rxthread can send ethtool queries, so this comes after its reaping
+    if(ns->ethtool){
+      if(pthread_cancel(ns->ethtool->tid) == 0){
+        ret |= pthread_join(ns->ethtool->tid, NULL);
+      }else{
+        ret = -1;
+      }
+      ethtool_destroy(ns->ethtool);
+    }
+    if(ns->sample_req){
+      request_release(ns->sample_req);
+    }
+    requests_cancel(ns);
+    uring_destroy(ns->uring);
+    nl_socket_free(ns->nl);
+    ret |= pthread_cond_destroy(&ns->reqcond);
+    ret |= pthread_cond_destroy(&ns->txcond);
+    ret |= pthread_mutex_destroy(&ns->txlock);
+    ret |= pthread_mutex_destroy(&ns->hashlock);
+    ret |= pthread_mutex_destroy(&ns->fiblock);
+    ret |= pthread_mutex_destroy(&ns->topolock);
+    destroy_iface_cache(ns);
+    destroy_topo_cache(ns);
+    destroy_fib(ns);
+    destroy_stats_slots(ns);
+    destroy_name_trie(ns->name_trie);
+    unsigned n;
+    for(n = 0 ; n < ns->nsid_count ; ++n){
+      destroy_name_trie(ns->nsid_tries[n].trie);
+    }
+    free(ns->nsid_tries);
+    destroy_iface_filters(ns);
+    free(ns->lflags);
+    free(ns->rxbuf);
+    free(ns->shards);
+    free(ns);
+  }
+  return ret;
+}
+
+// Optional per-thread, direct-mapped caches in front of the local share
+// lookups (the lookup_cache option), one keyed by index and one by name. Each
+// entry holds its own reference on the iface, so the object cannot be freed
+// out from under it. An entry is valid only for the netstack having its uid,
+// and only so long as that netstack's iface_gen is unchanged since the entry
+// was filled; a hit thus requires only an atomic load (and the refcount bump
+// every share requires). A miss releases every stale entry of its netstack,
+// as does thread exit. References held by entries are counted in the iface's
+// tlrefs, and excluded from the share statistics.
+#define TLCACHE_SLOTS 16
+
+typedef struct tlcache_entry {
+  uint64_t uid;
+  uint_fast64_t gen;
+  netstack_iface* ni;
+} tlcache_entry;
+
+static __thread tlcache_entry tlcache_byidx[TLCACHE_SLOTS];
+static __thread tlcache_entry tlcache_byname[TLCACHE_SLOTS];
+static pthread_key_t tlcache_key;
+static pthread_once_t tlcache_once = PTHREAD_ONCE_INIT;
+
+static void
+tlcache_drop(tlcache_entry* e){
+  if(e->ni){
+    atomic_fetch_sub(&e->ni->tlrefs, 1);
+    netstack_iface_destroy(e->ni);
+    e->ni = NULL;
+  }
+}
+
+// Run at thread exit, should the thread have used a lookup cache.
+static void
+tlcache_release(void* unused __attribute__ ((unused))){
+  int z;
+  for(z = 0 ; z < TLCACHE_SLOTS ; ++z){
+    tlcache_drop(&tlcache_byidx[z]);
+    tlcache_drop(&tlcache_byname[z]);
+  }
+}
+
+// A change to the iface cache invalidates every entry we hold for that
+// netstack. Release them all, lest they pin replaced ifaces as zombies.
+static void
+tlcache_drop_stale(uint64_t uid, uint_fast64_t gen){
+  int z;
+  for(z = 0 ; z < TLCACHE_SLOTS ; ++z){
+    if(tlcache_byidx[z].uid == uid && tlcache_byidx[z].gen != gen){
+      tlcache_drop(&tlcache_byidx[z]);
+    }
+    if(tlcache_byname[z].uid == uid && tlcache_byname[z].gen != gen){
+      tlcache_drop(&tlcache_byname[z]);
+    }
+  }
+}
+
+static void
+tlcache_key_create(void){
+  pthread_key_create(&tlcache_key, tlcache_release);
+}
+
+static inline int
+tlcache_name_slot(const char* name){
+  unsigned h = 2166136261u; // FNV-1a
+  while(*name){
+    h = (h ^ *(const unsigned char*)name++) * 16777619u;
+  }
+  return h % TLCACHE_SLOTS;
+}
+
+static netstack_iface* netstack_iface_byname(const name_node* array, const char* name);
+static netstack_iface* netstack_iface_byidx(const netstack* ns, int nsid, int idx);
+
+// Share the local iface having idx (if idx >= 0) or name via the entry e.
+static const netstack_iface*
+tlcache_share(netstack* ns, tlcache_entry* e, int idx, const char* name){
+  lookup_shard* shard = lookup_stats(ns);
+  netstack_iface* ni = e->ni;
+  const uint_fast64_t curgen = atomic_load_explicit(&ns->iface_gen, memory_order_acquire);
+  if(ni && e->uid == ns->uid && e->gen == curgen &&
+      (idx >= 0 ? ni->ifi.ifi_index == idx : strcmp(ni->name, name) == 0)){
+    atomic_fetch_add(&ni->refcount, 1);
+    atomic_fetch_add_explicit(&shard->tlcache_hits, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&shard->lookup_shares, 1, memory_order_relaxed);
+    return ni;
+  }
+  atomic_fetch_add_explicit(&shard->tlcache_misses, 1, memory_order_relaxed);
+  tlcache_drop_stale(ns->uid, curgen);
+  pthread_mutex_lock(&ns->hashlock);
+  ni = idx >= 0 ? netstack_iface_byidx(ns, NETSTACK_NSID_LOCAL, idx)
+                : netstack_iface_byname(ns->name_trie, name);
+  // iface_gen only changes under hashlock, so it's consistent with ni
+  uint_fast64_t gen = atomic_load_explicit(&ns->iface_gen, memory_order_relaxed);
+  if(ni){
+    atomic_fetch_add(&ni->refcount, 2); // one for the caller, one for e
+    atomic_fetch_add(&ni->tlrefs, 1);
+  }
+  pthread_mutex_unlock(&ns->hashlock);
+  if(ni == NULL){
+    atomic_fetch_add_explicit(&shard->lookup_failures, 1, memory_order_relaxed);
+    return NULL;
+  }
+  atomic_fetch_add_explicit(&shard->lookup_shares, 1, memory_order_relaxed);
+  pthread_once(&tlcache_once, tlcache_key_create);
+  tlcache_drop(e);
+  pthread_setspecific(tlcache_key, e); // any non-NULL value will do
+  e->uid = ns->uid;
+  e->gen = gen;
+  e->ni = ni;
+  return ni;
+}
+
+static netstack_iface*
+netstack_iface_byname(const name_node* array, const char* name){
+  while(array){
+    if(!*name){
+      return array->iface;
+    }
+    array = array->array[*(const unsigned char*)(name++)];
+  }
+  return NULL;
+}
+
+// Call with hashlock held.
+static inline netstack_iface*
+netstack_iface_byname_nsid(netstack* ns, int nsid, const char* name){
+  name_node** trie = name_trie_for(ns, nsid, false);
+  return trie ? netstack_iface_byname(*trie, name) : NULL;
+}
+
+netstack_iface* netstack_iface_copy_byname_nsid(netstack* ns, int nsid,
+                                                const char* name){
+  netstack_iface* ret;
+  pthread_mutex_lock(&ns->hashlock);
+  netstack_iface* ni = netstack_iface_byname_nsid(ns, nsid, name);
+  if(ni){
+    ret = dup_iface(ni);
+  }else{
+    ret = NULL;
+  }
+  pthread_mutex_unlock(&ns->hashlock);
+  if(ret){
+    atomic_fetch_add_explicit(&lookup_stats(ns)->lookup_copies, 1,
+                              memory_order_relaxed);
+  }else{
+    atomic_fetch_add_explicit(&lookup_stats(ns)->lookup_failures, 1,
+                              memory_order_relaxed);
+  }
+  return ret;
+}
+
+netstack_iface* netstack_iface_copy_byname(netstack* ns, const char* name){
+  return netstack_iface_copy_byname_nsid(ns, NETSTACK_NSID_LOCAL, name);
+}
+
+const netstack_iface* netstack_iface_share_byname_nsid(netstack* ns, int nsid,
+                                                       const char* name){
   pthread_mutex_lock(&ns->hashlock);
-  netstack_iface* ni = netstack_iface_byname(ns->name_trie, name);
+  netstack_iface* ni = netstack_iface_byname_nsid(ns, nsid, name);
   if(ni){
     atomic_fetch_add(&ni->refcount, 1);
   }
   pthread_mutex_unlock(&ns->hashlock);
   if(ni){
-    atomic_fetch_add(&ns->lookup_shares, 1);
+    atomic_fetch_add_explicit(&lookup_stats(ns)->lookup_shares, 1,
+                              memory_order_relaxed);
   }else{
-    atomic_fetch_add(&ns->lookup_failures, 1);
+    atomic_fetch_add_explicit(&lookup_stats(ns)->lookup_failures, 1,
+                              memory_order_relaxed);
   }
   return ni;
 }
 
+const netstack_iface* netstack_iface_share_byname(netstack* ns, const char* name){
+  if(ns->opts.lookup_cache){
+    return tlcache_share(ns, tlcache_byname + tlcache_name_slot(name), -1, name);
+  }
+  return netstack_iface_share_byname_nsid(ns, NETSTACK_NSID_LOCAL, name);
+}
+
 static inline netstack_iface*
-netstack_iface_byidx(const netstack* ns, int idx){
+netstack_iface_byidx(const netstack* ns, int nsid, int idx){
   if(idx < 0){
     return NULL;
   }
-  int hidx = iface_hash(ns, idx);
+  int hidx = iface_hash(ns, nsid, idx);
   netstack_iface* ni = ns->iface_hash[hidx];
   while(ni){
-    if(ni->ifi.ifi_index == idx){
+    if(ni->ifi.ifi_index == idx && ni->nsid == nsid){
       break;
     }
     ni = ni->hnext;
@@ -1168,63 +8820,648 @@ netstack_iface_byidx(const netstack* ns, int idx){
   return ni;
 }
 
-netstack_iface* netstack_iface_copy_byidx(netstack* ns, int idx){
-  netstack_iface* ret;
-  pthread_mutex_lock(&ns->hashlock);
-  netstack_iface* ni = netstack_iface_byidx(ns, idx);
-  if(ni){
-    ret = create_iface(ni->rtabuf, ni->rtabuflen);
-  }else{
-    ret = NULL;
+netstack_iface* netstack_iface_copy_byidx_nsid(netstack* ns, int nsid, int idx){
+  netstack_iface* ret;
+  pthread_mutex_lock(&ns->hashlock);
+  netstack_iface* ni = netstack_iface_byidx(ns, nsid, idx);
+  if(ni){
+    ret = dup_iface(ni);
+  }else{
+    ret = NULL;
+  }
+  pthread_mutex_unlock(&ns->hashlock);
+  if(ret){
+    atomic_fetch_add_explicit(&lookup_stats(ns)->lookup_copies, 1,
+                              memory_order_relaxed);
+  }else{
+    atomic_fetch_add_explicit(&lookup_stats(ns)->lookup_failures, 1,
+                              memory_order_relaxed);
+  }
+  return ret;
+}
+
+netstack_iface* netstack_iface_copy_byidx(netstack* ns, int idx){
+  return netstack_iface_copy_byidx_nsid(ns, NETSTACK_NSID_LOCAL, idx);
+}
+
+// No locking, object is already owned by caller
+netstack_iface* netstack_iface_copy(const netstack_iface* ni){
+  return dup_iface(ni);
+}
+
+const netstack_iface* netstack_iface_share_byidx_nsid(netstack* ns, int nsid, int idx){
+  pthread_mutex_lock(&ns->hashlock);
+  netstack_iface* ni = netstack_iface_byidx(ns, nsid, idx);
+  if(ni){
+    atomic_fetch_add(&ni->refcount, 1);
+  }
+  pthread_mutex_unlock(&ns->hashlock);
+  if(ni){
+    atomic_fetch_add_explicit(&lookup_stats(ns)->lookup_shares, 1,
+                              memory_order_relaxed);
+  }else{
+    atomic_fetch_add_explicit(&lookup_stats(ns)->lookup_failures, 1,
+                              memory_order_relaxed);
+  }
+  return ni;
+}
+
+const netstack_iface* netstack_iface_share_byidx(netstack* ns, int idx){
+  if(ns->opts.lookup_cache && idx >= 0){
+    return tlcache_share(ns, tlcache_byidx + (idx % TLCACHE_SLOTS), idx, NULL);
+  }
+  return netstack_iface_share_byidx_nsid(ns, NETSTACK_NSID_LOCAL, idx);
+}
+
+// Account for a batch of lookups all at once.
+static void
+lookup_batch_stats(netstack* ns, size_t found, size_t n){
+  lookup_shard* shard = lookup_stats(ns);
+  if(found){
+    atomic_fetch_add_explicit(&shard->lookup_shares, found, memory_order_relaxed);
+  }
+  if(n - found){
+    atomic_fetch_add_explicit(&shard->lookup_failures, n - found, memory_order_relaxed);
+  }
+}
+
+size_t netstack_iface_share_byidx_batch(netstack* ns, const int* idxs, size_t n,
+                                        const netstack_iface** out){
+  size_t z, found = 0;
+  pthread_mutex_lock(&ns->hashlock);
+  // Pull in the chain heads first, so that their misses overlap
+  for(z = 0 ; z < n ; ++z){
+    if(idxs[z] >= 0){
+      __builtin_prefetch(ns->iface_hash[iface_hash(ns, NETSTACK_NSID_LOCAL, idxs[z])]);
+    }
+  }
+  for(z = 0 ; z < n ; ++z){
+    netstack_iface* ni = netstack_iface_byidx(ns, NETSTACK_NSID_LOCAL, idxs[z]);
+    if(ni){
+      atomic_fetch_add(&ni->refcount, 1);
+      ++found;
+    }
+    out[z] = ni;
+  }
+  pthread_mutex_unlock(&ns->hashlock);
+  lookup_batch_stats(ns, found, n);
+  return found;
+}
+
+size_t netstack_iface_share_byname_batch(netstack* ns, const char* const* names,
+                                         size_t n, const netstack_iface** out){
+  size_t z, found = 0;
+  pthread_mutex_lock(&ns->hashlock);
+  for(z = 0 ; z < n ; ++z){
+    netstack_iface* ni = netstack_iface_byname(ns->name_trie, names[z]);
+    if(ni){
+      atomic_fetch_add(&ni->refcount, 1);
+      ++found;
+    }
+    out[z] = ni;
+  }
+  pthread_mutex_unlock(&ns->hashlock);
+  lookup_batch_stats(ns, found, n);
+  return found;
+}
+
+// Nothing gets locked here, since ownership indicates sufficient locking
+const netstack_iface* netstack_iface_share(const netstack_iface* ni){
+  netstack_iface* unsafe_ni = (netstack_iface*)ni;
+  atomic_fetch_add(&unsafe_ni->refcount, 1);
+  return ni;
+}
+
+void netstack_iface_abandon(const netstack_iface* ni){
+  netstack_iface* unsafe_ni = (netstack_iface*)ni;
+  netstack_iface_destroy(unsafe_ni);
+}
+
+uint64_t netstack_iface_bytes(const netstack* ns){
+  netstack* unsafe_ns = (netstack*)ns;
+  uint64_t ret;
+  pthread_mutex_lock(&unsafe_ns->hashlock);
+  ret = ns->iface_bytes;
+  pthread_mutex_unlock(&unsafe_ns->hashlock);
+  return ret;
+}
+
+unsigned netstack_route_count(const netstack* ns){
+  netstack* unsafe_ns = (netstack*)ns;
+  unsigned ret;
+  pthread_mutex_lock(&unsafe_ns->fiblock);
+  ret = ns->route_count;
+  pthread_mutex_unlock(&unsafe_ns->fiblock);
+  return ret;
+}
+
+unsigned netstack_neigh_count(const netstack* ns){
+  netstack* unsafe_ns = (netstack*)ns;
+  unsigned ret;
+  pthread_mutex_lock(&unsafe_ns->fiblock);
+  ret = ns->neigh_count;
+  pthread_mutex_unlock(&unsafe_ns->fiblock);
+  return ret;
+}
+
+unsigned netstack_fdb_count(const netstack* ns){
+  netstack* unsafe_ns = (netstack*)ns;
+  unsigned ret;
+  pthread_mutex_lock(&unsafe_ns->fiblock);
+  ret = ns->fdb_count;
+  pthread_mutex_unlock(&unsafe_ns->fiblock);
+  return ret;
+}
+
+unsigned netstack_fdb_port_count(const netstack* ns, int port){
+  netstack* unsafe_ns = (netstack*)ns;
+  unsigned ret;
+  pthread_mutex_lock(&unsafe_ns->fiblock);
+  ret = fdb_port_entries(ns, port);
+  pthread_mutex_unlock(&unsafe_ns->fiblock);
+  return ret;
+}
+
+int netstack_fdb_lookup(const netstack* ns, int master, uint16_t vlan,
+                        const void* mac, netstack_fdb_entry* fe){
+  netstack* unsafe_ns = (netstack*)ns;
+  if(mac == NULL || fe == NULL){
+    errno = EINVAL;
+    return -1;
+  }
+  if(ns->opts.fdb_notrack){
+    errno = EOPNOTSUPP;
+    return -1;
+  }
+  memset(fe, 0, sizeof(*fe));
+  bool found = false;
+  pthread_mutex_lock(&unsafe_ns->fiblock);
+  if(ns->fdb_buckets){
+    const fdb_node* fd = *fdb_find(ns, master, vlan, mac);
+    if(fd){
+      const netstack_neigh* nn = fd->nn;
+      fe->port = fd->port;
+      fe->state = nn->nd.ndm_state;
+      fe->flags = nn->nd.ndm_flags;
+      const struct rtattr* dst = netstack_neigh_attr(nn, NDA_DST);
+      if(dst && (RTA_PAYLOAD(dst) == 4 || RTA_PAYLOAD(dst) == 16)){
+        fe->dst_family = RTA_PAYLOAD(dst) == 4 ? AF_INET : AF_INET6;
+        memcpy(fe->dst, RTA_DATA(dst), RTA_PAYLOAD(dst));
+      }
+      found = true;
+    }
+  }
+  pthread_mutex_unlock(&unsafe_ns->fiblock);
+  if(!found){
+    errno = ENOENT;
+    return -1;
+  }
+  return 0;
+}
+
+unsigned netstack_tc_count(const netstack* ns){
+  netstack* unsafe_ns = (netstack*)ns;
+  unsigned ret;
+  pthread_mutex_lock(&unsafe_ns->fiblock);
+  ret = ns->tc_count;
+  pthread_mutex_unlock(&unsafe_ns->fiblock);
+  return ret;
+}
+
+const netstack_tc* netstack_tc_share(const netstack* ns, bool isclass,
+                                     int ifindex, uint32_t handle){
+  netstack* unsafe_ns = (netstack*)ns;
+  netstack_tc* ret = NULL;
+  if(ns->opts.tc_notrack){
+    errno = EOPNOTSUPP;
+    return NULL;
+  }
+  pthread_mutex_lock(&unsafe_ns->fiblock);
+  if(ns->tc_buckets){
+    const tc_node* tn = *tc_find(ns, isclass, ifindex, handle);
+    if(tn){
+      ret = tn->tc;
+      atomic_fetch_add(&ret->refcount, 1);
+    }
+  }
+  pthread_mutex_unlock(&unsafe_ns->fiblock);
+  if(ret == NULL){
+    errno = ENOENT;
+  }
+  return ret;
+}
+
+int netstack_tc_stats_latest(const netstack* ns, bool isclass, int ifindex,
+                             uint32_t handle, netstack_tc_stats* st){
+  netstack* unsafe_ns = (netstack*)ns;
+  if(st == NULL){
+    errno = EINVAL;
+    return -1;
+  }
+  if(ns->opts.tc_notrack){
+    errno = EOPNOTSUPP;
+    return -1;
+  }
+  bool found = false;
+  pthread_mutex_lock(&unsafe_ns->fiblock);
+  if(ns->tc_buckets){
+    const tc_node* tn = *tc_find(ns, isclass, ifindex, handle);
+    if(tn){
+      *st = tn->stats;
+      found = true;
+    }
+  }
+  pthread_mutex_unlock(&unsafe_ns->fiblock);
+  if(!found){
+    errno = ENOENT;
+    return -1;
+  }
+  return 0;
+}
+
+int netstack_tc_refresh(netstack* ns){
+  if(queue_request(ns, RTM_GETQDISC)){
+    return -1;
+  }
+  // Gather the links with classful (or at least, not noqueue) qdiscs. A link
+  // can have several; we sort and dedup once we've dropped the lock.
+  int* ifindices = NULL;
+  size_t count = 0, size = 0;
+  pthread_mutex_lock(&ns->fiblock);
+  size_t z;
+  for(z = 0 ; z < ns->tc_buckets ; ++z){
+    const tc_node* tn;
+    for(tn = ns->tc_hash[z] ; tn ; tn = tn->hnext){
+      char kind[IFNAMSIZ];
+      if(tn->isclass || (netstack_tc_kind(tn->tc, kind) && !strcmp(kind, "noqueue"))){
+        continue;
+      }
+      if(count == size){
+        size_t nsize = size ? size * 2 : 16;
+        int* tmp = realloc(ifindices, nsize * sizeof(*tmp));
+        if(tmp == NULL){
+          continue;
+        }
+        ifindices = tmp;
+        size = nsize;
+      }
+      ifindices[count++] = tn->ifindex;
+    }
+  }
+  pthread_mutex_unlock(&ns->fiblock);
+  if(count){
+    qsort(ifindices, count, sizeof(*ifindices), ifindex_cmp);
+    size_t uniq = 1;
+    for(z = 1 ; z < count ; ++z){
+      if(ifindices[z] != ifindices[uniq - 1]){
+        ifindices[uniq++] = ifindices[z];
+      }
+    }
+    count = uniq;
+  }
+  int ret = 0;
+  for(z = 0 ; z < count ; ++z){
+    netstack_request* req = tc_dump_request(RTM_GETTCLASS, ifindices[z]);
+    if(req == NULL){
+      ret = -1;
+      break;
+    }
+    request_enqueue(ns, req);
+  }
+  free(ifindices);
+  return ret;
+}
+
+unsigned netstack_rule_count(const netstack* ns){
+  netstack* unsafe_ns = (netstack*)ns;
+  unsigned ret;
+  pthread_mutex_lock(&unsafe_ns->fiblock);
+  ret = ns->rules4.count + ns->rules6.count;
+  pthread_mutex_unlock(&unsafe_ns->fiblock);
+  return ret;
+}
+
+unsigned netstack_nexthop_count(const netstack* ns){
+  netstack* unsafe_ns = (netstack*)ns;
+  unsigned ret;
+  pthread_mutex_lock(&unsafe_ns->fiblock);
+  ret = ns->nh_count;
+  pthread_mutex_unlock(&unsafe_ns->fiblock);
+  return ret;
+}
+
+const netstack_nexthop* netstack_nexthop_share_byid(const netstack* ns, uint32_t id){
+  netstack* unsafe_ns = (netstack*)ns;
+  netstack_nexthop* ret = NULL;
+  if(ns->opts.nexthop_notrack){
+    errno = EOPNOTSUPP;
+    return NULL;
+  }
+  pthread_mutex_lock(&unsafe_ns->fiblock);
+  const nh_node* nd = nh_lookup(ns, id);
+  if(nd){
+    ret = nd->nh;
+    atomic_fetch_add(&ret->refcount, 1);
+  }
+  pthread_mutex_unlock(&unsafe_ns->fiblock);
+  if(ret == NULL){
+    errno = ENOENT;
+  }
+  return ret;
+}
+
+// A flow, as seen by the rules.
+typedef struct rule_flow {
+  uint64_t src[2], dst[2]; // network byte order, zero-padded
+  uint32_t mark;
+  int iif, oif;            // 0 if none
+} rule_flow;
+
+// Locally-originated traffic (iif 0) comes in through the loopback (always
+// index 1), as far as the rules are concerned.
+static void
+rule_flow_init(rule_flow* fl, int family, const void* src, const void* dst,
+               uint32_t mark, int iif, int oif){
+  const size_t alen = family_addrlen(family);
+  memset(fl, 0, sizeof(*fl));
+  if(src){
+    memcpy(fl->src, src, alen);
+  }
+  if(dst){
+    memcpy(fl->dst, dst, alen);
+  }
+  fl->mark = mark;
+  fl->iif = iif ? iif : 1;
+  fl->oif = oif;
+}
+
+// Does rn select fl? Rules are matched as if the flow had a TOS of 0.
+static inline bool
+rule_selects(const rule_node* rn, const rule_flow* fl){
+  if(rn->unmatchable){
+    return false;
+  }
+  bool m = !rn->tos &&
+           !((rn->mark ^ fl->mark) & rn->mask) &&
+           (!rn->iifname[0] || (rn->iif && rn->iif == fl->iif)) &&
+           (!rn->oifname[0] || (rn->oif && rn->oif == fl->oif)) &&
+           !(((fl->src[0] ^ rn->src[0]) & rn->srcmask[0]) |
+             ((fl->src[1] ^ rn->src[1]) & rn->srcmask[1]) |
+             ((fl->dst[0] ^ rn->dst[0]) & rn->dstmask[0]) |
+             ((fl->dst[1] ^ rn->dst[1]) & rn->dstmask[1]));
+  return rn->invert ? !m : m;
+}
+
+// A walk of a rule_set for some flow. With the fwmark index, it merges the
+// general rules with those selecting the flow's mark, [m, mend) of marked.
+// Otherwise, it visits every rule from idx on.
+typedef struct rule_cursor {
+  unsigned idx;  // no rule before this is visited
+  unsigned g;    // next of general
+  unsigned m, mend;
+} rule_cursor;
+
+static void
+rule_cursor_init(const rule_set* rs, const rule_flow* fl, rule_cursor* rc){
+  memset(rc, 0, sizeof(*rc));
+  if(!rs->indexed){
+    return;
+  }
+  unsigned lo = 0, hi = rs->mcount;
+  while(lo < hi){
+    unsigned mid = lo + (hi - lo) / 2;
+    if(rs->marked[mid].mark < fl->mark){
+      lo = mid + 1;
+    }else{
+      hi = mid;
+    }
+  }
+  rc->m = rc->mend = lo;
+  while(rc->mend < rs->mcount && rs->marked[rc->mend].mark == fl->mark){
+    ++rc->mend;
+  }
+}
+
+// Skip ahead to the rule at index t (following a goto).
+static void
+rule_cursor_seek(const rule_set* rs, rule_cursor* rc, unsigned t){
+  rc->idx = t;
+  if(!rs->indexed){
+    return;
+  }
+  unsigned lo = rc->g, hi = rs->gcount;
+  while(lo < hi){
+    unsigned mid = lo + (hi - lo) / 2;
+    if(rs->general[mid] < t){
+      lo = mid + 1;
+    }else{
+      hi = mid;
+    }
+  }
+  rc->g = lo;
+  while(rc->m < rc->mend && rs->marked[rc->m].idx < t){
+    ++rc->m;
+  }
+}
+
+// The next rule the walk might find selecting its flow, or NULL.
+static inline const rule_node*
+rule_cursor_next(const rule_set* rs, rule_cursor* rc){
+  if(!rs->indexed){
+    return rc->idx < rs->count ? &rs->rules[rc->idx++] : NULL;
+  }
+  const unsigned g = rc->g < rs->gcount ? rs->general[rc->g] : UINT_MAX;
+  const unsigned m = rc->m < rc->mend ? rs->marked[rc->m].idx : UINT_MAX;
+  if(g == UINT_MAX && m == UINT_MAX){
+    return NULL;
+  }
+  if(g < m){
+    ++rc->g;
+    rc->idx = g + 1;
+  }else{
+    ++rc->m;
+    rc->idx = m + 1;
+  }
+  return &rs->rules[rc->idx - 1];
+}
+
+// Continue the walk rc to the next rule selecting fl, following gotos (to the
+// first rule of the target priority, if there is one; otherwise the goto is
+// ignored, as in the kernel) and passing over nops. Returns NULL once the
+// rules are exhausted. Call with fiblock held.
+static const rule_node*
+rule_next(const rule_set* rs, rule_cursor* rc, const rule_flow* fl){
+  const rule_node* rn;
+  while( (rn = rule_cursor_next(rs, rc)) ){
+    if(!rule_selects(rn, fl)){
+      continue;
+    }
+    if(rn->action == FR_ACT_GOTO){
+      unsigned t = rule_set_find(rs, rn->target);
+      if(t < rs->count && rs->rules[t].priority == rn->target && t >= rc->idx){
+        rule_cursor_seek(rs, rc, t);
+      }
+      continue;
+    }
+    if(rn->action == FR_ACT_NOP){
+      continue;
+    }
+    return rn;
+  }
+  return NULL;
+}
+
+const netstack_rule* netstack_rule_match(netstack* ns, int family, const void* src,
+                                         const void* dst, uint32_t fwmark,
+                                         int iif, int oif){
+  if(family_addrlen(family) == 0){
+    errno = EINVAL;
+    return NULL;
   }
-  pthread_mutex_unlock(&ns->hashlock);
-  if(ret){
-    ++ns->lookup_copies;
-  }else{
-    ++ns->lookup_failures;
+  if(ns->opts.rule_notrack){
+    errno = EOPNOTSUPP;
+    return NULL;
+  }
+  rule_flow fl;
+  rule_flow_init(&fl, family, src, dst, fwmark, iif, oif);
+  netstack_rule* ret = NULL;
+  pthread_mutex_lock(&ns->fiblock);
+  const rule_set* rs = rule_set_of(ns, family);
+  rule_cursor rc;
+  rule_cursor_init(rs, &fl, &rc);
+  const rule_node* rn = rule_next(rs, &rc, &fl);
+  if(rn){
+    ret = rn->nr;
+    atomic_fetch_add(&ret->refcount, 1);
+  }
+  pthread_mutex_unlock(&ns->fiblock);
+  if(ret == NULL){
+    errno = ENOENT;
   }
   return ret;
 }
 
-// No locking, object is already owned by caller
-netstack_iface* netstack_iface_copy(const netstack_iface* ni){
-  return create_iface(ni->rtabuf, ni->rtabuflen);
-}
+// The tables consulted by the rules of a namespace which hasn't changed them
+// (see ip-rule(8)), in order. Used when we aren't caching rules (or have yet
+// to learn any).
+static const uint32_t default_rule_tables[] = {
+  RT_TABLE_LOCAL, RT_TABLE_MAIN, RT_TABLE_DEFAULT,
+};
 
-const netstack_iface* netstack_iface_share_byidx(netstack* ns, int idx){
-  pthread_mutex_lock(&ns->hashlock);
-  netstack_iface* ni = netstack_iface_byidx(ns, idx);
-  if(ni){
-    atomic_fetch_add(&ni->refcount, 1);
+// Look fl->dst up in table id, disregarding throw routes and those which rn
+// (if non-NULL) suppresses. Call with fiblock held.
+static const netstack_route*
+fib_rule_table_lookup(netstack* ns, int family, uint32_t id, const rule_node* rn,
+                      const rule_flow* fl){
+  const fib_table* ft = fib_table_get(ns, family, id, false);
+  const netstack_route* nr;
+  if(ft == NULL || (nr = fib_table_lookup(ns, ft, fl->dst, 0)) == NULL){
+    return NULL;
   }
-  pthread_mutex_unlock(&ns->hashlock);
-  if(ni){
-    atomic_fetch_add(&ns->lookup_shares, 1);
-  }else{
-    atomic_fetch_add(&ns->lookup_failures, 1);
+  if(nr->rt.rtm_type == RTN_THROW){
+    return NULL;
   }
-  return ni;
+  if(rn && rn->suppress_prefixlen >= 0 && nr->rt.rtm_dst_len <= (unsigned)rn->suppress_prefixlen){
+    return NULL;
+  }
+  return nr;
 }
 
-// Nothing gets locked here, since ownership indicates sufficient locking
-const netstack_iface* netstack_iface_share(const netstack_iface* ni){
-  netstack_iface* unsafe_ni = (netstack_iface*)ni;
-  atomic_fetch_add(&unsafe_ni->refcount, 1);
-  return ni;
+// Evaluate the rules in order of priority, looking up the destination in the
+// table each selects, until a route is found. Throw routes send us on to the
+// next rule. If instead a rule rejects the flow outright, NULL is returned
+// with *rtype set to the corresponding RTN_*. Call with fiblock held.
+static const netstack_route*
+fib_rules_lookup(netstack* ns, int family, const rule_flow* fl, unsigned* rtype){
+  const rule_set* rs = rule_set_of(ns, family);
+  const netstack_route* nr;
+  if(rs->count == 0){
+    size_t z;
+    for(z = 0 ; z < sizeof(default_rule_tables) / sizeof(*default_rule_tables) ; ++z){
+      if( (nr = fib_rule_table_lookup(ns, family, default_rule_tables[z], NULL, fl)) ){
+        return nr;
+      }
+    }
+    return NULL;
+  }
+  rule_cursor rc;
+  rule_cursor_init(rs, fl, &rc);
+  const rule_node* rn;
+  while( (rn = rule_next(rs, &rc, fl)) ){
+    switch(rn->action){
+      case FR_ACT_TO_TBL:
+        if( (nr = fib_rule_table_lookup(ns, family, rn->table, rn, fl)) ){
+          return nr;
+        }
+        break;
+      case FR_ACT_BLACKHOLE: *rtype = RTN_BLACKHOLE; return NULL;
+      case FR_ACT_UNREACHABLE: *rtype = RTN_UNREACHABLE; return NULL;
+      case FR_ACT_PROHIBIT: *rtype = RTN_PROHIBIT; return NULL;
+      default: break;
+    }
+  }
+  return NULL;
 }
 
-void netstack_iface_abandon(const netstack_iface* ni){
-  netstack_iface* unsafe_ni = (netstack_iface*)ni;
-  netstack_iface_destroy(unsafe_ni);
+// Fill in res from the route nr, following its first usable nexthop to the
+// neighbor cache. Call with fiblock held.
+static void
+fib_resolution(netstack* ns, const netstack_route* nr, const void* dst,
+               netstack_resolution* res){
+  const int family = nr->rt.rtm_family;
+  const size_t alen = family_addrlen(family);
+  res->table = route_table_id(nr);
+  res->type = nr->rt.rtm_type;
+  res->dst_len = nr->rt.rtm_dst_len;
+  netstack_rtattrcpy_exact(netstack_route_attr(nr, RTA_PRIORITY), &res->priority,
+                           sizeof(res->priority));
+  res->has_prefsrc = netstack_rtattrcpy_exact(netstack_route_attr(nr, RTA_PREFSRC),
+                                              res->prefsrc, alen);
+  fib_route_hop(ns, nr, res);
+  if(res->type != RTN_UNICAST || res->oif == 0 || ns->neigh_buckets == 0){
+    return;
+  }
+  const int nfamily = res->has_gateway ? (int)res->gw_family : family;
+  unsigned char key[16] = {};
+  memcpy(key, res->has_gateway ? res->gateway : dst, family_addrlen(nfamily));
+  const neigh_node* nd = *neigh_find(ns, nfamily, res->oif, key);
+  if(nd){
+    res->nud_state = nd->nn->nd.ndm_state;
+    size_t llen = sizeof(res->lladdr);
+    if(netstack_rtattrcpy(netstack_neigh_attr(nd->nn, NDA_LLADDR), res->lladdr, &llen)){
+      res->lladdr_len = llen;
+    }
+  }
 }
 
-uint64_t netstack_iface_bytes(const netstack* ns){
-  netstack* unsafe_ns = (netstack*)ns;
-  unsigned ret;
-  pthread_mutex_lock(&unsafe_ns->hashlock);
-  ret = ns->iface_bytes;
-  pthread_mutex_unlock(&unsafe_ns->hashlock);
-  return ret;
+int netstack_resolve(netstack* ns, int family, const void* dst, const void* src,
+                     uint32_t mark, int iif, netstack_resolution* res){
+  if(family_addrlen(family) == 0 || dst == NULL || res == NULL){
+    errno = EINVAL;
+    return -1;
+  }
+  if(ns->opts.route_notrack){
+    errno = EOPNOTSUPP;
+    return -1;
+  }
+  memset(res, 0, sizeof(*res));
+  rule_flow fl;
+  rule_flow_init(&fl, family, src, dst, mark, iif, 0);
+  unsigned rtype = RTN_UNSPEC;
+  pthread_mutex_lock(&ns->fiblock);
+  const netstack_route* nr = fib_rules_lookup(ns, family, &fl, &rtype);
+  if(nr){
+    fib_resolution(ns, nr, dst, res);
+  }
+  pthread_mutex_unlock(&ns->fiblock);
+  if(nr == NULL){
+    if(rtype == RTN_UNSPEC){
+      errno = ENETUNREACH;
+      return -1;
+    }
+    res->type = rtype;
+  }
+  return 0;
 }
 
 char* netstack_iface_qdisc(const struct netstack_iface* ni){
@@ -1248,8 +9485,18 @@ void netstack_iface_queuecounts(const struct netstack_iface* ni,
   if(rta && !rtattrtou32(rta, &val)){
     nqc->tx = val;
   }
-  nqc->combined = -1; // FIXME
-  nqc->xdp = -1;      // FIXME
+  nqc->combined = -1; // only known to ethtool
+  nqc->xdp = -1;      // not reported at all
+}
+
+void netstack_iface_queuecounts_ethtool(netstack* ns, const netstack_iface* ni,
+                                        netstack_iface_qcounts* nqc){
+  netstack_iface_queuecounts(ni, nqc);
+  netstack_ethtool ne;
+  if(ni->nsid == NETSTACK_NSID_LOCAL && netstack_iface_ethtool(ns, ni->ifi.ifi_index, &ne) &&
+     (ne.present & NETSTACK_ETHTOOL_CHANNELS)){
+    nqc->combined = ne.channels.combined;
+  }
 }
 
 const struct rtattr* netstack_iface_attr(const netstack_iface* ni, int attridx){
@@ -1323,6 +9570,10 @@ unsigned netstack_iface_type(const netstack_iface* ni){
   return ni->ifi.ifi_type;
 }
 
+unsigned netstack_iface_flags(const netstack_iface* ni){
+  return ni->ifi.ifi_flags;
+}
+
 char* netstack_iface_typestr(const netstack_iface* ni, char* buf, size_t blen){
   return nl_llproto2str(netstack_iface_type(ni), buf, blen);
 }
@@ -1331,6 +9582,22 @@ int netstack_iface_index(const netstack_iface* ni){
   return ni->ifi.ifi_index;
 }
 
+int netstack_iface_nsid(const netstack_iface* ni){
+  return ni->nsid;
+}
+
+int netstack_addr_nsid(const netstack_addr* na){
+  return na->nsid;
+}
+
+int netstack_route_nsid(const netstack_route* nr){
+  return nr->nsid;
+}
+
+int netstack_neigh_nsid(const netstack_neigh* nn){
+  return nn->nsid;
+}
+
 unsigned netstack_neigh_family(const netstack_neigh* nn){
   return nn->nd.ndm_family;
 }
@@ -1415,6 +9682,252 @@ unsigned netstack_route_flags(const netstack_route* nr){
   return nr->rt.rtm_flags;
 }
 
+// Fill in rnh's gateway from RTA_GATEWAY (of the route's family) or, failing
+// that, RTA_VIA (of any family).
+static void
+route_nexthop_gateway(const struct rtattr* gw, const struct rtattr* via, int family,
+                      netstack_route_nexthop* rnh){
+  const size_t alen = family_addrlen(family);
+  if(alen && netstack_rtattrcpy_exact(gw, rnh->gateway, alen)){
+    rnh->gw_family = family;
+  }else if(via && RTA_PAYLOAD(via) >= sizeof(struct rtvia)){
+    const struct rtvia* rv = RTA_DATA(via);
+    const size_t vlen = family_addrlen(rv->rtvia_family);
+    if(vlen && RTA_PAYLOAD(via) - sizeof(*rv) == vlen){
+      memcpy(rnh->gateway, rv->rtvia_addr, vlen);
+      rnh->gw_family = rv->rtvia_family;
+    }
+  }
+}
+
+bool netstack_route_nexthop_next(const netstack_route* nr, size_t* iter,
+                                 netstack_route_nexthop* rnh){
+  const int family = nr->rt.rtm_family;
+  memset(rnh, 0, sizeof(*rnh));
+  const struct rtattr* mp = netstack_route_attr(nr, RTA_MULTIPATH);
+  if(mp == NULL){
+    if(*iter){
+      return false;
+    }
+    uint32_t oif = 0;
+    netstack_rtattrcpy_exact(netstack_route_attr(nr, RTA_OIF), &oif, sizeof(oif));
+    rnh->oif = oif;
+    rnh->weight = 1;
+    rnh->flags = nr->rt.rtm_flags & 0xffu; // the RTNH_F_* live in the low byte
+    route_nexthop_gateway(netstack_route_attr(nr, RTA_GATEWAY),
+                          netstack_route_attr(nr, RTA_VIA), family, rnh);
+    *iter = 1;
+    return rnh->oif || rnh->gw_family;
+  }
+  const size_t mplen = RTA_PAYLOAD(mp);
+  if(*iter >= mplen || mplen - *iter < sizeof(struct rtnexthop)){
+    return false;
+  }
+  const struct rtnexthop* rtnh = (const struct rtnexthop*)((const char*)RTA_DATA(mp) + *iter);
+  if(rtnh->rtnh_len < sizeof(*rtnh) || rtnh->rtnh_len > mplen - *iter){
+    return false;
+  }
+  rnh->oif = rtnh->rtnh_ifindex;
+  rnh->weight = rtnh->rtnh_hops + 1u;
+  rnh->flags = rtnh->rtnh_flags;
+  const size_t alen = rtnh->rtnh_len - RTNH_LENGTH(0);
+  route_nexthop_gateway(netstack_extract_rta_attr(RTNH_DATA(rtnh), alen, RTA_GATEWAY),
+                        netstack_extract_rta_attr(RTNH_DATA(rtnh), alen, RTA_VIA),
+                        family, rnh);
+  *iter += RTNH_ALIGN(rtnh->rtnh_len);
+  return true;
+}
+
+const struct rtattr* netstack_rule_attr(const netstack_rule* nr, int attridx){
+  if(attridx < 0){
+    return NULL;
+  }
+  if((size_t)attridx < sizeof(nr->rta_index) / sizeof(*nr->rta_index)){
+    return index_into_rta(nr->rtabuf, nr->rta_index[attridx]);
+  }
+  if(!nr->unknown_attrs){
+    return NULL;
+  }
+  return netstack_extract_rta_attr(nr->rtabuf, nr->rtabuflen, attridx);
+}
+
+unsigned netstack_rule_family(const netstack_rule* nr){
+  return nr->frh.family;
+}
+
+int netstack_rule_nsid(const netstack_rule* nr){
+  return nr->nsid;
+}
+
+uint32_t netstack_rule_priority(const netstack_rule* nr){
+  uint32_t prio = 0;
+  netstack_rtattrcpy_exact(netstack_rule_attr(nr, FRA_PRIORITY), &prio, sizeof(prio));
+  return prio;
+}
+
+uint32_t netstack_rule_table(const netstack_rule* nr){
+  uint32_t table = nr->frh.table;
+  netstack_rtattrcpy_exact(netstack_rule_attr(nr, FRA_TABLE), &table, sizeof(table));
+  return table;
+}
+
+unsigned netstack_rule_action(const netstack_rule* nr){
+  return nr->frh.action;
+}
+
+unsigned netstack_rule_flags(const netstack_rule* nr){
+  return nr->frh.flags;
+}
+
+unsigned netstack_rule_src_len(const netstack_rule* nr){
+  return nr->frh.src_len;
+}
+
+unsigned netstack_rule_dst_len(const netstack_rule* nr){
+  return nr->frh.dst_len;
+}
+
+unsigned netstack_rule_tos(const netstack_rule* nr){
+  return nr->frh.tos;
+}
+
+void netstack_rule_abandon(const netstack_rule* nr){
+  free_rule((netstack_rule*)nr);
+}
+
+const struct rtattr* netstack_nexthop_attr(const netstack_nexthop* nh, int attridx){
+  if(attridx < 0){
+    return NULL;
+  }
+  if((size_t)attridx < sizeof(nh->rta_index) / sizeof(*nh->rta_index)){
+    return index_into_rta(nh->rtabuf, nh->rta_index[attridx]);
+  }
+  if(!nh->unknown_attrs){
+    return NULL;
+  }
+  return netstack_extract_rta_attr(nh->rtabuf, nh->rtabuflen, attridx);
+}
+
+unsigned netstack_nexthop_family(const netstack_nexthop* nh){
+  return nh->nh.nh_family;
+}
+
+int netstack_nexthop_nsid(const netstack_nexthop* nh){
+  return nh->nsid;
+}
+
+uint32_t netstack_nexthop_id(const netstack_nexthop* nh){
+  uint32_t id = 0;
+  netstack_rtattrcpy_exact(netstack_nexthop_attr(nh, NHA_ID), &id, sizeof(id));
+  return id;
+}
+
+unsigned netstack_nexthop_flags(const netstack_nexthop* nh){
+  return nh->nh.nh_flags;
+}
+
+unsigned netstack_nexthop_protocol(const netstack_nexthop* nh){
+  return nh->nh.nh_protocol;
+}
+
+unsigned netstack_nexthop_scope(const netstack_nexthop* nh){
+  return nh->nh.nh_scope;
+}
+
+int netstack_nexthop_oif(const netstack_nexthop* nh){
+  uint32_t oif = 0;
+  netstack_rtattrcpy_exact(netstack_nexthop_attr(nh, NHA_OIF), &oif, sizeof(oif));
+  return oif;
+}
+
+bool netstack_nexthop_blackhole(const netstack_nexthop* nh){
+  return netstack_nexthop_attr(nh, NHA_BLACKHOLE) != NULL;
+}
+
+unsigned netstack_nexthop_gateway(const netstack_nexthop* nh, void* gw){
+  const struct rtattr* rta = netstack_nexthop_attr(nh, NHA_GATEWAY);
+  if(rta == NULL || (RTA_PAYLOAD(rta) != 4 && RTA_PAYLOAD(rta) != 16)){
+    return AF_UNSPEC;
+  }
+  memcpy(gw, RTA_DATA(rta), RTA_PAYLOAD(rta));
+  return RTA_PAYLOAD(rta) == 4 ? AF_INET : AF_INET6;
+}
+
+unsigned netstack_nexthop_groupcount(const netstack_nexthop* nh){
+  const struct rtattr* rta = netstack_nexthop_attr(nh, NHA_GROUP);
+  return rta ? RTA_PAYLOAD(rta) / sizeof(struct nexthop_grp) : 0;
+}
+
+bool netstack_nexthop_group(const netstack_nexthop* nh, unsigned idx,
+                            uint32_t* id, unsigned* weight){
+  if(idx >= netstack_nexthop_groupcount(nh)){
+    return false;
+  }
+  const struct nexthop_grp* grp = RTA_DATA(netstack_nexthop_attr(nh, NHA_GROUP));
+  *id = grp[idx].id;
+  *weight = grp[idx].weight + 1u;
+  return true;
+}
+
+void netstack_nexthop_abandon(const netstack_nexthop* nh){
+  free_nexthop((netstack_nexthop*)nh);
+}
+
+const struct rtattr* netstack_tc_attr(const netstack_tc* nt, int attridx){
+  if(attridx < 0){
+    return NULL;
+  }
+  if((size_t)attridx < sizeof(nt->rta_index) / sizeof(*nt->rta_index)){
+    return index_into_rta(nt->rtabuf, nt->rta_index[attridx]);
+  }
+  if(!nt->unknown_attrs){
+    return NULL;
+  }
+  return netstack_extract_rta_attr(nt->rtabuf, nt->rtabuflen, attridx);
+}
+
+int netstack_tc_nsid(const netstack_tc* nt){
+  return nt->nsid;
+}
+
+bool netstack_tc_class(const netstack_tc* nt){
+  return nt->isclass;
+}
+
+int netstack_tc_index(const netstack_tc* nt){
+  return nt->tcm.tcm_ifindex;
+}
+
+uint32_t netstack_tc_handle(const netstack_tc* nt){
+  return nt->tcm.tcm_handle;
+}
+
+uint32_t netstack_tc_parent(const netstack_tc* nt){
+  return nt->tcm.tcm_parent;
+}
+
+bool netstack_tc_kind(const netstack_tc* nt, char* buf){
+  const struct rtattr* kind = netstack_tc_attr(nt, TCA_KIND);
+  if(kind == NULL || RTA_PAYLOAD(kind) == 0){
+    return false;
+  }
+  size_t len = strnlen(RTA_DATA(kind), RTA_PAYLOAD(kind));
+  if(len >= IFNAMSIZ){
+    len = IFNAMSIZ - 1;
+  }
+  memcpy(buf, RTA_DATA(kind), len);
+  buf[len] = '\0';
+  return true;
+}
+
+void netstack_tc_stats_get(const netstack_tc* nt, netstack_tc_stats* st){
+  tc_stats_decode(netstack_tc_attr(nt, TCA_STATS2), netstack_tc_attr(nt, TCA_STATS), st);
+}
+
+void netstack_tc_abandon(const netstack_tc* nt){
+  free_tc((netstack_tc*)nt);
+}
+
 char* netstack_l2addrstr(unsigned l2type, size_t len, const void* addr){
   (void)l2type; // FIXME need for quirks
   // Each byte becomes two ASCII characters + separator or nul
@@ -1439,20 +9952,302 @@ netstack_stats* netstack_sample_stats(const netstack* ns, netstack_stats* stats)
   netstack* unsafe_ns = (netstack*)ns;
   stats->netlink_errors = ns->netlink_errors;
   stats->user_callbacks_total = ns->user_callbacks_total;
-  stats->lookup_copies = ns->lookup_copies;
-  stats->lookup_shares = ns->lookup_shares;
-  stats->lookup_failures = ns->lookup_failures;
+  stats->lookup_copies = 0;
+  stats->lookup_shares = 0;
+  stats->lookup_failures = 0;
+  stats->tlcache_hits = 0;
+  stats->tlcache_misses = 0;
+  unsigned shard;
+  for(shard = 0 ; shard < ns->shard_count ; ++shard){
+    const lookup_shard* ls = &ns->shards[shard];
+    stats->lookup_copies += atomic_load(&ls->lookup_copies);
+    stats->lookup_shares += atomic_load(&ls->lookup_shares);
+    stats->lookup_failures += atomic_load(&ls->lookup_failures);
+    stats->tlcache_hits += atomic_load(&ls->tlcache_hits);
+    stats->tlcache_misses += atomic_load(&ls->tlcache_misses);
+  }
   stats->iface_events = ns->iface_events;
   stats->addr_events = ns->addr_events;
   stats->route_events = ns->route_events;
   stats->neigh_events = ns->neigh_events;
+  stats->rule_events = ns->rule_events;
+  stats->nexthop_events = ns->nexthop_events;
+  stats->tc_events = ns->tc_events;
+  stats->parse_failures = ns->parse_failures;
+  stats->overruns = ns->overruns;
+  stats->resyncs = ns->resyncs;
+  stats->filtered = ns->filtered;
+  stats->dumps = ns->dumps;
+  stats->dump_nsec_total = ns->dump_nsec_total;
+  stats->dump_nsec_max = ns->dump_nsec_max;
+  stats->live_shares = 0;
+  stats->zombie_shares = 0;
   pthread_mutex_lock(&unsafe_ns->hashlock);
   stats->ifaces = ns->iface_count;
+  stats->iface_bytes = ns->iface_bytes;
+  // Every reference beyond our own (and those of thread-local lookup caches)
+  // on a cached object is a client's share. This is o(n) in cached ifaces,
+  // but keeps the share paths free of it.
+  size_t z;
+  for(z = 0 ; z < sizeof(ns->iface_hash) / sizeof(*ns->iface_hash) ; ++z){
+    const netstack_iface* ni;
+    for(ni = ns->iface_hash[z] ; ni ; ni = ni->hnext){
+      stats->live_shares += client_shares(ni);
+    }
+  }
+  reap_zombies(unsafe_ns);
+  const netstack_iface* ni;
+  for(ni = ns->zombies ; ni ; ni = ni->hnext){
+    stats->zombie_shares += client_shares(ni);
+  }
   pthread_mutex_unlock(&unsafe_ns->hashlock);
-  // FIXME not yet maintained
+  pthread_mutex_lock(&unsafe_ns->fiblock);
+  stats->routes = ns->route_count;
+  stats->neighs = ns->neigh_count;
+  stats->rules = ns->rules4.count + ns->rules6.count;
+  stats->nexthops = ns->nh_count;
+  stats->fdbs = ns->fdb_count;
+  stats->tcs = ns->tc_count;
+  pthread_mutex_unlock(&unsafe_ns->fiblock);
+  // Addresses are not cached, and cached routes and neighbors aren't sized
   stats->addrs = 0;
-  stats->routes = 0;
-  stats->neighs = 0;
-  stats->zombie_shares = 0;
+  stats->addr_bytes = 0;
+  stats->route_bytes = 0;
+  stats->neigh_bytes = 0;
   return stats;
 }
+
+// Accumulates OpenMetrics text into a caller-provided buffer. Once the buffer
+// is exhausted, we keep counting bytes (but stop writing them), so that the
+// caller can learn how much space is necessary.
+typedef struct metricbuf {
+  char* buf;
+  size_t len;
+  size_t used;
+} metricbuf;
+
+static inline void
+mb_putn(metricbuf* mb, const char* s, size_t n){
+  if(mb->used < mb->len){
+    size_t avail = mb->len - mb->used;
+    memcpy(mb->buf + mb->used, s, n > avail ? avail : n);
+  }
+  mb->used += n;
+}
+
+static inline void
+mb_puts(metricbuf* mb, const char* s){
+  mb_putn(mb, s, strlen(s));
+}
+
+static void
+mb_putu(metricbuf* mb, uintmax_t u){
+  char digits[24];
+  size_t d = sizeof(digits);
+  do{
+    digits[--d] = '0' + u % 10;
+    u /= 10;
+  }while(u);
+  mb_putn(mb, digits + d, sizeof(digits) - d);
+}
+
+// Nanoseconds presented as (decimal) seconds
+static void
+mb_putsec(metricbuf* mb, uintmax_t nsec){
+  char frac[10] = ".";
+  uintmax_t r = nsec % 1000000000ull;
+  int z;
+  for(z = 9 ; z > 0 ; --z){
+    frac[z] = '0' + r % 10;
+    r /= 10;
+  }
+  mb_putu(mb, nsec / 1000000000ull);
+  mb_putn(mb, frac, sizeof(frac));
+}
+
+// Label values must have backslashes, double quotes, and newlines escaped
+static void
+mb_putlabel(metricbuf* mb, const char* s){
+  while(*s){
+    if(*s == '\\' || *s == '"'){
+      mb_putn(mb, "\\", 1);
+      mb_putn(mb, s, 1);
+    }else if(*s == '\n'){
+      mb_putn(mb, "\\n", 2);
+    }else{
+      mb_putn(mb, s, 1);
+    }
+    ++s;
+  }
+}
+
+static void
+mb_family(metricbuf* mb, const char* name, const char* type, const char* help){
+  mb_puts(mb, "# TYPE ");
+  mb_puts(mb, name);
+  mb_puts(mb, " ");
+  mb_puts(mb, type);
+  mb_puts(mb, "\n# HELP ");
+  mb_puts(mb, name);
+  mb_puts(mb, " ");
+  mb_puts(mb, help);
+  mb_puts(mb, "\n");
+}
+
+static void
+mb_counter(metricbuf* mb, const char* name, const char* help, uintmax_t val){
+  mb_family(mb, name, "counter", help);
+  mb_puts(mb, name);
+  mb_puts(mb, "_total ");
+  mb_putu(mb, val);
+  mb_puts(mb, "\n");
+}
+
+static void
+mb_gauge(metricbuf* mb, const char* name, const char* help, uintmax_t val){
+  mb_family(mb, name, "gauge", help);
+  mb_puts(mb, name);
+  mb_puts(mb, " ");
+  mb_putu(mb, val);
+  mb_puts(mb, "\n");
+}
+
+// Per-interface counters drawn from IFLA_STATS64
+static const struct {
+  const char* name;
+  const char* help;
+  size_t off;
+} iface_metrics[] = {
+#define IFACE_METRIC(field, help) \
+  { "netstack_iface_" #field, help, offsetof(struct rtnl_link_stats64, field), }
+  IFACE_METRIC(rx_packets, "Packets received"),
+  IFACE_METRIC(tx_packets, "Packets transmitted"),
+  IFACE_METRIC(rx_bytes, "Bytes received"),
+  IFACE_METRIC(tx_bytes, "Bytes transmitted"),
+  IFACE_METRIC(rx_errors, "Bad packets received"),
+  IFACE_METRIC(tx_errors, "Packet transmit problems"),
+  IFACE_METRIC(rx_dropped, "Received packets dropped"),
+  IFACE_METRIC(tx_dropped, "Transmitted packets dropped"),
+  IFACE_METRIC(multicast, "Multicast packets received"),
+  IFACE_METRIC(collisions, "Collisions"),
+#undef IFACE_METRIC
+};
+
+// Samples of a metric family must be contiguous, so we make one pass over the
+// cache per family. The hashlock is dropped between families.
+static void
+mb_iface_counters(metricbuf* mb, netstack* ns, size_t m){
+  mb_family(mb, iface_metrics[m].name, "counter", iface_metrics[m].help);
+  pthread_mutex_lock(&ns->hashlock);
+  size_t z;
+  for(z = 0 ; z < sizeof(ns->iface_hash) / sizeof(*ns->iface_hash) ; ++z){
+    const netstack_iface* ni;
+    for(ni = ns->iface_hash[z] ; ni ; ni = ni->hnext){
+      struct rtnl_link_stats64 stats;
+      if(!netstack_iface_stats(ni, &stats)){
+        continue;
+      }
+      uint64_t val;
+      memcpy(&val, (const char*)&stats + iface_metrics[m].off, sizeof(val));
+      mb_puts(mb, iface_metrics[m].name);
+      mb_puts(mb, "_total{iface=\"");
+      mb_putlabel(mb, ni->name);
+      mb_puts(mb, "\",ifindex=\"");
+      mb_putu(mb, ni->ifi.ifi_index);
+      // names and indices repeat across namespaces
+      if(ni->nsid != NETSTACK_NSID_LOCAL){
+        mb_puts(mb, "\",nsid=\"");
+        mb_putu(mb, ni->nsid);
+      }
+      mb_puts(mb, "\"} ");
+      mb_putu(mb, val);
+      mb_puts(mb, "\n");
+    }
+  }
+  pthread_mutex_unlock(&ns->hashlock);
+}
+
+int netstack_write_metrics(const netstack* ns, char* buf, size_t len){
+  if(buf == NULL && len){
+    return -1;
+  }
+  netstack* unsafe_ns = (netstack*)ns;
+  netstack_stats stats;
+  netstack_sample_stats(ns, &stats);
+  metricbuf mb = { .buf = buf, .len = len, .used = 0, };
+  mb_gauge(&mb, "netstack_ifaces", "Interfaces in the cache", stats.ifaces);
+  mb_gauge(&mb, "netstack_iface_cache_bytes", "Bytes used by cached interfaces",
+           stats.iface_bytes);
+  mb_gauge(&mb, "netstack_routes", "Routes in the cache", stats.routes);
+  mb_gauge(&mb, "netstack_neighs", "Neighbors in the cache", stats.neighs);
+  mb_gauge(&mb, "netstack_rules", "Rules in the cache", stats.rules);
+  mb_gauge(&mb, "netstack_nexthops", "Nexthops in the cache", stats.nexthops);
+  mb_gauge(&mb, "netstack_fdbs", "Bridge FDB entries in the cache", stats.fdbs);
+  mb_gauge(&mb, "netstack_tcs", "Qdiscs and classes in the cache", stats.tcs);
+  mb_counter(&mb, "netstack_iface_events", "Interface events", stats.iface_events);
+  mb_counter(&mb, "netstack_addr_events", "Address events", stats.addr_events);
+  mb_counter(&mb, "netstack_route_events", "Route events", stats.route_events);
+  mb_counter(&mb, "netstack_neigh_events", "Neighbor events", stats.neigh_events);
+  mb_counter(&mb, "netstack_rule_events", "Rule events", stats.rule_events);
+  mb_counter(&mb, "netstack_nexthop_events", "Nexthop events", stats.nexthop_events);
+  mb_counter(&mb, "netstack_tc_events", "Traffic control events", stats.tc_events);
+  mb_counter(&mb, "netstack_lookup_shares", "Successful lookup+shares",
+             stats.lookup_shares);
+  mb_counter(&mb, "netstack_lookup_copies", "Successful lookup+copies",
+             stats.lookup_copies);
+  mb_counter(&mb, "netstack_lookup_failures", "Lookups of nonexistent keys",
+             stats.lookup_failures);
+  mb_counter(&mb, "netstack_tlcache_hits", "Lookups served by a thread cache",
+             stats.tlcache_hits);
+  mb_counter(&mb, "netstack_tlcache_misses", "Thread cache lookups which fell through",
+             stats.tlcache_misses);
+  mb_gauge(&mb, "netstack_live_shares", "Client shares of cached objects",
+           stats.live_shares);
+  mb_gauge(&mb, "netstack_zombie_shares", "Client shares of uncached objects",
+           stats.zombie_shares);
+  mb_counter(&mb, "netstack_netlink_errors", "Netlink errors received",
+             stats.netlink_errors);
+  mb_counter(&mb, "netstack_parse_failures", "Unparseable netlink messages",
+             stats.parse_failures);
+  mb_counter(&mb, "netstack_overruns", "Netlink socket overruns", stats.overruns);
+  mb_counter(&mb, "netstack_resyncs", "Redumps following overruns", stats.resyncs);
+  mb_counter(&mb, "netstack_filtered", "Messages discarded by iface filters",
+             stats.filtered);
+  mb_counter(&mb, "netstack_user_callbacks", "User callbacks invoked",
+             stats.user_callbacks_total);
+  mb_family(&mb, "netstack_dump_duration_seconds", "histogram",
+            "Time from dump request to NLMSG_DONE");
+  uintmax_t cumulative = 0;
+  size_t b;
+  for(b = 0 ; b < DUMP_BUCKETS ; ++b){
+    cumulative += atomic_load(&ns->dump_histogram[b]);
+    mb_puts(&mb, "netstack_dump_duration_seconds_bucket{le=\"");
+    if(b < DUMP_BUCKETS - 1){
+      mb_putsec(&mb, dump_buckets[b]);
+    }else{
+      mb_puts(&mb, "+Inf");
+    }
+    mb_puts(&mb, "\"} ");
+    mb_putu(&mb, cumulative);
+    mb_puts(&mb, "\n");
+  }
+  mb_puts(&mb, "netstack_dump_duration_seconds_count ");
+  mb_putu(&mb, cumulative);
+  mb_puts(&mb, "\nnetstack_dump_duration_seconds_sum ");
+  mb_putsec(&mb, stats.dump_nsec_total);
+  mb_puts(&mb, "\n");
+  size_t m;
+  for(m = 0 ; m < sizeof(iface_metrics) / sizeof(*iface_metrics) ; ++m){
+    mb_iface_counters(&mb, unsafe_ns, m);
+  }
+  mb_puts(&mb, "# EOF\n");
+  if(mb.used < len){
+    buf[mb.used] = '\0';
+  }else if(len){
+    buf[len - 1] = '\0';
+  }
+  if(mb.used > INT_MAX){
+    return -1;
+  }
+  return mb.used;
+}
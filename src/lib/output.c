@@ -130,17 +130,135 @@ int netstack_print_neigh(const struct netstack_neigh* nn, FILE* out){
   return 0;
 }
 
+int netstack_print_rule(const struct netstack_rule* nr, FILE* out){
+  unsigned family = netstack_rule_family(nr);
+  // an additional 4 for the slash, length, and space
+  char srcstr[INET6_ADDRSTRLEN + 4] = "all ";
+  char dststr[INET6_ADDRSTRLEN + 8] = "";
+  if(netstack_rule_srcstr(nr, srcstr, sizeof(srcstr), &family)){
+    snprintf(srcstr + strlen(srcstr), sizeof(srcstr) - strlen(srcstr), "/%u ",
+             netstack_rule_src_len(nr));
+  }
+  if(netstack_rule_dststr(nr, dststr + 3, sizeof(dststr) - 3, &family)){
+    memcpy(dststr, "to ", 3);
+    snprintf(dststr + strlen(dststr), sizeof(dststr) - strlen(dststr), "/%u ",
+             netstack_rule_dst_len(nr));
+  }
+  char selstr[64] = "";
+  uint32_t mark, mask;
+  if(netstack_rule_fwmark(nr, &mark, &mask)){
+    snprintf(selstr, sizeof(selstr), "fwmark 0x%x/0x%x ", mark, mask);
+  }
+  char name[IFNAMSIZ];
+  if(netstack_rule_iifname(nr, name)){
+    snprintf(selstr + strlen(selstr), sizeof(selstr) - strlen(selstr), "iif %s ", name);
+  }
+  if(netstack_rule_oifname(nr, name)){
+    snprintf(selstr + strlen(selstr), sizeof(selstr) - strlen(selstr), "oif %s ", name);
+  }
+  unsigned action = netstack_rule_action(nr);
+  int ret = fprintf(out, "[%s] %u: %sfrom %s%s%s%s %u\n",
+                    family_to_str(family), netstack_rule_priority(nr),
+                    netstack_rule_inverted(nr) ? "not " : "",
+                    srcstr, dststr, selstr, netstack_rule_actionstr(action),
+                    netstack_rule_table(nr));
+  if(ret < 0){
+    return -1;
+  }
+  return 0;
+}
+
+int netstack_print_nexthop(const struct netstack_nexthop* nh, FILE* out){
+  int ret;
+  unsigned groupcount = netstack_nexthop_groupcount(nh);
+  if(groupcount){
+    ret = fprintf(out, "id %u group", netstack_nexthop_id(nh));
+    unsigned z;
+    uint32_t id;
+    unsigned weight;
+    for(z = 0 ; ret >= 0 && netstack_nexthop_group(nh, z, &id, &weight) ; ++z){
+      ret = fprintf(out, "%c%u,%u", z ? '/' : ' ', id, weight);
+    }
+    if(ret >= 0){
+      ret = fprintf(out, "\n");
+    }
+  }else if(netstack_nexthop_blackhole(nh)){
+    ret = fprintf(out, "id %u blackhole\n", netstack_nexthop_id(nh));
+  }else{
+    unsigned char gw[16];
+    char gwstr[INET6_ADDRSTRLEN + 5] = "";
+    unsigned gwfamily = netstack_nexthop_gateway(nh, gw);
+    if(gwfamily != AF_UNSPEC){
+      memcpy(gwstr, "via ", 4);
+      inet_ntop(gwfamily, gw, gwstr + 4, sizeof(gwstr) - 5);
+      strcat(gwstr, " ");
+    }
+    ret = fprintf(out, "[%s] id %u %sdev %d\n",
+                  family_to_str(netstack_nexthop_family(nh)),
+                  netstack_nexthop_id(nh), gwstr, netstack_nexthop_oif(nh));
+  }
+  if(ret < 0){
+    return -1;
+  }
+  return 0;
+}
+
+// tc(8)'s notation for handles, e.g. "1:10", "root", "ingress".
+static void
+tc_handlestr(uint32_t h, char* buf, size_t len){
+  if(h == TC_H_ROOT){
+    snprintf(buf, len, "root");
+  }else if(h == TC_H_INGRESS){
+    snprintf(buf, len, "ingress");
+  }else if(TC_H_MIN(h)){
+    snprintf(buf, len, "%x:%x", TC_H_MAJ(h) >> 16, TC_H_MIN(h));
+  }else{
+    snprintf(buf, len, "%x:", TC_H_MAJ(h) >> 16);
+  }
+}
+
+int netstack_print_tc(const struct netstack_tc* nt, FILE* out){
+  char kind[IFNAMSIZ];
+  if(!netstack_tc_kind(nt, kind)){
+    strcpy(kind, "?");
+  }
+  char handle[20], parent[20];
+  tc_handlestr(netstack_tc_handle(nt), handle, sizeof(handle));
+  tc_handlestr(netstack_tc_parent(nt), parent, sizeof(parent));
+  netstack_tc_stats st;
+  netstack_tc_stats_get(nt, &st);
+  int ret = fprintf(out, "[%d] %s %s %s parent %s %ju bytes %ju pkts %u drops %u overlimits\n",
+                    netstack_tc_index(nt), netstack_tc_class(nt) ? "class" : "qdisc",
+                    kind, handle, parent, (uintmax_t)st.bytes, (uintmax_t)st.packets,
+                    st.drops, st.overlimits);
+  if(ret < 0){
+    return -1;
+  }
+  return 0;
+}
+
 int netstack_print_stats(const netstack_stats* stats, FILE* out){
   int ret = 0;
-  ret = fprintf(out, "%u ifaces %u addrs %u routes %u neighs\n"
-                "%ju iface-evs %ju addr-evs %ju route-evs %ju neigh-evs\n"
-                "%ju lookup+shares %ju zombies %ju lookup+copies %ju lookup-failures\n"
-                "%ju netlink-errors %ju user-callbacks\n",
+  ret = fprintf(out, "%u ifaces %u addrs %u routes %u neighs %u rules %u nexthops %u fdbs %u tcs\n"
+                "%ju iface-bytes %ju addr-bytes %ju route-bytes %ju neigh-bytes\n"
+                "%ju iface-evs %ju addr-evs %ju route-evs %ju neigh-evs %ju rule-evs %ju nexthop-evs %ju tc-evs\n"
+                "%ju lookup+shares %ju live-shares %ju zombies %ju lookup+copies %ju lookup-failures\n"
+                "%ju netlink-errors %ju parse-failures %ju overruns %ju resyncs %ju filtered\n"
+                "%ju dumps %juns dump-time %juns dump-max %ju user-callbacks\n"
+                "%ju tlcache-hits %ju tlcache-misses\n",
                 stats->ifaces, stats->addrs, stats->routes, stats->neighs,
+                stats->rules, stats->nexthops, stats->fdbs, stats->tcs,
+                (uintmax_t)stats->iface_bytes, (uintmax_t)stats->addr_bytes,
+                (uintmax_t)stats->route_bytes, (uintmax_t)stats->neigh_bytes,
                 stats->iface_events, stats->addr_events,
-                stats->route_events, stats->neigh_events,
-                stats->lookup_shares, stats->zombie_shares,
+                stats->route_events, stats->neigh_events, stats->rule_events,
+                stats->nexthop_events, stats->tc_events,
+                stats->lookup_shares, stats->live_shares, stats->zombie_shares,
                 stats->lookup_copies, stats->lookup_failures,
-                stats->netlink_errors, stats->user_callbacks_total);
+                stats->netlink_errors, stats->parse_failures,
+                stats->overruns, stats->resyncs, stats->filtered,
+                stats->dumps, stats->dump_nsec_total, stats->dump_nsec_max,
+                stats->user_callbacks_total,
+                stats->tlcache_hits, stats->tlcache_misses);
   return ret;
 }
@@ -0,0 +1,295 @@
+#include <atomic>
+#include <cerrno>
+#include <thread>
+#include <chrono>
+#include <vector>
+#include <arpa/inet.h>
+#include "netns.h"
+
+// Unit tests for bulk route and link programming. Those which reach the
+// kernel run in a private network namespace, and are skipped if one can't be
+// created.
+
+using BatchNetns = NetnsTest;
+
+#define TESTTABLE 4242
+
+static std::vector<netstack_route_spec>
+test_routes(unsigned n){
+  std::vector<netstack_route_spec> routes(n);
+  for(unsigned i = 0 ; i < n ; ++i){
+    netstack_route_spec& rs = routes[i];
+    rs = {};
+    rs.family = AF_INET;
+    uint32_t dst = htonl(0x0af20000u + i); // 10.242.0.0/16
+    memcpy(rs.dst, &dst, sizeof(dst));
+    rs.dst_len = 32;
+    rs.table = TESTTABLE;
+    rs.type = RTN_BLACKHOLE;
+  }
+  return routes;
+}
+
+static void
+route_counter(const netstack_route* nr, netstack_event_e etype, void* vcount){
+  if(netstack_route_table(nr) == RT_TABLE_UNSPEC){ // tables >= 256
+    const struct rtattr* rta = netstack_route_attr(nr, RTA_TABLE);
+    uint32_t table;
+    if(netstack_rtattrcpy_exact(rta, &table, sizeof(table)) && table == TESTTABLE){
+      auto count = static_cast<std::atomic<int>*>(vcount);
+      *count += etype == NETSTACK_DEL ? -1 : 1;
+    }
+  }
+}
+
+TEST(Batch, InvalidFlags) {
+  netstack_opts nopts = {};
+  nopts.initial_events = netstack_opts::NETSTACK_INITIAL_EVENTS_NONE;
+  struct netstack* ns = netstack_create(&nopts);
+  ASSERT_NE(nullptr, ns);
+  auto routes = test_routes(1);
+  EXPECT_EQ(-1, netstack_route_add_batch(ns, routes.data(), 1, 0x80000000u, nullptr));
+  EXPECT_EQ(0, netstack_route_add_batch(ns, routes.data(), 0, 0, nullptr));
+  ASSERT_EQ(0, netstack_destroy(ns));
+}
+
+// Invalid specifications fail without being sent.
+TEST(Batch, InvalidRoutes) {
+  netstack_opts nopts = {};
+  nopts.initial_events = netstack_opts::NETSTACK_INITIAL_EVENTS_NONE;
+  struct netstack* ns = netstack_create(&nopts);
+  ASSERT_NE(nullptr, ns);
+  auto routes = test_routes(2);
+  routes[0].dst_len = 33;
+  routes[1].family = AF_UNIX;
+  netstack_batch_result results[2];
+  EXPECT_EQ(2, netstack_route_add_batch(ns, routes.data(), 2, 0, results));
+  EXPECT_EQ(-EINVAL, results[0].error);
+  EXPECT_EQ(-EINVAL, results[1].error);
+  ASSERT_EQ(0, netstack_destroy(ns));
+}
+
+// Several groups' worth of routes, added and then deleted, each producing an
+// event. Adding them again must fail for each route individually.
+TEST_F(BatchNetns, AddDelete) {
+  std::atomic<int> count(0);
+  netstack_opts nopts = {};
+  nopts.initial_events = netstack_opts::NETSTACK_INITIAL_EVENTS_NONE;
+  nopts.route_cb = route_counter;
+  nopts.route_curry = &count;
+  struct netstack* ns = netstack_create(&nopts);
+  ASSERT_NE(nullptr, ns);
+  const unsigned n = 5000;
+  auto routes = test_routes(n);
+  std::vector<netstack_batch_result> results(n);
+  ASSERT_EQ(0, netstack_route_add_batch(ns, routes.data(), n, 0, results.data()));
+  for(unsigned i = 0 ; i < n ; ++i){
+    ASSERT_EQ(0, results[i].error);
+  }
+  // every other route is already present
+  std::vector<netstack_route_spec> mixed;
+  auto more = test_routes(2 * n);
+  for(unsigned i = 0 ; i < 2 * n ; i += 2){
+    mixed.push_back(more[i]);
+  }
+  ASSERT_EQ(n / 2, netstack_route_add_batch(ns, mixed.data(), n, 0, results.data()));
+  for(unsigned i = 0 ; i < n ; ++i){
+    if(i < n / 2){
+      EXPECT_EQ(-EEXIST, results[i].error);
+    }else{
+      EXPECT_EQ(0, results[i].error);
+    }
+  }
+  // replacing succeeds
+  EXPECT_EQ(0, netstack_route_add_batch(ns, routes.data(), n, NETSTACK_BATCH_REPLACE, nullptr));
+  EXPECT_EQ(0, netstack_route_del_batch(ns, routes.data(), n, 0, nullptr));
+  EXPECT_EQ(0, netstack_route_del_batch(ns, mixed.data() + n / 2, n - n / 2, 0, nullptr));
+  // deleting them again fails for each
+  EXPECT_EQ(n, netstack_route_del_batch(ns, routes.data(), n, 0, results.data()));
+  EXPECT_EQ(-ESRCH, results[n - 1].error);
+  for(int i = 0 ; i < 200 && count.load() ; ++i){
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  netstack_stats stats;
+  ASSERT_NE(nullptr, netstack_sample_stats(ns, &stats));
+  if(stats.overruns == 0){ // otherwise, events were lost
+    EXPECT_EQ(0, count.load());
+  }
+  ASSERT_EQ(0, netstack_destroy(ns));
+}
+
+// A failure carries the kernel's explanation, where it has one.
+TEST_F(BatchNetns, Extack) {
+  netstack_opts nopts = {};
+  nopts.initial_events = netstack_opts::NETSTACK_INITIAL_EVENTS_NONE;
+  nopts.route_cb = route_counter;
+  std::atomic<int> count(0);
+  nopts.route_curry = &count;
+  struct netstack* ns = netstack_create(&nopts);
+  ASSERT_NE(nullptr, ns);
+  auto routes = test_routes(1);
+  routes[0].type = RTN_UNICAST;
+  routes[0].has_gateway = true;
+  uint32_t gw = htonl(0x0affffffu); // 10.255.255.255, not on any link
+  memcpy(routes[0].gateway, &gw, sizeof(gw));
+  netstack_batch_result result;
+  ASSERT_EQ(1, netstack_route_add_batch(ns, routes.data(), 1, 0, &result));
+  EXPECT_GT(0, result.error);
+  EXPECT_LT(0, strlen(result.extack));
+  ASSERT_EQ(0, netstack_destroy(ns));
+}
+
+// Threadless batches drive the socket themselves.
+TEST_F(BatchNetns, Threadless) {
+  netstack_opts nopts = {};
+  nopts.initial_events = netstack_opts::NETSTACK_INITIAL_EVENTS_NONE;
+  nopts.threadless = true;
+  nopts.route_notrack = true;
+  nopts.route_cb = route_counter;
+  std::atomic<int> count(0);
+  nopts.route_curry = &count;
+  struct netstack* ns = netstack_create(&nopts);
+  ASSERT_NE(nullptr, ns);
+  const unsigned n = 3000;
+  auto routes = test_routes(n);
+  EXPECT_EQ(0, netstack_route_add_batch(ns, routes.data(), n, 0, nullptr));
+  EXPECT_EQ(0, netstack_route_del_batch(ns, routes.data(), n, 0, nullptr));
+  ASSERT_EQ(0, netstack_destroy(ns));
+}
+
+static netstack_link_spec
+test_veth(unsigned i){
+  netstack_link_spec ls = {};
+  snprintf(ls.name, sizeof(ls.name), "nsbv%u", i);
+  snprintf(ls.peer, sizeof(ls.peer), "nsbp%u", i);
+  strcpy(ls.kind, "veth");
+  return ls;
+}
+
+static void
+addr_counter(const netstack_addr* na, netstack_event_e etype, void* vcount){
+  char label[IFNAMSIZ] = "";
+  const struct rtattr* rta = netstack_addr_attr(na, IFA_LABEL);
+  size_t len = sizeof(label);
+  if(rta && netstack_rtattrcpy(rta, label, &len) && !strncmp(label, "nsbv", 4)){
+    auto count = static_cast<std::atomic<int>*>(vcount);
+    *count += etype == NETSTACK_DEL ? -1 : 1;
+  }
+}
+
+// Invalid operations fail without being sent, and don't affect the others.
+TEST(Batch, BuilderInvalid) {
+  netstack_opts nopts = {};
+  nopts.initial_events = netstack_opts::NETSTACK_INITIAL_EVENTS_NONE;
+  struct netstack* ns = netstack_create(&nopts);
+  ASSERT_NE(nullptr, ns);
+  struct netstack_batch* nb = netstack_batch_create();
+  ASSERT_NE(nullptr, nb);
+  netstack_link_spec ls = {};
+  ASSERT_EQ(0, netstack_batch_link_add(nb, &ls)); // no kind
+  ASSERT_EQ(0, netstack_batch_link_set(nb, &ls)); // no index or name
+  netstack_addr_spec as = {};
+  as.family = AF_INET;
+  ASSERT_EQ(0, netstack_batch_addr_add(nb, &as)); // no interface
+  ls = test_veth(0);
+  strcpy(ls.kind, "vlan");
+  ASSERT_EQ(0, netstack_batch_link_add(nb, &ls)); // peer on a non-veth
+  errno = 0;
+  EXPECT_EQ(-1, netstack_batch_route_add(nb, nullptr)); // never recorded
+  EXPECT_EQ(EINVAL, errno);
+  ASSERT_EQ(4, netstack_batch_count(nb));
+  netstack_batch_result results[4];
+  EXPECT_EQ(4, netstack_batch_commit(ns, nb, 0, results));
+  for(const auto& r : results){
+    EXPECT_EQ(-EINVAL, r.error);
+  }
+  EXPECT_EQ(-1, netstack_batch_commit(ns, nb, 0x80000000u, nullptr));
+  netstack_batch_clear(nb);
+  EXPECT_EQ(0, netstack_batch_count(nb));
+  EXPECT_EQ(0, netstack_batch_commit(ns, nb, NETSTACK_BATCH_SYNC, nullptr));
+  netstack_batch_destroy(nb);
+  ASSERT_EQ(0, netstack_destroy(ns));
+}
+
+// Create veth pairs, configure them, and address them in one batch. With
+// NETSTACK_BATCH_SYNC, the cache reflects the results upon return.
+TEST_F(BatchNetns, Links) {
+  std::atomic<int> count(0);
+  netstack_opts nopts = {};
+  nopts.initial_events = netstack_opts::NETSTACK_INITIAL_EVENTS_BLOCK;
+  nopts.addr_cb = addr_counter;
+  nopts.addr_curry = &count;
+  struct netstack* ns = netstack_create(&nopts);
+  ASSERT_NE(nullptr, ns);
+  const unsigned n = 32;
+  struct netstack_batch* nb = netstack_batch_create();
+  ASSERT_NE(nullptr, nb);
+  for(unsigned i = 0 ; i < n ; ++i){
+    netstack_link_spec ls = test_veth(i);
+    ASSERT_EQ(0, netstack_batch_link_add(nb, &ls));
+    ls = {};
+    snprintf(ls.name, sizeof(ls.name), "nsbv%u", i);
+    ls.mtu = 1400;
+    ls.flags = ls.change = IFF_UP;
+    ASSERT_EQ(0, netstack_batch_link_set(nb, &ls));
+  }
+  std::vector<netstack_batch_result> results(n * 2);
+  ASSERT_EQ(0, netstack_batch_commit(ns, nb, NETSTACK_BATCH_SYNC, results.data()));
+  netstack_batch_clear(nb);
+  for(unsigned i = 0 ; i < n ; ++i){
+    char name[IFNAMSIZ];
+    snprintf(name, sizeof(name), "nsbv%u", i);
+    const netstack_iface* ni = netstack_iface_share_byname(ns, name);
+    ASSERT_NE(nullptr, ni);
+    EXPECT_EQ(1400, netstack_iface_mtu(ni));
+    EXPECT_TRUE(netstack_iface_up(ni));
+    netstack_addr_spec as = {};
+    as.family = AF_INET;
+    as.index = netstack_iface_index(ni);
+    uint32_t addr = htonl(0x0af30001u + i * 4); // 10.243.0.0/16, in /30s
+    memcpy(as.addr, &addr, sizeof(addr));
+    as.prefixlen = 30;
+    strcpy(as.label, name);
+    ASSERT_EQ(0, netstack_batch_addr_add(nb, &as));
+    netstack_iface_abandon(ni);
+  }
+  ASSERT_EQ(0, netstack_batch_commit(ns, nb, NETSTACK_BATCH_SYNC, nullptr));
+  EXPECT_EQ(n, count.load());
+  // adding them again fails, while replacing them succeeds
+  EXPECT_EQ(n, netstack_batch_commit(ns, nb, 0, results.data()));
+  EXPECT_EQ(-EEXIST, results[0].error);
+  EXPECT_EQ(0, netstack_batch_commit(ns, nb, NETSTACK_BATCH_REPLACE, nullptr));
+  // remove the addresses, and then the links, taking their peers with them
+  const int added = count.load(); // replacement announces them anew
+  struct netstack_batch* dels = netstack_batch_create();
+  ASSERT_NE(nullptr, dels);
+  for(unsigned i = 0 ; i < n ; ++i){
+    netstack_addr_spec as = {};
+    as.family = AF_INET;
+    char name[IFNAMSIZ];
+    snprintf(name, sizeof(name), "nsbv%u", i);
+    const netstack_iface* ni = netstack_iface_share_byname(ns, name);
+    ASSERT_NE(nullptr, ni);
+    as.index = netstack_iface_index(ni);
+    netstack_iface_abandon(ni);
+    uint32_t addr = htonl(0x0af30001u + i * 4);
+    memcpy(as.addr, &addr, sizeof(addr));
+    as.prefixlen = 30;
+    ASSERT_EQ(0, netstack_batch_addr_del(dels, &as));
+  }
+  for(unsigned i = 0 ; i < n ; ++i){
+    netstack_link_spec ls = {};
+    snprintf(ls.name, sizeof(ls.name), "nsbv%u", i);
+    ASSERT_EQ(0, netstack_batch_link_del(dels, &ls));
+  }
+  ASSERT_EQ(0, netstack_batch_commit(ns, dels, NETSTACK_BATCH_SYNC, nullptr));
+  EXPECT_EQ(added - (int)n, count.load());
+  for(unsigned i = 0 ; i < n ; ++i){
+    char name[IFNAMSIZ];
+    snprintf(name, sizeof(name), "nsbp%u", i);
+    EXPECT_EQ(nullptr, netstack_iface_share_byname(ns, name));
+  }
+  netstack_batch_destroy(dels);
+  netstack_batch_destroy(nb);
+  ASSERT_EQ(0, netstack_destroy(ns));
+}
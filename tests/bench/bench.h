@@ -0,0 +1,55 @@
+#ifndef LIBNETSTACK_BENCH
+#define LIBNETSTACK_BENCH
+
+#include <cerrno>
+#include <ctime>
+#include <cstdio>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <sched.h>
+#include <sys/socket.h>
+#include <netstack.h>
+
+// Helpers shared by the benchmarks. Each is a standalone program, built but
+// not run by ctest.
+
+static inline uint64_t
+bench_nsec(void){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// Move into a new, empty network namespace with only lo (brought up), so
+// that benchmarks can create links and routes without touching the host.
+// Requires CAP_SYS_ADMIN. Returns false on failure.
+static inline bool
+bench_scratch_netns(void){
+  if(unshare(CLONE_NEWNET)){
+    fprintf(stderr, "Couldn't enter a new network namespace (%s)\n", strerror(errno));
+    return false;
+  }
+  if(system("ip link set lo up")){
+    fprintf(stderr, "Couldn't bring up lo\n");
+    return false;
+  }
+  return true;
+}
+
+// Fill in the ith of a set of distinct IPv4 /32 routes out of oif, within
+// 10.0.0.0/8 plus i / 2^24 (so up to 2^24 * 118 routes).
+static inline void
+bench_route(netstack_route_spec* rs, unsigned i, int oif){
+  memset(rs, 0, sizeof(*rs));
+  rs->family = AF_INET;
+  const uint32_t addr = (10u << 24) + i;
+  rs->dst[0] = addr >> 24;
+  rs->dst[1] = addr >> 16;
+  rs->dst[2] = addr >> 8;
+  rs->dst[3] = addr;
+  rs->dst_len = 32;
+  rs->oif = oif;
+}
+
+#endif
@@ -0,0 +1,156 @@
+#include <vector>
+#include <net/if.h>
+#include <netlink/netlink.h>
+#include <netlink/msg.h>
+#include <linux/rtnetlink.h>
+#include "bench.h"
+
+// Time taken to receive a route dump, replayed from the kernel: libnl's
+// nl_recvmsgs_default() (receiving only, building nothing), and a netstack
+// (parsing and caching every route) with each of its receive backends.
+// Installs the routes in a scratch network namespace.
+//
+// usage: netstack-bench-dump [ routes [ rounds ] ]
+
+static void
+usage(const char* argv0){
+  fprintf(stderr, "usage: %s [ routes [ rounds ] ]\n", argv0);
+}
+
+static int
+count_msg(struct nl_msg*, void* vcount){
+  ++*static_cast<uint64_t*>(vcount);
+  return NL_OK;
+}
+
+// Returns nanoseconds taken by the dump, or 0 on failure.
+static uint64_t
+libnl_dump(uint64_t* msgs){
+  struct nl_sock* nl = nl_socket_alloc();
+  if(nl == nullptr || nl_connect(nl, NETLINK_ROUTE)){
+    nl_socket_free(nl);
+    return 0;
+  }
+  *msgs = 0;
+  nl_socket_modify_cb(nl, NL_CB_VALID, NL_CB_CUSTOM, count_msg, msgs);
+  const uint64_t start = bench_nsec();
+  struct rtgenmsg rt = { .rtgen_family = AF_INET, };
+  if(nl_send_simple(nl, RTM_GETROUTE, NLM_F_DUMP, &rt, sizeof(rt)) < 0 ||
+      nl_recvmsgs_default(nl) < 0){
+    nl_socket_free(nl);
+    return 0;
+  }
+  const uint64_t elapsed = bench_nsec() - start;
+  nl_socket_free(nl);
+  return elapsed;
+}
+
+// Returns nanoseconds taken by the dump, or 0 on failure.
+static uint64_t
+netstack_dump(struct netstack* ns){
+  struct {
+    struct nlmsghdr nh;
+    struct rtgenmsg rt;
+  } req = {};
+  req.nh.nlmsg_len = NLMSG_LENGTH(sizeof(req.rt));
+  req.nh.nlmsg_type = RTM_GETROUTE;
+  req.nh.nlmsg_flags = NLM_F_DUMP;
+  req.rt.rtgen_family = AF_INET;
+  const uint64_t start = bench_nsec();
+  struct netstack_request* r = netstack_request_submit(ns, &req.nh, nullptr, nullptr);
+  if(r == nullptr){
+    return 0;
+  }
+  if(netstack_request_wait(ns, r, -1) || netstack_request_error(r)){
+    netstack_request_release(r);
+    return 0;
+  }
+  const uint64_t elapsed = bench_nsec() - start;
+  netstack_request_release(r);
+  return elapsed;
+}
+
+static void
+report(const char* name, const std::vector<uint64_t>& nsecs, unsigned routes){
+  uint64_t best = 0, total = 0;
+  for(auto n : nsecs){
+    if(best == 0 || n < best){
+      best = n;
+    }
+    total += n;
+  }
+  printf("%-20s %10.2f %10.2f %12.0f\n", name, best / 1e6,
+         total / 1e6 / nsecs.size(), routes * 1e9 / best);
+}
+
+int main(int argc, char** argv){
+  unsigned routes = 100000;
+  unsigned rounds = 5;
+  if(argc > 3){
+    usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+  if(argc > 1 && (routes = strtoul(argv[1], nullptr, 0)) == 0){
+    usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+  if(argc > 2 && (rounds = strtoul(argv[2], nullptr, 0)) == 0){
+    usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+  if(!bench_scratch_netns()){
+    return EXIT_FAILURE;
+  }
+  const int lo = if_nametoindex("lo");
+  netstack_opts nopts = {};
+  nopts.initial_events = netstack_opts::NETSTACK_INITIAL_EVENTS_BLOCK;
+  nopts.diagfxn = netstack_stderr_diag;
+  struct netstack* ns = netstack_create(&nopts);
+  if(ns == nullptr){
+    fprintf(stderr, "Couldn't create netstack\n");
+    return EXIT_FAILURE;
+  }
+  std::vector<netstack_route_spec> specs(routes);
+  for(unsigned i = 0 ; i < routes ; ++i){
+    bench_route(&specs[i], i, lo);
+  }
+  if(netstack_route_add_batch(ns, specs.data(), routes, 0, nullptr)){
+    fprintf(stderr, "Couldn't install %u routes\n", routes);
+    return EXIT_FAILURE;
+  }
+  netstack_destroy(ns);
+  printf("%u routes, %u rounds\n", routes, rounds);
+  printf("%-20s %10s %10s %12s\n", "receiver", "best ms", "mean ms", "routes/s");
+  std::vector<uint64_t> nsecs;
+  uint64_t msgs = 0;
+  for(unsigned r = 0 ; r < rounds ; ++r){
+    uint64_t n = libnl_dump(&msgs);
+    if(n == 0){
+      fprintf(stderr, "libnl dump failed\n");
+      return EXIT_FAILURE;
+    }
+    nsecs.push_back(n);
+  }
+  report("nl_recvmsgs_default", nsecs, msgs);
+  for(int uring = 0 ; uring < 2 ; ++uring){
+    nopts.io_uring = uring;
+    if((ns = netstack_create(&nopts)) == nullptr){
+      fprintf(stderr, "Couldn't create netstack\n");
+      return EXIT_FAILURE;
+    }
+    nsecs.clear();
+    for(unsigned r = 0 ; r < rounds ; ++r){
+      uint64_t n = netstack_dump(ns);
+      if(n == 0){
+        fprintf(stderr, "netstack dump failed\n");
+        return EXIT_FAILURE;
+      }
+      nsecs.push_back(n);
+    }
+    netstack_stats stats;
+    netstack_sample_stats(ns, &stats);
+    report(uring ? "netstack io_uring" : "netstack recvmsg", nsecs, stats.routes);
+    netstack_destroy(ns);
+  }
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,92 @@
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <unistd.h>
+#include <net/if.h>
+#include "bench.h"
+
+// Scaling of netstack_iface_share_byidx() + netstack_iface_abandon() across
+// threads, with and without the lookup_cache option. Read-only; runs in the
+// current namespace, looking up lo.
+//
+// usage: netstack-bench-lookups [ maxthreads [ seconds ] ]
+
+static void
+usage(const char* argv0){
+  fprintf(stderr, "usage: %s [ maxthreads [ seconds ] ]\n", argv0);
+}
+
+// Returns lookups per second across nthreads threads.
+static double
+run(struct netstack* ns, int idx, unsigned nthreads, unsigned secs){
+  std::atomic<bool> stop(false);
+  std::vector<uint64_t> counts(nthreads);
+  std::vector<std::thread> threads;
+  const uint64_t start = bench_nsec();
+  for(unsigned t = 0 ; t < nthreads ; ++t){
+    threads.emplace_back([ns, idx, &stop, &counts, t](){
+      uint64_t n = 0;
+      while(!stop.load(std::memory_order_relaxed)){
+        const netstack_iface* ni = netstack_iface_share_byidx(ns, idx);
+        if(ni){
+          netstack_iface_abandon(ni);
+        }
+        ++n;
+      }
+      counts[t] = n;
+    });
+  }
+  sleep(secs);
+  stop = true;
+  for(auto& t : threads){
+    t.join();
+  }
+  const uint64_t elapsed = bench_nsec() - start;
+  uint64_t total = 0;
+  for(auto c : counts){
+    total += c;
+  }
+  return total * 1e9 / elapsed;
+}
+
+int main(int argc, char** argv){
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  unsigned maxthreads = cpus > 0 ? cpus * 2 : 2;
+  unsigned secs = 2;
+  if(argc > 3){
+    usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+  if(argc > 1 && (maxthreads = strtoul(argv[1], nullptr, 0)) == 0){
+    usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+  if(argc > 2 && (secs = strtoul(argv[2], nullptr, 0)) == 0){
+    usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+  const int idx = if_nametoindex("lo");
+  if(idx == 0){
+    fprintf(stderr, "Couldn't find lo\n");
+    return EXIT_FAILURE;
+  }
+  printf("%ld online CPUs, %us per run\n", cpus, secs);
+  printf("%8s %16s %16s\n", "threads", "lookups/s", "cached/s");
+  for(unsigned n = 1 ; n <= maxthreads ; n *= 2){
+    double rates[2];
+    for(int cached = 0 ; cached < 2 ; ++cached){
+      netstack_opts nopts = {};
+      nopts.initial_events = netstack_opts::NETSTACK_INITIAL_EVENTS_BLOCK;
+      nopts.lookup_cache = cached;
+      struct netstack* ns = netstack_create(&nopts);
+      if(ns == nullptr){
+        fprintf(stderr, "Couldn't create netstack\n");
+        return EXIT_FAILURE;
+      }
+      rates[cached] = run(ns, idx, n, secs);
+      netstack_destroy(ns);
+    }
+    printf("%8u %16.0f %16.0f\n", n, rates[0], rates[1]);
+  }
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,93 @@
+#include <vector>
+#include <net/if.h>
+#include "bench.h"
+
+// Throughput of netstack_route_add_batch() and netstack_route_del_batch(),
+// in routes per second, for distinct IPv4 /32s out of lo. Each is run with
+// NETSTACK_BATCH_SYNC, and so includes bringing the route cache up to date
+// from the resulting notifications. Runs in a scratch network namespace.
+// The library's batching (BATCH_GROUP and BATCH_ACK_EVERY) can be overridden
+// at build time for comparison, e.g. -DCMAKE_C_FLAGS=-DBATCH_ACK_EVERY=16.
+//
+// usage: netstack-bench-routes [ routes [ rounds ] ]
+
+static void
+usage(const char* argv0){
+  fprintf(stderr, "usage: %s [ routes [ rounds ] ]\n", argv0);
+}
+
+static void
+report(const char* name, const std::vector<uint64_t>& nsecs, unsigned routes){
+  uint64_t best = 0, total = 0;
+  for(auto n : nsecs){
+    if(best == 0 || n < best){
+      best = n;
+    }
+    total += n;
+  }
+  printf("%-8s %10.2f %10.2f %12.0f %12.0f\n", name, best / 1e6,
+         total / 1e6 / nsecs.size(), routes * 1e9 / best,
+         routes * 1e9 * nsecs.size() / total);
+}
+
+int main(int argc, char** argv){
+  unsigned routes = 1000000;
+  unsigned rounds = 3;
+  if(argc > 3){
+    usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+  if(argc > 1 && (routes = strtoul(argv[1], nullptr, 0)) == 0){
+    usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+  if(argc > 2 && (rounds = strtoul(argv[2], nullptr, 0)) == 0){
+    usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+  if(!bench_scratch_netns()){
+    return EXIT_FAILURE;
+  }
+  const int lo = if_nametoindex("lo");
+  netstack_opts nopts = {};
+  nopts.initial_events = netstack_opts::NETSTACK_INITIAL_EVENTS_BLOCK;
+  nopts.diagfxn = netstack_stderr_diag;
+  struct netstack* ns = netstack_create(&nopts);
+  if(ns == nullptr){
+    fprintf(stderr, "Couldn't create netstack\n");
+    return EXIT_FAILURE;
+  }
+  std::vector<netstack_route_spec> specs(routes);
+  for(unsigned i = 0 ; i < routes ; ++i){
+    bench_route(&specs[i], i, lo);
+  }
+  const unsigned base = netstack_route_count(ns);
+  std::vector<uint64_t> adds, dels;
+  for(unsigned r = 0 ; r < rounds ; ++r){
+    uint64_t start = bench_nsec();
+    int failed = netstack_route_add_batch(ns, specs.data(), routes, NETSTACK_BATCH_SYNC, nullptr);
+    adds.push_back(bench_nsec() - start);
+    if(failed || netstack_route_count(ns) != base + routes){
+      fprintf(stderr, "Couldn't install %u routes (%d failed, %u cached)\n",
+              routes, failed, netstack_route_count(ns) - base);
+      return EXIT_FAILURE;
+    }
+    start = bench_nsec();
+    failed = netstack_route_del_batch(ns, specs.data(), routes, NETSTACK_BATCH_SYNC, nullptr);
+    dels.push_back(bench_nsec() - start);
+    if(failed || netstack_route_count(ns) != base){
+      fprintf(stderr, "Couldn't remove %u routes (%d failed, %u cached)\n",
+              routes, failed, netstack_route_count(ns) - base);
+      return EXIT_FAILURE;
+    }
+  }
+  netstack_stats stats;
+  netstack_sample_stats(ns, &stats);
+  printf("%u routes, %u rounds, %ju overruns, %ju resyncs\n", routes, rounds,
+         stats.overruns, stats.resyncs);
+  printf("%-8s %10s %10s %12s %12s\n", "op", "best ms", "mean ms", "best rt/s", "mean rt/s");
+  report("add", adds, routes);
+  report("del", dels, routes);
+  netstack_destroy(ns);
+  return EXIT_SUCCESS;
+}
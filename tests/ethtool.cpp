@@ -0,0 +1,95 @@
+#include <cstdlib>
+#include "netns.h"
+
+// Unit tests for ethtool-netlink support. Kernels lacking ethtool-netlink
+// cause netstack_create() to fail with the ethtool option; those are skipped.
+// Those creating links run in a private network namespace, and are skipped
+// if one can't be created.
+
+using EthtoolNetns = NetnsTest;
+
+TEST(Ethtool, InvalidWithThreadless) {
+  netstack_opts nopts = {};
+  nopts.ethtool = true;
+  nopts.threadless = true;
+  EXPECT_EQ(nullptr, netstack_create(&nopts));
+}
+
+TEST(Ethtool, InvalidWithoutIfaceTracking) {
+  netstack_opts nopts = {};
+  nopts.ethtool = true;
+  nopts.iface_notrack = true;
+  EXPECT_EQ(nullptr, netstack_create(&nopts));
+}
+
+TEST(Ethtool, NoneWithoutOption) {
+  netstack_opts nopts = {};
+  nopts.initial_events = netstack_opts::NETSTACK_INITIAL_EVENTS_BLOCK;
+  struct netstack* ns = netstack_create(&nopts);
+  ASSERT_NE(nullptr, ns);
+  netstack_ethtool ne;
+  EXPECT_FALSE(netstack_iface_ethtool(ns, 1, &ne));
+  EXPECT_EQ(-1, netstack_ethtool_feature_index(ns, "loopback"));
+  ASSERT_EQ(0, netstack_destroy(ns));
+}
+
+// Every device supports the features query, and lo has its "loopback"
+// feature fixed on. _BLOCK must wait for the initial ethtool dumps.
+TEST(Ethtool, LoopbackFeatures) {
+  netstack_opts nopts = {};
+  nopts.initial_events = netstack_opts::NETSTACK_INITIAL_EVENTS_BLOCK;
+  nopts.ethtool = true;
+  struct netstack* ns = netstack_create(&nopts);
+  if(ns == nullptr){
+    GTEST_SKIP();
+  }
+  const netstack_iface* ni = netstack_iface_share_byname(ns, "lo");
+  if(ni){
+    netstack_ethtool ne;
+    ASSERT_TRUE(netstack_iface_ethtool(ns, netstack_iface_index(ni), &ne));
+    ASSERT_TRUE(ne.present & NETSTACK_ETHTOOL_FEATURES);
+    int fidx = netstack_ethtool_feature_index(ns, "loopback");
+    ASSERT_LE(0, fidx);
+    EXPECT_TRUE(netstack_ethtool_feature(&ne, fidx));
+    EXPECT_FALSE(netstack_ethtool_feature(&ne, -1));
+    EXPECT_FALSE(netstack_ethtool_feature(&ne, NETSTACK_ETHTOOL_FEATURE_MAX));
+    netstack_iface_abandon(ni);
+  }
+  EXPECT_EQ(-1, netstack_ethtool_feature_index(ns, "not-a-real-feature"));
+  netstack_stats stats;
+  ASSERT_NE(nullptr, netstack_sample_stats(ns, &stats));
+  EXPECT_EQ(0, stats.parse_failures);
+  ASSERT_EQ(0, netstack_destroy(ns));
+}
+
+// veths report their channels, so the combined count is known with the
+// ethtool option. Nothing reports XDP queues.
+TEST_F(EthtoolNetns, QueueCounts) {
+  ASSERT_EQ(0, system("ip link add nset0 type veth peer name nset1"));
+  netstack_opts nopts = {};
+  nopts.initial_events = netstack_opts::NETSTACK_INITIAL_EVENTS_BLOCK;
+  nopts.ethtool = true;
+  struct netstack* ns = netstack_create(&nopts);
+  if(ns == nullptr){
+    GTEST_SKIP();
+  }
+  const netstack_iface* ni = netstack_iface_share_byname(ns, "nset0");
+  ASSERT_NE(nullptr, ni);
+  netstack_iface_qcounts qc;
+  netstack_iface_queuecounts(ni, &qc);
+  EXPECT_LT(0, qc.rx);
+  EXPECT_LT(0, qc.tx);
+  EXPECT_EQ(-1, qc.combined);
+  EXPECT_EQ(-1, qc.xdp);
+  netstack_ethtool ne;
+  ASSERT_TRUE(netstack_iface_ethtool(ns, netstack_iface_index(ni), &ne));
+  netstack_iface_queuecounts_ethtool(ns, ni, &qc);
+  if(ne.present & NETSTACK_ETHTOOL_CHANNELS){
+    EXPECT_EQ((int)ne.channels.combined, qc.combined);
+  }else{
+    EXPECT_EQ(-1, qc.combined);
+  }
+  EXPECT_EQ(-1, qc.xdp);
+  netstack_iface_abandon(ni);
+  ASSERT_EQ(0, netstack_destroy(ns));
+}
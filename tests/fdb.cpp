@@ -0,0 +1,141 @@
+#include <thread>
+#include <chrono>
+#include <cstdlib>
+#include <linux/if_ether.h>
+#include "netns.h"
+
+// Unit tests for the bridge FDB cache. Those adding bridges run in a private
+// network namespace, and are skipped if one can't be created (or without
+// bridge support).
+
+using FdbNetns = NetnsTest;
+
+TEST(Fdb, Invalid) {
+  netstack_opts nopts = {};
+  nopts.initial_events = netstack_opts::NETSTACK_INITIAL_EVENTS_NONE;
+  nopts.fdb_notrack = true;
+  struct netstack* ns = netstack_create(&nopts);
+  ASSERT_NE(nullptr, ns);
+  const unsigned char mac[ETH_ALEN] = { 0x02, 0, 0, 0, 0x42, 0x60 };
+  netstack_fdb_entry fe;
+  EXPECT_EQ(-1, netstack_fdb_lookup(ns, 1, 0, nullptr, &fe));
+  EXPECT_EQ(EINVAL, errno);
+  EXPECT_EQ(-1, netstack_fdb_lookup(ns, 1, 0, mac, &fe));
+  EXPECT_EQ(EOPNOTSUPP, errno);
+  EXPECT_EQ(0, netstack_fdb_count(ns));
+  ASSERT_EQ(0, netstack_destroy(ns));
+}
+
+// Poll up to a second for pred to be satisfied.
+template<typename P> static bool
+await(P pred){
+  for(int i = 0 ; i < 100 ; ++i){
+    if(pred()){
+      return true;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  return false;
+}
+
+static int
+ifindex_of(struct netstack* ns, const char* name){
+  const netstack_iface* ni = nullptr;
+  await([&](){ return (ni = netstack_iface_share_byname(ns, name)) != nullptr; });
+  if(ni == nullptr){
+    return 0;
+  }
+  int idx = netstack_iface_index(ni);
+  netstack_iface_abandon(ni);
+  return idx;
+}
+
+// Entries are found by (bridge, vlan, MAC), and counted by port. A port going
+// down loses its learned entries but keeps its static ones; one going away
+// loses everything.
+TEST_F(FdbNetns, LookupAndFlush) {
+  netstack_opts nopts = {};
+  nopts.initial_events = netstack_opts::NETSTACK_INITIAL_EVENTS_BLOCK;
+  struct netstack* ns = netstack_create(&nopts);
+  ASSERT_NE(nullptr, ns);
+  if(system("ip link add nsbr0 type bridge 2>/dev/null")){
+    netstack_destroy(ns);
+    GTEST_SKIP();
+  }
+  ASSERT_EQ(0, system("ip link add nsfdb0 type veth peer name nsfdb1 && "
+                      "ip link set nsfdb0 master nsbr0 && "
+                      "ip link set nsbr0 up && ip link set nsfdb1 up && "
+                      "ip link set nsfdb0 up && "
+                      "bridge fdb add 02:00:00:00:42:60 dev nsfdb0 master static && "
+                      "bridge fdb add 02:00:00:00:42:61 dev nsfdb0 master dynamic"));
+  const int br = ifindex_of(ns, "nsbr0");
+  const int port = ifindex_of(ns, "nsfdb0");
+  ASSERT_NE(0, br);
+  ASSERT_NE(0, port);
+  const unsigned char fixed[ETH_ALEN] = { 0x02, 0, 0, 0, 0x42, 0x60 };
+  const unsigned char dyn[ETH_ALEN] = { 0x02, 0, 0, 0, 0x42, 0x61 };
+  netstack_fdb_entry fe;
+  ASSERT_TRUE(await([&](){ return netstack_fdb_lookup(ns, br, 0, fixed, &fe) == 0; }));
+  EXPECT_EQ(port, fe.port);
+  EXPECT_TRUE(fe.state & NUD_NOARP);
+  // the vlan is part of the key, as is the bridge
+  EXPECT_EQ(-1, netstack_fdb_lookup(ns, br, 7, fixed, &fe));
+  EXPECT_EQ(ENOENT, errno);
+  EXPECT_EQ(-1, netstack_fdb_lookup(ns, port, 0, fixed, &fe));
+  ASSERT_EQ(0, netstack_fdb_lookup(ns, br, 0, dyn, &fe));
+  EXPECT_EQ(port, fe.port);
+  EXPECT_TRUE(fe.state & NUD_REACHABLE);
+  const unsigned entries = netstack_fdb_port_count(ns, port);
+  EXPECT_LE(3, entries);
+  EXPECT_LE(entries, netstack_fdb_count(ns));
+  ASSERT_EQ(0, system("ip link set nsfdb0 down"));
+  EXPECT_TRUE(await([&](){ return netstack_fdb_lookup(ns, br, 0, dyn, &fe) != 0; }));
+  EXPECT_EQ(0, netstack_fdb_lookup(ns, br, 0, fixed, &fe));
+  EXPECT_GT(entries, netstack_fdb_port_count(ns, port));
+  ASSERT_EQ(0, system("ip link del nsfdb0"));
+  EXPECT_TRUE(await([&](){ return netstack_fdb_port_count(ns, port) == 0; }));
+  EXPECT_EQ(-1, netstack_fdb_lookup(ns, br, 0, fixed, &fe));
+  netstack_stats stats;
+  ASSERT_NE(nullptr, netstack_sample_stats(ns, &stats));
+  EXPECT_EQ(netstack_fdb_count(ns), stats.fdbs);
+  ASSERT_EQ(0, netstack_destroy(ns));
+}
+
+// A bridge going away takes the entries of all its ports along with it,
+// while the ports themselves remain.
+TEST_F(FdbNetns, BridgeRemoval) {
+  netstack_opts nopts = {};
+  nopts.initial_events = netstack_opts::NETSTACK_INITIAL_EVENTS_BLOCK;
+  struct netstack* ns = netstack_create(&nopts);
+  ASSERT_NE(nullptr, ns);
+  if(system("ip link add nsbr0 type bridge 2>/dev/null")){
+    netstack_destroy(ns);
+    GTEST_SKIP();
+  }
+  ASSERT_EQ(0, system("ip link add nsfdb0 type veth peer name nsfdb1 && "
+                      "ip link add nsfdb2 type veth peer name nsfdb3 && "
+                      "ip link set nsfdb0 master nsbr0 && "
+                      "ip link set nsfdb2 master nsbr0 && "
+                      "bridge fdb add 02:00:00:00:42:60 dev nsfdb0 master static && "
+                      "bridge fdb add 02:00:00:00:42:62 dev nsfdb2 master static"));
+  const int br = ifindex_of(ns, "nsbr0");
+  const int port0 = ifindex_of(ns, "nsfdb0");
+  const int port2 = ifindex_of(ns, "nsfdb2");
+  ASSERT_NE(0, br);
+  const unsigned char mac0[ETH_ALEN] = { 0x02, 0, 0, 0, 0x42, 0x60 };
+  const unsigned char mac2[ETH_ALEN] = { 0x02, 0, 0, 0, 0x42, 0x62 };
+  netstack_fdb_entry fe;
+  ASSERT_TRUE(await([&](){ return netstack_fdb_lookup(ns, br, 0, mac0, &fe) == 0 &&
+                                  netstack_fdb_lookup(ns, br, 0, mac2, &fe) == 0; }));
+  EXPECT_LT(0, netstack_fdb_port_count(ns, port0));
+  EXPECT_LT(0, netstack_fdb_port_count(ns, port2));
+  ASSERT_EQ(0, system("ip link del nsbr0"));
+  EXPECT_TRUE(await([&](){ return netstack_fdb_lookup(ns, br, 0, mac0, &fe) != 0 &&
+                                  netstack_fdb_lookup(ns, br, 0, mac2, &fe) != 0; }));
+  EXPECT_TRUE(await([&](){ return netstack_fdb_port_count(ns, port0) == 0 &&
+                                  netstack_fdb_port_count(ns, port2) == 0; }));
+  netstack_stats stats;
+  ASSERT_NE(nullptr, netstack_sample_stats(ns, &stats));
+  EXPECT_EQ(netstack_fdb_count(ns), stats.fdbs);
+  ASSERT_EQ(0, netstack_destroy(ns));
+}
@@ -0,0 +1,219 @@
+#include <set>
+#include <mutex>
+#include <thread>
+#include <chrono>
+#include <string>
+#include <cstdlib>
+#include <net/if.h>
+#include "netns.h"
+
+// Unit tests for the iface_include and iface_exclude filters. Those adding
+// links run in a private network namespace, and are skipped if one can't be
+// created.
+
+using FilterNetns = NetnsTest;
+
+TEST(Filter, Invalid) {
+  netstack_opts nopts = {};
+  netstack_iface_filter nf = {};
+  nopts.iface_include = &nf;
+  EXPECT_EQ(nullptr, netstack_create(&nopts));
+  nf.ifindex_count = 1;
+  EXPECT_EQ(nullptr, netstack_create(&nopts));
+  nopts.iface_include = nullptr;
+  nopts.iface_exclude = &nf;
+  EXPECT_EQ(nullptr, netstack_create(&nopts));
+}
+
+// Poll up to a second for pred to be satisfied.
+template<typename P> static bool
+await(P pred){
+  for(int i = 0 ; i < 100 ; ++i){
+    if(pred()){
+      return true;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  return false;
+}
+
+static bool
+cached(struct netstack* ns, const char* name){
+  const netstack_iface* ni = netstack_iface_share_byname(ns, name);
+  if(ni){
+    netstack_iface_abandon(ni);
+  }
+  return ni;
+}
+
+// Only the named index is tracked, and the filter needn't outlive creation.
+TEST(Filter, IncludeByIndex) {
+  const int lo = if_nametoindex("lo");
+  if(lo == 0){
+    GTEST_SKIP();
+  }
+  netstack_opts nopts = {};
+  nopts.initial_events = netstack_opts::NETSTACK_INITIAL_EVENTS_BLOCK;
+  struct netstack* ns;
+  {
+    const int idxs[] = { 0x7fffffff, lo, };
+    netstack_iface_filter nf = {};
+    nf.ifindices = idxs;
+    nf.ifindex_count = sizeof(idxs) / sizeof(*idxs);
+    nopts.iface_include = &nf;
+    ns = netstack_create(&nopts);
+  }
+  ASSERT_NE(nullptr, ns);
+  EXPECT_EQ(1, netstack_iface_count(ns));
+  EXPECT_TRUE(cached(ns, "lo"));
+  netstack_stats stats;
+  ASSERT_NE(nullptr, netstack_sample_stats(ns, &stats));
+  EXPECT_EQ(1, stats.ifaces);
+  ASSERT_EQ(0, netstack_destroy(ns));
+}
+
+// What the callbacks have seen.
+struct filter_seen {
+  std::mutex lock;
+  std::set<std::string> names;
+  std::multiset<int> addr_indices; // one per event
+  std::set<int> neigh_indices;
+  std::set<int> route_oifs;
+  unsigned dels;
+};
+
+static void
+iface_cb(const netstack_iface* ni, netstack_event_e etype, void* vseen){
+  auto seen = static_cast<filter_seen*>(vseen);
+  char name[IFNAMSIZ];
+  std::lock_guard<std::mutex> guard(seen->lock);
+  if(netstack_iface_name(ni, name)){
+    seen->names.insert(name);
+  }
+  if(etype == NETSTACK_DEL){
+    ++seen->dels;
+  }
+}
+
+static void
+addr_cb(const netstack_addr* na, netstack_event_e, void* vseen){
+  auto seen = static_cast<filter_seen*>(vseen);
+  std::lock_guard<std::mutex> guard(seen->lock);
+  seen->addr_indices.insert(netstack_addr_index(na));
+}
+
+static void
+neigh_cb(const netstack_neigh* nn, netstack_event_e, void* vseen){
+  auto seen = static_cast<filter_seen*>(vseen);
+  std::lock_guard<std::mutex> guard(seen->lock);
+  seen->neigh_indices.insert(netstack_neigh_index(nn));
+}
+
+static void
+route_cb(const netstack_route* nr, netstack_event_e, void* vseen){
+  auto seen = static_cast<filter_seen*>(vseen);
+  std::lock_guard<std::mutex> guard(seen->lock);
+  seen->route_oifs.insert(netstack_route_oif(nr));
+}
+
+// Excluded links, and their addresses and neighbors, reach neither the cache
+// nor the callbacks. Links are processed in order, so once nsok0 has arrived,
+// everything about nsflt0 has been seen (and discarded).
+TEST_F(FilterNetns, ExcludeByName) {
+  filter_seen seen{};
+  const char* names[] = { "nsflt*", nullptr, };
+  netstack_iface_filter nf = {};
+  nf.names = names;
+  netstack_opts nopts = {};
+  nopts.initial_events = netstack_opts::NETSTACK_INITIAL_EVENTS_BLOCK;
+  nopts.iface_exclude = &nf;
+  nopts.iface_cb = iface_cb;
+  nopts.iface_curry = &seen;
+  nopts.addr_cb = addr_cb;
+  nopts.addr_curry = &seen;
+  nopts.neigh_cb = neigh_cb;
+  nopts.neigh_curry = &seen;
+  struct netstack* ns = netstack_create(&nopts);
+  ASSERT_NE(nullptr, ns);
+  ASSERT_EQ(0, system("ip link add nsflt0 type veth peer name nsflt1 && "
+                      "ip link set nsflt0 up && ip link set nsflt1 up && "
+                      "ip addr add 10.254.0.1/24 dev nsflt0 && "
+                      "ip neigh add 10.254.0.2 lladdr 02:00:00:00:42:54 dev nsflt0 && "
+                      "ip link add nsok0 type veth peer name nsok1"));
+  const int flt = if_nametoindex("nsflt0");
+  ASSERT_NE(0, flt);
+  EXPECT_TRUE(await([ns](){ return cached(ns, "nsok0"); }));
+  EXPECT_FALSE(cached(ns, "nsflt0"));
+  EXPECT_FALSE(cached(ns, "nsflt1"));
+  EXPECT_EQ(nullptr, netstack_iface_share_byidx(ns, flt));
+  {
+    std::lock_guard<std::mutex> guard(seen.lock);
+    EXPECT_EQ(0, seen.names.count("nsflt0"));
+    EXPECT_EQ(0, seen.names.count("nsflt1"));
+    EXPECT_EQ(1, seen.names.count("nsok0"));
+    EXPECT_EQ(0, seen.addr_indices.count(flt));
+    EXPECT_EQ(0, seen.neigh_indices.count(flt));
+  }
+  netstack_stats stats;
+  ASSERT_NE(nullptr, netstack_sample_stats(ns, &stats));
+  EXPECT_LE(4, stats.filtered);
+  ASSERT_EQ(0, netstack_destroy(ns));
+}
+
+// A link renamed out of the include filter is delivered as a deletion, and
+// is tracked again (along with its addresses and routes) upon being renamed
+// back, without resyncing everything else.
+TEST_F(FilterNetns, IncludeRename) {
+  filter_seen seen{};
+  const char* names[] = { "nsok*", nullptr, };
+  netstack_iface_filter nf = {};
+  nf.names = names;
+  netstack_opts nopts = {};
+  nopts.initial_events = netstack_opts::NETSTACK_INITIAL_EVENTS_BLOCK;
+  nopts.iface_include = &nf;
+  nopts.iface_cb = iface_cb;
+  nopts.iface_curry = &seen;
+  nopts.addr_cb = addr_cb;
+  nopts.addr_curry = &seen;
+  nopts.route_cb = route_cb;
+  nopts.route_curry = &seen;
+  struct netstack* ns = netstack_create(&nopts);
+  ASSERT_NE(nullptr, ns);
+  EXPECT_FALSE(cached(ns, "lo"));
+  ASSERT_EQ(0, system("sysctl -qw net.ipv6.conf.default.disable_ipv6=1 && "
+                      "ip link add nsok0 type veth peer name nsok1 && "
+                      "ip link set nsok0 up && ip link set nsok1 up && "
+                      "ip addr add 10.254.3.1/24 dev nsok1"));
+  ASSERT_TRUE(await([ns](){ return cached(ns, "nsok0") && cached(ns, "nsok1"); }));
+  const int idx = if_nametoindex("nsok0");
+  const int peer = if_nametoindex("nsok1");
+  ASSERT_TRUE(await([&seen, peer](){
+    std::lock_guard<std::mutex> guard(seen.lock);
+    return seen.addr_indices.count(peer) > 0;
+  }));
+  ASSERT_EQ(0, system("ip link set nsok0 name nsflt0"));
+  EXPECT_TRUE(await([ns](){ return !cached(ns, "nsok0"); }));
+  EXPECT_EQ(nullptr, netstack_iface_share_byidx(ns, idx));
+  {
+    std::lock_guard<std::mutex> guard(seen.lock);
+    EXPECT_EQ(1, seen.dels);
+  }
+  // the address and route arrive while the link is turned away, and are
+  // learned only by the redump following its return
+  ASSERT_EQ(0, system("ip addr add 10.254.1.1/24 dev nsflt0 && "
+                      "ip route add 10.254.2.0/24 dev nsflt0 && "
+                      "ip link set nsflt0 name nsok0"));
+  EXPECT_TRUE(await([ns](){ return cached(ns, "nsok0"); }));
+  EXPECT_TRUE(await([&seen, idx](){
+    std::lock_guard<std::mutex> guard(seen.lock);
+    return seen.addr_indices.count(idx) > 0 && seen.route_oifs.count(idx) > 0;
+  }));
+  {
+    // only nsok0 was redumped; nsok1's address wasn't delivered anew
+    std::lock_guard<std::mutex> guard(seen.lock);
+    EXPECT_EQ(1, seen.addr_indices.count(peer));
+  }
+  ASSERT_EQ(0, system("ip link del nsok0"));
+  EXPECT_TRUE(await([ns](){ return !cached(ns, "nsok1"); }));
+  ASSERT_EQ(0, netstack_destroy(ns));
+}
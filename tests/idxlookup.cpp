@@ -107,3 +107,38 @@ TEST(IdxLookup, IfaceShare) {
   ASSERT_EQ(0, netstack_destroy(ns));
   netstack_iface_abandon(ni); // we should still be able to use it
 }
+
+// Batched shares must match individual shares, with misses left NULL and
+// accounted as failures.
+TEST(IdxLookup, IfaceShareBatch) {
+  struct copycurry cc = {};
+  cc.idx = -1;
+  netstack_opts nopts;
+  memset(&nopts, 0, sizeof(nopts));
+  nopts.initial_events = netstack_opts::NETSTACK_INITIAL_EVENTS_BLOCK;
+  nopts.iface_cb = ExternalCB;
+  nopts.iface_curry = &cc;
+  struct netstack* ns = netstack_create(&nopts);
+  ASSERT_NE(nullptr, ns);
+  cc.mlock.lock();
+  const int idxs[] = { cc.idx, -1, 0, cc.idx, };
+  cc.mlock.unlock();
+  const size_t n = sizeof(idxs) / sizeof(*idxs);
+  const netstack_iface* out[n];
+  ASSERT_EQ(2, netstack_iface_share_byidx_batch(ns, idxs, n, out));
+  ASSERT_NE(nullptr, out[0]);
+  EXPECT_EQ(nullptr, out[1]);
+  EXPECT_EQ(nullptr, out[2]);
+  EXPECT_EQ(out[0], out[3]);
+  EXPECT_EQ(cc.idx, netstack_iface_index(out[0]));
+  const netstack_iface* ni = netstack_iface_share_byidx(ns, cc.idx);
+  EXPECT_EQ(ni, out[0]);
+  netstack_iface_abandon(ni);
+  netstack_stats stats;
+  ASSERT_NE(nullptr, netstack_sample_stats(ns, &stats));
+  EXPECT_EQ(3, stats.lookup_shares);
+  EXPECT_EQ(2, stats.lookup_failures);
+  netstack_iface_abandon(out[3]);
+  netstack_iface_abandon(out[0]);
+  ASSERT_EQ(0, netstack_destroy(ns));
+}
@@ -23,6 +23,105 @@ TEST(Inspect, IfaceProperties) {
   ASSERT_EQ(0, netstack_destroy(ns));
 }
 
+// The pre-decoded hot fields must agree with the raw attributes.
+static void
+HotFieldsCB(const netstack_iface* ni, netstack_event_e etype,
+            void* curry __attribute__ ((unused))) {
+  if(etype != NETSTACK_MOD){
+    return;
+  }
+  uint32_t u32;
+  const struct rtattr* rta = netstack_iface_attr(ni, IFLA_MTU);
+  if(netstack_rtattrcpy_exact(rta, &u32, sizeof(u32))){
+    EXPECT_EQ(u32, netstack_iface_mtu(ni));
+  }else{
+    EXPECT_EQ(0, netstack_iface_mtu(ni));
+  }
+  rta = netstack_iface_attr(ni, IFLA_TXQLEN);
+  if(netstack_rtattrcpy_exact(rta, &u32, sizeof(u32))){
+    EXPECT_EQ(u32, netstack_iface_txqlen(ni));
+  }
+  int master;
+  rta = netstack_iface_attr(ni, IFLA_MASTER);
+  if(!netstack_rtattrcpy_exact(rta, &master, sizeof(master))){
+    master = -1;
+  }
+  EXPECT_EQ(master, netstack_iface_master(ni));
+  uint8_t u8;
+  rta = netstack_iface_attr(ni, IFLA_OPERSTATE);
+  if(netstack_rtattrcpy_exact(rta, &u8, sizeof(u8))){
+    EXPECT_EQ(u8, netstack_iface_operstate(ni));
+  }
+  rta = netstack_iface_attr(ni, IFLA_CARRIER);
+  if(netstack_rtattrcpy_exact(rta, &u8, sizeof(u8))){
+    EXPECT_EQ(u8, netstack_iface_carrier(ni));
+  }else{
+    EXPECT_EQ(-1, netstack_iface_carrier(ni));
+  }
+  unsigned char raw[32], hot[32];
+  size_t rawlen = sizeof(raw), hotlen = sizeof(hot);
+  rta = netstack_iface_attr(ni, IFLA_ADDRESS);
+  if(netstack_rtattrcpy(rta, raw, &rawlen)){
+    ASSERT_EQ(hot, netstack_iface_l2addr(ni, hot, &hotlen));
+    ASSERT_EQ(rawlen, hotlen);
+    EXPECT_EQ(0, memcmp(raw, hot, rawlen));
+  }else{
+    EXPECT_EQ(nullptr, netstack_iface_l2addr(ni, hot, &hotlen));
+  }
+  struct rtnl_link_stats64 rawstats, hotstats;
+  rta = netstack_iface_attr(ni, IFLA_STATS64);
+  if(netstack_rtattrcpy_exact(rta, &rawstats, sizeof(rawstats))){
+    ASSERT_TRUE(netstack_iface_stats(ni, &hotstats));
+    EXPECT_EQ(0, memcmp(&rawstats, &hotstats, sizeof(rawstats)));
+  }
+}
+
+TEST(Inspect, IfaceHotFields) {
+  netstack_opts nopts;
+  memset(&nopts, 0, sizeof(nopts));
+  nopts.initial_events = netstack_opts::NETSTACK_INITIAL_EVENTS_BLOCK;
+  nopts.iface_cb = HotFieldsCB;
+  struct netstack* ns = netstack_create(&nopts);
+  ASSERT_NE(nullptr, ns);
+  // copies must carry the hot fields along
+  netstack_iface* ni = netstack_iface_copy_byname(ns, "lo");
+  if(ni){
+    HotFieldsCB(ni, NETSTACK_MOD, nullptr);
+    netstack_iface_abandon(ni);
+  }
+  ASSERT_EQ(0, netstack_destroy(ns));
+}
+
+// IRQ lookups are cached per object; repeated lookups (and those against a
+// copy) must agree with the first.
+TEST(Inspect, IfaceIrqsCached) {
+  netstack_opts nopts;
+  memset(&nopts, 0, sizeof(nopts));
+  nopts.initial_events = netstack_opts::NETSTACK_INITIAL_EVENTS_BLOCK;
+  struct netstack* ns = netstack_create(&nopts);
+  ASSERT_NE(nullptr, ns);
+  for(int idx = 1 ; idx < 64 ; ++idx){
+    const netstack_iface* ni = netstack_iface_share_byidx(ns, idx);
+    if(ni == nullptr){
+      continue;
+    }
+    const unsigned count = netstack_iface_irqcount(ni);
+    const int irq = netstack_iface_irq(ni, 0);
+    for(int i = 0 ; i < 4 ; ++i){
+      EXPECT_EQ(count, netstack_iface_irqcount(ni));
+      EXPECT_EQ(irq, netstack_iface_irq(ni, 0));
+    }
+    netstack_iface* nicopy = netstack_iface_copy_byidx(ns, idx);
+    if(nicopy){
+      EXPECT_EQ(count, netstack_iface_irqcount(nicopy));
+      EXPECT_EQ(irq, netstack_iface_irq(nicopy, 0));
+      netstack_iface_abandon(nicopy);
+    }
+    netstack_iface_abandon(ni);
+  }
+  ASSERT_EQ(0, netstack_destroy(ns));
+}
+
 static void
 AddrCB(const netstack_addr* na, netstack_event_e etype,
        void* curry __attribute__ ((unused))) {
@@ -0,0 +1,40 @@
+#include <string>
+#include <vector>
+#include "main.h"
+
+// Unit tests for OpenMetrics exposition
+
+TEST(Metrics, TruncationReportsSize) {
+  netstack_opts nopts = {};
+  nopts.initial_events = netstack_opts::NETSTACK_INITIAL_EVENTS_BLOCK;
+  struct netstack* ns = netstack_create(&nopts);
+  ASSERT_NE(nullptr, ns);
+  char small[16];
+  int need = netstack_write_metrics(ns, small, sizeof(small));
+  ASSERT_LE(static_cast<int>(sizeof(small)), need);
+  EXPECT_EQ('\0', small[sizeof(small) - 1]);
+  ASSERT_LT(0, netstack_write_metrics(ns, nullptr, 0));
+  ASSERT_EQ(0, netstack_destroy(ns));
+}
+
+TEST(Metrics, Exposition) {
+  netstack_opts nopts = {};
+  nopts.initial_events = netstack_opts::NETSTACK_INITIAL_EVENTS_BLOCK;
+  struct netstack* ns = netstack_create(&nopts);
+  ASSERT_NE(nullptr, ns);
+  int need = netstack_write_metrics(ns, nullptr, 0);
+  ASSERT_LT(0, need);
+  // leave some slack, in case an interface shows up in the meantime
+  std::vector<char> buf(need * 2 + 1);
+  int r = netstack_write_metrics(ns, buf.data(), buf.size());
+  ASSERT_LT(0, r);
+  ASSERT_GT(static_cast<int>(buf.size()), r);
+  std::string text(buf.data());
+  EXPECT_EQ(static_cast<size_t>(r), text.size());
+  EXPECT_NE(std::string::npos, text.find("\nnetstack_ifaces "));
+  EXPECT_NE(std::string::npos, text.find("netstack_dump_duration_seconds_bucket{le=\"+Inf\"}"));
+  EXPECT_NE(std::string::npos, text.find("netstack_iface_rx_bytes_total{iface=\"lo\""));
+  ASSERT_LE(6u, text.size());
+  EXPECT_EQ("# EOF\n", text.substr(text.size() - 6));
+  ASSERT_EQ(0, netstack_destroy(ns));
+}
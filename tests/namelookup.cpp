@@ -99,3 +99,35 @@ TEST(NameLookup, IfaceShare) {
   ASSERT_EQ(0, netstack_destroy(ns));
   netstack_iface_abandon(ni); // we should still be able to use it
 }
+
+// Batched shares by name must match individual shares
+TEST(NameLookup, IfaceShareBatch) {
+  struct copycurry cc = {};
+  cc.name = "";
+  netstack_opts nopts;
+  memset(&nopts, 0, sizeof(nopts));
+  nopts.initial_events = netstack_opts::NETSTACK_INITIAL_EVENTS_BLOCK;
+  nopts.iface_cb = ExternalCB;
+  nopts.iface_curry = &cc;
+  struct netstack* ns = netstack_create(&nopts);
+  ASSERT_NE(nullptr, ns);
+  cc.mlock.lock();
+  std::string name = cc.name;
+  cc.mlock.unlock();
+  const char* names[] = { name.c_str(), "", "no-such-iface-here", };
+  const size_t n = sizeof(names) / sizeof(*names);
+  const netstack_iface* out[n];
+  ASSERT_EQ(1, netstack_iface_share_byname_batch(ns, names, n, out));
+  ASSERT_NE(nullptr, out[0]);
+  EXPECT_EQ(nullptr, out[1]);
+  EXPECT_EQ(nullptr, out[2]);
+  const netstack_iface* ni = netstack_iface_share_byname(ns, name.c_str());
+  EXPECT_EQ(ni, out[0]);
+  netstack_iface_abandon(ni);
+  netstack_stats stats;
+  ASSERT_NE(nullptr, netstack_sample_stats(ns, &stats));
+  EXPECT_EQ(2, stats.lookup_shares);
+  EXPECT_EQ(2, stats.lookup_failures);
+  netstack_iface_abandon(out[0]);
+  ASSERT_EQ(0, netstack_destroy(ns));
+}
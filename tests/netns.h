@@ -0,0 +1,64 @@
+#ifndef LIBNETSTACK_TEST_NETNS
+#define LIBNETSTACK_TEST_NETNS
+
+#include <cstring>
+#include <fcntl.h>
+#include <sched.h>
+#include <unistd.h>
+#include <net/if.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include "main.h"
+
+// Fixture for tests which create links, addresses, routes, rules, and the
+// like. Each runs in a private network namespace containing only lo (brought
+// up), entered by the test's thread before the test body. Threads created
+// by the test (including those of its netstacks) and commands it runs with
+// system() inherit the namespace, so nothing touches the host's, and
+// whatever the test creates disappears along with the namespace, even when
+// it fails partway through. Tests are skipped if the namespace can't be
+// created (this requires CAP_SYS_ADMIN).
+class NetnsTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    hostns = open("/proc/thread-self/ns/net", O_RDONLY | O_CLOEXEC);
+    if(hostns < 0 || unshare(CLONE_NEWNET)){
+      GTEST_SKIP();
+    }
+    entered = true;
+    ASSERT_TRUE(lo_up());
+  }
+
+  // Return to the original namespace. Ours is freed once nothing (e.g. a
+  // netstack leaked by a failed assertion) refers to it.
+  void TearDown() override {
+    if(entered){
+      EXPECT_EQ(0, setns(hostns, CLONE_NEWNET));
+    }
+    if(hostns >= 0){
+      close(hostns);
+    }
+  }
+
+ private:
+  static bool lo_up(){
+    int sd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if(sd < 0){
+      return false;
+    }
+    struct ifreq ifr = {};
+    strcpy(ifr.ifr_name, "lo");
+    bool ret = false;
+    if(ioctl(sd, SIOCGIFFLAGS, &ifr) == 0){
+      ifr.ifr_flags |= IFF_UP;
+      ret = ioctl(sd, SIOCSIFFLAGS, &ifr) == 0;
+    }
+    close(sd);
+    return ret;
+  }
+
+  int hostns = -1;
+  bool entered = false;
+};
+
+#endif
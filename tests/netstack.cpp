@@ -1,4 +1,16 @@
 #include <atomic>
+#include <thread>
+#include <chrono>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <unistd.h>
+#include <net/if.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
 #include "main.h"
 
 TEST(Netstack, CreatenullptrOpts) {
@@ -116,3 +128,72 @@ TEST(Netstack, IfaceCountNoCache) {
   EXPECT_EQ(0, stats.iface_events);
   ASSERT_EQ(0, netstack_destroy(ns));
 }
+
+// The NETLINK_ROUTE ports bound by this process (libnl derives them from our
+// pid), per /proc/net/netlink.
+static std::vector<uint32_t>
+our_route_ports(){
+  std::vector<uint32_t> ports;
+  std::ifstream f("/proc/net/netlink");
+  std::string line;
+  std::getline(f, line); // header
+  while(std::getline(f, line)){
+    std::istringstream ss(line);
+    std::string sk;
+    int proto;
+    uint32_t port;
+    if(ss >> sk >> proto >> port && proto == NETLINK_ROUTE &&
+        (port & 0x3fffffu) == (uint32_t)getpid()){
+      ports.push_back(port);
+    }
+  }
+  return ports;
+}
+
+// An RTM_NEWLINK unicast by some local process rather than the kernel must
+// not make it into the cache, with either receive backend.
+TEST(Netstack, DropForeignUnicast) {
+  for(bool uring : { false, true }){
+    netstack_opts nopts = {};
+    nopts.initial_events = netstack_opts::NETSTACK_INITIAL_EVENTS_BLOCK;
+    nopts.io_uring = uring;
+    struct netstack* ns = netstack_create(&nopts);
+    ASSERT_NE(nullptr, ns);
+    const unsigned count = netstack_iface_count(ns);
+    std::vector<uint32_t> ports = our_route_ports();
+    if(ports.empty()){
+      netstack_destroy(ns);
+      GTEST_SKIP();
+    }
+    const int fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+    ASSERT_LE(0, fd);
+    const int forged = 0x7ffffff0;
+    struct {
+      struct nlmsghdr nh;
+      struct ifinfomsg ifi;
+      struct rtattr rta;
+      char name[IFNAMSIZ];
+    } msg = {};
+    msg.nh.nlmsg_len = sizeof(msg);
+    msg.nh.nlmsg_type = RTM_NEWLINK;
+    msg.ifi.ifi_family = AF_UNSPEC;
+    msg.ifi.ifi_index = forged;
+    msg.ifi.ifi_flags = IFF_UP;
+    msg.rta.rta_type = IFLA_IFNAME;
+    msg.rta.rta_len = RTA_LENGTH(sizeof(msg.name));
+    strcpy(msg.name, "nsforge0");
+    for(uint32_t port : ports){
+      struct sockaddr_nl sa = {};
+      sa.nl_family = AF_NETLINK;
+      sa.nl_pid = port;
+      EXPECT_EQ((ssize_t)sizeof(msg), sendto(fd, &msg, sizeof(msg), 0,
+                (const struct sockaddr*)&sa, sizeof(sa)));
+    }
+    close(fd);
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    EXPECT_EQ(nullptr, netstack_iface_share_byidx(ns, forged));
+    EXPECT_EQ(nullptr, netstack_iface_share_byname(ns, "nsforge0"));
+    EXPECT_EQ(count, netstack_iface_count(ns));
+    ASSERT_EQ(0, netstack_destroy(ns));
+  }
+}
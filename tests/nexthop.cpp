@@ -0,0 +1,204 @@
+#include <thread>
+#include <chrono>
+#include <mutex>
+#include <cstdlib>
+#include <cstring>
+#include <arpa/inet.h>
+#include "netns.h"
+
+// Unit tests for the nexthop object cache and multipath routes. Those adding
+// links and nexthops run in a private network namespace, and are skipped if
+// one can't be created (or without nexthop objects, new in Linux 5.3).
+
+using NexthopNetns = NetnsTest;
+
+TEST(Nexthop, Invalid) {
+  netstack_opts nopts = {};
+  nopts.nexthop_curry = &nopts;
+  EXPECT_EQ(nullptr, netstack_create(&nopts));
+  nopts = {};
+  nopts.initial_events = netstack_opts::NETSTACK_INITIAL_EVENTS_NONE;
+  nopts.nexthop_notrack = true;
+  struct netstack* ns = netstack_create(&nopts);
+  ASSERT_NE(nullptr, ns);
+  EXPECT_EQ(nullptr, netstack_nexthop_share_byid(ns, 4250));
+  EXPECT_EQ(EOPNOTSUPP, errno);
+  EXPECT_EQ(0, netstack_nexthop_count(ns));
+  ASSERT_EQ(0, netstack_destroy(ns));
+}
+
+// What the route callback has seen of our multipath route.
+struct mp_seen {
+  std::mutex lock;
+  unsigned paths;
+  unsigned weights[2];
+};
+
+static void
+route_cb(const netstack_route* nr, netstack_event_e etype, void* vseen){
+  auto seen = static_cast<mp_seen*>(vseen);
+  char dst[INET6_ADDRSTRLEN];
+  unsigned family;
+  if(etype != NETSTACK_MOD || !netstack_route_dststr(nr, dst, sizeof(dst), &family) ||
+     strcmp(dst, "10.252.0.0")){
+    return;
+  }
+  std::lock_guard<std::mutex> guard(seen->lock);
+  netstack_route_nexthop rnh;
+  size_t iter = 0;
+  seen->paths = 0;
+  while(netstack_route_nexthop_next(nr, &iter, &rnh)){
+    if(seen->paths < 2){
+      seen->weights[seen->paths] = rnh.weight;
+    }
+    ++seen->paths;
+  }
+}
+
+// Poll up to a second for pred to be satisfied.
+template<typename P> static bool
+await(P pred){
+  for(int i = 0 ; i < 100 ; ++i){
+    if(pred()){
+      return true;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  return false;
+}
+
+static bool
+resolves_via(struct netstack* ns, const char* dst, const char* gw,
+             netstack_resolution* res){
+  uint32_t d, g;
+  inet_pton(AF_INET, dst, &d);
+  inet_pton(AF_INET, gw, &g);
+  return netstack_resolve(ns, AF_INET, &d, nullptr, 0, 0, res) == 0 &&
+         res->has_gateway && res->gw_family == AF_INET &&
+         !memcmp(res->gateway, &g, sizeof(g));
+}
+
+static bool
+has_nexthop(struct netstack* ns, uint32_t id){
+  const netstack_nexthop* nh = netstack_nexthop_share_byid(ns, id);
+  if(nh){
+    netstack_nexthop_abandon(nh);
+  }
+  return nh;
+}
+
+// Routes using nexthop groups resolve through the cached members, follow
+// replacements of the group, and go away along with the link beneath them.
+TEST_F(NexthopNetns, GroupsAndPurge) {
+  mp_seen seen{};
+  netstack_opts nopts = {};
+  nopts.initial_events = netstack_opts::NETSTACK_INITIAL_EVENTS_BLOCK;
+  nopts.route_cb = route_cb;
+  nopts.route_curry = &seen;
+  struct netstack* ns = netstack_create(&nopts);
+  ASSERT_NE(nullptr, ns);
+  ASSERT_EQ(0, system("ip link add nsnh0 type veth peer name nsnh1 && "
+                      "ip link set nsnh0 up && ip link set nsnh1 up && "
+                      "ip addr add 10.250.0.1/24 dev nsnh0 && "
+                      "ip neigh add 10.250.0.2 lladdr 02:00:00:00:42:50 dev nsnh0"));
+  if(system("ip nexthop add id 4250 via 10.250.0.2 dev nsnh0 2>/dev/null")){
+    netstack_destroy(ns);
+    GTEST_SKIP();
+  }
+  ASSERT_EQ(0, system("ip nexthop add id 4251 via 10.250.0.3 dev nsnh0 && "
+                      "ip nexthop add id 4252 group 4250/4251,3 && "
+                      "ip route add 10.251.0.0/16 nhid 4252 && "
+                      "ip route add 10.252.0.0/16 nexthop via 10.250.0.2 dev nsnh0 "
+                      "nexthop via 10.250.0.3 dev nsnh0 weight 3"));
+  ASSERT_TRUE(await([ns](){ return has_nexthop(ns, 4252); }));
+  const netstack_nexthop* nh = netstack_nexthop_share_byid(ns, 4252);
+  ASSERT_NE(nullptr, nh);
+  EXPECT_EQ(4252, netstack_nexthop_id(nh));
+  ASSERT_EQ(2, netstack_nexthop_groupcount(nh));
+  uint32_t id;
+  unsigned weight;
+  ASSERT_TRUE(netstack_nexthop_group(nh, 1, &id, &weight));
+  EXPECT_EQ(4251, id);
+  EXPECT_EQ(3, weight);
+  EXPECT_FALSE(netstack_nexthop_group(nh, 2, &id, &weight));
+  netstack_nexthop_abandon(nh);
+  nh = netstack_nexthop_share_byid(ns, 4250);
+  ASSERT_NE(nullptr, nh);
+  const int ifindex = netstack_nexthop_oif(nh);
+  EXPECT_NE(0, ifindex);
+  unsigned char gw[16];
+  EXPECT_EQ(AF_INET, netstack_nexthop_gateway(nh, gw));
+  netstack_nexthop_abandon(nh);
+  netstack_resolution res;
+  EXPECT_TRUE(await([&](){ return resolves_via(ns, "10.251.0.1", "10.250.0.2", &res); }));
+  EXPECT_EQ(ifindex, res.oif);
+  EXPECT_EQ(6, res.lladdr_len);
+  EXPECT_TRUE(await([&](){
+    std::lock_guard<std::mutex> guard(seen.lock);
+    return seen.paths == 2;
+  }));
+  {
+    std::lock_guard<std::mutex> guard(seen.lock);
+    EXPECT_EQ(1, seen.weights[0]);
+    EXPECT_EQ(3, seen.weights[1]);
+  }
+  // replacing the group needn't touch the route
+  ASSERT_EQ(0, system("ip nexthop replace id 4252 group 4251"));
+  EXPECT_TRUE(await([&](){ return resolves_via(ns, "10.251.0.1", "10.250.0.3", &res); }));
+  // the kernel flushes the nexthops, the emptied group, and our routes
+  // without a word
+  const unsigned routes = netstack_route_count(ns);
+  ASSERT_EQ(0, system("ip link del nsnh0"));
+  EXPECT_TRUE(await([ns](){ return !has_nexthop(ns, 4250) && !has_nexthop(ns, 4251); }));
+  EXPECT_FALSE(has_nexthop(ns, 4252));
+  EXPECT_TRUE(await([ns, routes](){ return netstack_route_count(ns) < routes; }));
+  uint32_t dst;
+  inet_pton(AF_INET, "10.251.0.1", &dst);
+  if(netstack_resolve(ns, AF_INET, &dst, nullptr, 0, 0, &res) == 0){
+    EXPECT_EQ(0, res.dst_len);
+  }
+  netstack_stats stats;
+  ASSERT_NE(nullptr, netstack_sample_stats(ns, &stats));
+  EXPECT_EQ(netstack_nexthop_count(ns), stats.nexthops);
+  EXPECT_LE(4, stats.nexthop_events);
+  ASSERT_EQ(0, netstack_destroy(ns));
+}
+
+// Deleting a nexthop takes the routes using it along, even after it has been
+// replaced, while leaving those using other nexthops alone.
+TEST_F(NexthopNetns, DeleteTakesUsers) {
+  netstack_opts nopts = {};
+  nopts.initial_events = netstack_opts::NETSTACK_INITIAL_EVENTS_BLOCK;
+  struct netstack* ns = netstack_create(&nopts);
+  ASSERT_NE(nullptr, ns);
+  ASSERT_EQ(0, system("ip link add nsnh0 type veth peer name nsnh1 && "
+                      "ip link set nsnh0 up && ip link set nsnh1 up && "
+                      "ip addr add 10.250.0.1/24 dev nsnh0"));
+  if(system("ip nexthop add id 4250 via 10.250.0.2 dev nsnh0 2>/dev/null")){
+    netstack_destroy(ns);
+    GTEST_SKIP();
+  }
+  const unsigned base = netstack_route_count(ns);
+  FILE* fp = popen("ip -batch -", "w");
+  ASSERT_NE(nullptr, fp);
+  fprintf(fp, "nexthop add id 4251 via 10.250.0.3 dev nsnh0\n");
+  for(int i = 0 ; i < 200 ; ++i){
+    fprintf(fp, "route add 10.251.%d.0/24 nhid %d\n", i, 4250 + i % 2);
+  }
+  ASSERT_EQ(0, pclose(fp));
+  ASSERT_TRUE(await([&](){ return netstack_route_count(ns) >= base + 200; }));
+  ASSERT_EQ(0, system("ip nexthop replace id 4250 via 10.250.0.4 dev nsnh0"));
+  netstack_resolution res;
+  EXPECT_TRUE(await([&](){ return resolves_via(ns, "10.251.0.1", "10.250.0.4", &res); }));
+  const unsigned routes = netstack_route_count(ns);
+  ASSERT_EQ(0, system("ip nexthop del id 4250"));
+  EXPECT_TRUE(await([&](){ return netstack_route_count(ns) == routes - 100; }));
+  EXPECT_EQ(base + 100, netstack_route_count(ns));
+  EXPECT_TRUE(resolves_via(ns, "10.251.1.1", "10.250.0.3", &res));
+  uint32_t dst;
+  inet_pton(AF_INET, "10.251.0.1", &dst);
+  if(netstack_resolve(ns, AF_INET, &dst, nullptr, 0, 0, &res) == 0){
+    EXPECT_NE(24, res.dst_len);
+  }
+  ASSERT_EQ(0, netstack_destroy(ns));
+}
@@ -32,6 +32,22 @@ TEST(NoTrack, NoWorkIsInvalid) {
   EXPECT_EQ(0, netstack_destroy(ns));
   nopts.iface_notrack = true;
   ns = netstack_create(&nopts);
+  ASSERT_NE(nullptr, ns);
+  EXPECT_EQ(0, netstack_destroy(ns));
+  nopts.rule_notrack = true;
+  ns = netstack_create(&nopts);
+  ASSERT_NE(nullptr, ns);
+  EXPECT_EQ(0, netstack_destroy(ns));
+  nopts.nexthop_notrack = true;
+  ns = netstack_create(&nopts);
+  ASSERT_NE(nullptr, ns);
+  EXPECT_EQ(0, netstack_destroy(ns));
+  nopts.fdb_notrack = true;
+  ns = netstack_create(&nopts);
+  ASSERT_NE(nullptr, ns);
+  EXPECT_EQ(0, netstack_destroy(ns));
+  nopts.tc_notrack = true;
+  ns = netstack_create(&nopts);
   ASSERT_EQ(nullptr, ns);
 }
 
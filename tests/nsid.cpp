@@ -0,0 +1,147 @@
+#include <thread>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <linux/net_namespace.h>
+#include "netns.h"
+
+// Unit tests for multiple network namespace support (all_nsids). Those with
+// a peer namespace run in a private network namespace, and are skipped if one
+// can't be created.
+
+#define TESTNSID 7
+#define TESTNSIDSTR "7"
+
+using NsidNetns = NetnsTest;
+
+// Create a peer namespace, and assign it TESTNSID in ours. Returns a
+// descriptor holding the peer open (it is destroyed once this is closed), or
+// -1 on failure.
+static int
+make_peer(){
+  int peer = -1;
+  std::thread([&peer](){
+    if(unshare(CLONE_NEWNET) == 0){
+      peer = open("/proc/thread-self/ns/net", O_RDONLY | O_CLOEXEC);
+    }
+  }).join();
+  if(peer < 0){
+    return -1;
+  }
+  struct {
+    struct nlmsghdr nlh;
+    struct rtgenmsg rtg;
+    char pad[NLMSG_ALIGN(sizeof(struct rtgenmsg)) - sizeof(struct rtgenmsg)];
+    struct rtattr nsidrta;
+    int32_t nsid;
+    struct rtattr fdrta;
+    uint32_t fd;
+  } req = {};
+  req.nlh.nlmsg_len = sizeof(req);
+  req.nlh.nlmsg_type = RTM_NEWNSID;
+  req.rtg.rtgen_family = AF_UNSPEC;
+  req.nsidrta.rta_type = NETNSA_NSID;
+  req.nsidrta.rta_len = RTA_LENGTH(sizeof(req.nsid));
+  req.nsid = TESTNSID;
+  req.fdrta.rta_type = NETNSA_FD;
+  req.fdrta.rta_len = RTA_LENGTH(sizeof(req.fd));
+  req.fd = peer;
+  netstack_opts nopts = {};
+  nopts.initial_events = netstack_opts::NETSTACK_INITIAL_EVENTS_NONE;
+  struct netstack* ns = netstack_create(&nopts);
+  int err = -1;
+  if(ns){
+    struct netstack_request* nreq = netstack_request_submit(ns, &req.nlh, nullptr, nullptr);
+    if(nreq){
+      if(netstack_request_wait(ns, nreq, 1000) == 0){
+        err = netstack_request_error(nreq);
+      }
+      netstack_request_release(nreq);
+    }
+    netstack_destroy(ns);
+  }
+  if(err){
+    close(peer);
+    return -1;
+  }
+  return peer;
+}
+
+// Wait up to a second for the peer namespace's loopback to appear (or vanish).
+static const netstack_iface*
+await_peer_lo(struct netstack* ns, bool present){
+  const netstack_iface* ni = nullptr;
+  for(int i = 0 ; i < 100 ; ++i){
+    ni = netstack_iface_share_byname_nsid(ns, TESTNSID, "lo");
+    if(!ni == !present){
+      break;
+    }
+    if(ni){
+      netstack_iface_abandon(ni);
+      ni = nullptr;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  return ni;
+}
+
+// Without all_nsids, only the local namespace is visible.
+TEST(Nsid, LocalOnlyByDefault) {
+  netstack_opts nopts = {};
+  nopts.initial_events = netstack_opts::NETSTACK_INITIAL_EVENTS_BLOCK;
+  struct netstack* ns = netstack_create(&nopts);
+  ASSERT_NE(nullptr, ns);
+  const netstack_iface* ni = netstack_iface_share_byname(ns, "lo");
+  if(ni){
+    EXPECT_EQ(NETSTACK_NSID_LOCAL, netstack_iface_nsid(ni));
+    const netstack_iface* ni2 = netstack_iface_share_byname_nsid(ns, NETSTACK_NSID_LOCAL, "lo");
+    EXPECT_EQ(ni, ni2);
+    netstack_iface_abandon(ni2);
+    EXPECT_EQ(ni, netstack_iface_share_byidx_nsid(ns, NETSTACK_NSID_LOCAL,
+                                                  netstack_iface_index(ni)));
+    netstack_iface_abandon(ni);
+    netstack_iface_abandon(ni);
+  }
+  EXPECT_EQ(nullptr, netstack_iface_share_byname_nsid(ns, TESTNSID, "lo"));
+  ASSERT_EQ(0, netstack_destroy(ns));
+}
+
+// A namespace with an nsid prior to creation ought be enumerated, and its
+// links forgotten once it is destroyed.
+TEST_F(NsidNetns, PeerNamespace) {
+  const int peer = make_peer();
+  ASSERT_LE(0, peer);
+  netstack_opts nopts = {};
+  nopts.initial_events = netstack_opts::NETSTACK_INITIAL_EVENTS_BLOCK;
+  nopts.all_nsids = true;
+  struct netstack* ns = netstack_create(&nopts);
+  ASSERT_NE(nullptr, ns);
+  const netstack_iface* ni = await_peer_lo(ns, true);
+  ASSERT_NE(nullptr, ni);
+  EXPECT_EQ(TESTNSID, netstack_iface_nsid(ni));
+  const netstack_iface* ni2 = netstack_iface_share_byidx_nsid(ns, TESTNSID,
+                                                  netstack_iface_index(ni));
+  EXPECT_EQ(ni, ni2);
+  netstack_iface_abandon(ni2);
+  // our sysfs knows nothing of the peer's links, whatever their names
+  EXPECT_EQ(nullptr, netstack_iface_topology(ns, ni));
+  EXPECT_EQ(nullptr, netstack_iface_topology_refresh(ns, ni));
+  netstack_iface* nicopy = netstack_iface_copy_byname_nsid(ns, TESTNSID, "lo");
+  ASSERT_NE(nullptr, nicopy);
+  EXPECT_EQ(TESTNSID, netstack_iface_nsid(nicopy));
+  EXPECT_EQ(netstack_iface_index(ni), netstack_iface_index(nicopy));
+  netstack_iface_abandon(nicopy);
+  netstack_iface_abandon(ni);
+  // both loopbacks are exposed, distinguished by nsid
+  std::vector<char> buf(netstack_write_metrics(ns, nullptr, 0) * 2 + 1);
+  ASSERT_LT(0, netstack_write_metrics(ns, buf.data(), buf.size()));
+  const std::string text(buf.data());
+  EXPECT_NE(std::string::npos, text.find("netstack_iface_rx_bytes_total{iface=\"lo\",ifindex=\"1\"}"));
+  EXPECT_NE(std::string::npos, text.find("netstack_iface_rx_bytes_total{iface=\"lo\",ifindex=\"1\","
+                                         "nsid=\"" TESTNSIDSTR "\"}"));
+  close(peer);
+  EXPECT_EQ(nullptr, await_peer_lo(ns, false));
+  ASSERT_EQ(0, netstack_destroy(ns));
+}
@@ -0,0 +1,149 @@
+#include <poll.h>
+#include <thread>
+#include <chrono>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include "main.h"
+
+// Unit tests for link stats sampling and rate derivation
+
+// Send some datagrams over loopback, so its counters advance.
+static void
+loopback_traffic(int count){
+  int fd = socket(AF_INET, SOCK_DGRAM, 0);
+  ASSERT_LE(0, fd);
+  struct sockaddr_in sin = {};
+  sin.sin_family = AF_INET;
+  sin.sin_port = htons(9); // discard
+  sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  char buf[100] = {};
+  for(int i = 0 ; i < count ; ++i){
+    sendto(fd, buf, sizeof(buf), 0, (const struct sockaddr*)&sin, sizeof(sin));
+  }
+  close(fd);
+}
+
+static int
+loopback_index(struct netstack* ns){
+  const netstack_iface* ni = netstack_iface_share_byname(ns, "lo");
+  if(ni == nullptr){
+    return -1;
+  }
+  int idx = netstack_iface_index(ni);
+  netstack_iface_abandon(ni);
+  return idx;
+}
+
+TEST(Rates, DepthBounded) {
+  netstack_opts nopts = {};
+  nopts.initial_events = netstack_opts::NETSTACK_INITIAL_EVENTS_NONE;
+  nopts.sample_depth = NETSTACK_SAMPLE_DEPTH_MAX + 1;
+  EXPECT_EQ(nullptr, netstack_create(&nopts));
+  nopts.sample_depth = NETSTACK_SAMPLE_DEPTH_MAX;
+  struct netstack* ns = netstack_create(&nopts);
+  ASSERT_NE(nullptr, ns);
+  ASSERT_EQ(0, netstack_destroy(ns));
+}
+
+TEST(Rates, NoneWithoutSamples) {
+  netstack_opts nopts = {};
+  nopts.initial_events = netstack_opts::NETSTACK_INITIAL_EVENTS_BLOCK;
+  struct netstack* ns = netstack_create(&nopts);
+  ASSERT_NE(nullptr, ns);
+  int idx = loopback_index(ns);
+  if(idx < 0){
+    netstack_destroy(ns);
+    GTEST_SKIP();
+  }
+  ASSERT_EQ(0, netstack_iface_stats_refresh_sync(ns, idx, 1000));
+  ASSERT_EQ(0, netstack_iface_stats_refresh_sync(ns, idx, 1000));
+  netstack_rates rates;
+  EXPECT_EQ(-1, netstack_iface_rates(ns, idx, 0, &rates));
+  ASSERT_EQ(0, netstack_destroy(ns));
+}
+
+// sample_depth alone retains the samples of synchronous refreshes.
+TEST(Rates, FromRefreshes) {
+  netstack_opts nopts = {};
+  nopts.initial_events = netstack_opts::NETSTACK_INITIAL_EVENTS_BLOCK;
+  nopts.sample_depth = 4;
+  struct netstack* ns = netstack_create(&nopts);
+  ASSERT_NE(nullptr, ns);
+  int idx = loopback_index(ns);
+  if(idx < 0){
+    netstack_destroy(ns);
+    GTEST_SKIP();
+  }
+  netstack_rates rates;
+  ASSERT_EQ(0, netstack_iface_stats_refresh_sync(ns, idx, 1000));
+  EXPECT_EQ(-1, netstack_iface_rates(ns, idx, 0, &rates));
+  loopback_traffic(16);
+  std::this_thread::sleep_for(std::chrono::milliseconds(5));
+  ASSERT_EQ(0, netstack_iface_stats_refresh_sync(ns, idx, 1000));
+  ASSERT_EQ(0, netstack_iface_rates(ns, idx, 0, &rates));
+  EXPECT_EQ(2, rates.samples);
+  EXPECT_LT(0, rates.nsec);
+  EXPECT_LT(0, rates.tx_pps);
+  EXPECT_LT(0, rates.tx_bps);
+  EXPECT_LE(0, rates.rx_drops_ps);
+  // only depth samples are retained
+  for(int i = 0 ; i < 6 ; ++i){
+    ASSERT_EQ(0, netstack_iface_stats_refresh_sync(ns, idx, 1000));
+  }
+  ASSERT_EQ(0, netstack_iface_rates(ns, idx, 0, &rates));
+  EXPECT_EQ(4, rates.samples);
+  ASSERT_EQ(0, netstack_destroy(ns));
+}
+
+TEST(Rates, SamplerThread) {
+  netstack_opts nopts = {};
+  nopts.initial_events = netstack_opts::NETSTACK_INITIAL_EVENTS_BLOCK;
+  nopts.sample_interval_ms = 5;
+  struct netstack* ns = netstack_create(&nopts);
+  ASSERT_NE(nullptr, ns);
+  int idx = loopback_index(ns);
+  if(idx < 0){
+    netstack_destroy(ns);
+    GTEST_SKIP();
+  }
+  netstack_rates rates;
+  int r = -1;
+  for(int i = 0 ; i < 200 && r ; ++i){
+    loopback_traffic(1);
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    r = netstack_iface_rates(ns, idx, 1000, &rates);
+  }
+  ASSERT_EQ(0, r);
+  EXPECT_LE(2, rates.samples);
+  EXPECT_GE(NETSTACK_SAMPLE_DEPTH_DEFAULT, rates.samples);
+  ASSERT_EQ(0, netstack_destroy(ns));
+}
+
+// Threadless sampling is driven by netstack_process().
+TEST(Rates, SamplerThreadless) {
+  netstack_opts nopts = {};
+  nopts.initial_events = netstack_opts::NETSTACK_INITIAL_EVENTS_BLOCK;
+  nopts.threadless = true;
+  nopts.sample_interval_ms = 5;
+  struct netstack* ns = netstack_create(&nopts);
+  ASSERT_NE(nullptr, ns);
+  int idx = loopback_index(ns);
+  if(idx < 0){
+    netstack_destroy(ns);
+    GTEST_SKIP();
+  }
+  struct pollfd pfd = {};
+  pfd.fd = netstack_get_fd(ns);
+  pfd.events = POLLIN;
+  netstack_rates rates;
+  int r = -1;
+  for(int i = 0 ; i < 200 && r ; ++i){
+    poll(&pfd, 1, 5);
+    ASSERT_LE(0, netstack_process(ns, 0));
+    r = netstack_iface_rates(ns, idx, 0, &rates);
+  }
+  ASSERT_EQ(0, r);
+  EXPECT_LE(2, rates.samples);
+  ASSERT_EQ(0, netstack_destroy(ns));
+}
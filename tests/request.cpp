@@ -0,0 +1,245 @@
+#include <poll.h>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <linux/if_link.h>
+#include "main.h"
+
+// Unit tests for the request engine (netstack_request_submit())
+
+// A message of type, with a single payload of T (and no attributes).
+template<typename T>
+struct rtmsgbuf {
+  struct nlmsghdr nlh;
+  T body;
+};
+
+template<typename T>
+static rtmsgbuf<T>
+make_request(int type, int flags){
+  rtmsgbuf<T> r;
+  memset(&r, 0, sizeof(r));
+  r.nlh.nlmsg_len = NLMSG_LENGTH(sizeof(T));
+  r.nlh.nlmsg_type = type;
+  r.nlh.nlmsg_flags = flags;
+  return r;
+}
+
+static int
+loopback_index(struct netstack* ns){
+  const netstack_iface* ni = netstack_iface_share_byname(ns, "lo");
+  if(ni == nullptr){
+    return -1;
+  }
+  int idx = netstack_iface_index(ni);
+  netstack_iface_abandon(ni);
+  return idx;
+}
+
+TEST(Request, InvalidMessage) {
+  netstack_opts nopts = {};
+  nopts.initial_events = netstack_opts::NETSTACK_INITIAL_EVENTS_NONE;
+  struct netstack* ns = netstack_create(&nopts);
+  ASSERT_NE(nullptr, ns);
+  EXPECT_EQ(nullptr, netstack_request_submit(ns, nullptr, nullptr, nullptr));
+  struct nlmsghdr nlh = {};
+  EXPECT_EQ(nullptr, netstack_request_submit(ns, &nlh, nullptr, nullptr));
+  ASSERT_EQ(0, netstack_destroy(ns));
+}
+
+// A non-dump request is completed by its acknowledgement.
+TEST(Request, Acknowledged) {
+  netstack_opts nopts = {};
+  nopts.initial_events = netstack_opts::NETSTACK_INITIAL_EVENTS_BLOCK;
+  struct netstack* ns = netstack_create(&nopts);
+  ASSERT_NE(nullptr, ns);
+  int idx = loopback_index(ns);
+  if(idx < 0){
+    netstack_destroy(ns);
+    GTEST_SKIP();
+  }
+  auto msg = make_request<struct ifinfomsg>(RTM_GETLINK, 0);
+  msg.body.ifi_index = idx;
+  struct netstack_request* req = netstack_request_submit(ns, &msg.nlh, nullptr, nullptr);
+  ASSERT_NE(nullptr, req);
+  ASSERT_EQ(0, netstack_request_wait(ns, req, 1000));
+  EXPECT_TRUE(netstack_request_done(req));
+  EXPECT_EQ(0, netstack_request_error(req));
+  EXPECT_EQ(-1, netstack_request_extack_offset(req));
+  netstack_request_release(req);
+  ASSERT_EQ(0, netstack_destroy(ns));
+}
+
+// Failures carry the errno, and the extended ack where the kernel has one
+// (RTM_GETSTATS without a filter mask is rejected with a message).
+TEST(Request, ErrorWithExtack) {
+  netstack_opts nopts = {};
+  nopts.initial_events = netstack_opts::NETSTACK_INITIAL_EVENTS_BLOCK;
+  struct netstack* ns = netstack_create(&nopts);
+  ASSERT_NE(nullptr, ns);
+  int idx = loopback_index(ns);
+  if(idx < 0){
+    netstack_destroy(ns);
+    GTEST_SKIP();
+  }
+  auto msg = make_request<struct if_stats_msg>(RTM_GETSTATS, 0);
+  msg.body.ifindex = idx;
+  struct netstack_request* req = netstack_request_submit(ns, &msg.nlh, nullptr, nullptr);
+  ASSERT_NE(nullptr, req);
+  ASSERT_EQ(0, netstack_request_wait(ns, req, 1000));
+  EXPECT_EQ(-EINVAL, netstack_request_error(req));
+  const char* extack = netstack_request_extack(req);
+  if(extack){
+    EXPECT_LT(0, strlen(extack));
+  }
+  netstack_request_release(req);
+  ASSERT_EQ(0, netstack_destroy(ns));
+}
+
+// More requests than can be on the wire at once must all complete, in
+// order, each invoking its callback exactly once.
+TEST(Request, Pipelined) {
+  netstack_opts nopts = {};
+  nopts.initial_events = netstack_opts::NETSTACK_INITIAL_EVENTS_BLOCK;
+  struct netstack* ns = netstack_create(&nopts);
+  ASSERT_NE(nullptr, ns);
+  int idx = loopback_index(ns);
+  if(idx < 0){
+    netstack_destroy(ns);
+    GTEST_SKIP();
+  }
+  const int count = 300;
+  std::atomic<int> completions(0);
+  struct netstack_request* reqs[count];
+  // these have small answers, lest we overrun our receive buffer
+  auto msg = make_request<struct if_stats_msg>(RTM_GETSTATS, 0);
+  msg.body.ifindex = idx;
+  msg.body.filter_mask = IFLA_STATS_FILTER_BIT(IFLA_STATS_LINK_64);
+  netstack_request_cb cb = [](struct netstack*, const struct netstack_request* req, void* vc){
+    auto c = static_cast<std::atomic<int>*>(vc);
+    if(netstack_request_error(req) == 0){
+      ++*c;
+    }
+  };
+  for(int i = 0 ; i < count ; ++i){
+    reqs[i] = netstack_request_submit(ns, &msg.nlh, cb, &completions);
+    ASSERT_NE(nullptr, reqs[i]);
+  }
+  // a dump in the midst of them must be sent and completed as well
+  auto dump = make_request<struct rtgenmsg>(RTM_GETLINK, NLM_F_DUMP);
+  struct netstack_request* dreq = netstack_request_submit(ns, &dump.nlh, nullptr, nullptr);
+  ASSERT_NE(nullptr, dreq);
+  ASSERT_EQ(0, netstack_request_wait(ns, reqs[count - 1], 5000));
+  ASSERT_EQ(0, netstack_request_wait(ns, dreq, 5000));
+  EXPECT_EQ(0, netstack_request_error(dreq));
+  netstack_request_release(dreq);
+  for(int i = 0 ; i < count ; ++i){
+    EXPECT_TRUE(netstack_request_done(reqs[i]));
+    EXPECT_EQ(0, netstack_request_error(reqs[i]));
+    netstack_request_release(reqs[i]);
+  }
+  // callbacks can trail completion slightly
+  ASSERT_EQ(0, netstack_destroy(ns));
+  EXPECT_EQ(count, completions.load());
+}
+
+TEST(Request, Threadless) {
+  netstack_opts nopts = {};
+  nopts.initial_events = netstack_opts::NETSTACK_INITIAL_EVENTS_BLOCK;
+  nopts.threadless = true;
+  struct netstack* ns = netstack_create(&nopts);
+  ASSERT_NE(nullptr, ns);
+  int idx = loopback_index(ns);
+  if(idx < 0){
+    netstack_destroy(ns);
+    GTEST_SKIP();
+  }
+  auto msg = make_request<struct ifinfomsg>(RTM_GETLINK, 0);
+  msg.body.ifi_index = idx;
+  bool called = false;
+  netstack_request_cb cb = [](struct netstack*, const struct netstack_request*, void* vb){
+    *static_cast<bool*>(vb) = true;
+  };
+  struct netstack_request* req = netstack_request_submit(ns, &msg.nlh, cb, &called);
+  ASSERT_NE(nullptr, req);
+  EXPECT_FALSE(called);
+  ASSERT_EQ(0, netstack_request_wait(ns, req, 1000));
+  EXPECT_EQ(0, netstack_request_error(req));
+  EXPECT_TRUE(called);
+  netstack_request_release(req);
+  ASSERT_EQ(0, netstack_destroy(ns));
+}
+
+// Waiting on the kernel from a callback (on a netstack thread, or within
+// netstack_process()) fails with EDEADLK rather than hanging.
+TEST(Request, WaitFromCallback) {
+  for(int threadless = 0 ; threadless < 2 ; ++threadless){
+    netstack_opts nopts = {};
+    nopts.initial_events = netstack_opts::NETSTACK_INITIAL_EVENTS_BLOCK;
+    nopts.threadless = threadless;
+    struct netstack* ns = netstack_create(&nopts);
+    ASSERT_NE(nullptr, ns);
+    int idx = loopback_index(ns);
+    if(idx < 0){
+      netstack_destroy(ns);
+      GTEST_SKIP();
+    }
+    auto msg = make_request<struct ifinfomsg>(RTM_GETLINK, 0);
+    msg.body.ifi_index = idx;
+    struct waits {
+      const struct netstack_request* req;
+      int wait, refresh, batch, process;
+    } w = {};
+    netstack_request_cb cb = [](struct netstack* cns, const struct netstack_request* r, void* vw){
+      auto cw = static_cast<waits*>(vw);
+      errno = 0;
+      if(netstack_request_wait(cns, r, 1000) == -1){
+        cw->wait = errno;
+      }
+      errno = 0;
+      if(netstack_iface_stats_refresh_sync(cns, 0, 1000) == -1){
+        cw->refresh = errno;
+      }
+      errno = 0;
+      if(netstack_route_add_batch(cns, nullptr, 0, 0, nullptr) == -1){
+        cw->batch = errno;
+      }
+      errno = 0;
+      if(netstack_process(cns, 0) == -1){
+        cw->process = errno;
+      }
+    };
+    struct netstack_request* req = netstack_request_submit(ns, &msg.nlh, cb, &w);
+    ASSERT_NE(nullptr, req);
+    ASSERT_EQ(0, netstack_request_wait(ns, req, 1000));
+    netstack_request_release(req);
+    ASSERT_EQ(0, netstack_destroy(ns));
+    EXPECT_EQ(EDEADLK, w.wait);
+    EXPECT_EQ(EDEADLK, w.refresh);
+    EXPECT_EQ(EDEADLK, w.batch);
+    // netstack_process() is only for threadless netstacks
+    EXPECT_EQ(threadless ? EDEADLK : EINVAL, w.process);
+  }
+}
+
+// Handles survive the netstack, whose destruction completes any requests.
+TEST(Request, OutlivesNetstack) {
+  netstack_opts nopts = {};
+  nopts.initial_events = netstack_opts::NETSTACK_INITIAL_EVENTS_NONE;
+  nopts.threadless = true;
+  struct netstack* ns = netstack_create(&nopts);
+  ASSERT_NE(nullptr, ns);
+  auto dump = make_request<struct rtgenmsg>(RTM_GETLINK, NLM_F_DUMP);
+  struct netstack_request* dreq = netstack_request_submit(ns, &dump.nlh, nullptr, nullptr);
+  ASSERT_NE(nullptr, dreq);
+  struct netstack_request* dreq2 = netstack_request_submit(ns, &dump.nlh, nullptr, nullptr);
+  ASSERT_NE(nullptr, dreq2);
+  EXPECT_FALSE(netstack_request_done(dreq2));
+  EXPECT_EQ(-EINPROGRESS, netstack_request_error(dreq2));
+  ASSERT_EQ(0, netstack_destroy(ns));
+  EXPECT_TRUE(netstack_request_done(dreq));
+  EXPECT_TRUE(netstack_request_done(dreq2));
+  EXPECT_EQ(-ECANCELED, netstack_request_error(dreq2));
+  netstack_request_release(dreq);
+  netstack_request_release(dreq2);
+}
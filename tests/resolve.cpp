@@ -0,0 +1,192 @@
+#include <thread>
+#include <chrono>
+#include <cstdlib>
+#include <arpa/inet.h>
+#include <linux/neighbour.h>
+#include "netns.h"
+
+// Unit tests for resolution against the route and neighbor caches. Those
+// building a topology run in a private network namespace, and are skipped if
+// one can't be created.
+
+using ResolveNetns = NetnsTest;
+
+TEST(Resolve, Invalid) {
+  netstack_opts nopts = {};
+  nopts.initial_events = netstack_opts::NETSTACK_INITIAL_EVENTS_NONE;
+  struct netstack* ns = netstack_create(&nopts);
+  ASSERT_NE(nullptr, ns);
+  netstack_resolution res;
+  uint32_t dst = htonl(INADDR_LOOPBACK);
+  EXPECT_EQ(-1, netstack_resolve(ns, AF_UNIX, &dst, nullptr, 0, 0, &res));
+  EXPECT_EQ(EINVAL, errno);
+  EXPECT_EQ(-1, netstack_resolve(ns, AF_INET, &dst, nullptr, 0, 0, &res));
+  EXPECT_EQ(ENETUNREACH, errno);
+  ASSERT_EQ(0, netstack_destroy(ns));
+  nopts.route_notrack = true;
+  nopts.iface_cb = [](const netstack_iface*, netstack_event_e, void*){};
+  ns = netstack_create(&nopts);
+  ASSERT_NE(nullptr, ns);
+  EXPECT_EQ(-1, netstack_resolve(ns, AF_INET, &dst, nullptr, 0, 0, &res));
+  EXPECT_EQ(EOPNOTSUPP, errno);
+  EXPECT_EQ(0, netstack_route_count(ns));
+  ASSERT_EQ(0, netstack_destroy(ns));
+}
+
+// 127.0.0.1 is found in the local table, on lo.
+TEST(Resolve, Loopback) {
+  netstack_opts nopts = {};
+  nopts.initial_events = netstack_opts::NETSTACK_INITIAL_EVENTS_BLOCK;
+  struct netstack* ns = netstack_create(&nopts);
+  ASSERT_NE(nullptr, ns);
+  const netstack_iface* lo = netstack_iface_share_byname(ns, "lo");
+  if(lo == nullptr || !netstack_iface_up(lo)){
+    netstack_iface_abandon(lo);
+    netstack_destroy(ns);
+    GTEST_SKIP();
+  }
+  EXPECT_LT(0, netstack_route_count(ns));
+  netstack_resolution res;
+  uint32_t dst = htonl(INADDR_LOOPBACK);
+  ASSERT_EQ(0, netstack_resolve(ns, AF_INET, &dst, nullptr, 0, 0, &res));
+  EXPECT_EQ(RTN_LOCAL, res.type);
+  EXPECT_EQ(RT_TABLE_LOCAL, res.table);
+  EXPECT_EQ(netstack_iface_index(lo), res.oif);
+  EXPECT_FALSE(res.has_gateway);
+  netstack_iface_abandon(lo);
+  ASSERT_EQ(0, netstack_destroy(ns));
+}
+
+// Poll up to a second for the resolution of dst to satisfy pred.
+template<typename P> static bool
+await_resolution(struct netstack* ns, const char* dst, netstack_resolution* res, P pred){
+  uint32_t addr;
+  inet_pton(AF_INET, dst, &addr);
+  for(int i = 0 ; i < 100 ; ++i){
+    if(netstack_resolve(ns, AF_INET, &addr, nullptr, 0, 0, res) == 0 && pred(*res)){
+      return true;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  return false;
+}
+
+// Build a veth with a gateway behind it, and follow routes through it to the
+// gateway's neighbor entry. A more specific blackhole takes precedence.
+TEST_F(ResolveNetns, GatewayNeighbor) {
+  netstack_opts nopts = {};
+  nopts.initial_events = netstack_opts::NETSTACK_INITIAL_EVENTS_BLOCK;
+  struct netstack* ns = netstack_create(&nopts);
+  ASSERT_NE(nullptr, ns);
+  ASSERT_EQ(0, system("ip link add nsrv0 type veth peer name nsrv1 && "
+                      "ip link set nsrv0 up && ip link set nsrv1 up && "
+                      "ip addr add 10.244.0.1/24 dev nsrv0 && "
+                      "ip neigh replace 10.244.0.2 lladdr 02:00:00:00:00:02 nud permanent dev nsrv0 && "
+                      "ip route add 10.245.0.0/16 via 10.244.0.2 && "
+                      "ip route add blackhole 10.245.1.0/24"));
+  const netstack_iface* ni = nullptr;
+  for(int i = 0 ; i < 100 && !ni ; ++i){
+    if(!(ni = netstack_iface_share_byname(ns, "nsrv0"))){
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+  }
+  ASSERT_NE(nullptr, ni);
+  const int oif = netstack_iface_index(ni);
+  netstack_iface_abandon(ni);
+  netstack_resolution res;
+  EXPECT_TRUE(await_resolution(ns, "10.245.2.3", &res, [](const netstack_resolution& r){
+    return r.nud_state != 0;
+  }));
+  EXPECT_EQ(RTN_UNICAST, res.type);
+  EXPECT_EQ(RT_TABLE_MAIN, res.table);
+  EXPECT_EQ(16, res.dst_len);
+  EXPECT_EQ(oif, res.oif);
+  ASSERT_TRUE(res.has_gateway);
+  uint32_t gw;
+  inet_pton(AF_INET, "10.244.0.2", &gw);
+  EXPECT_EQ(0, memcmp(&gw, res.gateway, sizeof(gw)));
+  EXPECT_EQ(NUD_PERMANENT, res.nud_state);
+  ASSERT_EQ(6, res.lladdr_len);
+  EXPECT_EQ(2, res.lladdr[5]);
+  EXPECT_TRUE(await_resolution(ns, "10.245.1.3", &res, [](const netstack_resolution& r){
+    return r.type == RTN_BLACKHOLE;
+  }));
+  EXPECT_EQ(24, res.dst_len);
+  // on-link destinations are their own next hop
+  EXPECT_TRUE(await_resolution(ns, "10.244.0.2", &res, [](const netstack_resolution& r){
+    return r.nud_state != 0;
+  }));
+  EXPECT_FALSE(res.has_gateway);
+  EXPECT_EQ(oif, res.oif);
+  EXPECT_EQ(24, res.dst_len);
+  ASSERT_EQ(0, system("ip route del blackhole 10.245.1.0/24"));
+  EXPECT_TRUE(await_resolution(ns, "10.245.1.3", &res, [](const netstack_resolution& r){
+    return r.type == RTN_UNICAST;
+  }));
+  ASSERT_EQ(0, system("ip link del nsrv0"));
+  EXPECT_TRUE(await_resolution(ns, "10.245.2.3", &res, [](const netstack_resolution& r){
+    return r.table != RT_TABLE_MAIN || r.dst_len != 16;
+  }) || errno == ENETUNREACH);
+  ASSERT_EQ(0, netstack_destroy(ns));
+}
+
+// Poll up to a second for the route count to reach n.
+static bool
+await_routes(struct netstack* ns, unsigned n){
+  for(int i = 0 ; i < 100 ; ++i){
+    if(netstack_route_count(ns) == n){
+      return true;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  return false;
+}
+
+// IPv4 routes differing only in their first hop are cached alongside one
+// another. Nexthops on a link without carrier are flagged linkdown, and
+// skipped, whether those of a sibling or of a multipath route.
+TEST_F(ResolveNetns, SiblingsAndLinkdown) {
+  // keep IPv6's link-local routes out of the count
+  ASSERT_EQ(0, system("sysctl -qw net.ipv6.conf.default.disable_ipv6=1"));
+  ASSERT_EQ(0, system("ip link add nsra0 type veth peer name nsra1 && "
+                      "ip link add nsrb0 type veth peer name nsrb1 && "
+                      "ip link set nsra0 up && "
+                      "ip link set nsrb0 up && ip link set nsrb1 up"));
+  netstack_opts nopts = {};
+  nopts.initial_events = netstack_opts::NETSTACK_INITIAL_EVENTS_BLOCK;
+  struct netstack* ns = netstack_create(&nopts);
+  ASSERT_NE(nullptr, ns);
+  const unsigned base = netstack_route_count(ns);
+  const int aidx = if_nametoindex("nsra0");
+  const int bidx = if_nametoindex("nsrb0");
+  ASSERT_NE(0, aidx);
+  ASSERT_NE(0, bidx);
+  ASSERT_EQ(0, system("ip route add 10.246.0.0/24 dev nsra0 && "
+                      "ip route append 10.246.0.0/24 dev nsrb0 && "
+                      "ip route add 10.247.0.0/24 nexthop dev nsra0 nexthop dev nsrb0"));
+  ASSERT_TRUE(await_routes(ns, base + 3));
+  netstack_resolution res;
+  ASSERT_TRUE(await_resolution(ns, "10.246.0.5", &res, [](const netstack_resolution& r){
+    return r.oif != 0;
+  }));
+  EXPECT_EQ(bidx, res.oif);
+  ASSERT_TRUE(await_resolution(ns, "10.247.0.5", &res, [](const netstack_resolution& r){
+    return r.oif != 0;
+  }));
+  EXPECT_EQ(bidx, res.oif);
+  // deleting one sibling leaves the other, the linkdown route
+  ASSERT_EQ(0, system("ip route del 10.246.0.0/24 dev nsrb0"));
+  ASSERT_TRUE(await_routes(ns, base + 2));
+  uint32_t dst;
+  inet_pton(AF_INET, "10.246.0.5", &dst);
+  EXPECT_EQ(-1, netstack_resolve(ns, AF_INET, &dst, nullptr, 0, 0, &res));
+  EXPECT_EQ(ENETUNREACH, errno);
+  // a replacement takes the place of the first sibling
+  ASSERT_EQ(0, system("ip route replace 10.246.0.0/24 dev nsrb0"));
+  ASSERT_TRUE(await_resolution(ns, "10.246.0.5", &res, [](const netstack_resolution& r){
+    return r.oif != 0;
+  }));
+  EXPECT_EQ(bidx, res.oif);
+  EXPECT_EQ(base + 2, netstack_route_count(ns));
+  ASSERT_EQ(0, netstack_destroy(ns));
+}
@@ -0,0 +1,249 @@
+#include <thread>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <cstdlib>
+#include <net/if.h>
+#include <arpa/inet.h>
+#include "netns.h"
+
+// Unit tests for the policy routing rule cache. Those adding rules run in a
+// private network namespace, and are skipped if one can't be created.
+
+using RuleNetns = NetnsTest;
+
+TEST(Rule, Invalid) {
+  netstack_opts nopts = {};
+  nopts.rule_curry = &nopts;
+  EXPECT_EQ(nullptr, netstack_create(&nopts));
+  nopts = {};
+  nopts.initial_events = netstack_opts::NETSTACK_INITIAL_EVENTS_NONE;
+  nopts.rule_notrack = true;
+  struct netstack* ns = netstack_create(&nopts);
+  ASSERT_NE(nullptr, ns);
+  uint32_t dst = htonl(INADDR_LOOPBACK);
+  EXPECT_EQ(nullptr, netstack_rule_match(ns, AF_UNIX, nullptr, &dst, 0, 0, 0));
+  EXPECT_EQ(EINVAL, errno);
+  EXPECT_EQ(nullptr, netstack_rule_match(ns, AF_INET, nullptr, &dst, 0, 0, 0));
+  EXPECT_EQ(EOPNOTSUPP, errno);
+  EXPECT_EQ(0, netstack_rule_count(ns));
+  ASSERT_EQ(0, netstack_destroy(ns));
+}
+
+// Every namespace starts out with the local, main, and default rules, in
+// that order, and local traffic is matched by the first of them.
+TEST(Rule, Defaults) {
+  netstack_opts nopts = {};
+  nopts.initial_events = netstack_opts::NETSTACK_INITIAL_EVENTS_BLOCK;
+  struct netstack* ns = netstack_create(&nopts);
+  ASSERT_NE(nullptr, ns);
+  EXPECT_LE(3, netstack_rule_count(ns));
+  netstack_stats stats;
+  ASSERT_NE(nullptr, netstack_sample_stats(ns, &stats));
+  EXPECT_EQ(netstack_rule_count(ns), stats.rules);
+  EXPECT_LE(stats.rules, stats.rule_events);
+  uint32_t dst = htonl(INADDR_LOOPBACK);
+  const netstack_rule* nr = netstack_rule_match(ns, AF_INET, nullptr, &dst, 0, 0, 0);
+  ASSERT_NE(nullptr, nr);
+  EXPECT_EQ(AF_INET, netstack_rule_family(nr));
+  EXPECT_EQ(NETSTACK_NSID_LOCAL, netstack_rule_nsid(nr));
+  EXPECT_EQ(0, netstack_rule_priority(nr));
+  EXPECT_EQ(FR_ACT_TO_TBL, netstack_rule_action(nr));
+  EXPECT_EQ(RT_TABLE_LOCAL, netstack_rule_table(nr));
+  netstack_rule_abandon(nr);
+  ASSERT_EQ(0, netstack_destroy(ns));
+}
+
+// What the callback has seen of our rules.
+struct rule_seen {
+  std::mutex lock;
+  bool marked, ifnamed;
+  uint32_t mark, mask;
+  std::string iifname;
+};
+
+static void
+rule_cb(const netstack_rule* nr, netstack_event_e etype, void* vseen){
+  auto seen = static_cast<rule_seen*>(vseen);
+  std::lock_guard<std::mutex> guard(seen->lock);
+  if(etype != NETSTACK_MOD){
+    return;
+  }
+  if(netstack_rule_priority(nr) == 4240){
+    seen->marked = netstack_rule_fwmark(nr, &seen->mark, &seen->mask);
+  }else if(netstack_rule_priority(nr) == 4242){
+    char name[IFNAMSIZ];
+    if( (seen->ifnamed = netstack_rule_iifname(nr, name)) ){
+      seen->iifname = name;
+    }
+  }
+}
+
+// Poll up to a second for the resolution of dst to satisfy pred.
+template<typename P> static bool
+await_resolution(struct netstack* ns, const char* src, const char* dst,
+                 uint32_t mark, netstack_resolution* res, P pred){
+  uint32_t s, d;
+  inet_pton(AF_INET, src, &s);
+  inet_pton(AF_INET, dst, &d);
+  for(int i = 0 ; i < 100 ; ++i){
+    if(netstack_resolve(ns, AF_INET, &d, &s, mark, 0, res) == 0 && pred(*res)){
+      return true;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  return false;
+}
+
+// Rules selecting on marks, prefixes, and interfaces steer resolution into
+// their tables in order of priority (the local table having nothing for
+// these destinations), and are forgotten once deleted.
+TEST_F(RuleNetns, MatchAndResolve) {
+  rule_seen seen{};
+  netstack_opts nopts = {};
+  nopts.initial_events = netstack_opts::NETSTACK_INITIAL_EVENTS_BLOCK;
+  nopts.rule_cb = rule_cb;
+  nopts.rule_curry = &seen;
+  struct netstack* ns = netstack_create(&nopts);
+  ASSERT_NE(nullptr, ns);
+  const unsigned base = netstack_rule_count(ns);
+  ASSERT_EQ(0, system("ip rule add priority 4240 fwmark 0x10/0xf0 lookup 4240 && "
+                      "ip rule add priority 4241 from 10.246.0.0/16 lookup 4241 && "
+                      "ip rule add priority 4242 to 10.247.0.0/16 iif lo blackhole && "
+                      "ip rule add priority 4243 not to 10.248.0.0/16 fwmark 0x20 goto 4245 && "
+                      "ip rule add priority 4244 fwmark 0x20 prohibit && "
+                      "ip rule add priority 4245 fwmark 0x20 lookup 4245 && "
+                      "ip route add blackhole 10.249.0.0/16 table 4240 && "
+                      "ip route add prohibit 10.249.0.0/16 table 4241 && "
+                      "ip route add unreachable 10.249.0.0/16 table 4245"));
+  netstack_resolution res;
+  // the mark is masked before comparison
+  EXPECT_TRUE(await_resolution(ns, "0.0.0.0", "10.249.0.1", 0x1f, &res,
+                               [](const netstack_resolution& r){
+    return r.table == 4240;
+  }));
+  EXPECT_EQ(RTN_BLACKHOLE, res.type);
+  EXPECT_EQ(16, res.dst_len);
+  EXPECT_TRUE(await_resolution(ns, "10.246.1.1", "10.249.0.1", 0, &res,
+                               [](const netstack_resolution& r){
+    return r.table == 4241;
+  }));
+  EXPECT_EQ(RTN_PROHIBIT, res.type);
+  // locally-originated traffic arrives through lo, as far as rules care
+  EXPECT_TRUE(await_resolution(ns, "0.0.0.0", "10.247.0.1", 0, &res,
+                               [](const netstack_resolution& r){
+    return r.type == RTN_BLACKHOLE;
+  }));
+  EXPECT_EQ(0, res.table);
+  // the goto at 4243 jumps over the prohibit at 4244, unless its inverted
+  // destination selector excludes the flow
+  EXPECT_TRUE(await_resolution(ns, "0.0.0.0", "10.249.0.1", 0x20, &res,
+                               [](const netstack_resolution& r){
+    return r.table == 4245;
+  }));
+  EXPECT_EQ(RTN_UNREACHABLE, res.type);
+  EXPECT_TRUE(await_resolution(ns, "0.0.0.0", "10.248.0.1", 0x20, &res,
+                               [](const netstack_resolution& r){
+    return r.type == RTN_PROHIBIT;
+  }));
+  EXPECT_EQ(0, res.table);
+  EXPECT_EQ(base + 6, netstack_rule_count(ns));
+  {
+    std::lock_guard<std::mutex> guard(seen.lock);
+    ASSERT_TRUE(seen.marked);
+    EXPECT_EQ(0x10, seen.mark);
+    EXPECT_EQ(0xf0, seen.mask);
+    ASSERT_TRUE(seen.ifnamed);
+    EXPECT_EQ("lo", seen.iifname);
+  }
+  // without our rules, the flows go wherever the main table sends them
+  for(int prio = 4240 ; prio < 4246 ; ++prio){
+    ASSERT_EQ(0, system(("ip rule del priority " + std::to_string(prio)).c_str()));
+  }
+  for(int i = 0 ; i < 100 && netstack_rule_count(ns) != base ; ++i){
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  EXPECT_EQ(base, netstack_rule_count(ns));
+  uint32_t dst;
+  inet_pton(AF_INET, "10.247.0.1", &dst);
+  if(netstack_resolve(ns, AF_INET, &dst, nullptr, 0, 0, &res) == 0){
+    EXPECT_NE(RTN_BLACKHOLE, res.type);
+  }
+  ASSERT_EQ(0, netstack_destroy(ns));
+}
+
+// Poll up to a second for the first rule selecting the flow to have priority
+// prio.
+static bool
+await_match(struct netstack* ns, const char* dst, uint32_t mark, int iif,
+            uint32_t prio){
+  uint32_t d;
+  inet_pton(AF_INET, dst, &d);
+  for(int i = 0 ; i < 100 ; ++i){
+    const netstack_rule* nr = netstack_rule_match(ns, AF_INET, nullptr, &d, mark, iif, 0);
+    if(nr){
+      const uint32_t p = netstack_rule_priority(nr);
+      netstack_rule_abandon(nr);
+      if(p == prio){
+        return true;
+      }
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  return false;
+}
+
+// Many single-mark rules, interleaved with others which any mark might
+// select, and a goto leaping into their midst: each flow finds the first rule
+// selecting it, in order of priority. The local rule, which would select
+// everything, is removed first.
+TEST_F(RuleNetns, MarkIndex) {
+  netstack_opts nopts = {};
+  nopts.initial_events = netstack_opts::NETSTACK_INITIAL_EVENTS_BLOCK;
+  struct netstack* ns = netstack_create(&nopts);
+  ASSERT_NE(nullptr, ns);
+  FILE* fp = popen("ip -batch -", "w");
+  ASSERT_NE(nullptr, fp);
+  fprintf(fp, "rule del priority 0\n");
+  for(int i = 0 ; i < 200 ; ++i){
+    fprintf(fp, "rule add priority %d fwmark %d lookup %d\n", 5000 + 2 * i, 1000 + i, 5000 + 2 * i);
+  }
+  fprintf(fp, "rule add priority 5101 to 10.248.0.0/16 lookup 5101\n"
+              "rule add priority 5051 to 10.249.0.0/16 goto 5300\n"
+              "rule add priority 5399 fwmark 0x4000/0x4000 lookup 5399\n");
+  ASSERT_EQ(0, pclose(fp));
+  EXPECT_TRUE(await_match(ns, "10.247.0.1", 1060, 0, 5120));
+  EXPECT_TRUE(await_match(ns, "10.248.0.1", 1060, 0, 5101));
+  EXPECT_TRUE(await_match(ns, "10.248.0.1", 1020, 0, 5040));
+  EXPECT_TRUE(await_match(ns, "10.249.0.1", 1020, 0, 5040));
+  // the goto jumps over 5120, but not 5360
+  EXPECT_TRUE(await_match(ns, "10.249.0.1", 1060, 0, 32766));
+  EXPECT_TRUE(await_match(ns, "10.249.0.1", 1180, 0, 5360));
+  EXPECT_TRUE(await_match(ns, "10.249.0.1", 0x40, 0, 32766));
+  // marks selected by no single-mark rule are still seen by masked ones
+  EXPECT_TRUE(await_match(ns, "10.249.0.1", 0x4040, 0, 5399));
+  EXPECT_TRUE(await_match(ns, "10.247.0.1", 0x4000, 0, 5399));
+  ASSERT_EQ(0, netstack_destroy(ns));
+}
+
+// Interface selectors follow the name from link to link, as in the kernel.
+TEST_F(RuleNetns, InterfaceByName) {
+  netstack_opts nopts = {};
+  nopts.initial_events = netstack_opts::NETSTACK_INITIAL_EVENTS_BLOCK;
+  struct netstack* ns = netstack_create(&nopts);
+  ASSERT_NE(nullptr, ns);
+  ASSERT_EQ(0, system("ip rule del priority 0 && "
+                      "ip rule add priority 4300 iif nsrl0 lookup 4300 && "
+                      "ip link add nsrl0 type veth peer name nsrl1"));
+  const int idx = if_nametoindex("nsrl0");
+  const int peer = if_nametoindex("nsrl1");
+  ASSERT_NE(0, idx);
+  EXPECT_TRUE(await_match(ns, "10.247.0.1", 0, idx, 4300));
+  EXPECT_TRUE(await_match(ns, "10.247.0.1", 0, peer, 32766));
+  ASSERT_EQ(0, system("ip link set nsrl0 name nsrl2 && ip link set nsrl1 name nsrl0"));
+  EXPECT_TRUE(await_match(ns, "10.247.0.1", 0, peer, 4300));
+  EXPECT_TRUE(await_match(ns, "10.247.0.1", 0, idx, 32766));
+  ASSERT_EQ(0, system("ip link del nsrl0"));
+  EXPECT_TRUE(await_match(ns, "10.247.0.1", 0, peer, 32766));
+  ASSERT_EQ(0, netstack_destroy(ns));
+}
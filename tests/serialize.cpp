@@ -0,0 +1,126 @@
+#include <vector>
+#include <cstring>
+#include <arpa/inet.h>
+#include <net/if_arp.h>
+#include "main.h"
+
+// Unit tests for the relocatable serialization format.
+
+static std::vector<uint32_t>
+serialize_lo(struct netstack* ns, unsigned flags){
+  const netstack_iface* ni = netstack_iface_share_byname(ns, "lo");
+  if(ni == nullptr){
+    return {};
+  }
+  ssize_t s = netstack_iface_serialize(ni, nullptr, 0, flags);
+  std::vector<uint32_t> buf(s > 0 ? s / 4 : 0);
+  if(s <= 0 || netstack_iface_serialize(ni, buf.data(), s, flags) != s){
+    buf.clear();
+  }
+  netstack_iface_abandon(ni);
+  return buf;
+}
+
+// A record means the same thing wherever it's copied, with or without an
+// index, and is only viewed as what it is.
+TEST(Serialize, IfaceRelocates) {
+  netstack_opts nopts = {};
+  nopts.initial_events = netstack_opts::NETSTACK_INITIAL_EVENTS_BLOCK;
+  struct netstack* ns = netstack_create(&nopts);
+  ASSERT_NE(nullptr, ns);
+  for(unsigned flags : { 0u, NETSTACK_SERIALIZE_INDEX }){
+    auto buf = serialize_lo(ns, flags);
+    ASSERT_FALSE(buf.empty());
+    // copied to a different address, and the original scribbled over
+    std::vector<uint32_t> moved(buf.size() + 3);
+    memcpy(moved.data() + 3, buf.data(), buf.size() * 4);
+    memset(buf.data(), 0xff, buf.size() * 4);
+    netstack_view v;
+    ASSERT_EQ(0, netstack_iface_view(moved.data() + 3, (moved.size() - 3) * 4, &v));
+    EXPECT_EQ(NETSTACK_OBJ_IFACE, v.type);
+    EXPECT_EQ(NETSTACK_NSID_LOCAL, v.nsid);
+    EXPECT_EQ(flags ? IFLA_MAX + 1 : 0u, v.idxcount);
+    ASSERT_LE(sizeof(struct ifinfomsg), v.msglen);
+    auto ifi = static_cast<const struct ifinfomsg*>(v.msg);
+    EXPECT_EQ(ARPHRD_LOOPBACK, ifi->ifi_type);
+    const struct rtattr* name = netstack_view_attr(&v, IFLA_IFNAME);
+    ASSERT_NE(nullptr, name);
+    EXPECT_STREQ("lo", static_cast<const char*>(RTA_DATA(name)));
+    EXPECT_EQ(nullptr, netstack_view_attr(&v, 1000));
+    EXPECT_EQ(-1, netstack_route_view(moved.data() + 3, v.len, &v));
+    EXPECT_EQ(EPROTO, errno);
+  }
+  ASSERT_EQ(0, netstack_destroy(ns));
+}
+
+// Records of several types can be concatenated and walked.
+TEST(Serialize, Concatenated) {
+  netstack_opts nopts = {};
+  nopts.initial_events = netstack_opts::NETSTACK_INITIAL_EVENTS_BLOCK;
+  struct netstack* ns = netstack_create(&nopts);
+  ASSERT_NE(nullptr, ns);
+  auto buf = serialize_lo(ns, NETSTACK_SERIALIZE_INDEX);
+  ASSERT_FALSE(buf.empty());
+  uint32_t dst = htonl(INADDR_LOOPBACK);
+  const netstack_rule* nr = netstack_rule_match(ns, AF_INET, nullptr, &dst, 0, 0, 0);
+  ASSERT_NE(nullptr, nr);
+  const size_t ilen = buf.size() * 4;
+  const ssize_t rlen = netstack_rule_serialize(nr, nullptr, 0, 0);
+  ASSERT_LT(0, rlen);
+  buf.resize(buf.size() + rlen / 4);
+  EXPECT_EQ(rlen, netstack_rule_serialize(nr, buf.data() + ilen / 4, rlen, 0));
+  EXPECT_EQ(-1, netstack_rule_serialize(nr, reinterpret_cast<char*>(buf.data()) + 1, rlen, 0));
+  EXPECT_EQ(EINVAL, errno);
+  netstack_rule_abandon(nr);
+  size_t off = 0;
+  netstack_view v;
+  ASSERT_EQ(1, netstack_view_next(buf.data(), buf.size() * 4, &off, &v));
+  EXPECT_EQ(NETSTACK_OBJ_IFACE, v.type);
+  EXPECT_EQ(ilen, off);
+  ASSERT_EQ(1, netstack_view_next(buf.data(), buf.size() * 4, &off, &v));
+  EXPECT_EQ(NETSTACK_OBJ_RULE, v.type);
+  auto frh = static_cast<const struct fib_rule_hdr*>(v.msg);
+  EXPECT_EQ(RT_TABLE_LOCAL, frh->table);
+  EXPECT_EQ(0, netstack_view_next(buf.data(), buf.size() * 4, &off, &v));
+  ASSERT_EQ(0, netstack_destroy(ns));
+}
+
+// Damaged records are refused, rather than trusted.
+TEST(Serialize, Invalid) {
+  netstack_opts nopts = {};
+  nopts.initial_events = netstack_opts::NETSTACK_INITIAL_EVENTS_BLOCK;
+  struct netstack* ns = netstack_create(&nopts);
+  ASSERT_NE(nullptr, ns);
+  auto buf = serialize_lo(ns, NETSTACK_SERIALIZE_INDEX);
+  ASSERT_FALSE(buf.empty());
+  ASSERT_EQ(0, netstack_destroy(ns));
+  const size_t len = buf.size() * 4;
+  netstack_view v;
+  EXPECT_EQ(-1, netstack_iface_view(buf.data(), len - 4, &v));
+  EXPECT_EQ(EINVAL, errno);
+  EXPECT_EQ(-1, netstack_iface_view(reinterpret_cast<char*>(buf.data()) + 2, len - 2, &v));
+  EXPECT_EQ(EINVAL, errno);
+  auto hdr = reinterpret_cast<netstack_blob*>(buf.data());
+  auto bad = buf;
+  reinterpret_cast<netstack_blob*>(bad.data())->magic = htonl(NETSTACK_BLOB_MAGIC);
+  EXPECT_EQ(-1, netstack_iface_view(bad.data(), len, &v));
+  EXPECT_EQ(EPROTO, errno);
+  bad = buf;
+  ++reinterpret_cast<netstack_blob*>(bad.data())->version;
+  EXPECT_EQ(-1, netstack_iface_view(bad.data(), len, &v));
+  EXPECT_EQ(EPROTONOSUPPORT, errno);
+  // an attribute overrunning the attributes
+  bad = buf;
+  auto rta = reinterpret_cast<struct rtattr*>(reinterpret_cast<char*>(bad.data()) + hdr->attroff);
+  rta->rta_len = hdr->attrlen + 4;
+  EXPECT_EQ(-1, netstack_iface_view(bad.data(), len, &v));
+  EXPECT_EQ(EINVAL, errno);
+  // an index entry pointing at an attribute of another type
+  bad = buf;
+  auto idx = reinterpret_cast<uint32_t*>(reinterpret_cast<char*>(bad.data()) + hdr->idxoff);
+  ASSERT_NE(0, idx[IFLA_IFNAME]);
+  idx[IFLA_MTU] = idx[IFLA_IFNAME];
+  EXPECT_EQ(-1, netstack_iface_view(bad.data(), len, &v));
+  EXPECT_EQ(EINVAL, errno);
+  EXPECT_EQ(0, netstack_iface_view(buf.data(), len, &v));
+}
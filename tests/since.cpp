@@ -0,0 +1,201 @@
+#include <set>
+#include <string>
+#include <thread>
+#include <chrono>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include "netns.h"
+
+// Unit tests for incremental enumeration. Those adding links run in a private
+// network namespace, and are skipped if one can't be created.
+
+using SinceNetns = NetnsTest;
+
+TEST(Since, Invalid) {
+  netstack_opts nopts = {};
+  nopts.initial_events = netstack_opts::NETSTACK_INITIAL_EVENTS_BLOCK;
+  nopts.neigh_notrack = true;
+  struct netstack* ns = netstack_create(&nopts);
+  ASSERT_NE(nullptr, ns);
+  uint32_t buf[64];
+  size_t len = sizeof(buf);
+  uint64_t gen;
+  EXPECT_EQ(-1, netstack_neigh_enumerate_since(ns, 0, buf, &len, 0, &gen));
+  EXPECT_EQ(EOPNOTSUPP, errno);
+  EXPECT_EQ(-1, netstack_iface_enumerate_since(ns, 0, reinterpret_cast<char*>(buf) + 1,
+                                               &len, 0, &gen));
+  EXPECT_EQ(EINVAL, errno);
+  EXPECT_EQ(-1, netstack_iface_enumerate_since(ns, 0, buf, nullptr, 0, &gen));
+  EXPECT_EQ(EINVAL, errno);
+  ASSERT_EQ(0, netstack_destroy(ns));
+}
+
+// Fetch the changes since *gen into buf, growing it as necessary, and
+// advancing *gen. Returns the number of records, or -1.
+template<typename F> static int
+fetch(F since, struct netstack* ns, uint64_t* gen, std::vector<uint32_t>& buf){
+  for( ; ; ){
+    size_t len = buf.size() * 4;
+    uint64_t newgen;
+    int r = since(ns, *gen, buf.data(), &len, NETSTACK_SERIALIZE_INDEX, &newgen);
+    if(r >= 0){
+      buf.resize(len / 4);
+      *gen = newgen;
+      return r;
+    }
+    if(errno != ENOBUFS){
+      return -1;
+    }
+    buf.resize(len / 4 + 64);
+  }
+}
+
+// Names of the (deleted, if del) ifaces among the records.
+static std::set<std::string>
+iface_names(const std::vector<uint32_t>& buf, bool del){
+  std::set<std::string> names;
+  size_t off = 0;
+  netstack_view v;
+  while(netstack_view_next(buf.data(), buf.size() * 4, &off, &v) == 1){
+    const struct rtattr* name = netstack_view_attr(&v, IFLA_IFNAME);
+    if(name && !(v.flags & NETSTACK_BLOB_DELETED) == !del){
+      names.insert(static_cast<const char*>(RTA_DATA(name)));
+    }
+  }
+  return names;
+}
+
+// Poll up to a second for pred to be satisfied.
+template<typename P> static bool
+await(P pred){
+  for(int i = 0 ; i < 100 ; ++i){
+    if(pred()){
+      return true;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  return false;
+}
+
+// A full enumeration, then only what's changed since: nothing, then new
+// links, then their deletions.
+TEST_F(SinceNetns, Ifaces) {
+  netstack_opts nopts = {};
+  nopts.initial_events = netstack_opts::NETSTACK_INITIAL_EVENTS_BLOCK;
+  struct netstack* ns = netstack_create(&nopts);
+  ASSERT_NE(nullptr, ns);
+  uint64_t gen = 0;
+  std::vector<uint32_t> buf;
+  ASSERT_EQ(netstack_iface_count(ns), fetch(netstack_iface_enumerate_since, ns, &gen, buf));
+  EXPECT_EQ(1, iface_names(buf, false).count("lo"));
+  EXPECT_LE(gen, netstack_generation(ns));
+  uint64_t quiet = gen;
+  EXPECT_EQ(0, fetch(netstack_iface_enumerate_since, ns, &quiet, buf));
+  ASSERT_EQ(0, system("ip link add nsgen0 type veth peer name nsgen1"));
+  std::set<std::string> names;
+  EXPECT_TRUE(await([&](){
+    uint64_t g = gen;
+    return fetch(netstack_iface_enumerate_since, ns, &g, buf) >= 2 &&
+           (names = iface_names(buf, false)).count("nsgen0") && names.count("nsgen1");
+  }));
+  EXPECT_EQ(0, names.count("lo"));
+  gen = netstack_generation(ns);
+  ASSERT_EQ(0, system("ip link del nsgen0"));
+  EXPECT_TRUE(await([&](){
+    uint64_t g = gen;
+    return fetch(netstack_iface_enumerate_since, ns, &g, buf) >= 2 &&
+           (names = iface_names(buf, true)).count("nsgen0") && names.count("nsgen1");
+  }));
+  EXPECT_EQ(0, iface_names(buf, false).count("nsgen0"));
+  ASSERT_EQ(0, netstack_destroy(ns));
+}
+
+// More deletions than are remembered force a fresh start.
+TEST_F(SinceNetns, Stale) {
+  netstack_opts nopts = {};
+  nopts.initial_events = netstack_opts::NETSTACK_INITIAL_EVENTS_BLOCK;
+  struct netstack* ns = netstack_create(&nopts);
+  ASSERT_NE(nullptr, ns);
+  ASSERT_EQ(0, system("ip link add nsgen0 type veth peer name nsgen1"));
+  uint64_t gen = 0;
+  std::vector<uint32_t> buf;
+  ASSERT_LE(0, fetch(netstack_neigh_enumerate_since, ns, &gen, buf));
+  FILE* fp = popen("ip -batch -", "w");
+  ASSERT_NE(nullptr, fp);
+  for(int i = 0 ; i < 1100 ; ++i){
+    fprintf(fp, "neigh add 10.254.%d.%d lladdr 02:00:00:00:%02x:%02x dev nsgen0\n",
+            i / 250, i % 250 + 1, i / 256, i % 256);
+  }
+  ASSERT_EQ(0, pclose(fp));
+  EXPECT_TRUE(await([&](){ return netstack_neigh_count(ns) >= 1100; }));
+  uint64_t g = gen;
+  ASSERT_LE(1100, fetch(netstack_neigh_enumerate_since, ns, &g, buf));
+  // the kernel flushes them without a word; we bury them all the same
+  ASSERT_EQ(0, system("ip link del nsgen0"));
+  EXPECT_TRUE(await([&](){ return netstack_neigh_count(ns) < 1100; }));
+  g = gen;
+  EXPECT_EQ(-1, fetch(netstack_neigh_enumerate_since, ns, &g, buf));
+  EXPECT_EQ(ESTALE, errno);
+  g = 0;
+  EXPECT_EQ(netstack_neigh_count(ns), fetch(netstack_neigh_enumerate_since, ns, &g, buf));
+  ASSERT_EQ(0, netstack_destroy(ns));
+}
+
+// Live (or deleted, if del) records among buf.
+static int
+records(const std::vector<uint32_t>& buf, bool del){
+  int count = 0;
+  size_t off = 0;
+  netstack_view v;
+  while(netstack_view_next(buf.data(), buf.size() * 4, &off, &v) == 1){
+    count += !(v.flags & NETSTACK_BLOB_DELETED) == !del;
+  }
+  return count;
+}
+
+// Nexthops, FDB entries, and qdiscs are enumerated likewise, and buried
+// along with their link.
+TEST_F(SinceNetns, FibClasses) {
+  netstack_opts nopts = {};
+  nopts.initial_events = netstack_opts::NETSTACK_INITIAL_EVENTS_BLOCK;
+  struct netstack* ns = netstack_create(&nopts);
+  ASSERT_NE(nullptr, ns);
+  uint64_t nhgen = 0, fdbgen = 0, tcgen = 0;
+  std::vector<uint32_t> buf;
+  ASSERT_LE(0, fetch(netstack_nexthop_enumerate_since, ns, &nhgen, buf));
+  ASSERT_LE(0, fetch(netstack_fdb_enumerate_since, ns, &fdbgen, buf));
+  ASSERT_LE(0, fetch(netstack_tc_enumerate_since, ns, &tcgen, buf));
+  ASSERT_EQ(0, system("ip link add nsgen0 type veth peer name nsgen1 && "
+                      "ip link set nsgen0 up && ip link set nsgen1 up && "
+                      "ip nexthop add id 7 dev nsgen0 && "
+                      "bridge fdb add 02:00:00:00:00:07 dev nsgen0 && "
+                      "tc qdisc add dev nsgen0 root handle 1: htb"));
+  EXPECT_TRUE(await([&](){
+    uint64_t g = nhgen;
+    return fetch(netstack_nexthop_enumerate_since, ns, &g, buf) >= 1 && records(buf, false) >= 1;
+  }));
+  EXPECT_TRUE(await([&](){
+    uint64_t g = fdbgen;
+    return fetch(netstack_fdb_enumerate_since, ns, &g, buf) >= 1 && records(buf, false) >= 1;
+  }));
+  EXPECT_TRUE(await([&](){
+    uint64_t g = tcgen;
+    return fetch(netstack_tc_enumerate_since, ns, &g, buf) >= 1 && records(buf, false) >= 1;
+  }));
+  nhgen = fdbgen = tcgen = netstack_generation(ns);
+  ASSERT_EQ(0, system("ip link del nsgen0"));
+  EXPECT_TRUE(await([&](){
+    uint64_t g = nhgen;
+    return fetch(netstack_nexthop_enumerate_since, ns, &g, buf) >= 1 && records(buf, true) >= 1;
+  }));
+  EXPECT_TRUE(await([&](){
+    uint64_t g = fdbgen;
+    return fetch(netstack_fdb_enumerate_since, ns, &g, buf) >= 1 && records(buf, true) >= 1;
+  }));
+  EXPECT_TRUE(await([&](){
+    uint64_t g = tcgen;
+    return fetch(netstack_tc_enumerate_since, ns, &g, buf) >= 1 && records(buf, true) >= 1;
+  }));
+  ASSERT_EQ(0, netstack_destroy(ns));
+}
@@ -0,0 +1,287 @@
+#include <thread>
+#include <vector>
+#include <chrono>
+#include <cstdlib>
+#include "netns.h"
+
+// Unit tests for statistics accounting. Those adding links run in a private
+// network namespace, and are skipped if one can't be created.
+
+using StatsNetns = NetnsTest;
+
+// Following a blocking initial enumeration, dumps ought have been timed, and
+// the cache byte count ought match netstack_iface_bytes().
+TEST(Stats, DumpsAndBytes) {
+  netstack_opts nopts = {};
+  nopts.initial_events = netstack_opts::NETSTACK_INITIAL_EVENTS_BLOCK;
+  struct netstack* ns = netstack_create(&nopts);
+  ASSERT_NE(nullptr, ns);
+  netstack_stats stats;
+  ASSERT_NE(nullptr, netstack_sample_stats(ns, &stats));
+  EXPECT_LT(0, stats.dumps);
+  EXPECT_LE(stats.dump_nsec_max, stats.dump_nsec_total);
+  EXPECT_EQ(netstack_iface_bytes(ns), stats.iface_bytes);
+  EXPECT_EQ(netstack_iface_count(ns), stats.ifaces);
+  EXPECT_EQ(0, stats.parse_failures);
+  EXPECT_EQ(0, stats.live_shares);
+  EXPECT_EQ(0, stats.zombie_shares);
+  ASSERT_EQ(0, netstack_destroy(ns));
+}
+
+// Shares ought be reflected in live_shares until abandoned.
+TEST(Stats, LiveShares) {
+  netstack_opts nopts = {};
+  nopts.initial_events = netstack_opts::NETSTACK_INITIAL_EVENTS_BLOCK;
+  struct netstack* ns = netstack_create(&nopts);
+  ASSERT_NE(nullptr, ns);
+  const netstack_iface* ni = netstack_iface_share_byname(ns, "lo");
+  if(ni == nullptr){
+    netstack_destroy(ns);
+    GTEST_SKIP();
+  }
+  const netstack_iface* ni2 = netstack_iface_share(ni);
+  netstack_stats stats;
+  ASSERT_NE(nullptr, netstack_sample_stats(ns, &stats));
+  EXPECT_EQ(2, stats.live_shares + stats.zombie_shares);
+  netstack_iface_abandon(ni2);
+  netstack_iface_abandon(ni);
+  ASSERT_NE(nullptr, netstack_sample_stats(ns, &stats));
+  EXPECT_EQ(0, stats.live_shares);
+  EXPECT_EQ(0, stats.zombie_shares);
+  ASSERT_EQ(0, netstack_destroy(ns));
+}
+
+// A share held across a redump becomes a zombie, and is reaped once abandoned.
+// Redumping must not inflate the cached iface count.
+TEST(Stats, ZombieShares) {
+  netstack_opts nopts = {};
+  nopts.initial_events = netstack_opts::NETSTACK_INITIAL_EVENTS_BLOCK;
+  struct netstack* ns = netstack_create(&nopts);
+  ASSERT_NE(nullptr, ns);
+  const netstack_iface* ni = netstack_iface_share_byname(ns, "lo");
+  if(ni == nullptr){
+    netstack_destroy(ns);
+    GTEST_SKIP();
+  }
+  netstack_stats stats;
+  ASSERT_NE(nullptr, netstack_sample_stats(ns, &stats));
+  const unsigned ifaces = stats.ifaces;
+  const uintmax_t dumps = stats.dumps;
+  ASSERT_EQ(0, netstack_iface_stats_refresh(ns));
+  for(int i = 0 ; i < 500 ; ++i){
+    ASSERT_NE(nullptr, netstack_sample_stats(ns, &stats));
+    if(stats.dumps > dumps){
+      break;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  ASSERT_LT(dumps, stats.dumps);
+  EXPECT_EQ(ifaces, stats.ifaces);
+  EXPECT_EQ(1, stats.zombie_shares);
+  EXPECT_EQ(0, stats.live_shares);
+  netstack_iface_abandon(ni);
+  ASSERT_NE(nullptr, netstack_sample_stats(ns, &stats));
+  EXPECT_EQ(0, stats.zombie_shares);
+  ASSERT_EQ(0, netstack_destroy(ns));
+}
+
+// Lookups from many threads land in different stat shards; the sampled sums
+// must nonetheless be exact.
+TEST(Stats, ShardedLookupCounts) {
+  netstack_opts nopts = {};
+  nopts.initial_events = netstack_opts::NETSTACK_INITIAL_EVENTS_BLOCK;
+  struct netstack* ns = netstack_create(&nopts);
+  ASSERT_NE(nullptr, ns);
+  const int threads = 32;
+  const int lookups = 1000;
+  std::vector<std::thread> workers;
+  for(int t = 0 ; t < threads ; ++t){
+    workers.emplace_back([ns]{
+      for(int i = 0 ; i < lookups ; ++i){
+        const netstack_iface* ni = netstack_iface_share_byname(ns, "lo");
+        if(ni){
+          netstack_iface_abandon(ni);
+        }
+        netstack_iface_share_byidx(ns, -1);
+      }
+    });
+  }
+  for(auto& w : workers){
+    w.join();
+  }
+  netstack_stats stats;
+  ASSERT_NE(nullptr, netstack_sample_stats(ns, &stats));
+  EXPECT_EQ(threads * lookups * 2, stats.lookup_shares + stats.lookup_failures);
+  EXPECT_LE(threads * lookups, stats.lookup_failures);
+  ASSERT_EQ(0, netstack_destroy(ns));
+}
+
+// With lookup_cache, repeated lookups on a thread hit its cache, until a
+// change to the iface cache invalidates the entry.
+TEST(Stats, ThreadCacheHits) {
+  netstack_opts nopts = {};
+  nopts.initial_events = netstack_opts::NETSTACK_INITIAL_EVENTS_BLOCK;
+  nopts.lookup_cache = true;
+  struct netstack* ns = netstack_create(&nopts);
+  ASSERT_NE(nullptr, ns);
+  const netstack_iface* ni = netstack_iface_share_byname(ns, "lo");
+  if(ni == nullptr){
+    netstack_destroy(ns);
+    GTEST_SKIP();
+  }
+  const int idx = netstack_iface_index(ni);
+  netstack_iface_abandon(ni);
+  for(int i = 0 ; i < 10 ; ++i){
+    ni = netstack_iface_share_byidx(ns, idx);
+    ASSERT_NE(nullptr, ni);
+    netstack_iface_abandon(ni);
+    ni = netstack_iface_share_byname(ns, "lo");
+    ASSERT_NE(nullptr, ni);
+    netstack_iface_abandon(ni);
+  }
+  netstack_stats stats;
+  ASSERT_NE(nullptr, netstack_sample_stats(ns, &stats));
+  EXPECT_EQ(2, stats.tlcache_misses);
+  EXPECT_EQ(19, stats.tlcache_hits);
+  EXPECT_EQ(21, stats.lookup_shares);
+  // A redump replaces lo, which must invalidate the cached entry
+  const netstack_iface* old = netstack_iface_share_byidx(ns, idx);
+  const uintmax_t dumps = stats.dumps;
+  ASSERT_EQ(0, netstack_iface_stats_refresh(ns));
+  for(int i = 0 ; i < 500 ; ++i){
+    ASSERT_NE(nullptr, netstack_sample_stats(ns, &stats));
+    if(stats.dumps > dumps){
+      break;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  ASSERT_LT(dumps, stats.dumps);
+  ni = netstack_iface_share_byidx(ns, idx);
+  ASSERT_NE(nullptr, ni);
+  EXPECT_NE(old, ni);
+  ASSERT_NE(nullptr, netstack_sample_stats(ns, &stats));
+  EXPECT_EQ(3, stats.tlcache_misses);
+  netstack_iface_abandon(ni);
+  netstack_iface_abandon(old);
+  ASSERT_EQ(0, netstack_destroy(ns));
+}
+
+// Threads must each use their own caches, and release them upon exit.
+TEST(Stats, ThreadCacheReleased) {
+  netstack_opts nopts = {};
+  nopts.initial_events = netstack_opts::NETSTACK_INITIAL_EVENTS_BLOCK;
+  nopts.lookup_cache = true;
+  struct netstack* ns = netstack_create(&nopts);
+  ASSERT_NE(nullptr, ns);
+  std::vector<std::thread> workers;
+  for(int t = 0 ; t < 8 ; ++t){
+    workers.emplace_back([ns]{
+      for(int i = 0 ; i < 100 ; ++i){
+        const netstack_iface* ni = netstack_iface_share_byname(ns, "lo");
+        if(ni){
+          netstack_iface_abandon(ni);
+        }
+      }
+    });
+  }
+  for(auto& w : workers){
+    w.join();
+  }
+  netstack_stats stats;
+  ASSERT_NE(nullptr, netstack_sample_stats(ns, &stats));
+  EXPECT_EQ(800, stats.tlcache_hits + stats.tlcache_misses);
+  EXPECT_EQ(0, stats.live_shares);
+  EXPECT_EQ(0, stats.zombie_shares);
+  ASSERT_EQ(0, netstack_destroy(ns));
+}
+
+// Lookup cache entries pin neither deleted ifaces nor the share statistics.
+TEST_F(StatsNetns, ThreadCacheZombieReaped) {
+  netstack_opts nopts = {};
+  nopts.initial_events = netstack_opts::NETSTACK_INITIAL_EVENTS_BLOCK;
+  nopts.lookup_cache = true;
+  struct netstack* ns = netstack_create(&nopts);
+  ASSERT_NE(nullptr, ns);
+  ASSERT_EQ(0, system("ip link add nstl0 type veth peer name nstl1"));
+  const netstack_iface* ni = nullptr;
+  for(int i = 0 ; i < 100 && !(ni = netstack_iface_share_byname(ns, "nstl0")) ; ++i){
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  ASSERT_NE(nullptr, ni);
+  netstack_stats stats;
+  ASSERT_NE(nullptr, netstack_sample_stats(ns, &stats));
+  EXPECT_EQ(1, stats.live_shares);
+  EXPECT_EQ(0, stats.zombie_shares);
+  ASSERT_EQ(0, system("ip link del nstl0"));
+  // this miss releases the entry held on the deleted iface
+  const netstack_iface* gone = ni;
+  for(int i = 0 ; i < 100 && gone ; ++i){
+    if( (gone = netstack_iface_share_byname(ns, "nstl0")) ){
+      netstack_iface_abandon(gone);
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+  }
+  ASSERT_EQ(nullptr, gone);
+  ASSERT_NE(nullptr, netstack_sample_stats(ns, &stats));
+  EXPECT_EQ(1, stats.zombie_shares);
+  netstack_iface_abandon(ni);
+  ASSERT_NE(nullptr, netstack_sample_stats(ns, &stats));
+  EXPECT_EQ(0, stats.zombie_shares);
+  EXPECT_EQ(0, stats.live_shares);
+  ASSERT_EQ(0, netstack_destroy(ns));
+}
+
+// A synchronous RTM_GETSTATS refresh fills the stats slot, without replacing
+// the iface object (nor generating iface events).
+TEST(Stats, RefreshSync) {
+  netstack_opts nopts = {};
+  nopts.initial_events = netstack_opts::NETSTACK_INITIAL_EVENTS_BLOCK;
+  struct netstack* ns = netstack_create(&nopts);
+  ASSERT_NE(nullptr, ns);
+  const netstack_iface* ni = netstack_iface_share_byname(ns, "lo");
+  if(ni == nullptr){
+    netstack_destroy(ns);
+    GTEST_SKIP();
+  }
+  const int idx = netstack_iface_index(ni);
+  struct rtnl_link_stats64 s64;
+  EXPECT_FALSE(netstack_iface_stats_latest(ns, idx, &s64));
+  netstack_stats stats;
+  ASSERT_NE(nullptr, netstack_sample_stats(ns, &stats));
+  const uintmax_t events = stats.iface_events;
+  ASSERT_EQ(0, netstack_iface_stats_refresh_sync(ns, idx, 1000));
+  ASSERT_TRUE(netstack_iface_stats_latest(ns, idx, &s64));
+  EXPECT_EQ(s64.rx_packets, s64.tx_packets); // loopback
+  ASSERT_EQ(0, netstack_iface_stats_refresh_sync(ns, 0, 1000));
+  EXPECT_TRUE(netstack_iface_stats_latest(ns, idx, &s64));
+  const netstack_iface* ni2 = netstack_iface_share_byname(ns, "lo");
+  EXPECT_EQ(ni, ni2);
+  netstack_iface_abandon(ni2);
+  ASSERT_NE(nullptr, netstack_sample_stats(ns, &stats));
+  EXPECT_EQ(events, stats.iface_events);
+  EXPECT_EQ(0, stats.parse_failures);
+  // a nonexistent link must fail, rather than time out
+  EXPECT_EQ(-1, netstack_iface_stats_refresh_sync(ns, 0x7ffffff0, -1));
+  EXPECT_FALSE(netstack_iface_stats_latest(ns, 0x7ffffff0, &s64));
+  netstack_iface_abandon(ni);
+  ASSERT_EQ(0, netstack_destroy(ns));
+}
+
+TEST(Stats, RefreshSyncThreadless) {
+  netstack_opts nopts = {};
+  nopts.initial_events = netstack_opts::NETSTACK_INITIAL_EVENTS_BLOCK;
+  nopts.threadless = true;
+  struct netstack* ns = netstack_create(&nopts);
+  ASSERT_NE(nullptr, ns);
+  const netstack_iface* ni = netstack_iface_share_byname(ns, "lo");
+  if(ni == nullptr){
+    netstack_destroy(ns);
+    GTEST_SKIP();
+  }
+  const int idx = netstack_iface_index(ni);
+  netstack_iface_abandon(ni);
+  ASSERT_EQ(0, netstack_iface_stats_refresh_sync(ns, idx, 1000));
+  struct rtnl_link_stats64 s64;
+  EXPECT_TRUE(netstack_iface_stats_latest(ns, idx, &s64));
+  ASSERT_EQ(0, netstack_destroy(ns));
+}
@@ -0,0 +1,150 @@
+#include <thread>
+#include <chrono>
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include "netns.h"
+
+// Unit tests for the traffic control cache. Those adding qdiscs run in a
+// private network namespace, and are skipped if one can't be created (or
+// without the htb scheduler).
+
+using TcNetns = NetnsTest;
+
+TEST(Tc, Invalid) {
+  netstack_opts nopts = {};
+  nopts.tc_curry = &nopts;
+  EXPECT_EQ(nullptr, netstack_create(&nopts));
+  nopts = {};
+  nopts.initial_events = netstack_opts::NETSTACK_INITIAL_EVENTS_NONE;
+  nopts.tc_notrack = true;
+  struct netstack* ns = netstack_create(&nopts);
+  ASSERT_NE(nullptr, ns);
+  EXPECT_EQ(nullptr, netstack_tc_share(ns, false, 1, TC_H_ROOT));
+  EXPECT_EQ(EOPNOTSUPP, errno);
+  netstack_tc_stats st;
+  EXPECT_EQ(-1, netstack_tc_stats_latest(ns, false, 1, TC_H_ROOT, &st));
+  EXPECT_EQ(EOPNOTSUPP, errno);
+  EXPECT_EQ(0, netstack_tc_count(ns));
+  ASSERT_EQ(0, netstack_destroy(ns));
+}
+
+// Poll up to a second for pred to be satisfied.
+template<typename P> static bool
+await(P pred){
+  for(int i = 0 ; i < 100 ; ++i){
+    if(pred()){
+      return true;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  return false;
+}
+
+static int
+ifindex_of(struct netstack* ns, const char* name){
+  const netstack_iface* ni = nullptr;
+  await([&](){ return (ni = netstack_iface_share_byname(ns, name)) != nullptr; });
+  if(ni == nullptr){
+    return 0;
+  }
+  int idx = netstack_iface_index(ni);
+  netstack_iface_abandon(ni);
+  return idx;
+}
+
+// Events seen on the interface under test. Others' default qdiscs are
+// announced by no one, and first show up in the refresh's dump.
+struct tc_seen {
+  std::atomic<int> ifindex;
+  std::atomic<unsigned> events;
+};
+
+static void
+tc_cb(const netstack_tc* nt, netstack_event_e etype, void* vseen){
+  auto seen = static_cast<tc_seen*>(vseen);
+  (void)etype;
+  if(netstack_tc_index(nt) == seen->ifindex){
+    ++seen->events;
+  }
+}
+
+// Qdiscs are found by attachment point and classes by classid. Refreshes
+// which only move counters update the cache in place, without callbacks, and
+// deleting the root qdisc takes its classes along with it.
+TEST_F(TcNetns, HtbRefreshInPlace) {
+  tc_seen seen{};
+  netstack_opts nopts = {};
+  nopts.initial_events = netstack_opts::NETSTACK_INITIAL_EVENTS_BLOCK;
+  nopts.tc_cb = tc_cb;
+  nopts.tc_curry = &seen;
+  struct netstack* ns = netstack_create(&nopts);
+  ASSERT_NE(nullptr, ns);
+  ASSERT_EQ(0, system("ip link add nstc0 type veth peer name nstc1"));
+  if(system("tc qdisc add dev nstc0 root handle 1: htb default 10 2>/dev/null")){
+    netstack_destroy(ns);
+    GTEST_SKIP();
+  }
+  ASSERT_EQ(0, system("tc class add dev nstc0 parent 1: classid 1:10 htb rate 10mbit && "
+                      "ip link set nstc0 up && ip link set nstc1 up && "
+                      "ip addr add 10.253.0.1/24 dev nstc0 && "
+                      "ip neigh add 10.253.0.2 lladdr 02:00:00:00:42:53 dev nstc0"));
+  const int idx = ifindex_of(ns, "nstc0");
+  ASSERT_NE(0, idx);
+  seen.ifindex = idx;
+  ASSERT_TRUE(await([&](){
+    const netstack_tc* nt = netstack_tc_share(ns, true, idx, 0x10010);
+    if(nt){
+      netstack_tc_abandon(nt);
+    }
+    return nt != nullptr;
+  }));
+  const netstack_tc* nt = netstack_tc_share(ns, false, idx, TC_H_ROOT);
+  ASSERT_NE(nullptr, nt);
+  char kind[IFNAMSIZ];
+  ASSERT_TRUE(netstack_tc_kind(nt, kind));
+  EXPECT_STREQ("htb", kind);
+  EXPECT_EQ(0x10000, netstack_tc_handle(nt));
+  EXPECT_FALSE(netstack_tc_class(nt));
+  EXPECT_EQ(idx, netstack_tc_index(nt));
+  netstack_tc_abandon(nt);
+  // move some packets through the class, and pick up its new counters
+  int sd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+  ASSERT_LE(0, sd);
+  struct sockaddr_in sin = {};
+  sin.sin_family = AF_INET;
+  sin.sin_port = htons(9);
+  inet_pton(AF_INET, "10.253.0.2", &sin.sin_addr);
+  for(int i = 0 ; i < 3 ; ++i){
+    EXPECT_EQ(4, sendto(sd, "nstc", 4, 0, (const struct sockaddr*)&sin, sizeof(sin)));
+  }
+  close(sd);
+  const unsigned before = seen.events;
+  netstack_tc_stats st;
+  ASSERT_EQ(0, netstack_tc_stats_latest(ns, true, idx, 0x10010, &st));
+  const uint64_t updated = st.updated_nsec;
+  ASSERT_EQ(0, netstack_tc_refresh(ns));
+  EXPECT_TRUE(await([&](){
+    return netstack_tc_stats_latest(ns, true, idx, 0x10010, &st) == 0 &&
+           st.updated_nsec != updated;
+  }));
+  EXPECT_LE(3, st.packets);
+  EXPECT_EQ(before, seen.events);
+  ASSERT_EQ(0, system("tc qdisc del dev nstc0 root"));
+  EXPECT_TRUE(await([&](){
+    return netstack_tc_stats_latest(ns, true, idx, 0x10010, &st) != 0;
+  }));
+  EXPECT_EQ(ENOENT, errno);
+  const unsigned count = netstack_tc_count(ns);
+  ASSERT_EQ(0, system("ip link del nstc0"));
+  EXPECT_TRUE(await([&](){ return netstack_tc_count(ns) < count; }));
+  netstack_stats stats;
+  ASSERT_NE(nullptr, netstack_sample_stats(ns, &stats));
+  EXPECT_EQ(netstack_tc_count(ns), stats.tcs);
+  EXPECT_LE(3, stats.tc_events);
+  EXPECT_LE(before + 1, seen.events);
+  ASSERT_EQ(0, netstack_destroy(ns));
+}
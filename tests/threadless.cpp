@@ -0,0 +1,79 @@
+#include <poll.h>
+#include "main.h"
+
+// Unit tests for threadless (caller-driven) operation
+
+// Drive ns until lo shows up, or a second passes without any traffic.
+static const netstack_iface*
+await_lo(struct netstack* ns){
+  struct pollfd pfd = {};
+  pfd.fd = netstack_get_fd(ns);
+  pfd.events = POLLIN;
+  const netstack_iface* ni;
+  while((ni = netstack_iface_share_byname(ns, "lo")) == nullptr){
+    if(poll(&pfd, 1, 1000) <= 0){
+      break;
+    }
+    if(netstack_process(ns, 0) < 0){
+      break;
+    }
+  }
+  return ni;
+}
+
+TEST(Threadless, ProcessRequiresThreadless) {
+  netstack_opts nopts = {};
+  nopts.initial_events = netstack_opts::NETSTACK_INITIAL_EVENTS_NONE;
+  struct netstack* ns = netstack_create(&nopts);
+  ASSERT_NE(nullptr, ns);
+  EXPECT_LE(0, netstack_get_fd(ns));
+  EXPECT_EQ(-1, netstack_process(ns, 0));
+  ASSERT_EQ(0, netstack_destroy(ns));
+}
+
+// _BLOCK must complete the initial enumeration within netstack_create().
+TEST(Threadless, InitialBlock) {
+  netstack_opts nopts = {};
+  nopts.initial_events = netstack_opts::NETSTACK_INITIAL_EVENTS_BLOCK;
+  nopts.threadless = true;
+  struct netstack* ns = netstack_create(&nopts);
+  ASSERT_NE(nullptr, ns);
+  netstack_stats stats;
+  ASSERT_NE(nullptr, netstack_sample_stats(ns, &stats));
+  EXPECT_LT(0, stats.dumps);
+  EXPECT_LE(0, netstack_process(ns, 0));
+  const netstack_iface* ni = netstack_iface_share_byname(ns, "lo");
+  if(ni){
+    netstack_iface_abandon(ni);
+  }
+  ASSERT_EQ(0, netstack_destroy(ns));
+}
+
+// With _ASYNC, nothing happens until the caller processes the socket. Queued
+// dumps must proceed one after another from within netstack_process().
+TEST(Threadless, AsyncDumpsAdvance) {
+  netstack_opts nopts = {};
+  nopts.initial_events = netstack_opts::NETSTACK_INITIAL_EVENTS_ASYNC;
+  nopts.threadless = true;
+  struct netstack* ns = netstack_create(&nopts);
+  ASSERT_NE(nullptr, ns);
+  const netstack_iface* ni = await_lo(ns);
+  if(ni == nullptr){
+    netstack_destroy(ns);
+    GTEST_SKIP();
+  }
+  netstack_iface_abandon(ni);
+  netstack_stats stats;
+  ASSERT_NE(nullptr, netstack_sample_stats(ns, &stats));
+  const uintmax_t dumps = stats.dumps;
+  ASSERT_EQ(0, netstack_iface_stats_refresh(ns));
+  struct pollfd pfd = {};
+  pfd.fd = netstack_get_fd(ns);
+  pfd.events = POLLIN;
+  while(stats.dumps == dumps && poll(&pfd, 1, 1000) > 0){
+    ASSERT_LE(0, netstack_process(ns, 1));
+    ASSERT_NE(nullptr, netstack_sample_stats(ns, &stats));
+  }
+  EXPECT_LT(dumps, stats.dumps);
+  ASSERT_EQ(0, netstack_destroy(ns));
+}
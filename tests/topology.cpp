@@ -0,0 +1,204 @@
+#include <cstdio>
+#include <cstring>
+#include <vector>
+#include <net/if.h>
+#include <string>
+#include <fstream>
+#include <thread>
+#include <chrono>
+#include "netns.h"
+
+// Unit tests for the queue/IRQ/CPU topology API. Those adding links run in a
+// private network namespace, and are skipped if one can't be created.
+
+using TopologyNetns = NetnsTest;
+
+static std::string
+read_sysfs(const std::string& path){
+  std::ifstream f(path);
+  std::string s;
+  std::getline(f, s);
+  return s;
+}
+
+// Poll up to a second for the named link to be cached, returning a share.
+static const netstack_iface*
+await_iface(struct netstack* ns, const char* name){
+  for(int i = 0 ; i < 100 ; ++i){
+    const netstack_iface* ni = netstack_iface_share_byname(ns, name);
+    if(ni){
+      return ni;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  return nullptr;
+}
+
+// lo has queues, but no device (and thus no IRQs nor NUMA node).
+TEST(Topology, Loopback) {
+  netstack_opts nopts = {};
+  nopts.initial_events = netstack_opts::NETSTACK_INITIAL_EVENTS_BLOCK;
+  struct netstack* ns = netstack_create(&nopts);
+  ASSERT_NE(nullptr, ns);
+  const netstack_iface* ni = netstack_iface_share_byname(ns, "lo");
+  if(ni == nullptr){
+    netstack_destroy(ns);
+    GTEST_SKIP();
+  }
+  const netstack_topology* nt = netstack_iface_topology(ns, ni);
+  ASSERT_NE(nullptr, nt);
+  EXPECT_EQ(-1, netstack_topology_numa_node(nt));
+  EXPECT_EQ(0, netstack_topology_irqcount(nt));
+  EXPECT_EQ(-1, netstack_topology_irq(nt, 0));
+  EXPECT_EQ(nullptr, netstack_topology_irq_name(nt, 0));
+  EXPECT_LE(1, netstack_topology_rxqueues(nt));
+  EXPECT_LE(1, netstack_topology_txqueues(nt));
+  EXPECT_EQ(-1, netstack_topology_rxqueue_irq(nt, 0));
+  netstack_cpumask mask;
+  if(netstack_topology_rps_cpus(nt, 0, &mask)){
+    const std::string rps = read_sysfs("/sys/class/net/lo/queues/rx-0/rps_cpus");
+    const unsigned long first = strtoul(rps.substr(rps.find_last_of(',') + 1).c_str(), nullptr, 16);
+    for(unsigned cpu = 0 ; cpu < 32 ; ++cpu){
+      EXPECT_EQ(!!(first & (1ul << cpu)), netstack_cpumask_isset(&mask, cpu));
+    }
+  }
+  EXPECT_FALSE(netstack_topology_rps_cpus(nt, netstack_topology_rxqueues(nt), &mask));
+  // the topology is cached with the interface...
+  const netstack_topology* nt2 = netstack_iface_topology(ns, ni);
+  EXPECT_EQ(nt, nt2);
+  netstack_topology_abandon(nt2);
+  // ...until refreshed, while the old one remains valid until abandoned
+  const netstack_topology* nt3 = netstack_iface_topology_refresh(ns, ni);
+  ASSERT_NE(nullptr, nt3);
+  EXPECT_NE(nt, nt3);
+  EXPECT_EQ(netstack_topology_rxqueues(nt), netstack_topology_rxqueues(nt3));
+  netstack_topology_abandon(nt);
+  nt2 = netstack_iface_topology(ns, ni);
+  EXPECT_EQ(nt3, nt2);
+  netstack_topology_abandon(nt2);
+  netstack_topology_abandon(nt3);
+  netstack_iface_abandon(ni);
+  ASSERT_EQ(0, netstack_destroy(ns));
+}
+
+// Every interface's topology must be internally consistent: any per-queue IRQ
+// must be one of the device's vectors.
+TEST(Topology, QueueIrqsAreVectors) {
+  netstack_opts nopts = {};
+  nopts.initial_events = netstack_opts::NETSTACK_INITIAL_EVENTS_BLOCK;
+  struct netstack* ns = netstack_create(&nopts);
+  ASSERT_NE(nullptr, ns);
+  for(int idx = 1 ; idx < 64 ; ++idx){
+    const netstack_iface* ni = netstack_iface_share_byidx(ns, idx);
+    if(ni == nullptr){
+      continue;
+    }
+    const netstack_topology* nt = netstack_iface_topology(ns, ni);
+    if(nt){
+      for(unsigned q = 0 ; q < netstack_topology_rxqueues(nt) ; ++q){
+        int irq = netstack_topology_rxqueue_irq(nt, q);
+        if(irq >= 0){
+          bool found = false;
+          for(unsigned i = 0 ; i < netstack_topology_irqcount(nt) ; ++i){
+            found |= netstack_topology_irq(nt, i) == irq;
+          }
+          EXPECT_TRUE(found);
+        }
+      }
+      for(unsigned i = 1 ; i < netstack_topology_irqcount(nt) ; ++i){
+        EXPECT_LT(netstack_topology_irq(nt, i - 1), netstack_topology_irq(nt, i));
+      }
+      netstack_topology_abandon(nt);
+    }
+    netstack_iface_abandon(ni);
+  }
+  ASSERT_EQ(0, netstack_destroy(ns));
+}
+
+// Enumerated copies share the netstack's cached topologies, and topologies
+// outlive the netstack.
+TEST(Topology, EnumeratedCopy) {
+  netstack_opts nopts = {};
+  nopts.initial_events = netstack_opts::NETSTACK_INITIAL_EVENTS_BLOCK;
+  struct netstack* ns = netstack_create(&nopts);
+  ASSERT_NE(nullptr, ns);
+  const netstack_iface* lo = netstack_iface_share_byname(ns, "lo");
+  if(lo == nullptr){
+    netstack_destroy(ns);
+    GTEST_SKIP();
+  }
+  const netstack_topology* cached = netstack_iface_topology(ns, lo);
+  ASSERT_NE(nullptr, cached);
+  netstack_iface_abandon(lo);
+  netstack_enumerator nenum{};
+  int n = 256;
+  size_t obytes = 1u << 16;
+  std::vector<char> buf(obytes);
+  std::vector<uint32_t> offs(n);
+  const int enums = netstack_iface_enumerate(ns, offs.data(), &n, buf.data(), &obytes, &nenum);
+  ASSERT_LT(0, enums);
+  const netstack_topology* nt = nullptr;
+  const netstack_topology* refreshed = nullptr;
+  const netstack_topology* after = nullptr;
+  for(int z = 0 ; z < enums ; ++z){
+    const netstack_iface* ni = reinterpret_cast<const netstack_iface*>(buf.data() + offs[z]);
+    char name[IFNAMSIZ];
+    if(netstack_iface_name(ni, name) && strcmp(name, "lo") == 0){
+      nt = netstack_iface_topology(ns, ni);
+      refreshed = netstack_iface_topology_refresh(ns, ni);
+      after = netstack_iface_topology(ns, ni);
+    }
+  }
+  ASSERT_NE(nullptr, nt);
+  ASSERT_NE(nullptr, refreshed);
+  EXPECT_EQ(cached, nt);
+  EXPECT_NE(cached, refreshed);
+  EXPECT_EQ(refreshed, after);
+  netstack_topology_abandon(cached);
+  netstack_topology_abandon(after);
+  ASSERT_EQ(0, netstack_destroy(ns));
+  EXPECT_LE(1, netstack_topology_rxqueues(nt));
+  EXPECT_LE(1, netstack_topology_rxqueues(refreshed));
+  netstack_topology_abandon(nt);
+  netstack_topology_abandon(refreshed);
+}
+
+// The cached topology survives the link changing (and being renamed), which
+// replaces its netstack_iface. sysfs describes the namespace which mounted it,
+// so only lo (which every namespace has) can be built here.
+TEST_F(TopologyNetns, SurvivesLinkChanges) {
+  netstack_opts nopts = {};
+  nopts.initial_events = netstack_opts::NETSTACK_INITIAL_EVENTS_BLOCK;
+  struct netstack* ns = netstack_create(&nopts);
+  ASSERT_NE(nullptr, ns);
+  const netstack_iface* ni = netstack_iface_share_byname(ns, "lo");
+  ASSERT_NE(nullptr, ni);
+  const netstack_topology* nt = netstack_iface_topology(ns, ni);
+  if(nt == nullptr){
+    netstack_iface_abandon(ni);
+    netstack_destroy(ns);
+    GTEST_SKIP();
+  }
+  netstack_iface_abandon(ni);
+  ASSERT_EQ(0, system("ip link set lo mtu 1500 && ip link set lo name nstopo0"));
+  ni = await_iface(ns, "nstopo0");
+  ASSERT_NE(nullptr, ni);
+  const netstack_topology* nt2 = netstack_iface_topology(ns, ni);
+  EXPECT_EQ(nt, nt2);
+  netstack_topology_abandon(nt2);
+  netstack_iface_abandon(ni);
+  netstack_topology_abandon(nt);
+  ASSERT_EQ(0, netstack_destroy(ns));
+}
+
+TEST(Topology, CpumaskHelpers) {
+  netstack_cpumask mask = {};
+  EXPECT_EQ(0, netstack_cpumask_count(&mask));
+  mask.bits[0] = 0x5;
+  mask.bits[1] = 0x1;
+  EXPECT_EQ(3, netstack_cpumask_count(&mask));
+  EXPECT_TRUE(netstack_cpumask_isset(&mask, 0));
+  EXPECT_FALSE(netstack_cpumask_isset(&mask, 1));
+  EXPECT_TRUE(netstack_cpumask_isset(&mask, 64));
+  EXPECT_FALSE(netstack_cpumask_isset(&mask, NETSTACK_MAX_CPUS));
+}
@@ -0,0 +1,65 @@
+#include <thread>
+#include <chrono>
+#include "main.h"
+
+// Unit tests for the io_uring receive backend. Where io_uring is unavailable,
+// the netstack falls back to recvmsg(), and these ought pass all the same.
+
+TEST(Uring, InvalidWithThreadless) {
+  netstack_opts nopts = {};
+  nopts.io_uring = true;
+  nopts.threadless = true;
+  EXPECT_EQ(nullptr, netstack_create(&nopts));
+}
+
+// The io_uring backend must build the same cache as the recvmsg() backend.
+TEST(Uring, MatchesRecvmsg) {
+  netstack_opts nopts = {};
+  nopts.initial_events = netstack_opts::NETSTACK_INITIAL_EVENTS_BLOCK;
+  struct netstack* ns = netstack_create(&nopts);
+  ASSERT_NE(nullptr, ns);
+  nopts.io_uring = true;
+  struct netstack* uns = netstack_create(&nopts);
+  ASSERT_NE(nullptr, uns);
+  EXPECT_EQ(netstack_iface_count(ns), netstack_iface_count(uns));
+  EXPECT_EQ(netstack_iface_bytes(ns), netstack_iface_bytes(uns));
+  const netstack_iface* ni = netstack_iface_share_byname(ns, "lo");
+  const netstack_iface* uni = netstack_iface_share_byname(uns, "lo");
+  if(ni){
+    ASSERT_NE(nullptr, uni);
+    EXPECT_EQ(netstack_iface_index(ni), netstack_iface_index(uni));
+    netstack_iface_abandon(ni);
+    netstack_iface_abandon(uni);
+  }
+  netstack_stats stats;
+  ASSERT_NE(nullptr, netstack_sample_stats(uns, &stats));
+  EXPECT_EQ(0, stats.parse_failures);
+  ASSERT_EQ(0, netstack_destroy(uns));
+  ASSERT_EQ(0, netstack_destroy(ns));
+}
+
+// Repeated dumps must keep flowing through the multishot receive.
+TEST(Uring, RepeatedDumps) {
+  netstack_opts nopts = {};
+  nopts.initial_events = netstack_opts::NETSTACK_INITIAL_EVENTS_BLOCK;
+  nopts.io_uring = true;
+  struct netstack* ns = netstack_create(&nopts);
+  ASSERT_NE(nullptr, ns);
+  netstack_stats stats;
+  ASSERT_NE(nullptr, netstack_sample_stats(ns, &stats));
+  const uintmax_t dumps = stats.dumps;
+  const int refreshes = 32;
+  for(int i = 0 ; i < refreshes ; ++i){
+    ASSERT_EQ(0, netstack_iface_stats_refresh(ns));
+  }
+  for(int i = 0 ; i < 500 ; ++i){
+    ASSERT_NE(nullptr, netstack_sample_stats(ns, &stats));
+    if(stats.dumps >= dumps + refreshes){
+      break;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  EXPECT_EQ(dumps + refreshes, stats.dumps);
+  EXPECT_EQ(0, stats.parse_failures);
+  ASSERT_EQ(0, netstack_destroy(ns));
+}